@@ -25,6 +25,122 @@
 #include "accounting.h"
 #include "block_int.h"
 #include "qemu/timer.h"
+#include "qemu/host-utils.h"
+
+static const int64_t block_acct_interval_ns[BLOCK_ACCT_INTERVAL_MAX] = {
+    [BLOCK_ACCT_INTERVAL_1S]    = 1000000000LL,
+    [BLOCK_ACCT_INTERVAL_60S]   = 60 * 1000000000LL,
+};
+
+static inline int block_acct_latency_bin(int64_t latency_ns)
+{
+    uint64_t v = latency_ns > 0 ? (uint64_t)latency_ns >> 10 : 0;
+    int bin = v ? 64 - clz64(v) : 0;
+
+    return MIN(bin, BLOCK_LATENCY_BINS - 1);
+}
+
+int64_t block_acct_latency_bin_start(int bin)
+{
+    return bin ? 1024LL << (bin - 1) : 0;
+}
+
+static void block_acct_window_reset(BlockAcctWindow *w, int64_t start_ns)
+{
+    memset(w, 0, sizeof(*w));
+    w->start_ns = start_ns;
+}
+
+static void block_acct_charge_depth(BlockAcctStats *stats, BlockAcctWindow *w,
+                                    int64_t ns)
+{
+    int j;
+
+    for (j = 0; j < BLOCK_MAX_IOTYPE; j++) {
+        w->queue_depth_ns[j] += stats->in_flight[j] * ns;
+    }
+}
+
+/* Moves the current window up to now, closing it at each interval boundary
+ * on the way.  The in-flight counts were constant since 'from', so that time
+ * is charged to the windows it falls in.  When whole intervals went by,
+ * the last of them becomes the last complete window. */
+static void block_acct_window_advance(BlockAcctStats *stats,
+                                      BlockAcctTimedStats *ts,
+                                      int64_t from, int64_t now)
+{
+    int64_t end = ts->current.start_ns + ts->interval_ns;
+    int64_t skipped;
+
+    for (;;) {
+        if (MIN(now, end) > from) {
+            block_acct_charge_depth(stats, &ts->current, MIN(now, end) - from);
+        }
+        if (now < end) {
+            return;
+        }
+        ts->current.end_ns = end;
+        ts->last = ts->current;
+        block_acct_window_reset(&ts->current, end);
+        from = end;
+
+        skipped = (now - end) / ts->interval_ns;
+        if (skipped) {
+            end += skipped * ts->interval_ns;
+            block_acct_window_reset(&ts->last, end - ts->interval_ns);
+            ts->last.end_ns = end;
+            block_acct_charge_depth(stats, &ts->last, ts->interval_ns);
+            block_acct_window_reset(&ts->current, end);
+            from = end;
+        }
+        end += ts->interval_ns;
+    }
+}
+
+/* Charges the time since the last change of the in-flight counts */
+static void block_acct_account_depth(BlockAcctStats *stats, int64_t now)
+{
+    int i;
+
+    for (i = 0; i < BLOCK_ACCT_INTERVAL_MAX; i++) {
+        block_acct_window_advance(stats, &stats->timed_stats[i],
+                                  stats->in_flight_changed_ns, now);
+    }
+    stats->in_flight_changed_ns = now;
+}
+
+void block_acct_set_intervals(BlockAcctStats *stats, bool enable)
+{
+    int64_t now = vmx_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int i;
+
+    if (enable == stats->intervals_enabled) {
+        return;
+    }
+    for (i = 0; i < BLOCK_ACCT_INTERVAL_MAX; i++) {
+        BlockAcctTimedStats *ts = &stats->timed_stats[i];
+
+        ts->interval_ns = block_acct_interval_ns[i];
+        block_acct_window_reset(&ts->current, now);
+        block_acct_window_reset(&ts->last, now - ts->interval_ns);
+        ts->last.end_ns = now;
+    }
+    stats->in_flight_changed_ns = now;
+    stats->intervals_enabled = enable;
+}
+
+BlockAcctWindow *block_acct_last_window(BlockAcctStats *stats,
+                                        enum BlockAcctInterval interval)
+{
+    BlockAcctTimedStats *ts = &stats->timed_stats[interval];
+
+    assert(interval < BLOCK_ACCT_INTERVAL_MAX);
+    if (!stats->intervals_enabled) {
+        return NULL;
+    }
+    block_acct_account_depth(stats, vmx_clock_get_ns(QEMU_CLOCK_REALTIME));
+    return &ts->last;
+}
 
 void block_acct_start(BlockAcctStats *stats, BlockAcctCookie *cookie,
                       int64_t bytes, enum BlockAcctType type)
@@ -38,20 +154,76 @@ void block_acct_start(BlockAcctStats *stats, BlockAcctCookie *cookie,
 
 void block_acct_done(BlockAcctStats *stats, BlockAcctCookie *cookie)
 {
-    assert(cookie->type < BLOCK_MAX_IOTYPE);
+    int64_t now = vmx_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int64_t latency_ns = now - cookie->start_time_ns;
+    enum BlockAcctType type = cookie->type;
+    int i;
 
-    stats->nr_bytes[cookie->type] += cookie->bytes;
-    stats->nr_ops[cookie->type]++;
-    stats->total_time_ns[cookie->type] +=
-        vmx_clock_get_ns(QEMU_CLOCK_REALTIME) - cookie->start_time_ns;
+    assert(type < BLOCK_MAX_IOTYPE);
+
+    stats->nr_bytes[type] += cookie->bytes;
+    stats->nr_ops[type]++;
+    stats->total_time_ns[type] += latency_ns;
+    stats->latency_histogram[type][block_acct_latency_bin(latency_ns)]++;
+
+    if (!stats->intervals_enabled) {
+        return;
+    }
+    block_acct_account_depth(stats, now);
+    for (i = 0; i < BLOCK_ACCT_INTERVAL_MAX; i++) {
+        BlockAcctWindow *w = &stats->timed_stats[i].current;
+
+        if (!w->nr_ops[type] || latency_ns < w->min_time_ns[type]) {
+            w->min_time_ns[type] = latency_ns;
+        }
+        if (latency_ns > w->max_time_ns[type]) {
+            w->max_time_ns[type] = latency_ns;
+        }
+        w->nr_ops[type]++;
+        w->total_time_ns[type] += latency_ns;
+    }
 }
 
 void block_acct_failed(BlockAcctStats *stats, BlockAcctCookie *cookie)
 {
+    assert(cookie->type < BLOCK_MAX_IOTYPE);
+
+    stats->failed_ops[cookie->type]++;
 }
 
 void block_acct_invalid(BlockAcctStats *stats, enum BlockAcctType type)
 {
+    assert(type < BLOCK_MAX_IOTYPE);
+
+    stats->invalid_ops[type]++;
+}
+
+void block_acct_throttled(BlockAcctStats *stats, enum BlockAcctType type,
+                          int64_t throttled_ns)
+{
+    assert(type < BLOCK_MAX_IOTYPE);
+
+    stats->nr_throttled[type]++;
+    stats->throttled_time_ns[type] += throttled_ns;
+}
+
+void block_acct_request_begin(BlockAcctStats *stats, enum BlockAcctType type)
+{
+    if (stats->intervals_enabled) {
+        block_acct_account_depth(stats, vmx_clock_get_ns(QEMU_CLOCK_REALTIME));
+    }
+    if (++stats->in_flight[type] > stats->max_in_flight[type]) {
+        stats->max_in_flight[type] = stats->in_flight[type];
+    }
+}
+
+void block_acct_request_end(BlockAcctStats *stats, enum BlockAcctType type)
+{
+    if (stats->intervals_enabled) {
+        block_acct_account_depth(stats, vmx_clock_get_ns(QEMU_CLOCK_REALTIME));
+    }
+    assert(stats->in_flight[type] > 0);
+    stats->in_flight[type]--;
 }
 
 void block_acct_highest_sector(BlockAcctStats *stats, int64_t sector_num,
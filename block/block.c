@@ -123,6 +123,151 @@ int is_windows_drive(const char *filename)
 }
 #endif
 
+/* throttling disk I/O limits */
+static void bdrv_throttle_read_timer_cb(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    vmx_co_enter_next(&bs->throttled_reqs[0]);
+}
+
+static void bdrv_throttle_write_timer_cb(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    vmx_co_enter_next(&bs->throttled_reqs[1]);
+}
+
+static void bdrv_throttle_timers_attach(BlockDriverState *bs,
+                                        VeertuAioContext *aio_context)
+{
+    bs->throttle_timers[0] = aio_timer_new(aio_context, QEMU_CLOCK_REALTIME,
+                                           SCALE_NS,
+                                           bdrv_throttle_read_timer_cb, bs);
+    bs->throttle_timers[1] = aio_timer_new(aio_context, QEMU_CLOCK_REALTIME,
+                                           SCALE_NS,
+                                           bdrv_throttle_write_timer_cb, bs);
+}
+
+static void bdrv_throttle_timers_detach(BlockDriverState *bs)
+{
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        timer_del(bs->throttle_timers[i]);
+        timer_free(bs->throttle_timers[i]);
+        bs->throttle_timers[i] = NULL;
+    }
+}
+
+/* Lets every queued request through, ignoring the limits */
+static bool bdrv_start_throttled_reqs(BlockDriverState *bs)
+{
+    bool drained = false;
+    bool enabled = bs->io_limits_enabled;
+    int i;
+
+    bs->io_limits_enabled = false;
+
+    for (i = 0; i < 2; i++) {
+        while (vmx_co_enter_next(&bs->throttled_reqs[i])) {
+            drained = true;
+        }
+    }
+
+    bs->io_limits_enabled = enabled;
+
+    return drained;
+}
+
+void bdrv_set_io_limits(BlockDriverState *bs,
+                        ThrottleConfig *cfg)
+{
+    int i;
+
+    throttle_config(&bs->throttle_state, cfg);
+
+    /* the queued requests re-evaluate themselves against the new limits */
+    for (i = 0; i < 2; i++) {
+        vmx_co_enter_next(&bs->throttled_reqs[i]);
+    }
+}
+
+void bdrv_io_limits_enable(BlockDriverState *bs)
+{
+    assert(!bs->io_limits_enabled);
+    throttle_init(&bs->throttle_state);
+    bdrv_throttle_timers_attach(bs, bdrv_get_aio_context(bs));
+    bs->io_limits_enabled = true;
+}
+
+void bdrv_io_limits_disable(BlockDriverState *bs)
+{
+    bs->io_limits_enabled = false;
+
+    bdrv_start_throttled_reqs(bs);
+
+    bdrv_throttle_timers_detach(bs);
+}
+
+/* Arms the timer of this direction if a request has to wait, or moves it
+ * earlier if the limits were raised since it was armed.  Returns true if
+ * the caller must wait in throttled_reqs. */
+static bool bdrv_throttle_schedule_timer(BlockDriverState *bs, bool is_write)
+{
+    QEMUTimer *timer = bs->throttle_timers[is_write];
+    int64_t now = vmx_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int64_t wait = throttle_compute_wait(&bs->throttle_state, is_write, now);
+
+    if (!wait) {
+        return false;
+    }
+    if (!timer_pending(timer) ||
+        now + wait < (int64_t)timer_expire_time_ns(timer)) {
+        timer_mod(timer, now + wait);
+    }
+    return true;
+}
+
+/* This function makes an I/O request wait until the token buckets of its
+ * direction allow it.  Requests are served in FIFO order: a request that
+ * could run immediately still queues behind the ones already waiting.
+ *
+ * @bytes:    the number of bytes of the I/O
+ * @is_write: is the I/O a write
+ */
+static void coroutine_fn bdrv_io_limits_intercept(BlockDriverState *bs,
+                                                  unsigned int bytes,
+                                                  bool is_write)
+{
+    int64_t start;
+
+    if (bdrv_throttle_schedule_timer(bs, is_write) ||
+        !vmx_co_queue_empty(&bs->throttled_reqs[is_write])) {
+        start = vmx_clock_get_ns(QEMU_CLOCK_REALTIME);
+        vmx_co_queue_wait(&bs->throttled_reqs[is_write]);
+        /* woken too early, go back to the front of the queue */
+        while (bs->io_limits_enabled &&
+               bdrv_throttle_schedule_timer(bs, is_write)) {
+            vmx_co_queue_wait_insert_head(&bs->throttled_reqs[is_write]);
+        }
+        block_acct_throttled(&bs->stats,
+                             is_write ? BLOCK_ACCT_WRITE : BLOCK_ACCT_READ,
+                             vmx_clock_get_ns(QEMU_CLOCK_REALTIME) - start);
+    }
+
+    /* limits may have been disabled while we were waiting */
+    if (!bs->io_limits_enabled) {
+        vmx_co_queue_next(&bs->throttled_reqs[is_write]);
+        return;
+    }
+
+    throttle_account(&bs->throttle_state, is_write, bytes);
+
+    /* if the next request must wait the timer wakes it, otherwise do it now */
+    if (bdrv_throttle_schedule_timer(bs, is_write)) {
+        return;
+    }
+    vmx_co_queue_next(&bs->throttled_reqs[is_write]);
+}
 
 size_t bdrv_opt_mem_align(BlockDriverState *bs)
 {
@@ -277,6 +422,8 @@ BlockDriverState *bdrv_new(void)
     veertu_notifiers_init(&bs->close_notifiers);
 
     veertu_notifiers_init(&bs->before_write_notifiers);
+    vmx_co_queue_init(&bs->throttled_reqs[0]);
+    vmx_co_queue_init(&bs->throttled_reqs[1]);
 
     bs->refcnt = 1;
     bs->aio_context = vmx_get_aio_context();
@@ -1761,7 +1908,10 @@ void bdrv_close(BlockDriverState *bs)
         blk_dev_change_media_cb(bs->blk, false);
     }
 
-
+    /* throttling disk I/O limits */
+    if (bs->io_limits_enabled) {
+        bdrv_io_limits_disable(bs);
+    }
 
     QLIST_FOREACH_SAFE(ban, &bs->aio_notifiers, list, ban_next) {
         g_free(ban);
@@ -1788,7 +1938,12 @@ static bool bdrv_requests_pending(BlockDriverState *bs)
     if (!QLIST_EMPTY(&bs->tracked_requests)) {
         return true;
     }
-
+    if (!vmx_co_queue_empty(&bs->throttled_reqs[0])) {
+        return true;
+    }
+    if (!vmx_co_queue_empty(&bs->throttled_reqs[1])) {
+        return true;
+    }
     if (bs->file && bdrv_requests_pending(bs->file)) {
         return true;
     }
@@ -1803,6 +1958,7 @@ static bool bdrv_drain_one(BlockDriverState *bs)
     bool bs_busy;
 
     bdrv_flush_io_queue(bs);
+    bdrv_start_throttled_reqs(bs);
     bs_busy = bdrv_requests_pending(bs);
     bs_busy |= aio_poll(bdrv_get_aio_context(bs), bs_busy);
     return bs_busy;
@@ -1898,7 +2054,15 @@ static void bdrv_move_feature_fields(BlockDriverState *bs_dest,
 
     bs_dest->enable_write_cache = bs_src->enable_write_cache;
 
-
+    /* i/o throttled req */
+    memcpy(&bs_dest->throttle_state,
+           &bs_src->throttle_state,
+           sizeof(ThrottleState));
+    bs_dest->throttled_reqs[0]  = bs_src->throttled_reqs[0];
+    bs_dest->throttled_reqs[1]  = bs_src->throttled_reqs[1];
+    bs_dest->throttle_timers[0] = bs_src->throttle_timers[0];
+    bs_dest->throttle_timers[1] = bs_src->throttle_timers[1];
+    bs_dest->io_limits_enabled  = bs_src->io_limits_enabled;
 
     /* r/w error */
     bs_dest->on_read_error      = bs_src->on_read_error;
@@ -1956,6 +2120,7 @@ void bdrv_swap(BlockDriverState *bs_new, BlockDriverState *bs_old)
     assert(!bs_new->blk);
     assert(QLIST_EMPTY(&bs_new->dirty_bitmaps));
     assert(bs_new->job == NULL);
+    assert(bs_new->io_limits_enabled == false);
 
     tmp = *bs_new;
     *bs_new = *bs_old;
@@ -1971,6 +2136,7 @@ void bdrv_swap(BlockDriverState *bs_new, BlockDriverState *bs_old)
 
     /* Check a few fields that should remain attached to the device */
     assert(bs_new->job == NULL);
+    assert(bs_new->io_limits_enabled == false);
 
     /* insert the nodes back into the graph node list if needed */
     if (bs_new->node_name[0] != '\0') {
@@ -2939,6 +3105,12 @@ static int coroutine_fn bdrv_co_do_preadv(BlockDriverState *bs,
         flags |= BDRV_REQ_COPY_ON_READ;
     }
 
+    /* throttling disk I/O */
+    if (bs->io_limits_enabled) {
+        bdrv_io_limits_intercept(bs, bytes, false);
+    }
+
+    block_acct_request_begin(&bs->stats, BLOCK_ACCT_READ);
 
     /* Align read if necessary by padding qiov */
     if (offset & (align - 1)) {
@@ -2970,6 +3142,7 @@ static int coroutine_fn bdrv_co_do_preadv(BlockDriverState *bs,
                               use_local_qiov ? &local_qiov : qiov,
                               flags);
     tracked_request_end(&req);
+    block_acct_request_end(&bs->stats, BLOCK_ACCT_READ);
 
     if (use_local_qiov) {
         vmx_iovec_destroy(&local_qiov);
@@ -3174,7 +3347,12 @@ static int coroutine_fn bdrv_co_do_pwritev(BlockDriverState *bs,
         return -EIO;
     }
 
+    /* throttling disk I/O */
+    if (bs->io_limits_enabled) {
+        bdrv_io_limits_intercept(bs, bytes, true);
+    }
 
+    block_acct_request_begin(&bs->stats, BLOCK_ACCT_WRITE);
 
     /*
      * Align write if necessary by performing a read-modify-write cycle.
@@ -3257,6 +3435,7 @@ static int coroutine_fn bdrv_co_do_pwritev(BlockDriverState *bs,
 
 fail:
     tracked_request_end(&req);
+    block_acct_request_end(&bs->stats, BLOCK_ACCT_WRITE);
 
     if (use_local_qiov) {
         vmx_iovec_destroy(&local_qiov);
@@ -4739,14 +4918,10 @@ static void coroutine_fn bdrv_flush_co_entry(void *opaque)
     rwco->ret = bdrv_co_flush(rwco->bs);
 }
 
-int coroutine_fn bdrv_co_flush(BlockDriverState *bs)
+static int coroutine_fn bdrv_co_do_flush(BlockDriverState *bs)
 {
     int ret;
 
-    if (!bs || !bdrv_is_inserted(bs) || bdrv_is_read_only(bs)) {
-        return 0;
-    }
-
     /* Write back cached data to the OS even with cache=unsafe */
     BLKDBG_EVENT(bs->file, BLKDBG_FLUSH_TO_OS);
     if (bs->drv->bdrv_co_flush_to_os) {
@@ -4802,6 +4977,20 @@ flush_parent:
     return bdrv_co_flush(bs->file);
 }
 
+int coroutine_fn bdrv_co_flush(BlockDriverState *bs)
+{
+    int ret;
+
+    if (!bs || !bdrv_is_inserted(bs) || bdrv_is_read_only(bs)) {
+        return 0;
+    }
+
+    block_acct_request_begin(&bs->stats, BLOCK_ACCT_FLUSH);
+    ret = bdrv_co_do_flush(bs);
+    block_acct_request_end(&bs->stats, BLOCK_ACCT_FLUSH);
+    return ret;
+}
+
 void bdrv_invalidate_cache(BlockDriverState *bs, Error **errp)
 {
     Error *local_err = NULL;
@@ -5584,6 +5773,9 @@ void bdrv_detach_aio_context(BlockDriverState *bs)
     }
 
 
+    if (bs->io_limits_enabled) {
+        bdrv_throttle_timers_detach(bs);
+    }
     if (bs->drv->bdrv_detach_aio_context) {
         bs->drv->bdrv_detach_aio_context(bs);
     }
@@ -5617,6 +5809,9 @@ void bdrv_attach_aio_context(BlockDriverState *bs,
     if (bs->drv->bdrv_attach_aio_context) {
         bs->drv->bdrv_attach_aio_context(bs, new_context);
     }
+    if (bs->io_limits_enabled) {
+        bdrv_throttle_timers_attach(bs, new_context);
+    }
 
     QLIST_FOREACH(ban, &bs->aio_notifiers, list) {
         ban->attached_aio_context(new_context, ban->opaque);
@@ -325,9 +325,10 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
     int on_read_error, on_write_error;
     BlockBackend *blk;
     BlockDriverState *bs;
-    //ThrottleConfig cfg;
+    ThrottleConfig cfg;
     int snapshot = 0;
     bool copy_on_read;
+    bool stats_intervals;
     int ret;
     Error *error = NULL;
     QemuOpts *opts;
@@ -361,6 +362,7 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
     snapshot = vmx_opt_get_bool(opts, "snapshot", 0);
     ro = vmx_opt_get_bool(opts, "read-only", 0);
     copy_on_read = vmx_opt_get_bool(opts, "copy-on-read", false);
+    stats_intervals = vmx_opt_get_bool(opts, "stats-intervals", false);
 
     if ((buf = vmx_opt_get(opts, "discard")) != NULL) {
         if (bdrv_parse_discard_flags(buf, &bdrv_flags) != 0) {
@@ -406,9 +408,8 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
             goto early_err;
         }
     }
-#if 0
     /* disk I/O throttling */
-    //memset(&cfg, 0, sizeof(cfg));
+    memset(&cfg, 0, sizeof(cfg));
     cfg.buckets[THROTTLE_BPS_TOTAL].avg =
         vmx_opt_get_number(opts, "throttling.bps-total", 0);
     cfg.buckets[THROTTLE_BPS_READ].avg  =
@@ -441,7 +442,7 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
         error_propagate(errp, error);
         goto early_err;
     }
-#endif
+
     on_write_error = BLOCKDEV_ON_ERROR_ENOSPC;
     if ((buf = vmx_opt_get(opts, "werror")) != NULL) {
         on_write_error = parse_block_error_action(buf, 0, &error);
@@ -489,7 +490,13 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
     bs->detect_zeroes = detect_zeroes;
 
     bdrv_set_on_error(bs, on_read_error, on_write_error);
+    block_acct_set_intervals(bdrv_get_stats(bs), stats_intervals);
 
+    /* disk I/O throttling */
+    if (throttle_enabled(&cfg)) {
+        bdrv_io_limits_enable(bs);
+        bdrv_set_io_limits(bs, &cfg);
+    }
 
     if (!file || !*file) {
         if (has_driver_specific_opts) {
@@ -1673,6 +1680,91 @@ out:
     aio_context_release(aio_context);
 }
 
+/* throttling disk I/O limits */
+void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
+                               int64_t bps_wr,
+                               int64_t iops,
+                               int64_t iops_rd,
+                               int64_t iops_wr,
+                               bool has_bps_max,
+                               int64_t bps_max,
+                               bool has_bps_rd_max,
+                               int64_t bps_rd_max,
+                               bool has_bps_wr_max,
+                               int64_t bps_wr_max,
+                               bool has_iops_max,
+                               int64_t iops_max,
+                               bool has_iops_rd_max,
+                               int64_t iops_rd_max,
+                               bool has_iops_wr_max,
+                               int64_t iops_wr_max,
+                               bool has_iops_size,
+                               int64_t iops_size, Error **errp)
+{
+    ThrottleConfig cfg;
+    BlockDriverState *bs;
+    BlockBackend *blk;
+    VeertuAioContext *aio_context;
+
+    blk = blk_by_name(device);
+    if (!blk) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return;
+    }
+    bs = blk_bs(blk);
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.buckets[THROTTLE_BPS_TOTAL].avg = bps;
+    cfg.buckets[THROTTLE_BPS_READ].avg  = bps_rd;
+    cfg.buckets[THROTTLE_BPS_WRITE].avg = bps_wr;
+
+    cfg.buckets[THROTTLE_OPS_TOTAL].avg = iops;
+    cfg.buckets[THROTTLE_OPS_READ].avg  = iops_rd;
+    cfg.buckets[THROTTLE_OPS_WRITE].avg = iops_wr;
+
+    if (has_bps_max) {
+        cfg.buckets[THROTTLE_BPS_TOTAL].max = bps_max;
+    }
+    if (has_bps_rd_max) {
+        cfg.buckets[THROTTLE_BPS_READ].max = bps_rd_max;
+    }
+    if (has_bps_wr_max) {
+        cfg.buckets[THROTTLE_BPS_WRITE].max = bps_wr_max;
+    }
+    if (has_iops_max) {
+        cfg.buckets[THROTTLE_OPS_TOTAL].max = iops_max;
+    }
+    if (has_iops_rd_max) {
+        cfg.buckets[THROTTLE_OPS_READ].max = iops_rd_max;
+    }
+    if (has_iops_wr_max) {
+        cfg.buckets[THROTTLE_OPS_WRITE].max = iops_wr_max;
+    }
+
+    if (has_iops_size) {
+        cfg.op_size = iops_size;
+    }
+
+    if (!check_throttle_config(&cfg, errp)) {
+        return;
+    }
+
+    aio_context = bdrv_get_aio_context(bs);
+    aio_context_acquire(aio_context);
+
+    if (!bs->io_limits_enabled && throttle_enabled(&cfg)) {
+        bdrv_io_limits_enable(bs);
+    } else if (bs->io_limits_enabled && !throttle_enabled(&cfg)) {
+        bdrv_io_limits_disable(bs);
+    }
+
+    if (bs->io_limits_enabled) {
+        bdrv_set_io_limits(bs, &cfg);
+    }
+
+    aio_context_release(aio_context);
+}
+
 int do_drive_del(Monitor *mon, const QDict *qdict, QObject **ret_data)
 {
     const char *id = qdict_get_str(qdict, "id");
@@ -2134,6 +2226,10 @@ QemuOptsList vmx_common_drive_opts = {
             .name = "read-only",
             .type = QEMU_OPT_BOOL,
             .help = "open drive file as read-only",
+        },{
+            .name = "stats-intervals",
+            .type = QEMU_OPT_BOOL,
+            .help = "keep per-second and per-minute latency statistics",
         },{
             .name = "throttling.iops-total",
             .type = QEMU_OPT_NUMBER,
@@ -24,21 +24,36 @@
 #include "qemu-common.h"
 #include "block_int.h"
 #include "qemu/module.h"
+#include "qemu/timer.h"
+#include "thread-pool.h"
+#include "decompress-cache.h"
 #include <zlib.h>
 
 /* Maximum compressed block size */
 #define MAX_BLOCK_SIZE (64 * 1024 * 1024)
 
+#define CLOOP_OPT_CACHE_SIZE "cache-size"
+
+/* Default amount of decompressed blocks kept in memory */
+#define CLOOP_DEFAULT_CACHE_SIZE (8 * 1024 * 1024)
+
+/* Room for the block being read and the one being prefetched */
+#define CLOOP_MIN_CACHE_ENTRIES 2
+
 typedef struct BDRVCloopState {
     CoMutex lock;
     uint32_t block_size;
     uint32_t n_blocks;
     uint64_t *offsets;
     uint32_t sectors_per_block;
-    uint32_t current_block;
-    uint8_t *compressed_block;
-    uint8_t *uncompressed_block;
-    z_stream zstream;
+
+    /* LRU cache of inflated blocks */
+    DecompressCache cache;
+    int prefetch_inflight;
+    uint32_t last_block;        /* block of the previous access */
+
+    uint64_t inflate_calls;
+    uint64_t inflate_ns;
 } BDRVCloopState;
 
 static int cloop_probe(const uint8_t *buf, int buf_size, const char *filename)
@@ -56,13 +71,41 @@ static int cloop_probe(const uint8_t *buf, int buf_size, const char *filename)
     return 0;
 }
 
+static QemuOptsList cloop_runtime_opts = {
+    .name = "cloop",
+    .head = QTAILQ_HEAD_INITIALIZER(cloop_runtime_opts.head),
+    .desc = {
+        {
+            .name = CLOOP_OPT_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum amount of decompressed blocks kept in memory",
+        },
+        { /* end of list */ }
+    },
+};
+
 static int cloop_open(BlockDriverState *bs, QDict *options, int flags,
                       Error **errp)
 {
     BDRVCloopState *s = bs->opaque;
-    uint32_t offsets_size, max_compressed_block_size = 1, i;
+    uint32_t offsets_size, i;
+    uint64_t cache_size;
+    int cache_entries;
+    QemuOpts *opts;
+    Error *local_err = NULL;
     int ret;
 
+    opts = vmx_opts_create(&cloop_runtime_opts, NULL, 0, &error_abort);
+    vmx_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        vmx_opts_del(opts);
+        return -EINVAL;
+    }
+    cache_size = vmx_opt_get_size(opts, CLOOP_OPT_CACHE_SIZE,
+                                  CLOOP_DEFAULT_CACHE_SIZE);
+    vmx_opts_del(opts);
+
     bs->read_only = 1;
 
     /* read header */
@@ -148,7 +191,7 @@ static int cloop_open(BlockDriverState *bs, QDict *options, int flags,
         /* Compressed blocks should be smaller than the uncompressed block size
          * but maybe compression performed poorly so the compressed block is
          * actually bigger.  Clamp down on unrealistic values to prevent
-         * ridiculous s->compressed_block allocation.
+         * ridiculous compressed buffer allocations.
          */
         if (size > 2 * MAX_BLOCK_SIZE) {
             error_setg(errp, "invalid compressed block size at index %" PRIu32
@@ -156,114 +199,204 @@ static int cloop_open(BlockDriverState *bs, QDict *options, int flags,
             ret = -EINVAL;
             goto fail;
         }
-
-        if (size > max_compressed_block_size) {
-            max_compressed_block_size = size;
-        }
     }
 
-    /* initialize zlib engine */
-    s->compressed_block = g_try_malloc(max_compressed_block_size + 1);
-    if (s->compressed_block == NULL) {
-        error_setg(errp, "Could not allocate compressed_block");
-        ret = -ENOMEM;
-        goto fail;
-    }
-
-    s->uncompressed_block = g_try_malloc(s->block_size);
-    if (s->uncompressed_block == NULL) {
-        error_setg(errp, "Could not allocate uncompressed_block");
-        ret = -ENOMEM;
-        goto fail;
-    }
-
-    if (inflateInit(&s->zstream) != Z_OK) {
-        ret = -EINVAL;
-        goto fail;
-    }
-    s->current_block = s->n_blocks;
+    /* blocks are inflated into cache entries allocated on first use */
+    cache_entries = MAX(CLOOP_MIN_CACHE_ENTRIES, cache_size / s->block_size);
+    cache_entries = MIN(cache_entries, MAX(s->n_blocks,
+                                           CLOOP_MIN_CACHE_ENTRIES));
 
     s->sectors_per_block = s->block_size/512;
     bs->total_sectors = s->n_blocks * s->sectors_per_block;
+    /* so that a read of block 0 counts as sequential */
+    s->last_block = UINT32_MAX;
     vmx_co_mutex_init(&s->lock);
+    decompress_cache_init(&s->cache, bs->file, &s->lock, cache_entries,
+                          s->block_size);
     return 0;
 
 fail:
     g_free(s->offsets);
-    g_free(s->compressed_block);
-    g_free(s->uncompressed_block);
     return ret;
 }
 
-static inline int cloop_read_block(BlockDriverState *bs, int block_num)
+typedef struct CloopInflateJob {
+    const uint8_t *in;
+    uint32_t in_len;
+    uint8_t *out;
+    uint32_t out_len;
+    int64_t ns;
+} CloopInflateJob;
+
+/* Runs in the thread pool; each job has its own zlib stream */
+static int cloop_inflate_block(void *opaque)
 {
+    CloopInflateJob *job = opaque;
+    int64_t start = vmx_clock_get_ns(QEMU_CLOCK_REALTIME);
+    z_stream strm;
+    int ret;
+
+    memset(&strm, 0, sizeof(strm));
+    if (inflateInit(&strm) != Z_OK) {
+        return -EIO;
+    }
+    strm.next_in = (uint8_t *)job->in;
+    strm.avail_in = job->in_len;
+    strm.next_out = job->out;
+    strm.avail_out = job->out_len;
+    ret = inflate(&strm, Z_FINISH);
+    inflateEnd(&strm);
+    job->ns = vmx_clock_get_ns(QEMU_CLOCK_REALTIME) - start;
+    if (ret != Z_STREAM_END || strm.total_out != job->out_len) {
+        return -EIO;
+    }
+    return 0;
+}
+
+/* Reads and inflates block_num into data, runs without s->lock */
+static int coroutine_fn cloop_fill_block(void *opaque, uint64_t block_num,
+                                         uint8_t *data)
+{
+    BlockDriverState *bs = opaque;
     BDRVCloopState *s = bs->opaque;
+    uint32_t bytes = s->offsets[block_num + 1] - s->offsets[block_num];
+    uint8_t *compressed;
+    CloopInflateJob job;
+    int ret;
 
-    if (s->current_block != block_num) {
-        int ret;
-        uint32_t bytes = s->offsets[block_num + 1] - s->offsets[block_num];
+    compressed = g_try_malloc(bytes + 1);
+    if (!compressed) {
+        return -ENOMEM;
+    }
 
-        ret = bdrv_pread(bs->file, s->offsets[block_num], s->compressed_block,
-                         bytes);
-        if (ret != bytes) {
-            return -1;
-        }
+    ret = bdrv_pread(bs->file, s->offsets[block_num], compressed, bytes);
+    if (ret != bytes) {
+        ret = -EIO;
+    } else {
+        job = (CloopInflateJob) {
+            .in         = compressed,
+            .in_len     = bytes,
+            .out        = data,
+            .out_len    = s->block_size,
+        };
+        ret = thread_pool_submit_co(aio_get_thread_pool(bdrv_get_aio_context(bs)),
+                                    cloop_inflate_block, &job);
+    }
 
-        s->zstream.next_in = s->compressed_block;
-        s->zstream.avail_in = bytes;
-        s->zstream.next_out = s->uncompressed_block;
-        s->zstream.avail_out = s->block_size;
-        ret = inflateReset(&s->zstream);
-        if (ret != Z_OK) {
-            return -1;
-        }
-        ret = inflate(&s->zstream, Z_FINISH);
-        if (ret != Z_STREAM_END || s->zstream.total_out != s->block_size) {
-            return -1;
-        }
+    g_free(compressed);
 
-        s->current_block = block_num;
+    if (ret == 0) {
+        s->inflate_calls++;
+        s->inflate_ns += job.ns;
     }
-    return 0;
+    return ret;
 }
 
-static int cloop_read(BlockDriverState *bs, int64_t sector_num,
-                    uint8_t *buf, int nb_sectors)
+/* Returns the inflated block, inflating it if needed. Called with s->lock
+ * held. */
+static int coroutine_fn cloop_get_block(BlockDriverState *bs,
+                                        uint32_t block_num, uint8_t **data)
 {
     BDRVCloopState *s = bs->opaque;
-    int i;
-
-    for (i = 0; i < nb_sectors; i++) {
-        uint32_t sector_offset_in_block =
-            ((sector_num + i) % s->sectors_per_block),
-            block_num = (sector_num + i) / s->sectors_per_block;
-        if (cloop_read_block(bs, block_num) != 0) {
-            return -1;
-        }
-        memcpy(buf + i * 512,
-            s->uncompressed_block + sector_offset_in_block * 512, 512);
+
+    return decompress_cache_get(&s->cache, block_num, cloop_fill_block, bs,
+                                data);
+}
+
+typedef struct CloopPrefetch {
+    BlockDriverState *bs;
+    uint32_t block_num;
+} CloopPrefetch;
+
+static void coroutine_fn cloop_prefetch_entry(void *opaque)
+{
+    CloopPrefetch *pf = opaque;
+    BDRVCloopState *s = pf->bs->opaque;
+    uint8_t *data;
+
+    vmx_co_mutex_lock(&s->lock);
+    cloop_get_block(pf->bs, pf->block_num, &data);
+    s->prefetch_inflight--;
+    vmx_co_mutex_unlock(&s->lock);
+    g_free(pf);
+}
+
+/* Starts inflating the block after the one just read in the background.
+ * Only one prefetch is kept in flight, and the caller only asks for it when
+ * the reads look sequential, so random access doesn't thrash the cache with
+ * blocks nobody asked for. */
+static void cloop_prefetch(BlockDriverState *bs, uint32_t block_num)
+{
+    BDRVCloopState *s = bs->opaque;
+    CloopPrefetch *pf;
+
+    if (block_num + 1 >= s->n_blocks || s->prefetch_inflight ||
+        decompress_cache_contains(&s->cache, block_num + 1)) {
+        return;
     }
-    return 0;
+
+    pf = g_new(CloopPrefetch, 1);
+    pf->bs = bs;
+    pf->block_num = block_num + 1;
+    s->prefetch_inflight++;
+    vmx_coroutine_enter(vmx_coroutine_create(cloop_prefetch_entry), pf);
 }
 
 static coroutine_fn int cloop_co_read(BlockDriverState *bs, int64_t sector_num,
                                       uint8_t *buf, int nb_sectors)
 {
-    int ret;
     BDRVCloopState *s = bs->opaque;
+    uint8_t *data;
+    uint32_t block_num = 0, prev_block = s->last_block;
+    int ret = 0;
+
     vmx_co_mutex_lock(&s->lock);
-    ret = cloop_read(bs, sector_num, buf, nb_sectors);
+    while (nb_sectors > 0) {
+        uint32_t sector_offset_in_block = sector_num % s->sectors_per_block;
+        int n = MIN(nb_sectors, s->sectors_per_block - sector_offset_in_block);
+
+        block_num = sector_num / s->sectors_per_block;
+        ret = cloop_get_block(bs, block_num, &data);
+        if (ret < 0) {
+            break;
+        }
+        prev_block = s->last_block;
+        s->last_block = block_num;
+        memcpy(buf, data + sector_offset_in_block * 512, n * 512);
+
+        sector_num += n;
+        nb_sectors -= n;
+        buf += n * 512;
+    }
+
+    if (ret == 0 && block_num == prev_block + 1) {
+        cloop_prefetch(bs, block_num);
+    }
     vmx_co_mutex_unlock(&s->lock);
     return ret;
 }
 
+static int cloop_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
+{
+    BDRVCloopState *s = bs->opaque;
+
+    bdi->cluster_size = s->block_size;
+    bdi->decompress_hits = s->cache.hits;
+    bdi->decompress_misses = s->inflate_calls;
+    bdi->decompress_ns = s->inflate_ns;
+    return 0;
+}
+
 static void cloop_close(BlockDriverState *bs)
 {
     BDRVCloopState *s = bs->opaque;
+
+    while (s->prefetch_inflight) {
+        aio_poll(bdrv_get_aio_context(bs), true);
+    }
+
     g_free(s->offsets);
-    g_free(s->compressed_block);
-    g_free(s->uncompressed_block);
-    inflateEnd(&s->zstream);
+    decompress_cache_destroy(&s->cache);
 }
 
 static BlockDriver bdrv_cloop = {
@@ -273,6 +406,7 @@ static BlockDriver bdrv_cloop = {
     .bdrv_open      = cloop_open,
     .bdrv_read      = cloop_co_read,
     .bdrv_close     = cloop_close,
+    .bdrv_get_info  = cloop_get_info,
 };
 
 void bdrv_cloop_init(void)
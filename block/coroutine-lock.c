@@ -40,6 +40,14 @@ void coroutine_fn vmx_co_queue_wait(CoQueue *queue)
     assert(vmx_in_coroutine());
 }
 
+void coroutine_fn vmx_co_queue_wait_insert_head(CoQueue *queue)
+{
+    Coroutine *self = vmx_coroutine_self();
+    QTAILQ_INSERT_HEAD(&queue->entries, self, co_queue_next);
+    vmx_coroutine_yield();
+    assert(vmx_in_coroutine());
+}
+
 /**
  * vmx_co_queue_run_restart:
  *
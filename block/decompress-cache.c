@@ -0,0 +1,145 @@
+/*
+ * LRU cache of decompressed blocks for the compressed image formats
+ *
+ * Copyright (C) 2016 Veertu Inc,
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 or
+ * (at your option) version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu-common.h"
+#include "block_int.h"
+#include "decompress-cache.h"
+
+void decompress_cache_init(DecompressCache *c, BlockDriverState *file,
+                           CoMutex *lock, int nb_entries, size_t entry_bytes)
+{
+    c->file = file;
+    c->lock = lock;
+    c->entries = g_new0(DecompressCacheEntry, nb_entries);
+    c->nb_entries = nb_entries;
+    c->entry_bytes = entry_bytes;
+    c->lru_counter = 0;
+    c->generation = 0;
+    c->hits = 0;
+    c->misses = 0;
+    vmx_co_queue_init(&c->fill_queue);
+}
+
+void decompress_cache_destroy(DecompressCache *c)
+{
+    int i;
+
+    for (i = 0; i < c->nb_entries; i++) {
+        vmx_vfree(c->entries[i].data);
+    }
+    g_free(c->entries);
+    c->entries = NULL;
+    c->nb_entries = 0;
+}
+
+/* Drops the cached blocks, e.g. because the image was rewritten */
+void decompress_cache_invalidate(DecompressCache *c)
+{
+    int i;
+
+    for (i = 0; i < c->nb_entries; i++) {
+        if (c->entries[i].state == DECOMPRESS_CACHE_READY) {
+            c->entries[i].state = DECOMPRESS_CACHE_EMPTY;
+        }
+    }
+    /* blocks being filled right now are dropped when they complete */
+    c->generation++;
+}
+
+/* True if key is cached or being filled */
+bool decompress_cache_contains(DecompressCache *c, uint64_t key)
+{
+    int i;
+
+    for (i = 0; i < c->nb_entries; i++) {
+        if (c->entries[i].state != DECOMPRESS_CACHE_EMPTY &&
+            c->entries[i].key == key) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int coroutine_fn decompress_cache_get(DecompressCache *c, uint64_t key,
+                                      DecompressCacheFill *fill, void *opaque,
+                                      uint8_t **data)
+{
+    DecompressCacheEntry *e, *victim;
+    uint64_t generation;
+    int i, ret;
+
+retry:
+    victim = NULL;
+    for (i = 0; i < c->nb_entries; i++) {
+        e = &c->entries[i];
+        if (e->state != DECOMPRESS_CACHE_EMPTY && e->key == key) {
+            if (e->state == DECOMPRESS_CACHE_FILLING) {
+                goto wait;
+            }
+            e->lru_counter = ++c->lru_counter;
+            c->hits++;
+            *data = e->data;
+            return 0;
+        }
+        if (e->state != DECOMPRESS_CACHE_FILLING &&
+            (!victim || e->lru_counter < victim->lru_counter)) {
+            victim = e;
+        }
+    }
+
+    if (!victim) {
+        /* every entry is being filled, wait for one to become free */
+        goto wait;
+    }
+
+    e = victim;
+    if (!e->data) {
+        e->data = vmx_try_blockalign(c->file, c->entry_bytes);
+        if (!e->data) {
+            return -ENOMEM;
+        }
+    }
+
+    c->misses++;
+    e->key = key;
+    e->state = DECOMPRESS_CACHE_FILLING;
+    e->lru_counter = ++c->lru_counter;
+    generation = c->generation;
+
+    vmx_co_mutex_unlock(c->lock);
+    ret = fill(opaque, key, e->data);
+    vmx_co_mutex_lock(c->lock);
+
+    /* the caller still gets a block invalidated while it was filled, but
+     * nobody after it does */
+    e->state = ret < 0 || generation != c->generation ?
+               DECOMPRESS_CACHE_EMPTY : DECOMPRESS_CACHE_READY;
+    vmx_co_queue_restart_all(&c->fill_queue);
+    if (ret < 0) {
+        return ret;
+    }
+    *data = e->data;
+    return 0;
+
+wait:
+    vmx_co_mutex_unlock(c->lock);
+    vmx_co_queue_wait(&c->fill_queue);
+    vmx_co_mutex_lock(c->lock);
+    goto retry;
+}
@@ -0,0 +1,80 @@
+/*
+ * LRU cache of decompressed blocks for the compressed image formats
+ *
+ * Copyright (C) 2016 Veertu Inc,
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 or
+ * (at your option) version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BLOCK_DECOMPRESS_CACHE_H
+#define BLOCK_DECOMPRESS_CACHE_H
+
+#include "block_int.h"
+
+/*
+ * Blocks are keyed by a driver chosen number (chunk, block or cluster
+ * offset) and decompressed by a driver callback with the driver's lock
+ * dropped, so misses on different blocks run in parallel.  Readers of a
+ * block that is being filled, or that find every entry being filled, wait
+ * for a fill to finish and look again.
+ *
+ * All functions except init and destroy are called with the driver's lock
+ * held.
+ */
+
+enum {
+    DECOMPRESS_CACHE_EMPTY,
+    DECOMPRESS_CACHE_FILLING,   /* being read and decoded without the lock */
+    DECOMPRESS_CACHE_READY,
+};
+
+typedef struct DecompressCacheEntry {
+    uint64_t key;
+    int state;
+    uint64_t lru_counter;
+    uint8_t *data;              /* allocated on first use */
+} DecompressCacheEntry;
+
+typedef struct DecompressCache {
+    BlockDriverState *file;     /* data buffers are aligned for it */
+    CoMutex *lock;
+    DecompressCacheEntry *entries;
+    int nb_entries;
+    size_t entry_bytes;
+    uint64_t lru_counter;
+    uint64_t generation;        /* bumped by invalidate */
+    CoQueue fill_queue;
+
+    uint64_t hits;
+    uint64_t misses;
+} DecompressCache;
+
+/* Decompresses block key into data, which holds entry_bytes. Called without
+ * the driver's lock. */
+typedef int coroutine_fn (DecompressCacheFill)(void *opaque, uint64_t key,
+                                               uint8_t *data);
+
+void decompress_cache_init(DecompressCache *c, BlockDriverState *file,
+                           CoMutex *lock, int nb_entries, size_t entry_bytes);
+void decompress_cache_destroy(DecompressCache *c);
+void decompress_cache_invalidate(DecompressCache *c);
+bool decompress_cache_contains(DecompressCache *c, uint64_t key);
+
+/* Points *data at the decompressed block, filling it if needed. *data stays
+ * valid until the lock is dropped. */
+int coroutine_fn decompress_cache_get(DecompressCache *c, uint64_t key,
+                                      DecompressCacheFill *fill, void *opaque,
+                                      uint8_t **data);
+
+#endif
@@ -176,4 +176,10 @@ BlockAIOCB *dma_blk_write(BlockBackend *blk,
                           void (*cb)(void *opaque, int ret), void *opaque)
 {
     return dma_blk_io(blk, sg, sector, blk_aio_writev, cb, opaque, 0);
-}
\ No newline at end of file
+}
+
+void dma_acct_start(BlockBackend *blk, BlockAcctCookie *cookie,
+                    VeertuSGList *sg, enum BlockAcctType type)
+{
+    block_acct_start(blk_get_stats(blk), cookie, sg->size, type);
+}
@@ -25,7 +25,13 @@
 #include "block_int.h"
 #include "qemu/bswap.h"
 #include "qemu/module.h"
+#include "thread-pool.h"
+#include "decompress-cache.h"
 #include <zlib.h>
+#include <bzlib.h>
+#ifdef __APPLE__
+#include <compression.h>
+#endif
 
 enum {
     /* Limit chunk sizes to prevent unreasonable amounts of memory being used
@@ -35,6 +41,17 @@ enum {
     DMG_SECTORCOUNTS_MAX = DMG_LENGTHS_MAX / 512,
 };
 
+#define DMG_OPT_CACHE_SIZE "cache-size"
+
+/* Default amount of decompressed chunks kept in memory */
+#define DMG_DEFAULT_CACHE_SIZE (16 * 1024 * 1024)
+
+/* Chunks decompressed ahead of a sequential reader */
+#define DMG_READAHEAD_CHUNKS 4
+
+/* The cache always has room for the chunk being read plus the read-ahead */
+#define DMG_MIN_CACHE_ENTRIES (DMG_READAHEAD_CHUNKS + 2)
+
 typedef struct BDRVDMGState {
     CoMutex lock;
     /* each chunk contains a certain number of sectors,
@@ -51,10 +68,12 @@ typedef struct BDRVDMGState {
     uint64_t* lengths;
     uint64_t* sectors;
     uint64_t* sectorcounts;
-    uint32_t current_chunk;
-    uint8_t *compressed_chunk;
-    uint8_t *uncompressed_chunk;
-    z_stream zstream;
+
+    /* LRU cache of decoded chunks */
+    DecompressCache cache;
+
+    uint32_t last_chunk;        /* last chunk read, for read-ahead */
+    int readahead_inflight;
 } BDRVDMGState;
 
 static int dmg_probe(const uint8_t *buf, int buf_size, const char *filename)
@@ -112,6 +131,8 @@ static void update_max_chunk_size(BDRVDMGState *s, uint32_t chunk,
 
     switch (s->types[chunk]) {
     case 0x80000005: /* zlib compressed */
+    case 0x80000006: /* bzip2 compressed */
+    case 0x80000007: /* lzfse compressed */
         compressed_size = s->lengths[chunk];
         uncompressed_sectors = s->sectorcounts[chunk];
         break;
@@ -131,6 +152,33 @@ static void update_max_chunk_size(BDRVDMGState *s, uint32_t chunk,
     }
 }
 
+static bool dmg_is_known_block_type(uint32_t entry_type)
+{
+    switch (entry_type) {
+    case 0x80000005: /* zlib compressed */
+    case 0x80000006: /* bzip2 compressed */
+    case 0x80000007: /* lzfse compressed */
+    case 1: /* copy */
+    case 2: /* zero */
+        return true;
+    default:
+        return false;
+    }
+}
+
+static QemuOptsList dmg_runtime_opts = {
+    .name = "dmg",
+    .head = QTAILQ_HEAD_INITIALIZER(dmg_runtime_opts.head),
+    .desc = {
+        {
+            .name = DMG_OPT_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum amount of decompressed chunks kept in memory",
+        },
+        { /* end of list */ }
+    },
+};
+
 static int dmg_open(BlockDriverState *bs, QDict *options, int flags,
                     Error **errp)
 {
@@ -138,9 +186,25 @@ static int dmg_open(BlockDriverState *bs, QDict *options, int flags,
     uint64_t info_begin, info_end, last_in_offset, last_out_offset;
     uint32_t count, tmp;
     uint32_t max_compressed_size = 1, max_sectors_per_chunk = 1, i;
+    uint64_t cache_size;
+    size_t max_chunk_bytes;
+    int cache_entries;
     int64_t offset;
+    QemuOpts *opts;
+    Error *local_err = NULL;
     int ret;
 
+    opts = vmx_opts_create(&dmg_runtime_opts, NULL, 0, &error_abort);
+    vmx_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        vmx_opts_del(opts);
+        return -EINVAL;
+    }
+    cache_size = vmx_opt_get_size(opts, DMG_OPT_CACHE_SIZE,
+                                  DMG_DEFAULT_CACHE_SIZE);
+    vmx_opts_del(opts);
+
     bs->read_only = 1;
     s->n_chunks = 0;
     s->offsets = s->lengths = s->sectors = s->sectorcounts = NULL;
@@ -220,8 +284,7 @@ static int dmg_open(BlockDriverState *bs, QDict *options, int flags,
                     goto fail;
                 }
                 offset += 4;
-                if (s->types[i] != 0x80000005 && s->types[i] != 1 &&
-                    s->types[i] != 2) {
+                if (!dmg_is_known_block_type(s->types[i])) {
                     if (s->types[i] == 0xffffffff && i > 0) {
                         last_in_offset = s->offsets[i - 1] + s->lengths[i - 1];
                         last_out_offset = s->sectors[i - 1] +
@@ -283,24 +346,16 @@ static int dmg_open(BlockDriverState *bs, QDict *options, int flags,
         }
     }
 
-    /* initialize zlib engine */
-    s->compressed_chunk = vmx_try_blockalign(bs->file,
-                                              max_compressed_size + 1);
-    s->uncompressed_chunk = vmx_try_blockalign(bs->file,
-                                                512 * max_sectors_per_chunk);
-    if (s->compressed_chunk == NULL || s->uncompressed_chunk == NULL) {
-        ret = -ENOMEM;
-        goto fail;
-    }
-
-    if (inflateInit(&s->zstream) != Z_OK) {
-        ret = -EINVAL;
-        goto fail;
-    }
-
-    s->current_chunk = s->n_chunks;
+    /* chunks are decoded into cache entries allocated on first use */
+    max_chunk_bytes = 512 * (size_t)max_sectors_per_chunk;
+    cache_entries = MAX(DMG_MIN_CACHE_ENTRIES, cache_size / max_chunk_bytes);
+    cache_entries = MIN(cache_entries, MAX(s->n_chunks,
+                                           DMG_MIN_CACHE_ENTRIES));
+    s->last_chunk = s->n_chunks;
 
     vmx_co_mutex_init(&s->lock);
+    decompress_cache_init(&s->cache, bs->file, &s->lock, cache_entries,
+                          max_chunk_bytes);
     return 0;
 
 fail:
@@ -309,22 +364,9 @@ fail:
     g_free(s->lengths);
     g_free(s->sectors);
     g_free(s->sectorcounts);
-    vmx_vfree(s->compressed_chunk);
-    vmx_vfree(s->uncompressed_chunk);
     return ret;
 }
 
-static inline int is_sector_in_chunk(BDRVDMGState* s,
-                uint32_t chunk_num, uint64_t sector_num)
-{
-    if (chunk_num >= s->n_chunks || s->sectors[chunk_num] > sector_num ||
-            s->sectors[chunk_num] + s->sectorcounts[chunk_num] <= sector_num) {
-        return 0;
-    } else {
-        return -1;
-    }
-}
-
 static inline uint32_t search_chunk(BDRVDMGState *s, uint64_t sector_num)
 {
     /* binary search */
@@ -342,84 +384,216 @@ static inline uint32_t search_chunk(BDRVDMGState *s, uint64_t sector_num)
     return s->n_chunks; /* error */
 }
 
-static inline int dmg_read_chunk(BlockDriverState *bs, uint64_t sector_num)
+typedef struct DMGDecodeJob {
+    uint32_t type;
+    const uint8_t *in;
+    uint64_t in_len;
+    uint8_t *out;
+    uint64_t out_len;
+} DMGDecodeJob;
+
+/* Runs in the thread pool; each job has its own decoder state */
+static int dmg_decode_chunk(void *opaque)
 {
-    BDRVDMGState *s = bs->opaque;
+    DMGDecodeJob *job = opaque;
+    z_stream strm;
+    int ret;
 
-    if (!is_sector_in_chunk(s, s->current_chunk, sector_num)) {
-        int ret;
-        uint32_t chunk = search_chunk(s, sector_num);
+    switch (job->type) {
+    case 0x80000005: /* zlib compressed */
+        memset(&strm, 0, sizeof(strm));
+        if (inflateInit(&strm) != Z_OK) {
+            return -EIO;
+        }
+        strm.next_in = (uint8_t *)job->in;
+        strm.avail_in = job->in_len;
+        strm.next_out = job->out;
+        strm.avail_out = job->out_len;
+        ret = inflate(&strm, Z_FINISH);
+        if (ret != Z_STREAM_END || strm.total_out != job->out_len) {
+            inflateEnd(&strm);
+            return -EIO;
+        }
+        inflateEnd(&strm);
+        return 0;
+    case 0x80000006: /* bzip2 compressed */
+    {
+        bz_stream bzstrm;
 
-        if (chunk >= s->n_chunks) {
-            return -1;
+        memset(&bzstrm, 0, sizeof(bzstrm));
+        if (BZ2_bzDecompressInit(&bzstrm, 0, 0) != BZ_OK) {
+            return -EIO;
+        }
+        bzstrm.next_in = (char *)job->in;
+        bzstrm.avail_in = job->in_len;
+        bzstrm.next_out = (char *)job->out;
+        bzstrm.avail_out = job->out_len;
+        ret = BZ2_bzDecompress(&bzstrm);
+        BZ2_bzDecompressEnd(&bzstrm);
+        if (ret != BZ_STREAM_END ||
+            bzstrm.total_out_lo32 != job->out_len) {
+            return -EIO;
+        }
+        return 0;
+    }
+    case 0x80000007: /* lzfse compressed */
+#ifdef __APPLE__
+        /* libcompression is weakly linked, it only exists on 10.11+ */
+        if (!compression_decode_buffer) {
+            return -ENOTSUP;
         }
+        if (compression_decode_buffer(job->out, job->out_len, job->in,
+                                      job->in_len, NULL,
+                                      COMPRESSION_LZFSE) != job->out_len) {
+            return -EIO;
+        }
+        return 0;
+#else
+        return -ENOTSUP;
+#endif
+    }
+    return -EIO;
+}
 
-        s->current_chunk = s->n_chunks;
-        switch (s->types[chunk]) {
-        case 0x80000005: { /* zlib compressed */
-            /* we need to buffer, because only the chunk as whole can be
-             * inflated. */
-            ret = bdrv_pread(bs->file, s->offsets[chunk],
-                             s->compressed_chunk, s->lengths[chunk]);
-            if (ret != s->lengths[chunk]) {
-                return -1;
-            }
+/* Reads and decodes chunk into data, runs without s->lock */
+static int coroutine_fn dmg_fill_chunk(void *opaque, uint64_t chunk,
+                                       uint8_t *data)
+{
+    BlockDriverState *bs = opaque;
+    BDRVDMGState *s = bs->opaque;
+    uint8_t *compressed = NULL;
+    DMGDecodeJob job;
+    int ret = 0;
 
-            s->zstream.next_in = s->compressed_chunk;
-            s->zstream.avail_in = s->lengths[chunk];
-            s->zstream.next_out = s->uncompressed_chunk;
-            s->zstream.avail_out = 512 * s->sectorcounts[chunk];
-            ret = inflateReset(&s->zstream);
-            if (ret != Z_OK) {
-                return -1;
-            }
-            ret = inflate(&s->zstream, Z_FINISH);
-            if (ret != Z_STREAM_END ||
-                s->zstream.total_out != 512 * s->sectorcounts[chunk]) {
-                return -1;
-            }
-            break; }
-        case 1: /* copy */
-            ret = bdrv_pread(bs->file, s->offsets[chunk],
-                             s->uncompressed_chunk, s->lengths[chunk]);
-            if (ret != s->lengths[chunk]) {
-                return -1;
-            }
+    switch (s->types[chunk]) {
+    case 1: /* copy */
+        ret = bdrv_pread(bs->file, s->offsets[chunk], data,
+                         s->lengths[chunk]);
+        ret = ret != s->lengths[chunk] ? -EIO : 0;
+        break;
+    default:
+        /* we need to buffer, because only the chunk as whole can be
+         * decoded. */
+        compressed = vmx_try_blockalign(bs->file, s->lengths[chunk] + 1);
+        if (!compressed) {
+            ret = -ENOMEM;
             break;
-        case 2: /* zero */
-            memset(s->uncompressed_chunk, 0, 512 * s->sectorcounts[chunk]);
+        }
+        ret = bdrv_pread(bs->file, s->offsets[chunk], compressed,
+                         s->lengths[chunk]);
+        if (ret != s->lengths[chunk]) {
+            ret = -EIO;
             break;
         }
-        s->current_chunk = chunk;
+        job = (DMGDecodeJob) {
+            .type       = s->types[chunk],
+            .in         = compressed,
+            .in_len     = s->lengths[chunk],
+            .out        = data,
+            .out_len    = 512 * s->sectorcounts[chunk],
+        };
+        ret = thread_pool_submit_co(aio_get_thread_pool(bdrv_get_aio_context(bs)),
+                                    dmg_decode_chunk, &job);
+        break;
     }
-    return 0;
+
+    vmx_vfree(compressed);
+    return ret;
+}
+
+/* Returns the decoded chunk, decoding it if needed. Called with s->lock
+ * held. */
+static int coroutine_fn dmg_get_chunk(BlockDriverState *bs, uint32_t chunk,
+                                      uint8_t **data)
+{
+    BDRVDMGState *s = bs->opaque;
+
+    return decompress_cache_get(&s->cache, chunk, dmg_fill_chunk, bs, data);
+}
+
+typedef struct DMGReadahead {
+    BlockDriverState *bs;
+    uint32_t chunk;
+} DMGReadahead;
+
+static void coroutine_fn dmg_readahead_entry(void *opaque)
+{
+    DMGReadahead *ra = opaque;
+    BDRVDMGState *s = ra->bs->opaque;
+    uint8_t *data;
+
+    vmx_co_mutex_lock(&s->lock);
+    dmg_get_chunk(ra->bs, ra->chunk, &data);
+    s->readahead_inflight--;
+    vmx_co_mutex_unlock(&s->lock);
+    g_free(ra);
 }
 
-static int dmg_read(BlockDriverState *bs, int64_t sector_num,
-                    uint8_t *buf, int nb_sectors)
+/* Starts decoding the chunks after a sequentially read chunk in the
+ * background, so they are ready when the guest gets there */
+static void dmg_readahead(BlockDriverState *bs, uint32_t chunk)
 {
     BDRVDMGState *s = bs->opaque;
-    int i;
+    uint32_t next;
+
+    if (s->last_chunk != chunk && s->last_chunk + 1 != chunk) {
+        return;
+    }
+
+    for (next = chunk + 1;
+         next < s->n_chunks && next <= chunk + DMG_READAHEAD_CHUNKS; next++) {
+        DMGReadahead *ra;
 
-    for (i = 0; i < nb_sectors; i++) {
-        uint32_t sector_offset_in_chunk;
-        if (dmg_read_chunk(bs, sector_num + i) != 0) {
-            return -1;
+        if (s->types[next] == 2 || decompress_cache_contains(&s->cache, next)) {
+            continue;
         }
-        sector_offset_in_chunk = sector_num + i - s->sectors[s->current_chunk];
-        memcpy(buf + i * 512,
-               s->uncompressed_chunk + sector_offset_in_chunk * 512, 512);
+        ra = g_new(DMGReadahead, 1);
+        ra->bs = bs;
+        ra->chunk = next;
+        s->readahead_inflight++;
+        vmx_coroutine_enter(vmx_coroutine_create(dmg_readahead_entry), ra);
     }
-    return 0;
 }
 
 static coroutine_fn int dmg_co_read(BlockDriverState *bs, int64_t sector_num,
                                     uint8_t *buf, int nb_sectors)
 {
-    int ret;
     BDRVDMGState *s = bs->opaque;
+    uint8_t *data;
+    uint32_t chunk = s->n_chunks;
+    uint64_t offset_in_chunk;
+    int n, ret = 0;
+
     vmx_co_mutex_lock(&s->lock);
-    ret = dmg_read(bs, sector_num, buf, nb_sectors);
+    while (nb_sectors > 0) {
+        chunk = search_chunk(s, sector_num);
+        if (chunk >= s->n_chunks) {
+            ret = -EIO;
+            break;
+        }
+
+        offset_in_chunk = sector_num - s->sectors[chunk];
+        n = MIN(nb_sectors, s->sectorcounts[chunk] - offset_in_chunk);
+
+        if (s->types[chunk] == 2) { /* zero */
+            memset(buf, 0, n * 512);
+        } else {
+            ret = dmg_get_chunk(bs, chunk, &data);
+            if (ret < 0) {
+                break;
+            }
+            memcpy(buf, data + offset_in_chunk * 512, n * 512);
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+        buf += n * 512;
+    }
+
+    if (ret == 0) {
+        dmg_readahead(bs, chunk);
+        s->last_chunk = chunk;
+    }
     vmx_co_mutex_unlock(&s->lock);
     return ret;
 }
@@ -428,15 +602,16 @@ static void dmg_close(BlockDriverState *bs)
 {
     BDRVDMGState *s = bs->opaque;
 
+    while (s->readahead_inflight) {
+        aio_poll(bdrv_get_aio_context(bs), true);
+    }
+
     g_free(s->types);
     g_free(s->offsets);
     g_free(s->lengths);
     g_free(s->sectors);
     g_free(s->sectorcounts);
-    vmx_vfree(s->compressed_chunk);
-    vmx_vfree(s->uncompressed_chunk);
-
-    inflateEnd(&s->zstream);
+    decompress_cache_destroy(&s->cache);
 }
 
 static BlockDriver bdrv_dmg = {
@@ -29,6 +29,7 @@
 #include "qapi/qmp-output-visitor.h"
 #include "qapi/qmp/types.h"
 #include "emublock-backend.h"
+#include "qemu/timer.h"
 
 #undef direct
 
@@ -62,6 +63,35 @@ BlockDeviceInfo *bdrv_block_device_info(BlockDriverState *bs)
     info->backing_file_depth = bdrv_get_backing_file_depth(bs);
     info->detect_zeroes = bs->detect_zeroes;
 
+    if (bs->io_limits_enabled) {
+        ThrottleConfig cfg;
+        throttle_get_config(&bs->throttle_state, &cfg);
+        info->bps     = cfg.buckets[THROTTLE_BPS_TOTAL].avg;
+        info->bps_rd  = cfg.buckets[THROTTLE_BPS_READ].avg;
+        info->bps_wr  = cfg.buckets[THROTTLE_BPS_WRITE].avg;
+
+        info->iops    = cfg.buckets[THROTTLE_OPS_TOTAL].avg;
+        info->iops_rd = cfg.buckets[THROTTLE_OPS_READ].avg;
+        info->iops_wr = cfg.buckets[THROTTLE_OPS_WRITE].avg;
+
+        info->has_bps_max     = cfg.buckets[THROTTLE_BPS_TOTAL].max;
+        info->bps_max         = cfg.buckets[THROTTLE_BPS_TOTAL].max;
+        info->has_bps_rd_max  = cfg.buckets[THROTTLE_BPS_READ].max;
+        info->bps_rd_max      = cfg.buckets[THROTTLE_BPS_READ].max;
+        info->has_bps_wr_max  = cfg.buckets[THROTTLE_BPS_WRITE].max;
+        info->bps_wr_max      = cfg.buckets[THROTTLE_BPS_WRITE].max;
+
+        info->has_iops_max    = cfg.buckets[THROTTLE_OPS_TOTAL].max;
+        info->iops_max        = cfg.buckets[THROTTLE_OPS_TOTAL].max;
+        info->has_iops_rd_max = cfg.buckets[THROTTLE_OPS_READ].max;
+        info->iops_rd_max     = cfg.buckets[THROTTLE_OPS_READ].max;
+        info->has_iops_wr_max = cfg.buckets[THROTTLE_OPS_WRITE].max;
+        info->iops_wr_max     = cfg.buckets[THROTTLE_OPS_WRITE].max;
+
+        info->has_iops_size = cfg.op_size;
+        info->iops_size = cfg.op_size;
+    }
+
     return info;
 }
 
@@ -285,9 +315,71 @@ static void bdrv_query_info(BlockBackend *blk, BlockInfo **p_info,
     qapi_free_BlockInfo(info);
 }
 
+static BlockLatencyHistogram *bdrv_query_latency_histogram(BlockAcctStats *stats,
+                                                           enum BlockAcctType type)
+{
+    BlockLatencyHistogram *hgram = g_malloc0(sizeof(*hgram));
+    intList **p_bound = &hgram->boundaries, **p_bin = &hgram->bins;
+    int i;
+
+    for (i = 0; i < BLOCK_LATENCY_BINS; i++) {
+        intList *bin = g_malloc0(sizeof(*bin));
+
+        /* bin 0 starts at zero, only the upper bins need a boundary */
+        if (i) {
+            intList *bound = g_malloc0(sizeof(*bound));
+
+            bound->value = block_acct_latency_bin_start(i);
+            *p_bound = bound;
+            p_bound = &bound->next;
+        }
+        bin->value = stats->latency_histogram[type][i];
+        *p_bin = bin;
+        p_bin = &bin->next;
+    }
+    return hgram;
+}
+
+static BlockDeviceTimedStats *bdrv_query_timed_stats(BlockAcctStats *stats,
+                                                     enum BlockAcctInterval i)
+{
+    BlockAcctWindow *w = block_acct_last_window(stats, i);
+    BlockDeviceTimedStats *ts = g_malloc0(sizeof(*ts));
+    int64_t interval_ns = stats->timed_stats[i].interval_ns;
+    int64_t window_ns = MAX(w->end_ns - w->start_ns, 1);
+
+    ts->interval_length = interval_ns / get_ticks_per_sec();
+
+    ts->min_rd_latency_ns = w->min_time_ns[BLOCK_ACCT_READ];
+    ts->max_rd_latency_ns = w->max_time_ns[BLOCK_ACCT_READ];
+    if (w->nr_ops[BLOCK_ACCT_READ]) {
+        ts->avg_rd_latency_ns = w->total_time_ns[BLOCK_ACCT_READ] /
+                                w->nr_ops[BLOCK_ACCT_READ];
+    }
+    ts->min_wr_latency_ns = w->min_time_ns[BLOCK_ACCT_WRITE];
+    ts->max_wr_latency_ns = w->max_time_ns[BLOCK_ACCT_WRITE];
+    if (w->nr_ops[BLOCK_ACCT_WRITE]) {
+        ts->avg_wr_latency_ns = w->total_time_ns[BLOCK_ACCT_WRITE] /
+                                w->nr_ops[BLOCK_ACCT_WRITE];
+    }
+    ts->min_flush_latency_ns = w->min_time_ns[BLOCK_ACCT_FLUSH];
+    ts->max_flush_latency_ns = w->max_time_ns[BLOCK_ACCT_FLUSH];
+    if (w->nr_ops[BLOCK_ACCT_FLUSH]) {
+        ts->avg_flush_latency_ns = w->total_time_ns[BLOCK_ACCT_FLUSH] /
+                                   w->nr_ops[BLOCK_ACCT_FLUSH];
+    }
+
+    ts->avg_rd_queue_depth =
+        (double)w->queue_depth_ns[BLOCK_ACCT_READ] / window_ns;
+    ts->avg_wr_queue_depth =
+        (double)w->queue_depth_ns[BLOCK_ACCT_WRITE] / window_ns;
+    return ts;
+}
+
 static BlockStats *bdrv_query_stats(const BlockDriverState *bs,
                                     bool query_backing)
 {
+    BlockAcctStats *stats;
     BlockStats *s;
 
     s = g_malloc0(sizeof(*s));
@@ -313,6 +405,40 @@ static BlockStats *bdrv_query_stats(const BlockDriverState *bs,
     s->stats->wr_total_time_ns = bs->stats.total_time_ns[BLOCK_ACCT_WRITE];
     s->stats->rd_total_time_ns = bs->stats.total_time_ns[BLOCK_ACCT_READ];
     s->stats->flush_total_time_ns = bs->stats.total_time_ns[BLOCK_ACCT_FLUSH];
+    s->stats->failed_rd_operations = bs->stats.failed_ops[BLOCK_ACCT_READ];
+    s->stats->failed_wr_operations = bs->stats.failed_ops[BLOCK_ACCT_WRITE];
+    s->stats->failed_flush_operations = bs->stats.failed_ops[BLOCK_ACCT_FLUSH];
+    s->stats->invalid_rd_operations = bs->stats.invalid_ops[BLOCK_ACCT_READ];
+    s->stats->invalid_wr_operations = bs->stats.invalid_ops[BLOCK_ACCT_WRITE];
+    s->stats->invalid_flush_operations =
+        bs->stats.invalid_ops[BLOCK_ACCT_FLUSH];
+    s->stats->max_rd_queue_depth = bs->stats.max_in_flight[BLOCK_ACCT_READ];
+    s->stats->max_wr_queue_depth = bs->stats.max_in_flight[BLOCK_ACCT_WRITE];
+
+    /* the histograms are always kept, the windows only when enabled */
+    stats = (BlockAcctStats *)&bs->stats;
+    s->stats->has_rd_latency_histogram = true;
+    s->stats->rd_latency_histogram =
+        bdrv_query_latency_histogram(stats, BLOCK_ACCT_READ);
+    s->stats->has_wr_latency_histogram = true;
+    s->stats->wr_latency_histogram =
+        bdrv_query_latency_histogram(stats, BLOCK_ACCT_WRITE);
+    s->stats->has_flush_latency_histogram = true;
+    s->stats->flush_latency_histogram =
+        bdrv_query_latency_histogram(stats, BLOCK_ACCT_FLUSH);
+
+    if (stats->intervals_enabled) {
+        BlockDeviceTimedStatsList **p_next = &s->stats->timed_stats;
+        int i;
+
+        for (i = 0; i < BLOCK_ACCT_INTERVAL_MAX; i++) {
+            BlockDeviceTimedStatsList *entry = g_malloc0(sizeof(*entry));
+
+            entry->value = bdrv_query_timed_stats(stats, i);
+            *p_next = entry;
+            p_next = &entry->next;
+        }
+    }
 
     if (bs->file) {
         s->has_parent = true;
@@ -27,51 +27,172 @@
 #include "qcow2.h"
 
 typedef struct Qcow2CachedTable {
-    void*   table;
     int64_t offset;
     bool    dirty;
-    int     cache_hits;
     int     ref;
+    int     hash_next;  /* next entry in the same hash bucket */
+    int     lru_prev;   /* unreferenced entries, most recently used first */
+    int     lru_next;
 } Qcow2CachedTable;
 
 struct Qcow2Cache {
     Qcow2CachedTable*       entries;
+    void*                   table_array;
+    int*                    buckets;
+    unsigned                hash_mask;
+    int                     lru_head;
+    int                     lru_tail;
     struct Qcow2Cache*      depends;
     int                     size;
+    int                     table_size;
+    int                     table_bits;
     bool                    depends_on_flush;
+    uint64_t                hits;
+    uint64_t                misses;
+    uint64_t                evictions;
 };
 
+static inline void *qcow2_cache_table(Qcow2Cache *c, int i)
+{
+    return (uint8_t *)c->table_array + ((size_t)i << c->table_bits);
+}
+
+static inline int qcow2_cache_table_idx(Qcow2Cache *c, void *table)
+{
+    ptrdiff_t offset = (uint8_t *)table - (uint8_t *)c->table_array;
+
+    if (offset < 0 || (offset >> c->table_bits) >= c->size) {
+        return -1;
+    }
+    assert((offset & (c->table_size - 1)) == 0);
+    return offset >> c->table_bits;
+}
+
+static inline unsigned qcow2_cache_hash(Qcow2Cache *c, uint64_t offset)
+{
+    return (offset >> c->table_bits) & c->hash_mask;
+}
+
+static void qcow2_cache_hash_insert(Qcow2Cache *c, int i)
+{
+    unsigned h = qcow2_cache_hash(c, c->entries[i].offset);
+
+    c->entries[i].hash_next = c->buckets[h];
+    c->buckets[h] = i;
+}
+
+static void qcow2_cache_hash_remove(Qcow2Cache *c, int i)
+{
+    int *p = &c->buckets[qcow2_cache_hash(c, c->entries[i].offset)];
+
+    while (*p != i) {
+        assert(*p >= 0);
+        p = &c->entries[*p].hash_next;
+    }
+    *p = c->entries[i].hash_next;
+    c->entries[i].hash_next = -1;
+}
+
+static int qcow2_cache_hash_find(Qcow2Cache *c, uint64_t offset)
+{
+    int i;
+
+    for (i = c->buckets[qcow2_cache_hash(c, offset)]; i >= 0;
+         i = c->entries[i].hash_next) {
+        if (c->entries[i].offset == offset) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void qcow2_cache_lru_remove(Qcow2Cache *c, int i)
+{
+    Qcow2CachedTable *e = &c->entries[i];
+
+    if (e->lru_prev >= 0) {
+        c->entries[e->lru_prev].lru_next = e->lru_next;
+    } else {
+        c->lru_head = e->lru_next;
+    }
+    if (e->lru_next >= 0) {
+        c->entries[e->lru_next].lru_prev = e->lru_prev;
+    } else {
+        c->lru_tail = e->lru_prev;
+    }
+    e->lru_prev = e->lru_next = -1;
+}
+
+/* Unused entries go to the tail so they are the first to be replaced */
+static void qcow2_cache_lru_insert(Qcow2Cache *c, int i, bool at_head)
+{
+    Qcow2CachedTable *e = &c->entries[i];
+
+    if (at_head) {
+        e->lru_prev = -1;
+        e->lru_next = c->lru_head;
+        if (c->lru_head >= 0) {
+            c->entries[c->lru_head].lru_prev = i;
+        } else {
+            c->lru_tail = i;
+        }
+        c->lru_head = i;
+    } else {
+        e->lru_next = -1;
+        e->lru_prev = c->lru_tail;
+        if (c->lru_tail >= 0) {
+            c->entries[c->lru_tail].lru_next = i;
+        } else {
+            c->lru_head = i;
+        }
+        c->lru_tail = i;
+    }
+}
+
+static void qcow2_cache_reset_entries(Qcow2Cache *c)
+{
+    int i;
+
+    for (i = 0; i <= c->hash_mask; i++) {
+        c->buckets[i] = -1;
+    }
+    c->lru_head = c->lru_tail = -1;
+    for (i = 0; i < c->size; i++) {
+        c->entries[i].offset = 0;
+        c->entries[i].hash_next = -1;
+        qcow2_cache_lru_insert(c, i, false);
+    }
+}
+
 Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables)
 {
     BDRVQcowState *s = bs->opaque;
     Qcow2Cache *c;
-    int i;
+    unsigned buckets = 1;
+
+    while (buckets < num_tables) {
+        buckets <<= 1;
+    }
 
     c = g_new0(Qcow2Cache, 1);
     c->size = num_tables;
+    c->table_size = s->cluster_size;
+    c->table_bits = s->cluster_bits;
+    c->hash_mask = buckets - 1;
     c->entries = g_try_new0(Qcow2CachedTable, num_tables);
-    if (!c->entries) {
-        goto fail;
-    }
-
-    for (i = 0; i < c->size; i++) {
-        c->entries[i].table = vmx_try_blockalign(bs->file, s->cluster_size);
-        if (c->entries[i].table == NULL) {
-            goto fail;
-        }
+    c->buckets = g_try_new(int, buckets);
+    c->table_array = vmx_try_blockalign(bs->file,
+                                        (size_t)num_tables * s->cluster_size);
+    if (!c->entries || !c->buckets || !c->table_array) {
+        vmx_vfree(c->table_array);
+        g_free(c->buckets);
+        g_free(c->entries);
+        g_free(c);
+        return NULL;
     }
 
+    qcow2_cache_reset_entries(c);
     return c;
-
-fail:
-    if (c->entries) {
-        for (i = 0; i < c->size; i++) {
-            vmx_vfree(c->entries[i].table);
-        }
-    }
-    g_free(c->entries);
-    g_free(c);
-    return NULL;
 }
 
 int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c)
@@ -80,15 +201,24 @@ int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c)
 
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
-        vmx_vfree(c->entries[i].table);
     }
 
+    vmx_vfree(c->table_array);
+    g_free(c->buckets);
     g_free(c->entries);
     g_free(c);
 
     return 0;
 }
 
+void qcow2_cache_get_stats(Qcow2Cache *c, uint64_t *hits, uint64_t *misses,
+                           uint64_t *evictions)
+{
+    *hits += c->hits;
+    *misses += c->misses;
+    *evictions += c->evictions;
+}
+
 static int qcow2_cache_flush_dependency(BlockDriverState *bs, Qcow2Cache *c)
 {
     int ret;
@@ -147,7 +277,7 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
         BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE);
     }
 
-    ret = bdrv_pwrite(bs->file, c->entries[i].offset, c->entries[i].table,
+    ret = bdrv_pwrite(bs->file, c->entries[i].offset, qcow2_cache_table(c, i),
         s->cluster_size);
     if (ret < 0) {
         return ret;
@@ -221,41 +351,21 @@ int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
 
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
-        c->entries[i].offset = 0;
-        c->entries[i].cache_hits = 0;
     }
+    qcow2_cache_reset_entries(c);
 
     return 0;
 }
 
+/* The least recently used table that nobody holds a reference to */
 static int qcow2_cache_find_entry_to_replace(Qcow2Cache *c)
 {
-    int i;
-    int min_count = INT_MAX;
-    int min_index = -1;
-
-
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].ref) {
-            continue;
-        }
-
-        if (c->entries[i].cache_hits < min_count) {
-            min_index = i;
-            min_count = c->entries[i].cache_hits;
-        }
-
-        /* Give newer hits priority */
-        /* TODO Check how to optimize the replacement strategy */
-        c->entries[i].cache_hits /= 2;
-    }
-
-    if (min_index == -1) {
+    if (c->lru_tail < 0) {
         /* This can't happen in current synchronous code, but leave the check
          * here as a reminder for whoever starts using AIO with the cache */
         abort();
     }
-    return min_index;
+    return c->lru_tail;
 }
 
 static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
@@ -266,11 +376,12 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     int ret;
 
     /* Check if the table is already cached */
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].offset == offset) {
-            goto found;
-        }
+    i = qcow2_cache_hash_find(c, offset);
+    if (i >= 0) {
+        c->hits++;
+        goto found;
     }
+    c->misses++;
 
     /* If not, write a table back and replace it */
     i = qcow2_cache_find_entry_to_replace(c);
@@ -283,28 +394,35 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
         return ret;
     }
 
-    c->entries[i].offset = 0;
+    if (c->entries[i].offset) {
+        c->evictions++;
+        qcow2_cache_hash_remove(c, i);
+        c->entries[i].offset = 0;
+    }
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
         }
 
-        ret = bdrv_pread(bs->file, offset, c->entries[i].table, s->cluster_size);
+        ret = bdrv_pread(bs->file, offset, qcow2_cache_table(c, i),
+                         s->cluster_size);
         if (ret < 0) {
+            /* the entry is now unused, make it the next one to replace */
+            qcow2_cache_lru_remove(c, i);
+            qcow2_cache_lru_insert(c, i, false);
             return ret;
         }
     }
 
-    /* Give the table some hits for the start so that it won't be replaced
-     * immediately. The number 32 is completely arbitrary. */
-    c->entries[i].cache_hits = 32;
     c->entries[i].offset = offset;
+    qcow2_cache_hash_insert(c, i);
 
     /* And return the right table */
 found:
-    c->entries[i].cache_hits++;
-    c->entries[i].ref++;
-    *table = c->entries[i].table;
+    if (c->entries[i].ref++ == 0) {
+        qcow2_cache_lru_remove(c, i);
+    }
+    *table = qcow2_cache_table(c, i);
 
     return 0;
 }
@@ -323,34 +441,28 @@ int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
 
 int qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table)
 {
-    int i;
+    int i = qcow2_cache_table_idx(c, *table);
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == *table) {
-            goto found;
-        }
+    if (i < 0) {
+        return -ENOENT;
     }
-    return -ENOENT;
 
-found:
     c->entries[i].ref--;
     *table = NULL;
 
     assert(c->entries[i].ref >= 0);
+    if (c->entries[i].ref == 0) {
+        qcow2_cache_lru_insert(c, i, true);
+    }
     return 0;
 }
 
 void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table)
 {
-    int i;
+    int i = qcow2_cache_table_idx(c, table);
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == table) {
-            goto found;
-        }
+    if (i < 0) {
+        abort();
     }
-    abort();
-
-found:
     c->entries[i].dirty = true;
 }
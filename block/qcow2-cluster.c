@@ -27,6 +27,8 @@
 #include "qemu-common.h"
 #include "block_int.h"
 #include "qcow2.h"
+#include "qemu/timer.h"
+#include "thread-pool.h"
 
 int qcow2_grow_l1_table(BlockDriverState *bs, uint64_t min_size,
                         bool exact_size)
@@ -1363,28 +1365,104 @@ static int decompress_buffer(uint8_t *out_buf, int out_buf_size,
     return 0;
 }
 
-int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset)
+typedef struct Qcow2DecompressData {
+    uint8_t *out_buf;
+    int out_buf_size;
+    const uint8_t *buf;
+    int buf_size;
+    int64_t ns;
+} Qcow2DecompressData;
+
+static int decompress_worker(void *opaque)
+{
+    Qcow2DecompressData *data = opaque;
+    int64_t start = vmx_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int ret;
+
+    ret = decompress_buffer(data->out_buf, data->out_buf_size,
+                            data->buf, data->buf_size);
+    data->ns = vmx_clock_get_ns(QEMU_CLOCK_REALTIME) - start;
+    return ret;
+}
+
+typedef struct Qcow2DecompressFill {
+    BlockDriverState *bs;
+    uint64_t cluster_offset;
+} Qcow2DecompressFill;
+
+/* Reads and inflates the compressed cluster at coffset, runs without
+ * s->lock */
+static int coroutine_fn qcow2_fill_cluster(void *opaque, uint64_t coffset,
+                                           uint8_t *out_buf)
 {
+    Qcow2DecompressFill *fill = opaque;
+    BlockDriverState *bs = fill->bs;
     BDRVQcowState *s = bs->opaque;
+    Qcow2DecompressData data;
+    ThreadPool *pool;
     int ret, csize, nb_csectors, sector_offset;
-    uint64_t coffset;
-
-    coffset = cluster_offset & s->cluster_offset_mask;
-    if (s->cluster_cache_offset != coffset) {
-        nb_csectors = ((cluster_offset >> s->csize_shift) & s->csize_mask) + 1;
-        sector_offset = coffset & 511;
-        csize = nb_csectors * 512 - sector_offset;
-        BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
-        ret = bdrv_read(bs->file, coffset >> 9, s->cluster_data, nb_csectors);
+    uint8_t *buf;
+
+    nb_csectors = ((fill->cluster_offset >> s->csize_shift) &
+                   s->csize_mask) + 1;
+    sector_offset = coffset & 511;
+    csize = nb_csectors * 512 - sector_offset;
+    buf = vmx_try_blockalign(bs->file, nb_csectors * 512);
+    if (buf == NULL) {
+        return -ENOMEM;
+    }
+
+    BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
+    ret = bdrv_read(bs->file, coffset >> 9, buf, nb_csectors);
+    if (ret >= 0) {
+        data = (Qcow2DecompressData) {
+            .out_buf        = out_buf,
+            .out_buf_size   = s->cluster_size,
+            .buf            = buf + sector_offset,
+            .buf_size       = csize,
+        };
+        pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+        ret = thread_pool_submit_co(pool, decompress_worker, &data);
         if (ret < 0) {
-            return ret;
-        }
-        if (decompress_buffer(s->cluster_cache, s->cluster_size,
-                              s->cluster_data + sector_offset, csize) < 0) {
-            return -EIO;
+            ret = -EIO;
+        } else {
+            s->decompress_ns += data.ns;
         }
-        s->cluster_cache_offset = coffset;
     }
+
+    vmx_vfree(buf);
+    return ret < 0 ? ret : 0;
+}
+
+/*
+ * Copies bytes at offset of the compressed cluster into qiov.
+ *
+ * The cluster is inflated in the thread pool with s->lock dropped, so reads
+ * of different compressed clusters decompress in parallel. Readers of a
+ * cluster that is already being inflated wait for it instead.
+ *
+ * Called with s->lock held.
+ */
+int coroutine_fn qcow2_decompress_cluster(BlockDriverState *bs,
+                                          uint64_t cluster_offset,
+                                          QEMUIOVector *qiov, size_t offset,
+                                          size_t bytes)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2DecompressFill fill = {
+        .bs             = bs,
+        .cluster_offset = cluster_offset,
+    };
+    uint8_t *data;
+    int ret;
+
+    ret = decompress_cache_get(&s->decompress_cache,
+                               cluster_offset & s->cluster_offset_mask,
+                               qcow2_fill_cluster, &fill, &data);
+    if (ret < 0) {
+        return ret;
+    }
+    vmx_iovec_from_buf(qiov, 0, data + offset, bytes);
     return 0;
 }
 
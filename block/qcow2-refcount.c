@@ -26,8 +26,11 @@
 #include "block_int.h"
 #include "qcow2.h"
 #include "qemu/range.h"
+#include "qemu/bitops.h"
 
 static int64_t alloc_clusters_noref(BlockDriverState *bs, uint64_t size);
+static void alloc_clusters_release(BlockDriverState *bs, int64_t offset,
+                                   uint64_t size);
 static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
                             int64_t offset, int64_t length,
                             int addend, enum qcow2_discard_type type);
@@ -69,9 +72,181 @@ void qcow2_refcount_close(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
     g_free(s->refcount_table);
+    qcow2_used_clusters_invalidate(bs);
 }
 
 
+/*********************************************************/
+/* used cluster map */
+
+/* The map grows in steps of one used_words word */
+#define USED_CLUSTERS_GRANULE (BITS_PER_LONG * BITS_PER_LONG)
+
+static void used_clusters_grow(BDRVQcowState *s, uint64_t nb_clusters)
+{
+    uint64_t old_size = s->used_clusters_size;
+    uint64_t new_size = ROUND_UP(MAX(nb_clusters, old_size * 2),
+                                 USED_CLUSTERS_GRANULE);
+
+    s->used_clusters = g_realloc(s->used_clusters, new_size / 8);
+    memset((uint8_t *)s->used_clusters + old_size / 8, 0,
+           (new_size - old_size) / 8);
+
+    s->used_words = g_realloc(s->used_words, new_size / BITS_PER_LONG / 8);
+    memset((uint8_t *)s->used_words + old_size / BITS_PER_LONG / 8, 0,
+           (new_size - old_size) / BITS_PER_LONG / 8);
+
+    s->used_clusters_size = new_size;
+}
+
+static void used_clusters_set(BDRVQcowState *s, uint64_t index,
+                              uint64_t count, bool used)
+{
+    uint64_t i, w;
+
+    if (index + count > s->used_clusters_size) {
+        if (!used) {
+            /* Everything past the end of the map is free already */
+            if (index >= s->used_clusters_size) {
+                return;
+            }
+            count = s->used_clusters_size - index;
+        } else {
+            used_clusters_grow(s, index + count);
+        }
+    }
+
+    for (i = index; i < index + count; i++) {
+        w = i / BITS_PER_LONG;
+        if (used) {
+            s->used_clusters[w] |= BIT_MASK(i);
+        } else {
+            s->used_clusters[w] &= ~BIT_MASK(i);
+        }
+
+        if (s->used_clusters[w] == ~0UL) {
+            s->used_words[BIT_WORD(w)] |= BIT_MASK(w);
+        } else {
+            s->used_words[BIT_WORD(w)] &= ~BIT_MASK(w);
+        }
+    }
+}
+
+/* Returns the first free cluster at or after index */
+static uint64_t used_clusters_next_free(BDRVQcowState *s, uint64_t index)
+{
+    uint64_t nb_words = s->used_clusters_size / BITS_PER_LONG;
+    uint64_t w;
+    unsigned long bits;
+
+    while (index < s->used_clusters_size) {
+        w = index / BITS_PER_LONG;
+        bits = s->used_clusters[w] | (BIT_MASK(index) - 1);
+        if (bits != ~0UL) {
+            return w * BITS_PER_LONG + ctzl(~bits);
+        }
+
+        /* Skip the words that are fully used */
+        for (w++; w < nb_words; w = (BIT_WORD(w) + 1) * BITS_PER_LONG) {
+            bits = s->used_words[BIT_WORD(w)] | (BIT_MASK(w) - 1);
+            if (bits != ~0UL) {
+                w = BIT_WORD(w) * BITS_PER_LONG + ctzl(~bits);
+                break;
+            }
+        }
+        index = MIN(w, nb_words) * BITS_PER_LONG;
+    }
+
+    return index;
+}
+
+/* Returns the first used cluster in [index, end), or end */
+static uint64_t used_clusters_next_used(BDRVQcowState *s, uint64_t index,
+                                        uint64_t end)
+{
+    uint64_t w;
+    unsigned long bits;
+
+    while (index < end && index < s->used_clusters_size) {
+        w = index / BITS_PER_LONG;
+        bits = s->used_clusters[w] & ~(BIT_MASK(index) - 1);
+        if (bits) {
+            return MIN(w * BITS_PER_LONG + ctzl(bits), end);
+        }
+        index = (w + 1) * BITS_PER_LONG;
+    }
+
+    return end;
+}
+
+/* Builds the map from the refcount blocks; clusters not covered by a
+ * refcount block have refcount 0 */
+static int used_clusters_build(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t i, j, nb_blocks = 0;
+    uint16_t *refcount_block;
+    int ret;
+
+    for (i = 0; i < s->refcount_table_size; i++) {
+        if (s->refcount_table[i] & REFT_OFFSET_MASK) {
+            nb_blocks = i + 1;
+        }
+    }
+
+    used_clusters_grow(s, MAX(nb_blocks, 1) << s->refcount_block_bits);
+
+    for (i = 0; i < nb_blocks; i++) {
+        uint64_t offset = s->refcount_table[i] & REFT_OFFSET_MASK;
+
+        if (!offset) {
+            continue;
+        }
+        if (offset_into_cluster(s, offset)) {
+            qcow2_signal_corruption(bs, true, -1, -1, "Refblock offset %#"
+                                    PRIx64 " unaligned (reftable index: %#"
+                                    PRIx64 ")", offset, i);
+            ret = -EIO;
+            goto fail;
+        }
+
+        ret = qcow2_cache_get(bs, s->refcount_block_cache, offset,
+                              (void **) &refcount_block);
+        if (ret < 0) {
+            goto fail;
+        }
+        for (j = 0; j < s->refcount_block_size; j++) {
+            if (refcount_block[j]) {
+                used_clusters_set(s, (i << s->refcount_block_bits) + j, 1,
+                                  true);
+            }
+        }
+        ret = qcow2_cache_put(bs, s->refcount_block_cache,
+                              (void **) &refcount_block);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    return 0;
+
+fail:
+    qcow2_used_clusters_invalidate(bs);
+    return ret;
+}
+
+/* Drops the map; it is rebuilt from the refcounts on the next allocation */
+void qcow2_used_clusters_invalidate(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    g_free(s->used_clusters);
+    g_free(s->used_words);
+    s->used_clusters = NULL;
+    s->used_words = NULL;
+    s->used_clusters_size = 0;
+}
+
 static int load_refcount_block(BlockDriverState *bs,
                                int64_t refcount_block_offset,
                                void **refcount_block)
@@ -231,7 +406,10 @@ static int alloc_refcount_block(BlockDriverState *bs,
         return ret;
     }
 
-    /* Allocate the refcount block itself and mark it as used */
+    /* Allocate the refcount block itself and mark it as used; it stays
+     * reserved in the used cluster map until it has a refcount, so every
+     * failure from here on, -EAGAIN from the recursion included, must go
+     * through fail_block */
     int64_t new_block = alloc_clusters_noref(bs, s->cluster_size);
     if (new_block < 0) {
         return new_block;
@@ -330,7 +508,8 @@ static int alloc_refcount_block(BlockDriverState *bs,
     uint64_t blocks_used = DIV_ROUND_UP(cluster_index, s->refcount_block_size);
 
     if (blocks_used > QCOW_MAX_REFTABLE_SIZE / sizeof(uint64_t)) {
-        return -EFBIG;
+        ret = -EFBIG;
+        goto fail_block;
     }
 
     /* And now we need at least one block more for the new metadata */
@@ -433,6 +612,11 @@ static int alloc_refcount_block(BlockDriverState *bs,
     s->refcount_table_size = table_size;
     s->refcount_table_offset = table_offset;
 
+    if (s->used_clusters) {
+        used_clusters_set(s, meta_offset >> s->cluster_bits,
+                          table_clusters + blocks_clusters, true);
+    }
+
     /* Free old table. */
     qcow2_free_clusters(bs, old_table_offset, old_table_size * sizeof(uint64_t),
                         QCOW2_DISCARD_OTHER);
@@ -454,6 +638,7 @@ fail_block:
     if (*refcount_block != NULL) {
         qcow2_cache_put(bs, s->refcount_block_cache, (void**) refcount_block);
     }
+    alloc_clusters_release(bs, new_block, s->cluster_size);
     return ret;
 }
 
@@ -591,6 +776,9 @@ static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
         if (refcount == 0 && cluster_index < s->free_cluster_index) {
             s->free_cluster_index = cluster_index;
         }
+        if (s->used_clusters) {
+            used_clusters_set(s, cluster_index, 1, refcount != 0);
+        }
         refcount_block[block_index] = cpu_to_be16(refcount);
 
         if (refcount == 0 && s->discard_passthrough[type]) {
@@ -662,36 +850,66 @@ int qcow2_update_cluster_refcount(BlockDriverState *bs,
 static int64_t alloc_clusters_noref(BlockDriverState *bs, uint64_t size)
 {
     BDRVQcowState *s = bs->opaque;
-    uint64_t i, nb_clusters;
-    int refcount;
+    uint64_t index, end, nb_clusters;
+    int ret;
 
-    nb_clusters = size_to_clusters(s, size);
-retry:
-    for(i = 0; i < nb_clusters; i++) {
-        uint64_t next_cluster_index = s->free_cluster_index++;
-        refcount = qcow2_get_refcount(bs, next_cluster_index);
+    if (!s->used_clusters) {
+        ret = used_clusters_build(bs);
+        if (ret < 0) {
+            return ret;
+        }
+    }
 
-        if (refcount < 0) {
-            return refcount;
-        } else if (refcount != 0) {
-            goto retry;
+    nb_clusters = size_to_clusters(s, size);
+    index = s->free_cluster_index;
+    for (;;) {
+        index = used_clusters_next_free(s, index);
+        end = used_clusters_next_used(s, index, index + nb_clusters);
+        if (end == index + nb_clusters) {
+            break;
         }
+        index = end + 1;
     }
 
     /* Make sure that all offsets in the "allocated" range are representable
      * in an int64_t */
-    if (s->free_cluster_index > 0 &&
-        s->free_cluster_index - 1 > (INT64_MAX >> s->cluster_bits))
-    {
+    if (index + nb_clusters - 1 > (INT64_MAX >> s->cluster_bits)) {
         return -EFBIG;
     }
 
+    /* The clusters stay reserved until update_refcount() accounts them;
+     * callers that fail before that return them with
+     * alloc_clusters_release() */
+    used_clusters_set(s, index, nb_clusters, true);
+    if (index <= s->free_cluster_index) {
+        s->free_cluster_index = index + nb_clusters;
+    }
+
 #ifdef DEBUG_ALLOC2
     fprintf(stderr, "alloc_clusters: size=%" PRId64 " -> %" PRId64 "\n",
-            size,
-            (s->free_cluster_index - nb_clusters) << s->cluster_bits);
+            size, index << s->cluster_bits);
 #endif
-    return (s->free_cluster_index - nb_clusters) << s->cluster_bits;
+    return index << s->cluster_bits;
+}
+
+/*
+ * Returns clusters handed out by alloc_clusters_noref() that never got a
+ * refcount to the free map, e.g. when the refcount update had to be retried.
+ */
+static void alloc_clusters_release(BlockDriverState *bs, int64_t offset,
+                                   uint64_t size)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t i, index = offset >> s->cluster_bits;
+
+    for (i = 0; i < size_to_clusters(s, size); i++) {
+        if (qcow2_get_refcount(bs, index + i) == 0) {
+            used_clusters_set(s, index + i, 1, false);
+            if (index + i < s->free_cluster_index) {
+                s->free_cluster_index = index + i;
+            }
+        }
+    }
 }
 
 int64_t qcow2_alloc_clusters(BlockDriverState *bs, uint64_t size)
@@ -707,6 +925,9 @@ int64_t qcow2_alloc_clusters(BlockDriverState *bs, uint64_t size)
         }
 
         ret = update_refcount(bs, offset, size, 1, QCOW2_DISCARD_NEVER);
+        if (ret < 0) {
+            alloc_clusters_release(bs, offset, size);
+        }
     } while (ret == -EAGAIN);
 
     if (ret < 0) {
@@ -1954,6 +2175,7 @@ write_refblocks:
     s->refcount_table = on_disk_reftable;
     s->refcount_table_offset = reftable_offset;
     s->refcount_table_size = reftable_size;
+    qcow2_used_clusters_invalidate(bs);
 
     return 0;
 
@@ -27,6 +27,7 @@
 #include <zlib.h>
 #include "qemu/aes.h"
 #include "qcow2.h"
+#include "thread-pool.h"
 #include "qemu/error-report.h"
 #include "qapi/qmp/qerror.h"
 #include "qapi/qmp/qbool.h"
@@ -466,6 +467,17 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_SIZE,
             .help = "Maximum refcount block cache size",
         },
+        {
+            .name = QCOW2_OPT_L2_CACHE_COVERAGE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Amount of guest disk the L2 table cache should map, "
+                    "instead of " QCOW2_OPT_L2_CACHE_SIZE,
+        },
+        {
+            .name = QCOW2_OPT_COMPRESSION_LEVEL,
+            .type = QEMU_OPT_NUMBER,
+            .help = "zlib level used for compressed writes (1-9)",
+        },
         { /* end of list */ }
     },
 };
@@ -481,10 +493,12 @@ static const char *overlap_bool_option_names[QCOW2_OL_MAX_BITNR] = {
     [QCOW2_OL_INACTIVE_L2_BITNR]    = QCOW2_OPT_OVERLAP_INACTIVE_L2,
 };
 
-static void read_cache_sizes(QemuOpts *opts, uint64_t *l2_cache_size,
+static void read_cache_sizes(BlockDriverState *bs, QemuOpts *opts,
+                             uint64_t *l2_cache_size,
                              uint64_t *refcount_cache_size, Error **errp)
 {
-    uint64_t combined_cache_size;
+    BDRVQcowState *s = bs->opaque;
+    uint64_t combined_cache_size, l2_cache_coverage;
     bool l2_cache_size_set, refcount_cache_size_set, combined_cache_size_set;
 
     combined_cache_size_set = vmx_opt_get(opts, QCOW2_OPT_CACHE_SIZE);
@@ -496,6 +510,21 @@ static void read_cache_sizes(QemuOpts *opts, uint64_t *l2_cache_size,
     *refcount_cache_size = vmx_opt_get_size(opts,
                                              QCOW2_OPT_REFCOUNT_CACHE_SIZE, 0);
 
+    if (vmx_opt_get(opts, QCOW2_OPT_L2_CACHE_COVERAGE)) {
+        if (l2_cache_size_set) {
+            error_setg(errp, QCOW2_OPT_L2_CACHE_SIZE " and "
+                       QCOW2_OPT_L2_CACHE_COVERAGE " may not be set the same "
+                       "time");
+            return;
+        }
+        /* each L2 table maps l2_size clusters */
+        l2_cache_coverage = vmx_opt_get_size(opts, QCOW2_OPT_L2_CACHE_COVERAGE, 0);
+        *l2_cache_size = DIV_ROUND_UP(l2_cache_coverage,
+                                      (uint64_t)s->l2_size << s->cluster_bits)
+                       * s->cluster_size;
+        l2_cache_size_set = true;
+    }
+
     if (combined_cache_size_set) {
         if (l2_cache_size_set && refcount_cache_size_set) {
             error_setg(errp, QCOW2_OPT_CACHE_SIZE ", " QCOW2_OPT_L2_CACHE_SIZE
@@ -798,7 +827,7 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
-    read_cache_sizes(opts, &l2_cache_size, &refcount_cache_size, &local_err);
+    read_cache_sizes(bs, opts, &l2_cache_size, &refcount_cache_size, &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
         ret = -EINVAL;
@@ -834,17 +863,8 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
-    s->cluster_cache = g_malloc(s->cluster_size);
-    /* one more sector for decompressed data alignment */
-    s->cluster_data = vmx_try_blockalign(bs->file, QCOW_MAX_CRYPT_CLUSTERS
-                                                    * s->cluster_size + 512);
-    if (s->cluster_data == NULL) {
-        error_setg(errp, "Could not allocate temporary cluster buffer");
-        ret = -ENOMEM;
-        goto fail;
-    }
-
-    s->cluster_cache_offset = -1;
+    decompress_cache_init(&s->decompress_cache, bs->file, &s->lock,
+                          QCOW2_DECOMPRESS_CACHE_SIZE, s->cluster_size);
     s->flags = flags;
 
     ret = qcow2_refcount_init(bs);
@@ -920,6 +940,15 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     s->use_lazy_refcounts = vmx_opt_get_bool(opts, QCOW2_OPT_LAZY_REFCOUNTS,
         (s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS));
 
+    s->compression_level = vmx_opt_get_number(opts, QCOW2_OPT_COMPRESSION_LEVEL,
+                                              Z_DEFAULT_COMPRESSION);
+    if (s->compression_level != Z_DEFAULT_COMPRESSION &&
+        (s->compression_level < 1 || s->compression_level > 9)) {
+        error_setg(errp, QCOW2_OPT_COMPRESSION_LEVEL " must be between 1 and 9");
+        ret = -EINVAL;
+        goto fail;
+    }
+
     s->discard_passthrough[QCOW2_DISCARD_NEVER] = false;
     s->discard_passthrough[QCOW2_DISCARD_ALWAYS] = true;
     s->discard_passthrough[QCOW2_DISCARD_REQUEST] =
@@ -1002,8 +1031,7 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     if (s->refcount_block_cache) {
         qcow2_cache_destroy(bs, s->refcount_block_cache);
     }
-    g_free(s->cluster_cache);
-    vmx_vfree(s->cluster_data);
+    decompress_cache_destroy(&s->decompress_cache);
     return ret;
 }
 
@@ -1199,15 +1227,12 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
             break;
 
         case QCOW2_CLUSTER_COMPRESSED:
-            /* add AIO support for compressed blocks ? */
-            ret = qcow2_decompress_cluster(bs, cluster_offset);
+            ret = qcow2_decompress_cluster(bs, cluster_offset, &hd_qiov,
+                                           index_in_cluster * 512,
+                                           512 * cur_nr_sectors);
             if (ret < 0) {
                 goto fail;
             }
-
-            vmx_iovec_from_buf(&hd_qiov, 0,
-                s->cluster_cache + index_in_cluster * 512,
-                512 * cur_nr_sectors);
             break;
 
         case QCOW2_CLUSTER_NORMAL:
@@ -1293,7 +1318,7 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
 
     vmx_iovec_init(&hd_qiov, qiov->niov);
 
-    s->cluster_cache_offset = -1; /* disable compressed cache */
+    decompress_cache_invalidate(&s->decompress_cache);
 
     vmx_co_mutex_lock(&s->lock);
 
@@ -1444,8 +1469,7 @@ static void qcow2_close(BlockDriverState *bs)
     g_free(s->unknown_header_fields);
     cleanup_unknown_header_ext(bs);
 
-    g_free(s->cluster_cache);
-    vmx_vfree(s->cluster_data);
+    decompress_cache_destroy(&s->decompress_cache);
     qcow2_refcount_close(bs);
     qcow2_free_snapshots(bs);
 }
@@ -2140,13 +2164,116 @@ static int qcow2_truncate(BlockDriverState *bs, int64_t offset)
 
 /* XXX: put compressed sectors first, then all the cluster aligned
    tables to avoid losing bytes in alignment */
-static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
-                                  const uint8_t *buf, int nb_sectors)
+typedef struct Qcow2CompressJob {
+    const uint8_t *buf;
+    uint8_t *out_buf;
+    int out_len;            /* -1 if the cluster does not compress */
+    int cluster_size;
+    int level;
+    int ret;
+    bool done;
+    Coroutine *co;          /* waiting for the job to finish */
+} Qcow2CompressJob;
+
+static int qcow2_compress_worker(void *opaque)
 {
-    BDRVQcowState *s = bs->opaque;
+    Qcow2CompressJob *job = opaque;
     z_stream strm;
-    int ret, out_len;
-    uint8_t *out_buf;
+    int ret;
+
+    /* small window, no zlib header */
+    memset(&strm, 0, sizeof(strm));
+    ret = deflateInit2(&strm, job->level,
+                       Z_DEFLATED, -12,
+                       9, Z_DEFAULT_STRATEGY);
+    if (ret != 0) {
+        return -EINVAL;
+    }
+
+    strm.avail_in = job->cluster_size;
+    strm.next_in = (uint8_t *)job->buf;
+    strm.avail_out = job->cluster_size;
+    strm.next_out = job->out_buf;
+
+    ret = deflate(&strm, Z_FINISH);
+    if (ret != Z_STREAM_END && ret != Z_OK) {
+        deflateEnd(&strm);
+        return -EINVAL;
+    }
+    job->out_len = strm.next_out - job->out_buf;
+
+    deflateEnd(&strm);
+
+    if (ret != Z_STREAM_END || job->out_len >= job->cluster_size) {
+        job->out_len = -1;
+    }
+    return 0;
+}
+
+static void qcow2_compress_complete(void *opaque, int ret)
+{
+    Qcow2CompressJob *job = opaque;
+
+    job->ret = ret;
+    job->done = true;
+    if (job->co) {
+        vmx_coroutine_enter(job->co, NULL);
+    }
+}
+
+static int coroutine_fn qcow2_write_compressed_cluster(BlockDriverState *bs,
+                                                       int64_t sector_num,
+                                                       Qcow2CompressJob *job)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t cluster_offset;
+    int ret;
+
+    if (job->out_len < 0) {
+        /* could not compress: write normal cluster */
+        return bdrv_write(bs, sector_num, job->buf, s->cluster_sectors);
+    }
+
+    vmx_co_mutex_lock(&s->lock);
+    cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
+        sector_num << 9, job->out_len);
+    if (!cluster_offset) {
+        vmx_co_mutex_unlock(&s->lock);
+        return -EIO;
+    }
+    cluster_offset &= s->cluster_offset_mask;
+
+    ret = qcow2_pre_write_overlap_check(bs, 0, cluster_offset, job->out_len);
+    vmx_co_mutex_unlock(&s->lock);
+    if (ret < 0) {
+        return ret;
+    }
+
+    BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
+    ret = bdrv_pwrite(bs->file, cluster_offset, job->out_buf, job->out_len);
+    if (ret < 0) {
+        return ret;
+    }
+    return 0;
+}
+
+/*
+ * Writes any number of whole clusters. The clusters are deflated in the
+ * thread pool in parallel and written in order as they complete, so the
+ * compressed data is laid out in the same order as the guest clusters.
+ * The coroutine sleeps while a cluster is still deflating and the pool's
+ * completion callback wakes it.
+ */
+static int coroutine_fn qcow2_co_write_compressed(BlockDriverState *bs,
+                                                  int64_t sector_num,
+                                                  const uint8_t *buf,
+                                                  int nb_sectors)
+{
+    BDRVQcowState *s = bs->opaque;
+    VeertuAioContext *ctx = bdrv_get_aio_context(bs);
+    ThreadPool *pool = aio_get_thread_pool(ctx);
+    Qcow2CompressJob *jobs;
+    int i, nb_clusters, ret;
     uint64_t cluster_offset;
 
     if (nb_sectors == 0) {
@@ -2156,80 +2283,102 @@ static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
         return bdrv_truncate(bs->file, cluster_offset);
     }
 
-    if (nb_sectors != s->cluster_sectors) {
-        ret = -EINVAL;
+    if (nb_sectors % s->cluster_sectors) {
+        int aligned = QEMU_ALIGN_DOWN(nb_sectors, s->cluster_sectors);
+        uint8_t *pad_buf;
 
         /* Zero-pad last write if image size is not cluster aligned */
-        if (sector_num + nb_sectors == bs->total_sectors &&
-            nb_sectors < s->cluster_sectors) {
-            uint8_t *pad_buf = vmx_blockalign(bs, s->cluster_size);
-            memset(pad_buf, 0, s->cluster_size);
-            memcpy(pad_buf, buf, nb_sectors * BDRV_SECTOR_SIZE);
-            ret = qcow2_write_compressed(bs, sector_num,
-                                         pad_buf, s->cluster_sectors);
-            vmx_vfree(pad_buf);
+        if (sector_num + nb_sectors != bs->total_sectors) {
+            return -EINVAL;
         }
+        if (aligned) {
+            ret = qcow2_co_write_compressed(bs, sector_num, buf, aligned);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+        pad_buf = vmx_blockalign(bs, s->cluster_size);
+        memset(pad_buf, 0, s->cluster_size);
+        memcpy(pad_buf, buf + aligned * BDRV_SECTOR_SIZE,
+               (nb_sectors - aligned) * BDRV_SECTOR_SIZE);
+        ret = qcow2_co_write_compressed(bs, sector_num + aligned,
+                                        pad_buf, s->cluster_sectors);
+        vmx_vfree(pad_buf);
         return ret;
     }
 
-    out_buf = g_malloc(s->cluster_size + (s->cluster_size / 1000) + 128);
+    nb_clusters = nb_sectors / s->cluster_sectors;
+    jobs = g_new0(Qcow2CompressJob, nb_clusters);
+    for (i = 0; i < nb_clusters; i++) {
+        jobs[i].buf = buf + (size_t)i * s->cluster_size;
+        jobs[i].out_buf = g_malloc(s->cluster_size + (s->cluster_size / 1000)
+                                   + 128);
+        jobs[i].cluster_size = s->cluster_size;
+        jobs[i].level = s->compression_level;
+        thread_pool_submit_aio(pool, qcow2_compress_worker, &jobs[i],
+                               qcow2_compress_complete, &jobs[i]);
+    }
 
-    /* best compression, small window, no zlib header */
-    memset(&strm, 0, sizeof(strm));
-    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
-                       Z_DEFLATED, -12,
-                       9, Z_DEFAULT_STRATEGY);
-    if (ret != 0) {
-        ret = -EINVAL;
-        goto fail;
+    /* Write the clusters in order; later ones keep deflating meanwhile */
+    ret = 0;
+    for (i = 0; i < nb_clusters; i++) {
+        if (!jobs[i].done) {
+            jobs[i].co = vmx_coroutine_self();
+            vmx_coroutine_yield();
+        }
+        if (ret == 0) {
+            ret = jobs[i].ret;
+        }
+        if (ret == 0) {
+            ret = qcow2_write_compressed_cluster(bs,
+                sector_num + (int64_t)i * s->cluster_sectors, &jobs[i]);
+        }
+        g_free(jobs[i].out_buf);
     }
 
-    strm.avail_in = s->cluster_size;
-    strm.next_in = (uint8_t *)buf;
-    strm.avail_out = s->cluster_size;
-    strm.next_out = out_buf;
+    g_free(jobs);
+    return ret;
+}
 
-    ret = deflate(&strm, Z_FINISH);
-    if (ret != Z_STREAM_END && ret != Z_OK) {
-        deflateEnd(&strm);
-        ret = -EINVAL;
-        goto fail;
-    }
-    out_len = strm.next_out - out_buf;
+typedef struct Qcow2WriteCompressedCo {
+    BlockDriverState *bs;
+    int64_t sector_num;
+    const uint8_t *buf;
+    int nb_sectors;
+    int ret;
+    bool done;
+} Qcow2WriteCompressedCo;
 
-    deflateEnd(&strm);
+static void coroutine_fn qcow2_write_compressed_entry(void *opaque)
+{
+    Qcow2WriteCompressedCo *wco = opaque;
 
-    if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
-        /* could not compress: write normal cluster */
-        ret = bdrv_write(bs, sector_num, buf, s->cluster_sectors);
-        if (ret < 0) {
-            goto fail;
-        }
-    } else {
-        cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
-            sector_num << 9, out_len);
-        if (!cluster_offset) {
-            ret = -EIO;
-            goto fail;
-        }
-        cluster_offset &= s->cluster_offset_mask;
+    wco->ret = qcow2_co_write_compressed(wco->bs, wco->sector_num, wco->buf,
+                                         wco->nb_sectors);
+    wco->done = true;
+}
 
-        ret = qcow2_pre_write_overlap_check(bs, 0, cluster_offset, out_len);
-        if (ret < 0) {
-            goto fail;
-        }
+static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
+                                  const uint8_t *buf, int nb_sectors)
+{
+    Qcow2WriteCompressedCo wco = {
+        .bs = bs,
+        .sector_num = sector_num,
+        .buf = buf,
+        .nb_sectors = nb_sectors,
+    };
+    Coroutine *co;
 
-        BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
-        ret = bdrv_pwrite(bs->file, cluster_offset, out_buf, out_len);
-        if (ret < 0) {
-            goto fail;
+    if (vmx_in_coroutine()) {
+        qcow2_write_compressed_entry(&wco);
+    } else {
+        co = vmx_coroutine_create(qcow2_write_compressed_entry);
+        vmx_coroutine_enter(co, &wco);
+        while (!wco.done) {
+            aio_poll(bdrv_get_aio_context(bs), true);
         }
     }
-
-    ret = 0;
-fail:
-    g_free(out_buf);
-    return ret;
+    return wco.ret;
 }
 
 static int make_completely_empty(BlockDriverState *bs)
@@ -2342,6 +2491,7 @@ static int make_completely_empty(BlockDriverState *bs)
     s->refcount_table[0] = 2 * s->cluster_size;
 
     s->free_cluster_index = 0;
+    qcow2_used_clusters_invalidate(bs);
     assert(3 + l1_clusters <= s->refcount_block_size);
     offset = qcow2_alloc_clusters(bs, 3 * s->cluster_size + l1_size2);
     if (offset < 0) {
@@ -2452,6 +2602,13 @@ static int qcow2_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
     bdi->can_write_zeroes_with_unmap = (s->qcow_version >= 3);
     bdi->cluster_size = s->cluster_size;
     bdi->vm_state_offset = qcow2_vm_state_offset(s);
+    qcow2_cache_get_stats(s->l2_table_cache, &bdi->cache_hits,
+                          &bdi->cache_misses, &bdi->cache_evictions);
+    qcow2_cache_get_stats(s->refcount_block_cache, &bdi->cache_hits,
+                          &bdi->cache_misses, &bdi->cache_evictions);
+    bdi->decompress_hits = s->decompress_cache.hits;
+    bdi->decompress_misses = s->decompress_cache.misses;
+    bdi->decompress_ns = s->decompress_ns;
     return 0;
 }
 
@@ -27,6 +27,7 @@
 
 #include "qemu/aes.h"
 #include "coroutine.h"
+#include "decompress-cache.h"
 
 //#define DEBUG_ALLOC
 //#define DEBUG_ALLOC2
@@ -75,6 +76,9 @@
 
 #define DEFAULT_CLUSTER_SIZE 65536
 
+/* Number of decompressed clusters kept for compressed images */
+#define QCOW2_DECOMPRESS_CACHE_SIZE 16
+
 
 #define QCOW2_OPT_LAZY_REFCOUNTS "lazy-refcounts"
 #define QCOW2_OPT_DISCARD_REQUEST "pass-discard-request"
@@ -93,6 +97,8 @@
 #define QCOW2_OPT_CACHE_SIZE "cache-size"
 #define QCOW2_OPT_L2_CACHE_SIZE "l2-cache-size"
 #define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
+#define QCOW2_OPT_L2_CACHE_COVERAGE "l2-cache-coverage"
+#define QCOW2_OPT_COMPRESSION_LEVEL "compression-level"
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -232,9 +238,8 @@ typedef struct BDRVQcowState {
     Qcow2Cache* l2_table_cache;
     Qcow2Cache* refcount_block_cache;
 
-    uint8_t *cluster_cache;
-    uint8_t *cluster_data;
-    uint64_t cluster_cache_offset;
+    DecompressCache decompress_cache;   /* keyed by compressed offset */
+    uint64_t decompress_ns;
     QLIST_HEAD(QCowClusterAlloc, QCowL2Meta) cluster_allocs;
 
     uint64_t *refcount_table;
@@ -243,6 +248,14 @@ typedef struct BDRVQcowState {
     uint64_t free_cluster_index;
     uint64_t free_byte_offset;
 
+    /* In-memory map of used clusters, built from the refcounts on the first
+     * allocation. A bit is set while the cluster has a non-zero refcount or
+     * has been handed out by the allocator. used_words has a bit per fully
+     * used word of used_clusters so that allocation skips full regions. */
+    unsigned long *used_clusters;
+    unsigned long *used_words;
+    uint64_t used_clusters_size;
+
     CoMutex lock;
 
     uint32_t crypt_method; /* current crypt method, 0 if no key yet */
@@ -257,6 +270,7 @@ typedef struct BDRVQcowState {
     int flags;
     int qcow_version;
     bool use_lazy_refcounts;
+    int compression_level;
     int refcount_order;
 
     bool discard_passthrough[QCOW2_DISCARD_MAX];
@@ -486,6 +500,7 @@ void qcow2_signal_corruption(BlockDriverState *bs, bool fatal, int64_t offset,
 /* qcow2-refcount.c functions */
 int qcow2_refcount_init(BlockDriverState *bs);
 void qcow2_refcount_close(BlockDriverState *bs);
+void qcow2_used_clusters_invalidate(BlockDriverState *bs);
 
 int qcow2_get_refcount(BlockDriverState *bs, int64_t cluster_index);
 
@@ -520,7 +535,10 @@ int qcow2_grow_l1_table(BlockDriverState *bs, uint64_t min_size,
                         bool exact_size);
 int qcow2_write_l1_entry(BlockDriverState *bs, int l1_index);
 void qcow2_l2_cache_reset(BlockDriverState *bs);
-int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset);
+int coroutine_fn qcow2_decompress_cluster(BlockDriverState *bs,
+                                          uint64_t cluster_offset,
+                                          QEMUIOVector *qiov, size_t offset,
+                                          size_t bytes);
 void qcow2_encrypt_sectors(BDRVQcowState *s, int64_t sector_num,
                      uint8_t *out_buf, const uint8_t *in_buf,
                      int nb_sectors, int enc,
@@ -575,5 +593,7 @@ int qcow2_cache_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
 int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table);
 int qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table);
+void qcow2_cache_get_stats(Qcow2Cache *c, uint64_t *hits, uint64_t *misses,
+                           uint64_t *evictions);
 
 #endif
@@ -52,16 +52,38 @@
 
 #include "qed.h"
 
-/* Each L2 holds 2GB so this let's us fully cache a 100GB disk */
-#define MAX_L2_CACHE_SIZE 50
+/*
+ * Entries are indexed by offset in a chained hash table so lookups don't
+ * depend on the cache size.  The entries list is kept in LRU order, a hit
+ * moves the entry to the tail and eviction starts from the head.
+ */
+
+static unsigned int qed_l2_cache_hash(L2TableCache *l2_cache, uint64_t offset)
+{
+    /* Offsets are cluster aligned, the multiply spreads them over the bits */
+    return (offset * 0x9e37fffffffc0001ULL) >> (64 - l2_cache->hash_bits);
+}
 
 /**
  * Initialize the L2 cache
+ *
+ * The cache holds up to max_entries unused tables, the hash table is sized
+ * so chains stay short at that load.
  */
-void qed_init_l2_cache(L2TableCache *l2_cache)
+void qed_init_l2_cache(L2TableCache *l2_cache, unsigned int max_entries)
 {
+    memset(l2_cache, 0, sizeof(*l2_cache));
     QTAILQ_INIT(&l2_cache->entries);
-    l2_cache->n_entries = 0;
+    l2_cache->max_entries = max_entries;
+
+    /* 16 to 1M buckets, beyond that chains may just get longer */
+    l2_cache->hash_bits = 4;
+    while (l2_cache->hash_bits < 20 &&
+           (1U << l2_cache->hash_bits) < max_entries) {
+        l2_cache->hash_bits++;
+    }
+    l2_cache->buckets = g_new0(typeof(*l2_cache->buckets),
+                               1U << l2_cache->hash_bits);
 }
 
 /**
@@ -75,6 +97,8 @@ void qed_free_l2_cache(L2TableCache *l2_cache)
         vmx_vfree(entry->table);
         g_free(entry);
     }
+    g_free(l2_cache->buckets);
+    l2_cache->buckets = NULL;
 }
 
 /**
@@ -121,9 +145,13 @@ void qed_unref_l2_cache_entry(CachedL2Table *entry)
 CachedL2Table *qed_find_l2_cache_entry(L2TableCache *l2_cache, uint64_t offset)
 {
     CachedL2Table *entry;
+    unsigned int hash = qed_l2_cache_hash(l2_cache, offset);
 
-    QTAILQ_FOREACH(entry, &l2_cache->entries, node) {
+    QLIST_FOREACH(entry, &l2_cache->buckets[hash], hash_node) {
         if (entry->offset == offset) {
+            /* Most recently used goes last */
+            QTAILQ_REMOVE(&l2_cache->entries, entry, node);
+            QTAILQ_INSERT_TAIL(&l2_cache->entries, entry, node);
             entry->ref++;
             return entry;
         }
@@ -156,10 +184,11 @@ void qed_commit_l2_cache_entry(L2TableCache *l2_cache, CachedL2Table *l2_table)
         return;
     }
 
-    /* Evict an unused cache entry so we have space.  If all entries are in use
-     * we can grow the cache temporarily and we try to shrink back down later.
+    /* Evict the least recently used entries that are not in use so we have
+     * space.  If all entries are in use we can grow the cache temporarily and
+     * we try to shrink back down later.
      */
-    if (l2_cache->n_entries >= MAX_L2_CACHE_SIZE) {
+    if (l2_cache->n_entries >= l2_cache->max_entries) {
         CachedL2Table *next;
         QTAILQ_FOREACH_SAFE(entry, &l2_cache->entries, node, next) {
             if (entry->ref > 1) {
@@ -167,11 +196,13 @@ void qed_commit_l2_cache_entry(L2TableCache *l2_cache, CachedL2Table *l2_table)
             }
 
             QTAILQ_REMOVE(&l2_cache->entries, entry, node);
+            QLIST_REMOVE(entry, hash_node);
             l2_cache->n_entries--;
+            l2_cache->evictions++;
             qed_unref_l2_cache_entry(entry);
 
             /* Stop evicting when we've shrunk back to max size */
-            if (l2_cache->n_entries < MAX_L2_CACHE_SIZE) {
+            if (l2_cache->n_entries < l2_cache->max_entries) {
                 break;
             }
         }
@@ -179,4 +210,7 @@ void qed_commit_l2_cache_entry(L2TableCache *l2_cache, CachedL2Table *l2_table)
 
     l2_cache->n_entries++;
     QTAILQ_INSERT_TAIL(&l2_cache->entries, l2_table, node);
+    QLIST_INSERT_HEAD(&l2_cache->buckets[qed_l2_cache_hash(l2_cache,
+                                                           l2_table->offset)],
+                      l2_table, hash_node);
 }
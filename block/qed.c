@@ -376,14 +376,45 @@ static void bdrv_qed_attach_aio_context(BlockDriverState *bs,
     }
 }
 
+static QemuOptsList qed_runtime_opts = {
+    .name = "qed",
+    .head = QTAILQ_HEAD_INITIALIZER(qed_runtime_opts.head),
+    .desc = {
+        {
+            .name = QED_OPT_L2_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum L2 table cache size",
+        },
+        { /* end of list */ }
+    },
+};
+
 static int bdrv_qed_open(BlockDriverState *bs, QDict *options, int flags,
                          Error **errp)
 {
     BDRVQEDState *s = bs->opaque;
     QEDHeader le_header;
     int64_t file_size;
+    uint64_t l2_cache_size = 0;
+    uint64_t table_bytes;
+    unsigned int l2_cache_entries;
     int ret;
 
+    if (options) {
+        QemuOpts *opts;
+        Error *local_err = NULL;
+
+        opts = vmx_opts_create(&qed_runtime_opts, NULL, 0, &error_abort);
+        vmx_opts_absorb_qdict(opts, options, &local_err);
+        if (local_err) {
+            error_propagate(errp, local_err);
+            vmx_opts_del(opts);
+            return -EINVAL;
+        }
+        l2_cache_size = vmx_opt_get_size(opts, QED_OPT_L2_CACHE_SIZE, 0);
+        vmx_opts_del(opts);
+    }
+
     s->bs = bs;
     QSIMPLEQ_INIT(&s->allocating_write_reqs);
 
@@ -473,8 +504,21 @@ static int bdrv_qed_open(BlockDriverState *bs, QDict *options, int flags,
         bdrv_flush(bs->file);
     }
 
+    table_bytes = (uint64_t)s->header.cluster_size * s->header.table_size;
+    if (!l2_cache_size) {
+        l2_cache_entries = QED_DEFAULT_L2_CACHE_ENTRIES;
+    } else if (l2_cache_size < table_bytes ||
+               l2_cache_size / table_bytes > UINT_MAX) {
+        error_setg(errp, QED_OPT_L2_CACHE_SIZE " must be between %" PRIu64
+                   " and %" PRIu64 " bytes for this image", table_bytes,
+                   table_bytes * UINT_MAX);
+        return -EINVAL;
+    } else {
+        l2_cache_entries = l2_cache_size / table_bytes;
+    }
+
     s->l1_table = qed_alloc_table(s);
-    qed_init_l2_cache(&s->l2_cache);
+    qed_init_l2_cache(&s->l2_cache, l2_cache_entries);
 
     ret = qed_read_l1_table_sync(s);
     if (ret) {
@@ -1488,6 +1532,9 @@ static int bdrv_qed_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
     bdi->is_dirty = s->header.features & QED_F_NEED_CHECK;
     bdi->unallocated_blocks_are_zero = true;
     bdi->can_write_zeroes_with_unmap = true;
+    bdi->cache_hits = s->l2_cache.hits;
+    bdi->cache_misses = s->l2_cache.misses;
+    bdi->cache_evictions = s->l2_cache.evictions;
     return 0;
 }
 
@@ -1566,6 +1613,7 @@ static int bdrv_qed_change_backing_file(BlockDriverState *bs,
 static void bdrv_qed_invalidate_cache(BlockDriverState *bs, Error **errp)
 {
     BDRVQEDState *s = bs->opaque;
+    QDict *options;
     Error *local_err = NULL;
     int ret;
 
@@ -1578,7 +1626,10 @@ static void bdrv_qed_invalidate_cache(BlockDriverState *bs, Error **errp)
     }
 
     memset(s, 0, sizeof(BDRVQEDState));
-    ret = bdrv_qed_open(bs, NULL, bs->open_flags, &local_err);
+    options = qdict_clone_shallow(bs->options);
+
+    ret = bdrv_qed_open(bs, options, bs->open_flags, &local_err);
+    QDECREF(options);
     if (local_err) {
         error_setg(errp, "Could not reopen qed layer: %s",
                    error_get_pretty(local_err));
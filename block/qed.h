@@ -44,6 +44,9 @@
  * All fields are little-endian on disk.
  */
 #define  QED_DEFAULT_CLUSTER_SIZE  65536
+
+/* Bytes of L2 tables kept in memory, defaults to QED_DEFAULT_L2_CACHE_ENTRIES */
+#define QED_OPT_L2_CACHE_SIZE "l2-cache-size"
 enum {
     QED_MAGIC = 'Q' | 'E' << 8 | 'D' << 16 | '\0' << 24,
 
@@ -78,6 +81,9 @@ enum {
     QED_MAX_TABLE_SIZE = 16,
     QED_DEFAULT_TABLE_SIZE = 4,
 
+    /* Each L2 holds 2GB so this let's us fully cache a 100GB disk */
+    QED_DEFAULT_L2_CACHE_ENTRIES = 50,
+
     /* Delay to flush and clean image after last allocating write completes */
     QED_NEED_CHECK_TIMEOUT = 5,    /* in seconds */
 };
@@ -109,13 +115,22 @@ typedef struct {
 typedef struct CachedL2Table {
     QEDTable *table;
     uint64_t offset;    /* offset=0 indicates an invalidate entry */
-    QTAILQ_ENTRY(CachedL2Table) node;
+    QTAILQ_ENTRY(CachedL2Table) node;       /* LRU list */
+    QLIST_ENTRY(CachedL2Table) hash_node;   /* hash bucket chain */
     int ref;
 } CachedL2Table;
 
 typedef struct {
-    QTAILQ_HEAD(, CachedL2Table) entries;
+    QTAILQ_HEAD(, CachedL2Table) entries;   /* least recently used first */
+    QLIST_HEAD(, CachedL2Table) *buckets;
+    unsigned int hash_bits;
     unsigned int n_entries;
+    unsigned int max_entries;
+
+    /* statistics */
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
 } L2TableCache;
 
 typedef struct QEDRequest {
@@ -218,7 +233,7 @@ int qed_write_header_sync(BDRVQEDState *s);
 /**
  * L2 cache functions
  */
-void qed_init_l2_cache(L2TableCache *l2_cache);
+void qed_init_l2_cache(L2TableCache *l2_cache, unsigned int max_entries);
 void qed_free_l2_cache(L2TableCache *l2_cache);
 CachedL2Table *qed_alloc_l2_cache_entry(L2TableCache *l2_cache);
 void qed_unref_l2_cache_entry(CachedL2Table *entry);
@@ -147,6 +147,11 @@ typedef struct BDRVRawState {
     bool has_write_zeroes:1;
     bool discard_zeroes:1;
     bool needs_alignment;
+
+    /* Reads and writes held back while the queue is plugged */
+    int io_plugged;
+    int io_queued;
+    QSIMPLEQ_HEAD(, RawPosixAIOCB) io_q;
 } BDRVRawState;
 
 typedef struct BDRVRawReopenState {
@@ -430,6 +435,7 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
         goto fail;
     }
     s->fd = fd;
+    QSIMPLEQ_INIT(&s->io_q);
 
 #ifdef CONFIG_LINUX_AIO
     if (raw_set_aio(&s->aio_ctx, &s->use_aio, bdrv_flags)) {
@@ -1075,6 +1081,105 @@ static BlockAIOCB *paio_submit(BlockDriverState *bs, int fd,
     return thread_pool_submit_aio(pool, aio_worker, acb, cb, opaque);
 }
 
+/*
+ * Requests queued while plugged.  On unplug, runs of requests of the same
+ * type that are contiguous on disk are merged into a single vectored request,
+ * so a walk over a guest command list turns into few large preadv/pwritev
+ * calls.  Overlapping requests are never merged, to keep write ordering.
+ */
+#define RAW_MAX_QUEUED_IO 128
+
+typedef struct RawPosixAIOCB {
+    BlockAIOCB common;
+    int64_t sector_num;
+    QEMUIOVector *qiov;
+    int nb_sectors;
+    int type;
+    QSIMPLEQ_ENTRY(RawPosixAIOCB) next;
+} RawPosixAIOCB;
+
+typedef struct RawPosixBatch {
+    QEMUIOVector qiov;
+    QSIMPLEQ_HEAD(, RawPosixAIOCB) reqs;
+} RawPosixBatch;
+
+static const AIOCBInfo raw_aiocb_info = {
+    .aiocb_size         = sizeof(RawPosixAIOCB),
+};
+
+static void raw_batch_cb(void *opaque, int ret)
+{
+    RawPosixBatch *batch = opaque;
+    RawPosixAIOCB *acb;
+
+    while ((acb = QSIMPLEQ_FIRST(&batch->reqs))) {
+        QSIMPLEQ_REMOVE_HEAD(&batch->reqs, next);
+        acb->common.cb(acb->common.opaque, ret);
+        vmx_aio_unref(acb);
+    }
+
+    vmx_iovec_destroy(&batch->qiov);
+    g_free(batch);
+}
+
+static void raw_submit_io_queue(BlockDriverState *bs)
+{
+    BDRVRawState *s = bs->opaque;
+    RawPosixAIOCB *acb, *first = NULL;
+    RawPosixBatch *batch = NULL;
+    int nb_sectors = 0;
+
+    while ((acb = QSIMPLEQ_FIRST(&s->io_q))) {
+        QSIMPLEQ_REMOVE_HEAD(&s->io_q, next);
+
+        if (batch && (acb->type != first->type ||
+                      acb->sector_num != first->sector_num + nb_sectors ||
+                      batch->qiov.niov + acb->qiov->niov > IOV_MAX)) {
+            paio_submit(bs, s->fd, first->sector_num, &batch->qiov,
+                        nb_sectors, raw_batch_cb, batch, first->type);
+            batch = NULL;
+        }
+
+        if (!batch) {
+            batch = g_new(RawPosixBatch, 1);
+            vmx_iovec_init(&batch->qiov, acb->qiov->niov);
+            QSIMPLEQ_INIT(&batch->reqs);
+            first = acb;
+            nb_sectors = 0;
+        }
+
+        vmx_iovec_concat(&batch->qiov, acb->qiov, 0, acb->qiov->size);
+        nb_sectors += acb->nb_sectors;
+        QSIMPLEQ_INSERT_TAIL(&batch->reqs, acb, next);
+    }
+
+    if (batch) {
+        paio_submit(bs, s->fd, first->sector_num, &batch->qiov,
+                    nb_sectors, raw_batch_cb, batch, first->type);
+    }
+    s->io_queued = 0;
+}
+
+static BlockAIOCB *raw_aio_queue(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockCompletionFunc *cb, void *opaque, int type)
+{
+    BDRVRawState *s = bs->opaque;
+    RawPosixAIOCB *acb;
+
+    acb = vmx_aio_get(&raw_aiocb_info, bs, cb, opaque);
+    acb->sector_num = sector_num;
+    acb->qiov = qiov;
+    acb->nb_sectors = nb_sectors;
+    acb->type = type;
+    QSIMPLEQ_INSERT_TAIL(&s->io_q, acb, next);
+
+    if (++s->io_queued >= RAW_MAX_QUEUED_IO) {
+        raw_submit_io_queue(bs);
+    }
+    return &acb->common;
+}
+
 static BlockAIOCB *raw_aio_submit(BlockDriverState *bs,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         BlockCompletionFunc *cb, void *opaque, int type)
@@ -1101,14 +1206,21 @@ static BlockAIOCB *raw_aio_submit(BlockDriverState *bs,
         }
     }
 
+    if (s->io_plugged) {
+        return raw_aio_queue(bs, sector_num, qiov, nb_sectors,
+                             cb, opaque, type);
+    }
+
     return paio_submit(bs, s->fd, sector_num, qiov, nb_sectors,
                        cb, opaque, type);
 }
 
 static void raw_aio_plug(BlockDriverState *bs)
 {
-#ifdef CONFIG_LINUX_AIO
     BDRVRawState *s = bs->opaque;
+
+    s->io_plugged++;
+#ifdef CONFIG_LINUX_AIO
     if (s->use_aio) {
         laio_io_plug(bs, s->aio_ctx);
     }
@@ -1117,8 +1229,13 @@ static void raw_aio_plug(BlockDriverState *bs)
 
 static void raw_aio_unplug(BlockDriverState *bs)
 {
-#ifdef CONFIG_LINUX_AIO
     BDRVRawState *s = bs->opaque;
+
+    assert(s->io_plugged > 0);
+    if (--s->io_plugged == 0) {
+        raw_submit_io_queue(bs);
+    }
+#ifdef CONFIG_LINUX_AIO
     if (s->use_aio) {
         laio_io_unplug(bs, s->aio_ctx, true);
     }
@@ -1127,6 +1244,7 @@ static void raw_aio_unplug(BlockDriverState *bs)
 
 static void raw_aio_flush_io_queue(BlockDriverState *bs)
 {
+    raw_submit_io_queue(bs);
 #ifdef CONFIG_LINUX_AIO
     BDRVRawState *s = bs->opaque;
     if (s->use_aio) {
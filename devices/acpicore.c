@@ -524,6 +524,8 @@ void acpi_pm_tmr_init(ACPIREGS *ar, acpi_update_sci_fn update_sci,
     ar->tmr.timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, acpi_pm_tmr_timer, ar);
     memory_area_init_io(&ar->tmr.io,NULL ,
                           &acpi_pm_tmr_ops, ar, "acpi-tmr", 4);
+    /* reads only sample the virtual clock, writes are ignored */
+    mem_area_clear_global_locking(&ar->tmr.io);
     mem_area_add_child(parent, 8, &ar->tmr.io);
 }
 
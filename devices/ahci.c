@@ -486,15 +486,23 @@ static void ahci_reg_init(AHCIState *s)
 static void check_cmd(AHCIState *s, int port)
 {
     AHCIPortRegs *pr = &s->dev[port].port_regs;
+    BlockBackend *blk = s->dev[port].port.ifs[0].blk;
     uint8_t slot;
 
     if ((pr->cmd & PORT_CMD_START) && pr->cmd_issue) {
+        /* Let the backend merge the NCQ commands issued together */
+        if (blk) {
+            blk_io_plug(blk);
+        }
         for (slot = 0; (slot < 32) && pr->cmd_issue; slot++) {
             if ((pr->cmd_issue & (1U << slot)) &&
                 !handle_cmd(s, port, slot)) {
                 pr->cmd_issue &= ~(1U << slot);
             }
         }
+        if (blk) {
+            blk_io_unplug(blk);
+        }
     }
 }
 
@@ -974,7 +982,7 @@ static void execute_ncq_command(NCQTransferState *ncq_tfs)
         DPRINTF(port, "tag %d aio read %"PRId64"\n",
                 ncq_tfs->tag, ncq_tfs->lba);
 
-        block_acct_start(ide_state->blk, &ncq_tfs->acct,
+        dma_acct_start(ide_state->blk, &ncq_tfs->acct,
                        &ncq_tfs->sglist, BLOCK_ACCT_READ);
         ncq_tfs->aiocb = dma_blk_read(ide_state->blk, &ncq_tfs->sglist,
                                       ncq_tfs->lba, ncq_cb, ncq_tfs);
@@ -986,7 +994,7 @@ static void execute_ncq_command(NCQTransferState *ncq_tfs)
         DPRINTF(port, "tag %d aio write %"PRId64"\n",
                 ncq_tfs->tag, ncq_tfs->lba);
 
-        block_acct_start(ide_state->blk, &ncq_tfs->acct,
+        dma_acct_start(ide_state->blk, &ncq_tfs->acct,
                        &ncq_tfs->sglist, BLOCK_ACCT_WRITE);
         ncq_tfs->aiocb = dma_blk_write(ide_state->blk, &ncq_tfs->sglist,
                                        ncq_tfs->lba, ncq_cb, ncq_tfs);
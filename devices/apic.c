@@ -24,6 +24,7 @@
 #include "ipc.h"
 #include "iapic-msidef.h"
 #include "vmm/vmx.h"
+#include "qemu/main-loop.h"
 
 #define MAX_APIC_WORDS 8
 
@@ -178,6 +179,7 @@ void apic_deliver_pic_intr(DeviceState *dev, int level)
 {
     APICCommonState *s = APIC_COMMON(dev);
 
+    apic_lock();
     if (level) {
         apic_local_deliver(s, APIC_LVT_LINT0);
     } else {
@@ -194,6 +196,7 @@ void apic_deliver_pic_intr(DeviceState *dev, int level)
             break;
         }
     }
+    apic_unlock();
 }
 
 static void apic_external_nmi(APICCommonState *s)
@@ -286,8 +289,10 @@ void apic_deliver_irq(uint8_t dest, uint8_t dest_mode, uint8_t delivery_mode,
 {
     uint32_t deliver_bitmask[MAX_APIC_WORDS];
 
+    apic_lock();
     apic_get_delivery_bitmask(deliver_bitmask, dest, dest_mode);
     apic_bus_deliver(deliver_bitmask, delivery_mode, vector_num, trigger_mode);
+    apic_unlock();
 }
 
 static void apic_set_base(APICCommonState *s, uint64_t val)
@@ -375,7 +380,11 @@ static void apic_update_irq(APICCommonState *s)
         cpu_interrupt(cpu, CPU_INTERRUPT_POLL);
     } else if (apic_irq_pending(s) > 0) {
         cpu_interrupt(cpu, CPU_INTERRUPT_HARD);
-    } else if (!apic_accept_pic_intr(&s->busdev.qdev) || !pic_get_output(isa_pic)) {
+    } else if (!apic_accept_pic_intr(&s->busdev.qdev) ||
+               /* may race with the PIC when called without the iothread
+                  lock; a raised output is delivered again through
+                  apic_deliver_pic_intr, which waits for the apic lock */
+               !pic_get_output(isa_pic)) {
         cpu_reset_interrupt(cpu, CPU_INTERRUPT_HARD);
     }
 }
@@ -384,8 +393,10 @@ void apic_poll_irq(DeviceState *dev)
 {
     APICCommonState *s = APIC_COMMON(dev);
 
+    apic_lock();
     apic_sync_vapic(s, SYNC_FROM_VAPIC);
     apic_update_irq(s);
+    apic_unlock();
 }
 
 static void apic_set_irq(APICCommonState *s, int vector_num, int trigger_mode)
@@ -492,10 +503,12 @@ void apic_sipi(DeviceState *dev)
 
     cpu_reset_interrupt(GETCPU(s->cpu), CPU_INTERRUPT_SIPI);
 
-    if (!s->wait_for_sipi)
-        return;
-    cpu_x86_load_seg_cache_sipi(s->cpu, s->sipi_vector);
-    s->wait_for_sipi = 0;
+    apic_lock();
+    if (s->wait_for_sipi) {
+        cpu_x86_load_seg_cache_sipi(s->cpu, s->sipi_vector);
+        s->wait_for_sipi = 0;
+    }
+    apic_unlock();
 }
 
 static void apic_deliver(DeviceState *dev, uint8_t dest, uint8_t dest_mode,
@@ -564,8 +577,12 @@ int apic_get_interrupt(DeviceState *dev)
        IRQs */
     if (!s)
         return -1;
-    if (!(s->spurious_vec & APIC_SV_ENABLE))
-        return -1;
+
+    apic_lock();
+    if (!(s->spurious_vec & APIC_SV_ENABLE)) {
+        intno = -1;
+        goto out;
+    }
 
     apic_sync_vapic(s, SYNC_FROM_VAPIC);
     intno = apic_irq_pending(s);
@@ -575,17 +592,20 @@ int apic_get_interrupt(DeviceState *dev)
      */
     if (intno == 0 || apic_check_pic(s)) {
         apic_sync_vapic(s, SYNC_TO_VAPIC);
-        return -1;
+        intno = -1;
+        goto out;
     } else if (intno < 0) {
         apic_sync_vapic(s, SYNC_TO_VAPIC);
-        return s->spurious_vec & 0xff;
+        intno = s->spurious_vec & 0xff;
+        goto out;
     }
     apic_reset_bit(s->irr, intno);
     apic_set_bit(s->isr, intno);
     apic_sync_vapic(s, SYNC_TO_VAPIC);
 
     apic_update_irq(s);
-
+out:
+    apic_unlock();
     return intno;
 }
 
@@ -637,8 +657,10 @@ static void apic_timer(void *opaque)
 {
     APICCommonState *s = opaque;
 
+    apic_lock();
     apic_local_deliver(s, APIC_LVT_TIMER);
     apic_timer_update(s, s->next_time);
+    apic_unlock();
 }
 
 static uint32_t apic_mem_readb(void *opaque, hwaddr addr)
@@ -659,12 +681,68 @@ static void apic_mem_writew(void *opaque, hwaddr addr, uint32_t val)
 {
 }
 
+/*
+ * The apic io area is dispatched without the iothread lock. Most registers
+ * only touch the local apic and are covered by the apic lock; the ones that
+ * reach into the PIC, the IOAPIC or other vcpus need the iothread lock too.
+ */
+static bool apic_mem_needs_iothread(APICCommonState *s, int index, bool is_write)
+{
+    int isrv;
+
+    switch (index) {
+    case 0x08:
+        return apic_report_tpr_access;
+    case 0x0b:
+        if (!is_write)
+            return false;
+        /* level triggered EOIs are broadcast to the IOAPIC */
+        isrv = get_highest_priority_int(s->isr);
+        return isrv >= 0 && !(s->spurious_vec & APIC_SV_DIRECTED_IO) &&
+               apic_get_bit(s->tmr, isrv);
+    case 0x30:
+        /* IPIs kick halted vcpus, whose wait is protected by the
+           iothread lock */
+        return is_write;
+    case 0x32 + APIC_LVT_LINT0:
+        return is_write;
+    default:
+        return false;
+    }
+}
+
+static bool apic_mem_lock(APICCommonState *s, int index, bool is_write)
+{
+    apic_lock();
+    if (vmx_mutex_iothread_locked() || !apic_mem_needs_iothread(s, index, is_write))
+        return false;
+
+    /* lock order is iothread lock, then apic lock. The register state can
+       change while neither is held, so decide again with both taken. */
+    apic_unlock();
+    vmx_mutex_lock_iothread();
+    apic_lock();
+    if (!apic_mem_needs_iothread(s, index, is_write)) {
+        vmx_mutex_unlock_iothread();
+        return false;
+    }
+    return true;
+}
+
+static void apic_mem_unlock(bool release_lock)
+{
+    apic_unlock();
+    if (release_lock)
+        vmx_mutex_unlock_iothread();
+}
+
 static uint32_t apic_mem_readl(void *opaque, hwaddr addr)
 {
     DeviceState *dev;
     APICCommonState *s;
     uint32_t val;
     int index;
+    bool release_lock;
 
     dev = cpu_get_current_apic();
     if (!dev) {
@@ -673,6 +751,7 @@ static uint32_t apic_mem_readl(void *opaque, hwaddr addr)
     s = APIC_COMMON(dev);
 
     index = (addr >> 4) & 0xff;
+    release_lock = apic_mem_lock(s, index, false);
     switch(index) {
     case 0x02: /* id */
         val = s->id << 24;
@@ -739,6 +818,7 @@ static uint32_t apic_mem_readl(void *opaque, hwaddr addr)
         val = 0;
         break;
     }
+    apic_mem_unlock(release_lock);
     return val;
 }
 
@@ -758,13 +838,20 @@ static void apic_mem_writel(void *opaque, hwaddr addr, uint32_t val)
     DeviceState *dev;
     APICCommonState *s;
     int index = (addr >> 4) & 0xff;
+    bool release_lock;
+
     if (addr > 0xfff || !index) {
         /* MSI and MMIO APIC are at the same memory location,
          * but actually not on the global bus: MSI is on PCI bus
          * APIC is connected directly to the GETCPU.
          * Mapping them on the global bus happens to work because
          * MSI registers are reserved in APIC MMIO and vice versa. */
+        release_lock = !vmx_mutex_iothread_locked();
+        if (release_lock)
+            vmx_mutex_lock_iothread();
         apic_send_msi(addr, val);
+        if (release_lock)
+            vmx_mutex_unlock_iothread();
         return;
     }
 
@@ -774,6 +861,7 @@ static void apic_mem_writel(void *opaque, hwaddr addr, uint32_t val)
     }
     s = APIC_COMMON(dev);
 
+    release_lock = apic_mem_lock(s, index, true);
     switch(index) {
     case 0x02:
         s->id = (val >> 24);
@@ -848,6 +936,7 @@ static void apic_mem_writel(void *opaque, hwaddr addr, uint32_t val)
         s->esr |= ESR_ILLEGAL_ADDRESS;
         break;
     }
+    apic_mem_unlock(release_lock);
 }
 
 void vmx_apic_mem_writel(void *opaque, hwaddr addr, uint32_t val)
@@ -883,6 +972,7 @@ static void apic_realize(DeviceState *dev, Error **errp)
 
     memory_area_init_io(&s->io_memory, VeertuTypeHold(s), &apic_io_ops, s, "apic-msi",
                           APIC_SPACE_SIZE);
+    mem_area_clear_global_locking(&s->io_memory);
 
     s->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, apic_timer, s);
     local_apics[s->idx] = s;
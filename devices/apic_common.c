@@ -17,6 +17,7 @@
  * You should have received a copy of the GNU Lesser General Public
  * License along with this library; if not, see <http://www.gnu.org/licenses/>
  */
+#include "qemu/thread.h"
 #include "iapic.h"
 #include "iapic_internal.h"
 #include "veertuemu.h"
@@ -26,6 +27,23 @@
 static int apic_irq_delivered;
 bool apic_report_tpr_access;
 
+/* Protects the state of all local apics. The apic io area is dispatched
+ * without the iothread lock, so every entry point takes this lock as well;
+ * it nests inside the iothread lock. Recursive, because IOAPIC EOI
+ * broadcasts and PIC checks call back into exported apic functions.
+ */
+static pthread_mutex_t apic_mutex;
+
+void apic_lock(void)
+{
+    pthread_mutex_lock(&apic_mutex);
+}
+
+void apic_unlock(void)
+{
+    pthread_mutex_unlock(&apic_mutex);
+}
+
 
 uint8_t* cpu_get_apic_vmx_page(DeviceState *dev)
 {
@@ -42,7 +60,9 @@ void cpu_set_apic_base(DeviceState *dev, uint64_t val)
     if (dev) {
         APICCommonState *s = APIC_COMMON(dev);
         APICCommonClass *info = APIC_COMMON_GET_CLASS(s);
+        apic_lock();
         info->set_base(s, val);
+        apic_unlock();
     }
 }
 
@@ -60,13 +80,17 @@ int apic_get_highest_priority_irr(DeviceState *dev)
 {
     APICCommonState *s;
     APICCommonClass *info;
+    int irr;
 
     if (!dev) {
         return -1;
     }
     s = APIC_COMMON(dev);
     info = APIC_COMMON_GET_CLASS(s);
-    return info->get_highest_priority_irr(s);
+    apic_lock();
+    irr = info->get_highest_priority_irr(s);
+    apic_unlock();
+    return irr;
 }
 
 void cpu_set_apic_tpr(DeviceState *dev, uint8_t val)
@@ -81,13 +105,16 @@ void cpu_set_apic_tpr(DeviceState *dev, uint8_t val)
     s = APIC_COMMON(dev);
     info = APIC_COMMON_GET_CLASS(s);
 
+    apic_lock();
     info->set_tpr(s, val);
+    apic_unlock();
 }
 
 uint8_t cpu_get_apic_tpr(DeviceState *dev)
 {
     APICCommonState *s;
     APICCommonClass *info;
+    uint8_t tpr;
 
     if (!dev) {
         return 0;
@@ -96,7 +123,10 @@ uint8_t cpu_get_apic_tpr(DeviceState *dev)
     s = APIC_COMMON(dev);
     info = APIC_COMMON_GET_CLASS(s);
 
-    return info->get_tpr(s);
+    apic_lock();
+    tpr = info->get_tpr(s);
+    apic_unlock();
+    return tpr;
 }
 
 void apic_enable_tpr_access_reporting(DeviceState *dev, bool enable)
@@ -115,8 +145,10 @@ void apic_enable_vapic(DeviceState *dev, hwaddr paddr)
     APICCommonState *s = APIC_COMMON(dev);
     APICCommonClass *info = APIC_COMMON_GET_CLASS(s);
 
+    apic_lock();
     s->vapic_paddr = paddr;
     info->vapic_base_update(s);
+    apic_unlock();
 }
 
 void apic_handle_tpr_access_report(DeviceState *dev, target_ulong ip,
@@ -153,7 +185,9 @@ void apic_deliver_nmi(DeviceState *dev)
     APICCommonState *s = APIC_COMMON(dev);
     APICCommonClass *info = APIC_COMMON_GET_CLASS(s);
 
+    apic_lock();
     info->external_nmi(s);
+    apic_unlock();
 }
 
 bool apic_next_timer(APICCommonState *s, int64_t current_time)
@@ -198,6 +232,7 @@ void apic_init_reset(DeviceState *dev)
     if (!s) {
         return;
     }
+    apic_lock();
     s->tpr = 0;
     s->spurious_vec = 0xff;
     s->log_dest = 0;
@@ -225,6 +260,7 @@ void apic_init_reset(DeviceState *dev)
     if (info->reset) {
         info->reset(s);
     }
+    apic_unlock();
 }
 
 void apic_designate_bsp(DeviceState *dev)
@@ -460,5 +496,12 @@ static const VeertuTypeInfo apic_common_type = {
 
 void apic_common_register_types(void)
 {
+    pthread_mutexattr_t attr;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&apic_mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+
     register_type_internal(&apic_common_type);
 }
\ No newline at end of file
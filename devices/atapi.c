@@ -130,12 +130,12 @@ cd_read_sector_sync(IDEState *s)
         }
         break;
     default:
-        //block_acct_invalid(blk_get_stats(s->blk), BLOCK_ACCT_READ);
+        block_acct_invalid(blk_get_stats(s->blk), BLOCK_ACCT_READ);
         return -EIO;
     }
 
     if (ret < 0) {
-        //block_acct_failed(blk_get_stats(s->blk), &s->acct);
+        block_acct_failed(blk_get_stats(s->blk), &s->acct);
     } else {
         block_acct_done(blk_get_stats(s->blk), &s->acct);
         s->lba++;
@@ -154,7 +154,7 @@ static void cd_read_sector_cb(void *opaque, int ret)
 #endif
 
     if (ret < 0) {
-        //block_acct_failed(blk_get_stats(s->blk), &s->acct);
+        block_acct_failed(blk_get_stats(s->blk), &s->acct);
         ide_atapi_io_error(s, ret);
         return;
     }
@@ -175,7 +175,7 @@ static void cd_read_sector_cb(void *opaque, int ret)
 static int cd_read_sector(IDEState *s)
 {
     if (s->cd_sector_size != 2048 && s->cd_sector_size != 2352) {
-        //block_acct_invalid(blk_get_stats(s->blk), BLOCK_ACCT_READ);
+        block_acct_invalid(blk_get_stats(s->blk), BLOCK_ACCT_READ);
         return -EINVAL;
     }
 
@@ -442,7 +442,7 @@ static void ide_atapi_cmd_read_dma_cb(void *opaque, int ret)
 
 eot:
     if (ret < 0) {
-        //block_acct_failed(blk_get_stats(s->blk), &s->acct);
+        block_acct_failed(blk_get_stats(s->blk), &s->acct);
     } else {
         block_acct_done(blk_get_stats(s->blk), &s->acct);
     }
@@ -29,6 +29,7 @@
 #include "pci.h"
 #include "net/net.h"
 #include "net/checksum.h"
+#include "net/tap.h"
 #include "loader.h"
 #include "sysemu.h"
 #include "emudma.h"
@@ -115,8 +116,13 @@ typedef struct E1000State_st {
         int8_t ip;
         int8_t tcp;
         char cptse;     // current packet tse bit
+        char gso;       // TSO frames go to the peer whole
     } tx;
 
+    /* The peer takes a virtio-net header with every frame and segments
+     * TSO frames itself, see xmit_gso() */
+    bool has_vnet;
+
     struct {
         uint32_t val_in;	// shifted in from guest driver
         uint16_t bitnum_in;
@@ -592,24 +598,140 @@ fcs_len(E1000State *s)
     return (s->mac_reg[RCTL] & E1000_RCTL_SECRC) ? 0 : 4;
 }
 
+static ssize_t e1000_receive_frame(NetClientState *nc,
+                                   const struct iovec *iov, int iovcnt);
+
 static void
-e1000_send_packet(E1000State *s, const uint8_t *buf, int size)
+e1000_send_packet(E1000State *s, const struct virtio_net_hdr *hdr,
+                  const uint8_t *buf, int size)
 {
+    static const struct virtio_net_hdr no_offload;
     NetClientState *nc = vmx_get_queue(s->nic);
+    struct iovec iov[2];
+
+    iov[1].iov_base = (uint8_t *)buf;
+    iov[1].iov_len = size;
     if (s->phy_reg[PHY_CTRL] & MII_CR_LOOPBACK) {
-        nc->info->receive(nc, buf, size);
+        e1000_receive_frame(nc, &iov[1], 1);
+    } else if (s->has_vnet) {
+        iov[0].iov_base = (void *)(hdr ? hdr : &no_offload);
+        iov[0].iov_len = sizeof(struct virtio_net_hdr);
+        vmx_sendv_packet(nc, iov, 2);
     } else {
         vmx_send_packet(nc, buf, size);
     }
 }
 
+static void
+e1000_tx_account(E1000State *s, unsigned int frames, unsigned int bytes)
+{
+    unsigned int n;
+
+    s->mac_reg[TPT] += frames;
+    s->mac_reg[GPTC] += frames;
+    n = s->mac_reg[TOTL];
+    if ((s->mac_reg[TOTL] += bytes) < n)
+        s->mac_reg[TOTH]++;
+}
+
+/*
+ * Whether the current TSO context can be handed to the peer as a single
+ * frame.  Otherwise it is segmented here, as it always was.
+ */
+static bool
+e1000_tx_gso_ok(E1000State *s)
+{
+    struct e1000_tx *tp = &s->tx;
+
+    if (!s->has_vnet || !tp->tse || !tp->mss ||
+        (s->phy_reg[PHY_CTRL] & MII_CR_LOOPBACK)) {
+        return false;
+    }
+    if (tp->hdr_len + tp->paylen > sizeof(tp->data) ||
+        tp->tucss >= tp->hdr_len || tp->tucso + 2 > tp->hdr_len) {
+        return false;
+    }
+    return tp->tcp || vmx_has_ufo(vmx_get_queue(s->nic)->peer);
+}
+
+/*
+ * Sends a whole TSO frame with a vnet header describing the segmentation.
+ * The headers are fixed up the way the host stack expects them: lengths
+ * covering the whole frame and the L4 checksum holding only the
+ * pseudo-header sum.
+ */
+static void
+xmit_gso(E1000State *s)
+{
+    struct e1000_tx *tp = &s->tx;
+    struct virtio_net_hdr hdr;
+    unsigned int css = tp->ipcss, len, frames, vlan_len = 0;
+    uint8_t *frame = tp->data;
+    uint16_t *sp;
+
+    if (tp->ip) {		// IPv4
+        stw_be_p(tp->data+css+2, tp->size - css);
+    } else {			// IPv6, minus its fixed header
+        stw_be_p(tp->data+css+4, tp->size - css - 40);
+    }
+    css = tp->tucss;
+    len = tp->size - css;
+    if (!tp->tcp) {
+        stw_be_p(tp->data+css+4, len);
+    }
+    if (tp->sum_needed & E1000_TXD_POPTS_TXSM) {
+        unsigned int phsum;
+        // add pseudo-header length, the segments' sums start from it
+        sp = (uint16_t *)(tp->data + tp->tucso);
+        phsum = be16_to_cpup(sp) + len;
+        phsum = (phsum >> 16) + (phsum & 0xffff);
+        stw_be_p(sp, phsum);
+    }
+    if (tp->sum_needed & E1000_TXD_POPTS_IXSM)
+        putsum(tp->data, tp->size, tp->ipcso, tp->ipcss, tp->ipcse);
+
+    if (tp->vlan_needed) {
+        memmove(tp->vlan, tp->data, 4);
+        memmove(tp->data, tp->data + 4, 8);
+        memcpy(tp->data + 8, tp->vlan_header, 4);
+        frame = tp->vlan;
+        vlan_len = 4;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    hdr.csum_start = tp->tucss + vlan_len;
+    hdr.csum_offset = tp->tucso - tp->tucss;
+    hdr.hdr_len = tp->hdr_len + vlan_len;
+    hdr.gso_size = tp->mss;
+    if (!tp->tcp) {
+        hdr.gso_type = VIRTIO_NET_HDR_GSO_UDP;
+    } else {
+        hdr.gso_type = tp->ip ? VIRTIO_NET_HDR_GSO_TCPV4 :
+                                VIRTIO_NET_HDR_GSO_TCPV6;
+        if (tp->data[css + 13] & 0x80) {	// CWR
+            hdr.gso_type |= VIRTIO_NET_HDR_GSO_ECN;
+        }
+    }
+    e1000_send_packet(s, &hdr, frame, tp->size + vlan_len);
+
+    /* statistics as if the segments had been sent one by one */
+    frames = MAX(1, DIV_ROUND_UP(tp->size - tp->hdr_len, tp->mss));
+    e1000_tx_account(s, frames, tp->size + (frames - 1) * tp->hdr_len);
+}
+
 static void
 xmit_seg(E1000State *s)
 {
     uint16_t len, *sp;
-    unsigned int frames = s->tx.tso_frames, css, sofar, n;
+    unsigned int frames = s->tx.tso_frames, css, sofar;
     struct e1000_tx *tp = &s->tx;
 
+    if (tp->tse && tp->cptse && tp->gso) {
+        xmit_gso(s);
+        return;
+    }
+
     if (tp->tse && tp->cptse) {
         css = tp->ipcss;
         DBGOUT(TXSUM, "frames %d size %d ipcss %d\n",
@@ -649,14 +771,10 @@ xmit_seg(E1000State *s)
         memmove(tp->vlan, tp->data, 4);
         memmove(tp->data, tp->data + 4, 8);
         memcpy(tp->data + 8, tp->vlan_header, 4);
-        e1000_send_packet(s, tp->vlan, tp->size + 4);
+        e1000_send_packet(s, NULL, tp->vlan, tp->size + 4);
     } else
-        e1000_send_packet(s, tp->data, tp->size);
-    s->mac_reg[TPT]++;
-    s->mac_reg[GPTC]++;
-    n = s->mac_reg[TOTL];
-    if ((s->mac_reg[TOTL] += s->tx.size) < n)
-        s->mac_reg[TOTH]++;
+        e1000_send_packet(s, NULL, tp->data, tp->size);
+    e1000_tx_account(s, 1, s->tx.size);
 }
 
 static void
@@ -691,6 +809,7 @@ process_tx_desc(E1000State *s, struct e1000_tx_desc *dp)
             DBGOUT(TXSUM, "TCP/UDP: cso 0!\n");
             tp->tucso = tp->tucss + (tp->tcp ? 16 : 6);
         }
+        tp->gso = e1000_tx_gso_ok(s);
         return;
     } else if (dtype == (E1000_TXD_CMD_DEXT | E1000_TXD_DTYP_D)) {
         // data descriptor
@@ -713,7 +832,7 @@ process_tx_desc(E1000State *s, struct e1000_tx_desc *dp)
     }
         
     addr = le64_to_cpu(dp->buffer_addr);
-    if (tp->tse && tp->cptse) {
+    if (tp->tse && tp->cptse && !tp->gso) {
         msh = tp->hdr_len + tp->mss;
         do {
             bytes = split_size;
@@ -934,7 +1053,7 @@ static uint64_t rx_desc_base(E1000State *s)
 }
 
 static ssize_t
-e1000_receive_iov(NetClientState *nc, const struct iovec *iov, int iovcnt)
+e1000_receive_frame(NetClientState *nc, const struct iovec *iov, int iovcnt)
 {
     E1000State *s = vmx_get_nic_opaque(nc);
     PCIDevice *d = PCI_DEVICE(s);
@@ -1088,6 +1207,41 @@ e1000_receive_iov(NetClientState *nc, const struct iovec *iov, int iovcnt)
     return size;
 }
 
+/* Frames from a vnet header peer carry one we have no use for on receive,
+ * offloads are never enabled in that direction. */
+#define E1000_VNET_RX_MAX_IOV 64
+
+static ssize_t
+e1000_receive_iov(NetClientState *nc, const struct iovec *iov, int iovcnt)
+{
+    E1000State *s = vmx_get_nic_opaque(nc);
+    struct iovec frame[E1000_VNET_RX_MAX_IOV];
+    size_t skip = sizeof(struct virtio_net_hdr);
+    int i, cnt = 0;
+
+    if (!s->has_vnet) {
+        return e1000_receive_frame(nc, iov, iovcnt);
+    }
+    for (i = 0; i < iovcnt; i++) {
+        if (skip >= iov[i].iov_len) {
+            skip -= iov[i].iov_len;
+            continue;
+        }
+        if (cnt == ARRAY_SIZE(frame)) {
+            DBGOUT(RXERR, "too many fragments, dropping frame\n");
+            return iov_size(iov, iovcnt);
+        }
+        frame[cnt].iov_base = (uint8_t *)iov[i].iov_base + skip;
+        frame[cnt].iov_len = iov[i].iov_len - skip;
+        skip = 0;
+        cnt++;
+    }
+    if (!cnt) {
+        return iov_size(iov, iovcnt);
+    }
+    return e1000_receive_frame(nc, frame, cnt);
+}
+
 static ssize_t
 e1000_receive(NetClientState *nc, const uint8_t *buf, size_t size)
 {
@@ -1345,6 +1499,9 @@ static int e1000_post_load(void *opaque, int version_id)
      * Alternatively, restart link negotiation if it was in progress. */
     nc->link_down = (s->mac_reg[STATUS] & E1000_STATUS_LU) == 0;
 
+    /* the peer on this side may segment differently */
+    s->tx.gso = e1000_tx_gso_ok(s);
+
     if (have_autoneg(s) &&
         !(s->phy_reg[PHY_STATUS] & MII_SR_AUTONEG_COMPLETE)) {
         nc->link_down = false;
@@ -1491,6 +1648,10 @@ e1000_mmio_setup(E1000State *d)
 
     memory_area_init_io(&d->mmio, VeertuTypeHold(d), &e1000_mmio_ops, d,
                           "e1000-mmio", PNPMMIO_SIZE);
+    mem_area_add_coalescing(&d->mmio, 0, excluded_regs[0]);
+    for (i = 0; excluded_regs[i] != PNPMMIO_SIZE; i++)
+        mem_area_add_coalescing(&d->mmio, excluded_regs[i] + 4,
+                                excluded_regs[i+1] - excluded_regs[i] - 4);
     memory_area_init_io(&d->io, VeertuTypeHold(d), &e1000_io_ops, d, "e1000-io", IOPORT_SIZE);
 }
 
@@ -1581,6 +1742,16 @@ static int pci_e1000_init(PCIDevice *pci_dev)
 
     vmx_format_nic_info_str(vmx_get_queue(d->nic), macaddr);
 
+    /* Hand TSO frames over whole when the peer can segment them */
+    d->has_vnet = vmx_has_vnet_hdr(vmx_get_queue(d->nic)->peer);
+    if (d->has_vnet) {
+        NetClientState *peer = vmx_get_queue(d->nic)->peer;
+
+        vmx_using_vnet_hdr(peer, true);
+        vmx_set_vnet_hdr_len(peer, sizeof(struct virtio_net_hdr));
+        vmx_set_offload(peer, 0, 0, 0, 0, 0);
+    }
+
     d->autoneg_timer = timer_new_ms(QEMU_CLOCK_VIRTUAL, e1000_autoneg_timer, d);
     d->mit_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, e1000_mit_timer, d);
 
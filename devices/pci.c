@@ -1544,6 +1544,7 @@ static const char * const pci_nic_models[] = {
     "e1000",
     "e1000-82545em",
     "pcnet",
+    "virtio",
     NULL
 };
 
@@ -1556,6 +1557,7 @@ static const char * const pci_nic_names[] = {
     "e1000",
     "e1000-82545em",
     "pcnet",
+    "virtio-net-pci",
     NULL
 };
 
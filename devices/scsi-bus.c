@@ -90,6 +90,9 @@ static void scsi_dma_restart_bh(void *opaque)
     vmx_bh_delete(s->bh);
     s->bh = NULL;
 
+    if (s->conf.blk) {
+        blk_io_plug(s->conf.blk);
+    }
     QTAILQ_FOREACH_SAFE(req, &s->requests, next, next) {
         scsi_req_ref(req);
         if (req->retry) {
@@ -107,6 +110,9 @@ static void scsi_dma_restart_bh(void *opaque)
         }
         scsi_req_unref(req);
     }
+    if (s->conf.blk) {
+        blk_io_unplug(s->conf.blk);
+    }
 }
 
 void scsi_req_retry(SCSIRequest *req)
@@ -2277,6 +2277,7 @@ VeertuMemArea *vga_init_io(VGACommonState *s, VeertuType *obj,
     vga_mem = g_malloc(sizeof(*vga_mem));
     memory_area_init_io(vga_mem, obj, &vga_mem_ops, s,
                           "vga-lowmem", 0x20000);
+    mem_area_set_coalescing(vga_mem);
 
     return vga_mem;
 }
@@ -0,0 +1,850 @@
+/*
+ * Virtio Network Device
+ *
+ * Copyright IBM, Corp. 2007
+ * Copyright (C) 2016 Veertu Inc,
+ *
+ * Authors:
+ *  Anthony Liguori   <aliguori@us.ibm.com>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include "hw.h"
+#include "virtio-pci.h"
+#include "net/net.h"
+#include "net/tap.h"
+#include "sysemu.h"
+#include "qemu/iov.h"
+#include "qemu/main-loop.h"
+#include "qemu/error-report.h"
+
+#define TYPE_VIRTIO_NET "virtio-net-pci"
+
+#define VIRTIO_NET(obj) obj
+
+/* Device feature bits */
+#define VIRTIO_NET_F_CSUM               0
+#define VIRTIO_NET_F_GUEST_CSUM         1
+#define VIRTIO_NET_F_MAC                5
+#define VIRTIO_NET_F_GUEST_TSO4         7
+#define VIRTIO_NET_F_GUEST_TSO6         8
+#define VIRTIO_NET_F_GUEST_ECN          9
+#define VIRTIO_NET_F_GUEST_UFO          10
+#define VIRTIO_NET_F_HOST_TSO4          11
+#define VIRTIO_NET_F_HOST_TSO6          12
+#define VIRTIO_NET_F_HOST_ECN           13
+#define VIRTIO_NET_F_HOST_UFO           14
+#define VIRTIO_NET_F_MRG_RXBUF          15
+#define VIRTIO_NET_F_STATUS             16
+#define VIRTIO_NET_F_CTRL_VQ            17
+#define VIRTIO_NET_F_MQ                 22
+
+#define VIRTIO_NET_S_LINK_UP            1
+
+/* Control virtqueue */
+#define VIRTIO_NET_OK                   0
+#define VIRTIO_NET_ERR                  1
+
+#define VIRTIO_NET_CTRL_MQ              4
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET 0
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN 1
+
+#define VIRTIO_NET_RX_QUEUE_SIZE        256
+#define VIRTIO_NET_TX_QUEUE_SIZE        256
+#define VIRTIO_NET_CTRL_QUEUE_SIZE      64
+
+/* Packets sent per bottom half run before yielding to the main loop */
+#define VIRTIO_NET_TX_BURST             256
+
+/* rx and tx for each pair, plus the control queue */
+#define VIRTIO_NET_MAX_QUEUES           ((VIRTIO_QUEUE_MAX - 1) / 2)
+
+struct virtio_net_config {
+    uint8_t mac[6];
+    uint16_t status;
+    uint16_t max_virtqueue_pairs;
+} QEMU_PACKED;
+
+struct virtio_net_ctrl_hdr {
+    uint8_t class;
+    uint8_t cmd;
+} QEMU_PACKED;
+
+typedef struct VirtIONet VirtIONet;
+
+typedef struct VirtIONetQueue {
+    VirtQueue *rx_vq;
+    VirtQueue *tx_vq;
+    QEMUBH *tx_bh;
+    int tx_waiting;
+    bool async_tx;              /* tx_elem is queued in the backend */
+    VirtQueueElement *tx_elem;
+    VirtIONet *n;
+} VirtIONetQueue;
+
+struct VirtIONet {
+    /*< private >*/
+    VirtIOPCIProxy proxy;
+    /*< public >*/
+
+    VirtIODevice vdev;
+    NICState *nic;
+    NICConf conf;
+    uint8_t mac[6];
+    uint16_t status;
+
+    VirtIONetQueue vqs[VIRTIO_NET_MAX_QUEUES];
+    VirtQueue *ctrl_vq;
+    int32_t max_queues;
+    int32_t curr_queues;
+    int32_t tx_burst;
+
+    int mergeable_rx_bufs;
+    bool has_vnet_hdr;          /* the backend takes virtio headers */
+    size_t guest_hdr_len;
+    size_t host_hdr_len;
+
+    /* scratch elements; the first rx buffer stays mapped until the
+     * number of buffers the packet took is known */
+    VirtQueueElement *rx_first;
+    VirtQueueElement *rx_elem;
+    VirtQueueElement *ctrl_elem;
+};
+
+static VirtIONetQueue *virtio_net_get_subqueue(NetClientState *nc)
+{
+    VirtIONet *n = vmx_get_nic_opaque(nc);
+
+    return &n->vqs[nc->queue_index];
+}
+
+static int vq2q(int queue_index)
+{
+    return queue_index / 2;
+}
+
+static void virtio_net_get_config(VirtIODevice *vdev, uint8_t *config)
+{
+    VirtIONet *n = container_of(vdev, VirtIONet, vdev);
+    struct virtio_net_config netcfg;
+
+    memcpy(netcfg.mac, n->mac, sizeof(netcfg.mac));
+    netcfg.status = n->status;
+    netcfg.max_virtqueue_pairs = n->max_queues;
+    memcpy(config, &netcfg, sizeof(netcfg));
+}
+
+static void virtio_net_set_config(VirtIODevice *vdev, const uint8_t *config)
+{
+    VirtIONet *n = container_of(vdev, VirtIONet, vdev);
+    struct virtio_net_config netcfg;
+
+    /* legacy drivers change the MAC through config space */
+    memcpy(&netcfg, config, sizeof(netcfg));
+    if (memcmp(netcfg.mac, n->mac, sizeof(n->mac))) {
+        memcpy(n->mac, netcfg.mac, sizeof(n->mac));
+        vmx_format_nic_info_str(vmx_get_queue(n->nic), n->mac);
+    }
+}
+
+static void virtio_net_set_status(VirtIODevice *vdev, uint8_t status)
+{
+    VirtIONet *n = container_of(vdev, VirtIONet, vdev);
+    int i;
+
+    for (i = 0; i < n->max_queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+        bool running = (status & VIRTIO_CONFIG_S_DRIVER_OK) &&
+                       (n->status & VIRTIO_NET_S_LINK_UP) &&
+                       i < n->curr_queues;
+
+        if (!running) {
+            vmx_bh_cancel(q->tx_bh);
+            continue;
+        }
+        if (q->tx_waiting) {
+            vmx_bh_schedule(q->tx_bh);
+        }
+        /* packets may have queued up while the driver was loading */
+        vmx_flush_queued_packets(vmx_get_subqueue(n->nic, i));
+    }
+}
+
+static void virtio_net_set_link_status(NetClientState *nc)
+{
+    VirtIONet *n = vmx_get_nic_opaque(nc);
+    uint16_t old_status = n->status;
+
+    if (nc->link_down) {
+        n->status &= ~VIRTIO_NET_S_LINK_UP;
+    } else {
+        n->status |= VIRTIO_NET_S_LINK_UP;
+    }
+    if (n->status != old_status) {
+        virtio_notify_config(&n->vdev);
+    }
+    virtio_net_set_status(&n->vdev, n->vdev.status);
+}
+
+static uint32_t virtio_net_get_features(VirtIODevice *vdev, uint32_t features)
+{
+    VirtIONet *n = container_of(vdev, VirtIONet, vdev);
+    NetClientState *nc = vmx_get_queue(n->nic);
+
+    features |= (1 << VIRTIO_NET_F_MAC) |
+                (1 << VIRTIO_NET_F_MRG_RXBUF) |
+                (1 << VIRTIO_NET_F_STATUS) |
+                (1 << VIRTIO_NET_F_CTRL_VQ);
+    if (n->max_queues > 1) {
+        features |= 1 << VIRTIO_NET_F_MQ;
+    }
+
+    /* offloads are passed through in the header, which needs a backend
+     * that understands it */
+    if (n->has_vnet_hdr) {
+        features |= (1 << VIRTIO_NET_F_CSUM) |
+                    (1 << VIRTIO_NET_F_HOST_TSO4) |
+                    (1 << VIRTIO_NET_F_HOST_TSO6) |
+                    (1 << VIRTIO_NET_F_HOST_ECN) |
+                    (1 << VIRTIO_NET_F_GUEST_CSUM) |
+                    (1 << VIRTIO_NET_F_GUEST_TSO4) |
+                    (1 << VIRTIO_NET_F_GUEST_TSO6) |
+                    (1 << VIRTIO_NET_F_GUEST_ECN);
+        if (vmx_has_ufo(nc->peer)) {
+            features |= (1 << VIRTIO_NET_F_HOST_UFO) |
+                        (1 << VIRTIO_NET_F_GUEST_UFO);
+        }
+    }
+    return features;
+}
+
+static void virtio_net_set_features(VirtIODevice *vdev, uint32_t features)
+{
+    VirtIONet *n = container_of(vdev, VirtIONet, vdev);
+    int i;
+
+    n->mergeable_rx_bufs = !!(features & (1 << VIRTIO_NET_F_MRG_RXBUF));
+    n->guest_hdr_len = n->mergeable_rx_bufs ?
+        sizeof(struct virtio_net_hdr_mrg_rxbuf) :
+        sizeof(struct virtio_net_hdr);
+    if (!(features & (1 << VIRTIO_NET_F_MQ))) {
+        n->curr_queues = 1;
+    }
+
+    if (!n->has_vnet_hdr) {
+        return;
+    }
+    for (i = 0; i < n->max_queues; i++) {
+        NetClientState *peer = vmx_get_subqueue(n->nic, i)->peer;
+
+        /* let the backend use the guest's header as is when it can */
+        if (vmx_has_vnet_hdr_len(peer, n->guest_hdr_len)) {
+            vmx_set_vnet_hdr_len(peer, n->guest_hdr_len);
+            n->host_hdr_len = n->guest_hdr_len;
+        }
+        vmx_set_offload(peer,
+                        !!(features & (1 << VIRTIO_NET_F_GUEST_CSUM)),
+                        !!(features & (1 << VIRTIO_NET_F_GUEST_TSO4)),
+                        !!(features & (1 << VIRTIO_NET_F_GUEST_TSO6)),
+                        !!(features & (1 << VIRTIO_NET_F_GUEST_ECN)),
+                        !!(features & (1 << VIRTIO_NET_F_GUEST_UFO)));
+    }
+}
+
+static void virtio_net_reset(VirtIODevice *vdev)
+{
+    VirtIONet *n = container_of(vdev, VirtIONet, vdev);
+    int i;
+
+    /* completes anything the backend still holds back to the ring */
+    for (i = 0; i < n->max_queues; i++) {
+        vmx_purge_queued_packets(vmx_get_subqueue(n->nic, i));
+        n->vqs[i].tx_waiting = 0;
+        n->vqs[i].async_tx = false;
+    }
+
+    n->curr_queues = 1;
+    virtio_net_set_features(vdev, 0);
+    memcpy(n->mac, n->conf.macaddr.a, sizeof(n->mac));
+    vmx_format_nic_info_str(vmx_get_queue(n->nic), n->mac);
+}
+
+/* RX */
+
+static int virtio_net_can_receive(NetClientState *nc)
+{
+    VirtIONet *n = vmx_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+
+    if (nc->queue_index >= n->curr_queues ||
+        !(n->vdev.status & VIRTIO_CONFIG_S_DRIVER_OK) ||
+        !virtio_queue_ready(q->rx_vq)) {
+        return 0;
+    }
+    return 1;
+}
+
+static int virtio_net_has_buffers(VirtIONetQueue *q, int bufsize)
+{
+    VirtIONet *n = q->n;
+
+    if (virtio_queue_empty(q->rx_vq) ||
+        (n->mergeable_rx_bufs &&
+         !virtqueue_avail_bytes(q->rx_vq, bufsize, 0))) {
+        virtio_queue_set_notification(q->rx_vq, 1);
+
+        /* the guest may have added buffers before it saw the flag */
+        if (virtio_queue_empty(q->rx_vq) ||
+            (n->mergeable_rx_bufs &&
+             !virtqueue_avail_bytes(q->rx_vq, bufsize, 0))) {
+            return 0;
+        }
+    }
+
+    virtio_queue_set_notification(q->rx_vq, 0);
+    return 1;
+}
+
+static void virtio_net_handle_rx(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtIONet *n = container_of(vdev, VirtIONet, vdev);
+
+    vmx_flush_queued_packets(vmx_get_subqueue(n->nic,
+                                              vq2q(virtio_get_queue_index(vq))));
+}
+
+/*
+ * Puts the count buffers taken for a packet back on the avail side without
+ * publishing anything, the next packet pops them again. The first one is
+ * still mapped, the others were unmapped when they were filled.
+ */
+static void virtio_net_rx_abort(VirtIONet *n, VirtIONetQueue *q, int count)
+{
+    virtqueue_discard(q->rx_vq, n->rx_first, 0);
+    virtqueue_rewind(q->rx_vq, count - 1);
+}
+
+/* Copies one packet into the rx ring; the caller notifies the guest */
+static ssize_t virtio_net_receive_one(NetClientState *nc, const uint8_t *buf,
+                                      size_t size)
+{
+    VirtIONet *n = vmx_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    struct virtio_net_hdr_mrg_rxbuf mhdr;
+    size_t offset = n->host_hdr_len, first_len = 0;
+    uint16_t num_buffers;
+    int i = 0;
+
+    if (!virtio_net_can_receive(nc)) {
+        return -1;
+    }
+    if (size < n->host_hdr_len) {
+        return size;
+    }
+    if (!virtio_net_has_buffers(q, size + n->guest_hdr_len - n->host_hdr_len)) {
+        return 0;
+    }
+
+    do {
+        VirtQueueElement *elem = i ? n->rx_elem : n->rx_first;
+        size_t guest_offset = 0, len;
+
+        if (!virtqueue_pop(q->rx_vq, elem)) {
+            /* the guest took back buffers has_buffers counted */
+            if (i) {
+                virtio_net_rx_abort(n, q, i);
+            }
+            return size;
+        }
+        if (!elem->in_num) {
+            virtio_error(&n->vdev, "receive buffer is not writable");
+            goto drop;
+        }
+
+        if (i == 0) {
+            /* the backend's header when there is one, else no offloads */
+            memset(&mhdr, 0, sizeof(mhdr));
+            memcpy(&mhdr, buf, MIN(n->host_hdr_len, sizeof(mhdr)));
+            guest_offset = n->guest_hdr_len;
+            if (iov_from_buf(elem->in_sg, elem->in_num, 0, &mhdr,
+                             guest_offset) < guest_offset) {
+                virtio_error(&n->vdev, "receive buffer is too short");
+                goto drop;
+            }
+        }
+
+        len = iov_from_buf(elem->in_sg, elem->in_num, guest_offset,
+                           buf + offset, size - offset);
+        offset += len;
+
+        if (!n->mergeable_rx_bufs && offset < size) {
+            /* too big for the guest's buffer, let it have it back */
+            virtqueue_discard(q->rx_vq, elem, 0);
+            return size;
+        }
+
+        if (i) {
+            virtqueue_fill(q->rx_vq, elem, len, i);
+        } else {
+            first_len = guest_offset + len;
+        }
+        i++;
+    } while (offset < size);
+
+    if (n->mergeable_rx_bufs) {
+        num_buffers = i;
+        iov_from_buf(n->rx_first->in_sg, n->rx_first->in_num,
+                     offsetof(struct virtio_net_hdr_mrg_rxbuf, num_buffers),
+                     &num_buffers, sizeof(num_buffers));
+    }
+
+    virtqueue_fill(q->rx_vq, n->rx_first, first_len, 0);
+    virtqueue_flush(q->rx_vq, i);
+    return size;
+
+drop:
+    /* the buffer that failed is still mapped */
+    if (i) {
+        virtqueue_discard(q->rx_vq, n->rx_elem, 0);
+        virtio_net_rx_abort(n, q, i);
+    } else {
+        virtqueue_discard(q->rx_vq, n->rx_first, 0);
+    }
+    return size;
+}
+
+static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf,
+                                  size_t size)
+{
+    VirtIONet *n = vmx_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    ssize_t ret;
+
+    ret = virtio_net_receive_one(nc, buf, size);
+    if (ret > 0) {
+        virtio_notify(&n->vdev, q->rx_vq);
+    }
+    return ret;
+}
+
+/* Fills the ring with as many of the packets as fit, then interrupts once */
+static int virtio_net_receive_batch(NetClientState *nc,
+                                    const struct iovec *pkts, int count)
+{
+    VirtIONet *n = vmx_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    bool filled = false;
+    ssize_t ret;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        ret = virtio_net_receive_one(nc, pkts[i].iov_base, pkts[i].iov_len);
+        if (ret == 0) {
+            break;
+        }
+        if (ret > 0) {
+            filled = true;
+        }
+    }
+
+    if (filled) {
+        virtio_notify(&n->vdev, q->rx_vq);
+    }
+    return i;
+}
+
+/* TX */
+
+static int32_t virtio_net_flush_tx(VirtIONetQueue *q);
+
+static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
+{
+    VirtIONet *n = vmx_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    int32_t ret;
+
+    virtqueue_push(q->tx_vq, q->tx_elem, 0);
+    virtio_notify(&n->vdev, q->tx_vq);
+
+    q->async_tx = false;
+    virtio_queue_set_notification(q->tx_vq, 1);
+    ret = virtio_net_flush_tx(q);
+    if (ret >= n->tx_burst) {
+        /* the flush stopped at tx_burst with kicks on, and the guest may
+         * not kick again for what's left, so hand it to the bottom half */
+        virtio_queue_set_notification(q->tx_vq, 0);
+        vmx_bh_schedule(q->tx_bh);
+        q->tx_waiting = 1;
+    }
+}
+
+/* Fills dst with what follows the first skip bytes of src */
+static unsigned int virtio_net_iov_skip(struct iovec *dst, unsigned int dst_cnt,
+                                        const struct iovec *src,
+                                        unsigned int src_cnt, size_t skip)
+{
+    unsigned int i, cnt = 0;
+
+    for (i = 0; i < src_cnt && cnt < dst_cnt; i++) {
+        if (skip >= src[i].iov_len) {
+            skip -= src[i].iov_len;
+            continue;
+        }
+        dst[cnt].iov_base = (uint8_t *)src[i].iov_base + skip;
+        dst[cnt].iov_len = src[i].iov_len - skip;
+        skip = 0;
+        cnt++;
+    }
+    return cnt;
+}
+
+/* Returns the number of packets sent, or -EBUSY if the backend is full */
+static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
+{
+    VirtIONet *n = q->n;
+    VirtIODevice *vdev = &n->vdev;
+    VirtQueueElement *elem = q->tx_elem;
+    NetClientState *nc = vmx_get_subqueue(n->nic, q - n->vqs);
+    int32_t num_packets = 0;
+
+    if (!(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK)) {
+        return num_packets;
+    }
+    if (q->async_tx) {
+        virtio_queue_set_notification(q->tx_vq, 0);
+        return num_packets;
+    }
+
+    while (virtqueue_pop(q->tx_vq, elem)) {
+        struct virtio_net_hdr_mrg_rxbuf mhdr;
+        struct iovec sg[VIRTQUEUE_MAX_SIZE];
+        struct iovec *out_sg = elem->out_sg;
+        unsigned int out_num = elem->out_num;
+        ssize_t ret;
+
+        if (out_num < 1) {
+            error_report("virtio-net: transmit buffer has no data");
+            virtqueue_push(q->tx_vq, elem, 0);
+            continue;
+        }
+
+        /* the backend's header is shorter than the guest's, or absent */
+        if (n->host_hdr_len != n->guest_hdr_len) {
+            unsigned int cnt = 0;
+
+            if (n->host_hdr_len) {
+                iov_to_buf(out_sg, out_num, 0, &mhdr, n->host_hdr_len);
+                sg[cnt].iov_base = &mhdr;
+                sg[cnt++].iov_len = n->host_hdr_len;
+            }
+            cnt += virtio_net_iov_skip(sg + cnt, ARRAY_SIZE(sg) - cnt,
+                                       out_sg, out_num, n->guest_hdr_len);
+            out_sg = sg;
+            out_num = cnt;
+        }
+
+        ret = vmx_sendv_packet_async(nc, out_sg, out_num,
+                                     virtio_net_tx_complete);
+        if (ret == 0) {
+            virtio_queue_set_notification(q->tx_vq, 0);
+            q->async_tx = true;
+            return -EBUSY;
+        }
+
+        virtqueue_push(q->tx_vq, elem, 0);
+        virtio_notify(vdev, q->tx_vq);
+
+        if (++num_packets >= n->tx_burst) {
+            break;
+        }
+    }
+    return num_packets;
+}
+
+static void virtio_net_handle_tx(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtIONet *n = container_of(vdev, VirtIONet, vdev);
+    VirtIONetQueue *q = &n->vqs[vq2q(virtio_get_queue_index(vq))];
+
+    if (q->tx_waiting) {
+        return;
+    }
+    q->tx_waiting = 1;
+    if (!(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK)) {
+        return;
+    }
+    /* no more kicks until the bottom half has drained the ring */
+    virtio_queue_set_notification(vq, 0);
+    vmx_bh_schedule(q->tx_bh);
+}
+
+static void virtio_net_tx_bh(void *opaque)
+{
+    VirtIONetQueue *q = opaque;
+    VirtIONet *n = q->n;
+    int32_t ret;
+
+    q->tx_waiting = 0;
+    if (!(n->vdev.status & VIRTIO_CONFIG_S_DRIVER_OK)) {
+        return;
+    }
+
+    ret = virtio_net_flush_tx(q);
+    if (ret == -EBUSY) {
+        return;         /* tx_complete restarts the queue */
+    }
+
+    if (ret >= n->tx_burst) {
+        vmx_bh_schedule(q->tx_bh);
+        q->tx_waiting = 1;
+        return;
+    }
+
+    /* the ring looked empty, take kicks again and catch anything the
+     * guest queued before seeing that */
+    virtio_queue_set_notification(q->tx_vq, 1);
+    if (virtio_net_flush_tx(q) > 0) {
+        virtio_queue_set_notification(q->tx_vq, 0);
+        vmx_bh_schedule(q->tx_bh);
+        q->tx_waiting = 1;
+    }
+}
+
+/* Control */
+
+static uint8_t virtio_net_handle_mq(VirtIONet *n, uint8_t cmd,
+                                    const VirtQueueElement *elem)
+{
+    uint16_t queues;
+
+    if (cmd != VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET ||
+        !(n->vdev.guest_features & (1 << VIRTIO_NET_F_MQ)) ||
+        iov_to_buf(elem->out_sg, elem->out_num,
+                   sizeof(struct virtio_net_ctrl_hdr),
+                   &queues, sizeof(queues)) < sizeof(queues)) {
+        return VIRTIO_NET_ERR;
+    }
+    if (queues < VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN || queues > n->max_queues) {
+        return VIRTIO_NET_ERR;
+    }
+
+    n->curr_queues = queues;
+    virtio_net_set_status(&n->vdev, n->vdev.status);
+    return VIRTIO_NET_OK;
+}
+
+static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtIONet *n = container_of(vdev, VirtIONet, vdev);
+    VirtQueueElement *elem = n->ctrl_elem;
+    struct virtio_net_ctrl_hdr ctrl;
+    uint8_t status;
+
+    while (virtqueue_pop(vq, elem)) {
+        if (iov_size(elem->in_sg, elem->in_num) < sizeof(status) ||
+            iov_to_buf(elem->out_sg, elem->out_num, 0,
+                       &ctrl, sizeof(ctrl)) < sizeof(ctrl)) {
+            error_report("virtio-net: malformed control message");
+            virtqueue_push(vq, elem, 0);
+            virtio_notify(vdev, vq);
+            continue;
+        }
+
+        if (ctrl.class == VIRTIO_NET_CTRL_MQ) {
+            status = virtio_net_handle_mq(n, ctrl.cmd, elem);
+        } else {
+            status = VIRTIO_NET_ERR;
+        }
+
+        iov_from_buf(elem->in_sg, elem->in_num, 0, &status, sizeof(status));
+        virtqueue_push(vq, elem, sizeof(status));
+        virtio_notify(vdev, vq);
+    }
+}
+
+static const VirtIODeviceOps virtio_net_ops = {
+    .get_features = virtio_net_get_features,
+    .set_features = virtio_net_set_features,
+    .get_config = virtio_net_get_config,
+    .set_config = virtio_net_set_config,
+    .set_status = virtio_net_set_status,
+    .reset = virtio_net_reset,
+};
+
+static int virtio_net_post_load(void *opaque, int version_id)
+{
+    VirtIONet *n = opaque;
+    int i;
+
+    if (n->curr_queues < 1 || n->curr_queues > n->max_queues) {
+        return -EINVAL;
+    }
+
+    virtio_net_set_features(&n->vdev, n->vdev.guest_features);
+    vmx_get_queue(n->nic)->link_down = !(n->status & VIRTIO_NET_S_LINK_UP);
+    vmx_format_nic_info_str(vmx_get_queue(n->nic), n->mac);
+
+    /* the guest may have queued packets without a kick we'll see again */
+    for (i = 0; i < n->curr_queues; i++) {
+        n->vqs[i].tx_waiting = 1;
+    }
+    virtio_net_set_status(&n->vdev, n->vdev.status);
+    return 0;
+}
+
+static const VMStateDescription vmstate_virtio_net = {
+    .name = "virtio-net",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = virtio_net_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_PCI_DEVICE(proxy.pci_dev, VirtIONet),
+        VMSTATE_STRUCT(vdev, VirtIONet, 1, vmstate_virtio, VirtIODevice),
+        VMSTATE_BUFFER(mac, VirtIONet),
+        VMSTATE_UINT16(status, VirtIONet),
+        VMSTATE_INT32(curr_queues, VirtIONet),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static NetClientInfo net_virtio_info = {
+    .type = NET_CLIENT_OPTIONS_KIND_NIC,
+    .size = sizeof(NICState),
+    .can_receive = virtio_net_can_receive,
+    .receive = virtio_net_receive,
+    .receive_batch = virtio_net_receive_batch,
+    .link_status_changed = virtio_net_set_link_status,
+};
+
+extern NICInfo *current_nd;
+
+static int virtio_net_pci_init(PCIDevice *dev)
+{
+    VirtIONet *n = VIRTIO_NET(dev);
+    DeviceState *d = DEVICE(dev);
+    NetClientState *nc;
+    int i;
+
+    memcpy(&n->conf.macaddr, &current_nd->macaddr, sizeof(n->conf.macaddr));
+    /* a multiqueue backend registers one client per queue under its name */
+    n->conf.peers.ncs[0] = current_nd->netdev;
+    n->conf.peers.queues = 1;
+    if (current_nd->netdev) {
+        n->conf.peers.queues =
+            vmx_find_net_clients_except(current_nd->netdev->name,
+                                        n->conf.peers.ncs,
+                                        NET_CLIENT_OPTIONS_KIND_NIC,
+                                        VIRTIO_NET_MAX_QUEUES);
+    }
+    vmx_macaddr_default_if_unset(&n->conf.macaddr);
+    memcpy(n->mac, n->conf.macaddr.a, sizeof(n->mac));
+
+    n->max_queues = MAX(1, MIN(n->conf.peers.queues, VIRTIO_NET_MAX_QUEUES));
+    n->curr_queues = 1;
+    n->tx_burst = VIRTIO_NET_TX_BURST;
+    n->status = VIRTIO_NET_S_LINK_UP;
+
+    virtio_init(&n->vdev, "virtio-net", &virtio_net_ops,
+                sizeof(struct virtio_net_config), pci_get_address_space(dev));
+    for (i = 0; i < n->max_queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        q->rx_vq = virtio_add_queue(&n->vdev, VIRTIO_NET_RX_QUEUE_SIZE,
+                                    virtio_net_handle_rx);
+        q->tx_vq = virtio_add_queue(&n->vdev, VIRTIO_NET_TX_QUEUE_SIZE,
+                                    virtio_net_handle_tx);
+        q->tx_bh = vmx_bh_new(virtio_net_tx_bh, q);
+        q->tx_elem = g_new(VirtQueueElement, 1);
+        q->n = n;
+    }
+    n->ctrl_vq = virtio_add_queue(&n->vdev, VIRTIO_NET_CTRL_QUEUE_SIZE,
+                                  virtio_net_handle_ctrl);
+    n->rx_first = g_new(VirtQueueElement, 1);
+    n->rx_elem = g_new(VirtQueueElement, 1);
+    n->ctrl_elem = g_new(VirtQueueElement, 1);
+
+    n->nic = vmx_new_nic(&net_virtio_info, &n->conf,
+                          get_typename(VeertuTypeHold(dev)), d->id, n);
+    nc = vmx_get_queue(n->nic);
+    vmx_format_nic_info_str(nc, n->mac);
+
+    n->has_vnet_hdr = vmx_has_vnet_hdr(nc->peer);
+    if (n->has_vnet_hdr) {
+        for (i = 0; i < n->max_queues; i++) {
+            vmx_using_vnet_hdr(vmx_get_subqueue(n->nic, i)->peer, true);
+        }
+        n->host_hdr_len = sizeof(struct virtio_net_hdr);
+    }
+    n->guest_hdr_len = sizeof(struct virtio_net_hdr);
+
+    /* after the backend is known, the offered features depend on it */
+    virtio_pci_init(&n->proxy, &n->vdev, VIRTIO_ID_NET);
+    return 0;
+}
+
+static void virtio_net_pci_exit(PCIDevice *dev)
+{
+    VirtIONet *n = VIRTIO_NET(dev);
+    int i;
+
+    for (i = 0; i < n->max_queues; i++) {
+        vmx_bh_delete(n->vqs[i].tx_bh);
+    }
+    vmx_del_nic(n->nic);
+    for (i = 0; i < n->max_queues; i++) {
+        g_free(n->vqs[i].tx_elem);
+    }
+    g_free(n->rx_first);
+    g_free(n->rx_elem);
+    g_free(n->ctrl_elem);
+    virtio_pci_exit(&n->proxy);
+}
+
+static void virtio_net_pci_reset(DeviceState *d)
+{
+    VirtIONet *n = VIRTIO_NET(d);
+
+    virtio_reset(&n->vdev);
+}
+
+static void virtio_net_instance_init(VeertuType *obj)
+{
+    VirtIONet *n = VIRTIO_NET(obj);
+
+    device_add_bootindex_property(obj, &n->conf.bootindex,
+                                  "bootindex", "/ethernet-phy@0",
+                                  DEVICE(obj), NULL);
+}
+
+static void virtio_net_class_init(VeertuTypeClassHold *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    PCIDeviceClass *k = PCI_DEVICE_CLASS(klass);
+
+    k->init = virtio_net_pci_init;
+    k->exit = virtio_net_pci_exit;
+    k->vendor_id = PCI_VENDOR_ID_REDHAT_QUMRANET;
+    k->device_id = PCI_DEVICE_ID_VIRTIO_NET;
+    k->revision = 0;
+    k->class_id = PCI_CLASS_NETWORK_ETHERNET;
+    dc->desc = "Virtio network device";
+    dc->reset = virtio_net_pci_reset;
+    dc->vmsd = &vmstate_virtio_net;
+    set_bit(DEVICE_CATEGORY_NETWORK, dc->categories);
+}
+
+static const VeertuTypeInfo virtio_net_info = {
+    .name          = TYPE_VIRTIO_NET,
+    .parent        = TYPE_PCI_DEVICE,
+    .instance_size = sizeof(VirtIONet),
+    .class_init    = virtio_net_class_init,
+    .instance_init = virtio_net_instance_init,
+};
+
+void virtio_net_register_types(void)
+{
+    register_type_internal(&virtio_net_info);
+}
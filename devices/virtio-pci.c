@@ -0,0 +1,196 @@
+/*
+ * Virtio PCI Bindings
+ *
+ * Copyright IBM, Corp. 2007
+ * Copyright (c) 2009 CodeSourcery
+ * Copyright (C) 2016 Veertu Inc,
+ *
+ * Authors:
+ *  Anthony Liguori   <aliguori@us.ibm.com>
+ *  Paul Brook        <paul@codesourcery.com>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include "hw.h"
+#include "virtio-pci.h"
+#include "qemu/bswap.h"
+
+static void virtio_pci_update_irq(void *opaque)
+{
+    VirtIOPCIProxy *proxy = opaque;
+
+    pci_set_irq(&proxy->pci_dev, proxy->vdev->isr & VIRTIO_ISR_QUEUE);
+}
+
+static uint64_t virtio_pci_config_read(VirtIODevice *vdev, hwaddr addr,
+                                       unsigned size)
+{
+    if (addr + size > vdev->config_len) {
+        return (uint32_t)-1;
+    }
+    virtio_update_config(vdev);
+    switch (size) {
+    case 1:
+        return ldub_p(vdev->config + addr);
+    case 2:
+        return lduw_le_p(vdev->config + addr);
+    case 4:
+        return (uint32_t)ldl_le_p(vdev->config + addr);
+    }
+    return (uint32_t)-1;
+}
+
+static void virtio_pci_config_write(VirtIODevice *vdev, hwaddr addr,
+                                    uint64_t val, unsigned size)
+{
+    if (addr + size > vdev->config_len) {
+        return;
+    }
+    virtio_update_config(vdev);
+    switch (size) {
+    case 1:
+        stb_p(vdev->config + addr, val);
+        break;
+    case 2:
+        stw_le_p(vdev->config + addr, val);
+        break;
+    case 4:
+        stl_le_p(vdev->config + addr, val);
+        break;
+    }
+    if (vdev->ops->set_config) {
+        vdev->ops->set_config(vdev, vdev->config);
+    }
+}
+
+static uint64_t virtio_pci_ioport_read(void *opaque, hwaddr addr,
+                                       unsigned size)
+{
+    VirtIOPCIProxy *proxy = opaque;
+    VirtIODevice *vdev = proxy->vdev;
+    uint32_t ret;
+
+    if (addr >= VIRTIO_PCI_CONFIG) {
+        return virtio_pci_config_read(vdev, addr - VIRTIO_PCI_CONFIG, size);
+    }
+
+    switch (addr) {
+    case VIRTIO_PCI_HOST_FEATURES:
+        return vdev->host_features;
+    case VIRTIO_PCI_GUEST_FEATURES:
+        return vdev->guest_features;
+    case VIRTIO_PCI_QUEUE_PFN:
+        return virtio_queue_get_addr(vdev, vdev->queue_sel)
+               >> VIRTIO_PCI_QUEUE_ADDR_SHIFT;
+    case VIRTIO_PCI_QUEUE_NUM:
+        return virtio_queue_get_num(vdev, vdev->queue_sel);
+    case VIRTIO_PCI_QUEUE_SEL:
+        return vdev->queue_sel;
+    case VIRTIO_PCI_STATUS:
+        return vdev->status;
+    case VIRTIO_PCI_ISR:
+        /* reading the ISR acknowledges the interrupt */
+        ret = vdev->isr;
+        vdev->isr = 0;
+        pci_set_irq(&proxy->pci_dev, 0);
+        return ret;
+    }
+    return (uint32_t)-1;
+}
+
+static void virtio_pci_ioport_write(void *opaque, hwaddr addr, uint64_t val,
+                                    unsigned size)
+{
+    VirtIOPCIProxy *proxy = opaque;
+    VirtIODevice *vdev = proxy->vdev;
+
+    if (addr >= VIRTIO_PCI_CONFIG) {
+        virtio_pci_config_write(vdev, addr - VIRTIO_PCI_CONFIG, val, size);
+        return;
+    }
+
+    switch (addr) {
+    case VIRTIO_PCI_GUEST_FEATURES:
+        /* the bad feature bit is a sign of a driver that acks everything */
+        if (val & (1 << VIRTIO_F_BAD_FEATURE)) {
+            val = 0;
+        }
+        virtio_set_features(vdev, val);
+        break;
+    case VIRTIO_PCI_QUEUE_PFN:
+        if (val == 0) {
+            virtio_reset(vdev);
+        } else {
+            virtio_queue_set_addr(vdev, vdev->queue_sel,
+                                  (hwaddr)val << VIRTIO_PCI_QUEUE_ADDR_SHIFT);
+        }
+        break;
+    case VIRTIO_PCI_QUEUE_SEL:
+        if (val < VIRTIO_QUEUE_MAX) {
+            vdev->queue_sel = val;
+        }
+        break;
+    case VIRTIO_PCI_QUEUE_NOTIFY:
+        virtio_queue_notify(vdev, val);
+        break;
+    case VIRTIO_PCI_STATUS:
+        if (val == 0) {
+            virtio_reset(vdev);
+        } else {
+            virtio_set_status(vdev, val);
+        }
+        break;
+    }
+}
+
+static const MemAreaOps virtio_pci_io_ops = {
+    .read = virtio_pci_ioport_read,
+    .write = virtio_pci_ioport_write,
+    .impl = {
+        .min_access_size = 1,
+        .max_access_size = 4,
+    },
+    .endianness = DEVICE_LITTLE_ENDIAN,
+};
+
+void virtio_pci_init(VirtIOPCIProxy *proxy, VirtIODevice *vdev,
+                     uint16_t subsystem_id)
+{
+    uint8_t *config = proxy->pci_dev.config;
+    uint32_t size = 1;
+
+    proxy->vdev = vdev;
+    vdev->update_irq = virtio_pci_update_irq;
+    vdev->transport = proxy;
+
+    /* the transport features are handled by the ring code for every device */
+    vdev->host_features |= (1 << VIRTIO_F_NOTIFY_ON_EMPTY) |
+                           (1 << VIRTIO_RING_F_INDIRECT_DESC) |
+                           (1 << VIRTIO_RING_F_EVENT_IDX);
+    if (vdev->ops->get_features) {
+        vdev->host_features = vdev->ops->get_features(vdev,
+                                                      vdev->host_features);
+    }
+
+    pci_set_word(config + PCI_SUBSYSTEM_VENDOR_ID,
+                 PCI_VENDOR_ID_REDHAT_QUMRANET);
+    pci_set_word(config + PCI_SUBSYSTEM_ID, subsystem_id);
+    config[PCI_INTERRUPT_PIN] = 1;      /* interrupt pin A */
+
+    /* I/O BARs must be a power of two */
+    while (size < VIRTIO_PCI_CONFIG + vdev->config_len) {
+        size <<= 1;
+    }
+    memory_area_init_io(&proxy->bar, VeertuTypeHold(proxy), &virtio_pci_io_ops,
+                        proxy, "virtio-pci", size);
+    pci_register_bar(&proxy->pci_dev, 0, PCI_BASE_ADDRESS_SPACE_IO,
+                     &proxy->bar);
+}
+
+void virtio_pci_exit(VirtIOPCIProxy *proxy)
+{
+    virtio_cleanup(proxy->vdev);
+}
@@ -0,0 +1,732 @@
+/*
+ * Virtio Support
+ *
+ * Copyright IBM, Corp. 2007
+ * Copyright (C) 2016 Veertu Inc,
+ *
+ * Authors:
+ *  Anthony Liguori   <aliguori@us.ibm.com>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include "virtio.h"
+#include "qemu/atomic.h"
+#include "qemu/error-report.h"
+
+/*
+ * The legacy ring of a queue is one contiguous block of guest RAM.  It is
+ * mapped once when the guest sets its address and accessed through host
+ * pointers from then on, only the buffers are mapped per request.
+ */
+struct VirtQueue {
+    VirtIODevice *vdev;
+    unsigned int num;           /* ring size set by the device, 0 = unused */
+    hwaddr pa;                  /* guest address of the ring, 0 = not set */
+
+    /* host mapping of the ring */
+    void *ring;
+    uint64_t ring_len;
+    VRingDesc *desc;
+    VRingAvail *avail;
+    VRingUsed *used;
+
+    uint16_t last_avail_idx;
+
+    /* last used index the guest was interrupted for, see virtio_notify */
+    uint16_t signalled_used;
+    bool signalled_used_valid;
+
+    unsigned int inuse;         /* popped but not yet pushed */
+    VirtIOHandleOutput *handle_output;
+};
+
+void virtio_error(VirtIODevice *vdev, const char *msg)
+{
+    if (!vdev->broken) {
+        error_report("%s: %s", vdev->name, msg);
+    }
+    vdev->broken = true;
+}
+
+static void virtio_update_irq(VirtIODevice *vdev)
+{
+    if (vdev->update_irq) {
+        vdev->update_irq(vdev->transport);
+    }
+}
+
+/* Ring accessors, the guest updates the avail side concurrently */
+
+static inline uint16_t vring_avail_flags(VirtQueue *vq)
+{
+    return *(volatile uint16_t *)&vq->avail->flags;
+}
+
+static inline uint16_t vring_avail_idx(VirtQueue *vq)
+{
+    return *(volatile uint16_t *)&vq->avail->idx;
+}
+
+static inline uint16_t vring_avail_ring(VirtQueue *vq, unsigned int i)
+{
+    return *(volatile uint16_t *)&vq->avail->ring[i % vq->num];
+}
+
+static inline uint16_t vring_used_event(VirtQueue *vq)
+{
+    return *(volatile uint16_t *)&vq->avail->ring[vq->num];
+}
+
+static inline void vring_set_avail_event(VirtQueue *vq, uint16_t val)
+{
+    *(volatile uint16_t *)&vq->used->ring[vq->num] = val;
+}
+
+/* True if the used index moving from old to new crossed the event index */
+static inline bool vring_need_event(uint16_t event, uint16_t new, uint16_t old)
+{
+    return (uint16_t)(new - event - 1) < (uint16_t)(new - old);
+}
+
+static void virtqueue_unmap_ring(VirtQueue *vq)
+{
+    if (vq->ring) {
+        address_space_unmap(vq->vdev->dma_as, vq->ring, vq->ring_len, 1,
+                            vq->ring_len);
+    }
+    vq->ring = NULL;
+    vq->desc = NULL;
+    vq->avail = NULL;
+    vq->used = NULL;
+}
+
+static void virtqueue_map_ring(VirtQueue *vq)
+{
+    VirtIODevice *vdev = vq->vdev;
+    uint64_t avail_off, used_off, size, len;
+
+    virtqueue_unmap_ring(vq);
+    if (!vq->pa || !vq->num) {
+        return;
+    }
+
+    /* descriptors, then avail ring and used_event, then the used ring
+     * and avail_event on the next aligned boundary */
+    avail_off = vq->num * sizeof(VRingDesc);
+    used_off = QEMU_ALIGN_UP(avail_off + sizeof(VRingAvail) +
+                             (vq->num + 1) * sizeof(uint16_t),
+                             VIRTIO_PCI_VRING_ALIGN);
+    size = used_off + sizeof(VRingUsed) + vq->num * sizeof(VRingUsedElem) +
+           sizeof(uint16_t);
+
+    len = size;
+    vq->ring = address_space_map(vdev->dma_as, vq->pa, &len, true);
+    if (!vq->ring || len < size) {
+        if (vq->ring) {
+            address_space_unmap(vdev->dma_as, vq->ring, len, 1, 0);
+            vq->ring = NULL;
+        }
+        virtio_error(vdev, "virtqueue ring is not in RAM");
+        return;
+    }
+    vq->ring_len = size;
+    vq->desc = vq->ring;
+    vq->avail = vq->ring + avail_off;
+    vq->used = vq->ring + used_off;
+}
+
+void virtio_init(VirtIODevice *vdev, const char *name,
+                 const VirtIODeviceOps *ops, size_t config_len,
+                 VeertuAddressSpace *dma_as)
+{
+    int i;
+
+    vdev->name = name;
+    vdev->ops = ops;
+    vdev->status = 0;
+    vdev->isr = 0;
+    vdev->queue_sel = 0;
+    vdev->host_features = 0;
+    vdev->guest_features = 0;
+    vdev->broken = false;
+    vdev->dma_as = dma_as;
+    vdev->nvqs = 0;
+    vdev->vq = g_new0(VirtQueue, VIRTIO_QUEUE_MAX);
+    for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+        vdev->vq[i].vdev = vdev;
+    }
+    vdev->config_len = config_len;
+    vdev->config = config_len ? g_malloc0(config_len) : NULL;
+}
+
+void virtio_cleanup(VirtIODevice *vdev)
+{
+    int i;
+
+    for (i = 0; i < vdev->nvqs; i++) {
+        virtqueue_unmap_ring(&vdev->vq[i]);
+    }
+    g_free(vdev->vq);
+    vdev->vq = NULL;
+    g_free(vdev->config);
+    vdev->config = NULL;
+}
+
+void virtio_set_status(VirtIODevice *vdev, uint8_t status)
+{
+    vdev->status = status;
+    if (vdev->ops->set_status) {
+        vdev->ops->set_status(vdev, status);
+    }
+}
+
+void virtio_reset(VirtIODevice *vdev)
+{
+    int i;
+
+    virtio_set_status(vdev, 0);
+    if (vdev->ops->reset) {
+        vdev->ops->reset(vdev);
+    }
+
+    vdev->guest_features = 0;
+    vdev->queue_sel = 0;
+    vdev->isr = 0;
+    vdev->broken = false;
+    virtio_update_irq(vdev);
+
+    for (i = 0; i < vdev->nvqs; i++) {
+        VirtQueue *vq = &vdev->vq[i];
+
+        virtqueue_unmap_ring(vq);
+        vq->pa = 0;
+        vq->last_avail_idx = 0;
+        vq->signalled_used = 0;
+        vq->signalled_used_valid = false;
+        vq->inuse = 0;
+    }
+}
+
+/* Returns -1 if the guest acked features that weren't offered */
+int virtio_set_features(VirtIODevice *vdev, uint32_t features)
+{
+    uint32_t bad = features & ~vdev->host_features;
+
+    features &= vdev->host_features;
+    vdev->guest_features = features;
+    if (vdev->ops->set_features) {
+        vdev->ops->set_features(vdev, features);
+    }
+    return bad ? -1 : 0;
+}
+
+void virtio_update_config(VirtIODevice *vdev)
+{
+    if (vdev->ops->get_config) {
+        vdev->ops->get_config(vdev, vdev->config);
+    }
+}
+
+VirtQueue *virtio_add_queue(VirtIODevice *vdev, int queue_size,
+                            VirtIOHandleOutput *handle_output)
+{
+    VirtQueue *vq;
+
+    assert(vdev->nvqs < VIRTIO_QUEUE_MAX);
+    assert(queue_size > 0 && queue_size <= VIRTQUEUE_MAX_SIZE);
+
+    vq = &vdev->vq[vdev->nvqs++];
+    vq->num = queue_size;
+    vq->handle_output = handle_output;
+    return vq;
+}
+
+int virtio_get_queue_index(VirtQueue *vq)
+{
+    return vq - vq->vdev->vq;
+}
+
+VirtQueue *virtio_get_queue(VirtIODevice *vdev, int n)
+{
+    return &vdev->vq[n];
+}
+
+void virtio_queue_set_addr(VirtIODevice *vdev, int n, hwaddr addr)
+{
+    VirtQueue *vq;
+
+    if (n >= vdev->nvqs) {
+        return;
+    }
+    vq = &vdev->vq[n];
+    vq->pa = addr;
+    vq->last_avail_idx = 0;
+    vq->signalled_used_valid = false;
+    vq->inuse = 0;
+    virtqueue_map_ring(vq);
+}
+
+hwaddr virtio_queue_get_addr(VirtIODevice *vdev, int n)
+{
+    return n < vdev->nvqs ? vdev->vq[n].pa : 0;
+}
+
+int virtio_queue_get_num(VirtIODevice *vdev, int n)
+{
+    return n < vdev->nvqs ? vdev->vq[n].num : 0;
+}
+
+void virtio_queue_notify(VirtIODevice *vdev, int n)
+{
+    VirtQueue *vq;
+
+    if (n >= vdev->nvqs || vdev->broken) {
+        return;
+    }
+    vq = &vdev->vq[n];
+    if (vq->avail && vq->handle_output) {
+        vq->handle_output(vdev, vq);
+    }
+}
+
+int virtio_queue_ready(VirtQueue *vq)
+{
+    return vq->avail != NULL;
+}
+
+int virtio_queue_empty(VirtQueue *vq)
+{
+    return !vq->avail || vring_avail_idx(vq) == vq->last_avail_idx;
+}
+
+void virtio_queue_set_notification(VirtQueue *vq, int enable)
+{
+    if (!vq->used) {
+        return;
+    }
+    if (vq->vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX)) {
+        /* ask for a kick once the guest moves past what we've seen */
+        if (enable) {
+            vring_set_avail_event(vq, vring_avail_idx(vq));
+        }
+    } else if (enable) {
+        vq->used->flags &= ~VRING_USED_F_NO_NOTIFY;
+    } else {
+        vq->used->flags |= VRING_USED_F_NO_NOTIFY;
+    }
+    if (enable) {
+        /* expose the flag before the caller checks the ring again */
+        smp_mb();
+    }
+}
+
+static int virtqueue_num_heads(VirtQueue *vq, unsigned int idx)
+{
+    uint16_t num_heads = vring_avail_idx(vq) - idx;
+
+    if (num_heads > vq->num) {
+        virtio_error(vq->vdev, "guest moved the avail index too far");
+        return 0;
+    }
+    if (num_heads) {
+        /* read the ring entries only after the index */
+        smp_rmb();
+    }
+    return num_heads;
+}
+
+/* Maps an indirect descriptor table for reading */
+static VRingDesc *virtqueue_map_indirect(VirtIODevice *vdev,
+                                         const VRingDesc *d, uint64_t *len)
+{
+    VRingDesc *table;
+
+    if (!d->len || d->len % sizeof(VRingDesc) ||
+        d->len / sizeof(VRingDesc) > VIRTQUEUE_MAX_SIZE) {
+        virtio_error(vdev, "invalid indirect descriptor table size");
+        return NULL;
+    }
+    *len = d->len;
+    table = address_space_map(vdev->dma_as, d->addr, len, false);
+    if (!table || *len < d->len) {
+        if (table) {
+            address_space_unmap(vdev->dma_as, table, *len, 0, 0);
+        }
+        virtio_error(vdev, "indirect descriptor table is not in RAM");
+        return NULL;
+    }
+    return table;
+}
+
+static void virtqueue_unmap_indirect(VirtIODevice *vdev, VRingDesc *table,
+                                     uint64_t len)
+{
+    address_space_unmap(vdev->dma_as, table, len, 0, len);
+}
+
+int virtqueue_avail_bytes(VirtQueue *vq, unsigned int in_bytes,
+                          unsigned int out_bytes)
+{
+    VirtIODevice *vdev = vq->vdev;
+    unsigned int idx = vq->last_avail_idx;
+    unsigned int in_total = 0, out_total = 0;
+    int num_heads;
+
+    if (!vq->avail || vdev->broken) {
+        return 0;
+    }
+
+    num_heads = virtqueue_num_heads(vq, idx);
+    while (num_heads--) {
+        VRingDesc *table = vq->desc, d;
+        unsigned int max = vq->num, i, seen = 0;
+        uint64_t table_len = 0;
+        bool enough = false;
+
+        i = vring_avail_ring(vq, idx++);
+        if (i >= max) {
+            virtio_error(vdev, "invalid head descriptor");
+            return 0;
+        }
+        d = table[i];
+        if (d.flags & VRING_DESC_F_INDIRECT) {
+            table = virtqueue_map_indirect(vdev, &d, &table_len);
+            if (!table) {
+                return 0;
+            }
+            max = d.len / sizeof(VRingDesc);
+            d = table[0];
+        }
+
+        for (;;) {
+            if (++seen > max) {
+                virtio_error(vdev, "looped descriptor chain");
+                break;
+            }
+            if (d.flags & VRING_DESC_F_WRITE) {
+                in_total += d.len;
+            } else {
+                out_total += d.len;
+            }
+            if (in_total >= in_bytes && out_total >= out_bytes) {
+                enough = true;
+                break;
+            }
+            if (!(d.flags & VRING_DESC_F_NEXT)) {
+                break;
+            }
+            if (d.next >= max) {
+                virtio_error(vdev, "invalid next descriptor");
+                break;
+            }
+            d = table[d.next];
+        }
+
+        if (table != vq->desc) {
+            virtqueue_unmap_indirect(vdev, table, table_len);
+        }
+        if (enough) {
+            return 1;
+        }
+        if (vdev->broken) {
+            return 0;
+        }
+    }
+    return 0;
+}
+
+static bool virtqueue_map_desc(VirtIODevice *vdev, unsigned int *p_num_sg,
+                               hwaddr *addr, struct iovec *iov,
+                               bool is_write, hwaddr pa, uint32_t sz)
+{
+    unsigned int num_sg = *p_num_sg;
+
+    /* a buffer that spans memory regions takes several entries */
+    while (sz) {
+        uint64_t len = sz;
+
+        if (num_sg == VIRTQUEUE_MAX_SIZE) {
+            virtio_error(vdev, "too many buffers in descriptor chain");
+            return false;
+        }
+        iov[num_sg].iov_base = address_space_map(vdev->dma_as, pa, &len,
+                                                 is_write);
+        if (!iov[num_sg].iov_base || !len) {
+            virtio_error(vdev, "invalid buffer address");
+            return false;
+        }
+        iov[num_sg].iov_len = len;
+        addr[num_sg] = pa;
+        num_sg++;
+        *p_num_sg = num_sg;
+
+        sz -= len;
+        pa += len;
+    }
+    return true;
+}
+
+/* Releases the buffers of elem, len bytes of them written by the device */
+static void virtqueue_unmap_sg(VirtIODevice *vdev, const VirtQueueElement *elem,
+                               unsigned int len)
+{
+    unsigned int offset = 0, i;
+
+    for (i = 0; i < elem->in_num; i++) {
+        size_t size = MIN(len - offset, elem->in_sg[i].iov_len);
+
+        address_space_unmap(vdev->dma_as, elem->in_sg[i].iov_base,
+                            elem->in_sg[i].iov_len, 1, size);
+        offset += size;
+    }
+    for (i = 0; i < elem->out_num; i++) {
+        address_space_unmap(vdev->dma_as, elem->out_sg[i].iov_base,
+                            elem->out_sg[i].iov_len, 0,
+                            elem->out_sg[i].iov_len);
+    }
+}
+
+int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
+{
+    VirtIODevice *vdev = vq->vdev;
+    VRingDesc *table = vq->desc, d;
+    unsigned int max = vq->num, i, seen = 0;
+    uint64_t table_len = 0;
+    bool ok = true;
+
+    if (!vq->avail || vdev->broken ||
+        !virtqueue_num_heads(vq, vq->last_avail_idx)) {
+        return 0;
+    }
+
+    i = vring_avail_ring(vq, vq->last_avail_idx);
+    if (i >= max) {
+        virtio_error(vdev, "invalid head descriptor");
+        return 0;
+    }
+    vq->last_avail_idx++;
+    if (vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX)) {
+        vring_set_avail_event(vq, vq->last_avail_idx);
+    }
+
+    elem->index = i;
+    elem->in_num = 0;
+    elem->out_num = 0;
+
+    d = table[i];
+    if (d.flags & VRING_DESC_F_INDIRECT) {
+        table = virtqueue_map_indirect(vdev, &d, &table_len);
+        if (!table) {
+            return 0;
+        }
+        max = d.len / sizeof(VRingDesc);
+        d = table[0];
+    }
+
+    for (;;) {
+        if (++seen > max) {
+            virtio_error(vdev, "looped descriptor chain");
+            ok = false;
+            break;
+        }
+        if (table != vq->desc && (d.flags & VRING_DESC_F_INDIRECT)) {
+            virtio_error(vdev, "nested indirect descriptor table");
+            ok = false;
+            break;
+        }
+
+        if (d.flags & VRING_DESC_F_WRITE) {
+            ok = virtqueue_map_desc(vdev, &elem->in_num, elem->in_addr,
+                                    elem->in_sg, true, d.addr, d.len);
+        } else if (elem->in_num) {
+            virtio_error(vdev, "device-readable buffer after writable one");
+            ok = false;
+        } else {
+            ok = virtqueue_map_desc(vdev, &elem->out_num, elem->out_addr,
+                                    elem->out_sg, false, d.addr, d.len);
+        }
+        if (!ok || !(d.flags & VRING_DESC_F_NEXT)) {
+            break;
+        }
+        if (d.next >= max) {
+            virtio_error(vdev, "invalid next descriptor");
+            ok = false;
+            break;
+        }
+        d = table[d.next];
+    }
+
+    if (table != vq->desc) {
+        virtqueue_unmap_indirect(vdev, table, table_len);
+    }
+    if (!ok) {
+        virtqueue_unmap_sg(vdev, elem, 0);
+        return 0;
+    }
+
+    vq->inuse++;
+    return elem->in_num + elem->out_num;
+}
+
+/* Gives elem back to the avail ring as if it was never popped */
+void virtqueue_discard(VirtQueue *vq, const VirtQueueElement *elem,
+                       unsigned int len)
+{
+    virtqueue_unmap_sg(vq->vdev, elem, len);
+    vq->last_avail_idx--;
+    vq->inuse--;
+}
+
+/* Takes back the last num elements popped, after they were unmapped */
+void virtqueue_rewind(VirtQueue *vq, unsigned int num)
+{
+    assert(num <= vq->inuse);
+    vq->last_avail_idx -= num;
+    vq->inuse -= num;
+}
+
+void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
+                    unsigned int len, unsigned int idx)
+{
+    VRingUsedElem *uelem;
+
+    virtqueue_unmap_sg(vq->vdev, elem, len);
+    if (!vq->used) {
+        return;
+    }
+
+    uelem = &vq->used->ring[(vq->used->idx + idx) % vq->num];
+    uelem->id = elem->index;
+    uelem->len = len;
+}
+
+void virtqueue_flush(VirtQueue *vq, unsigned int count)
+{
+    uint16_t old, new;
+
+    vq->inuse -= count;
+    if (!vq->used) {
+        return;
+    }
+
+    /* the guest must see the used entries before the index */
+    smp_wmb();
+    old = vq->used->idx;
+    new = old + count;
+    *(volatile uint16_t *)&vq->used->idx = new;
+
+    /* an event index the guest asked for may have been skipped over */
+    if ((int16_t)(new - vq->signalled_used) < (uint16_t)(new - old)) {
+        vq->signalled_used_valid = false;
+    }
+}
+
+void virtqueue_push(VirtQueue *vq, const VirtQueueElement *elem,
+                    unsigned int len)
+{
+    virtqueue_fill(vq, elem, len, 0);
+    virtqueue_flush(vq, 1);
+}
+
+static bool virtio_should_notify(VirtIODevice *vdev, VirtQueue *vq)
+{
+    uint16_t old, new;
+    bool valid;
+
+    if (!vq->used) {
+        return false;
+    }
+
+    /* the used index must be visible before we read the guest's flags */
+    smp_mb();
+
+    if ((vdev->guest_features & (1 << VIRTIO_F_NOTIFY_ON_EMPTY)) &&
+        !vq->inuse && virtio_queue_empty(vq)) {
+        return true;
+    }
+
+    if (!(vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX))) {
+        return !(vring_avail_flags(vq) & VRING_AVAIL_F_NO_INTERRUPT);
+    }
+
+    valid = vq->signalled_used_valid;
+    vq->signalled_used_valid = true;
+    old = vq->signalled_used;
+    new = vq->signalled_used = vq->used->idx;
+    return !valid || vring_need_event(vring_used_event(vq), new, old);
+}
+
+void virtio_notify(VirtIODevice *vdev, VirtQueue *vq)
+{
+    if (!virtio_should_notify(vdev, vq)) {
+        return;
+    }
+    vdev->isr |= VIRTIO_ISR_QUEUE;
+    virtio_update_irq(vdev);
+}
+
+void virtio_notify_config(VirtIODevice *vdev)
+{
+    if (!(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK)) {
+        return;
+    }
+    /* legacy drivers only look at the config bit once the line is up */
+    vdev->isr |= VIRTIO_ISR_CONFIG | VIRTIO_ISR_QUEUE;
+    virtio_update_irq(vdev);
+}
+
+static int virtio_post_load(void *opaque, int version_id)
+{
+    VirtIODevice *vdev = opaque;
+    int i;
+
+    vdev->broken = false;
+    for (i = 0; i < vdev->nvqs; i++) {
+        VirtQueue *vq = &vdev->vq[i];
+
+        vq->signalled_used_valid = false;
+        vq->inuse = 0;
+        virtqueue_map_ring(vq);
+        if (vq->pa && !vq->used) {
+            return -EINVAL;
+        }
+        if (vq->used &&
+            (uint16_t)(vring_avail_idx(vq) - vq->last_avail_idx) > vq->num) {
+            error_report("%s: queue %d has an inconsistent avail index",
+                         vdev->name, i);
+            return -EINVAL;
+        }
+    }
+    virtio_update_config(vdev);
+    return 0;
+}
+
+static const VMStateDescription vmstate_virtqueue = {
+    .name = "virtqueue",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT64(pa, VirtQueue),
+        VMSTATE_UINT16(last_avail_idx, VirtQueue),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+const VMStateDescription vmstate_virtio = {
+    .name = "virtio",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = virtio_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT8(status, VirtIODevice),
+        VMSTATE_UINT8(isr, VirtIODevice),
+        VMSTATE_UINT16(queue_sel, VirtIODevice),
+        VMSTATE_UINT32(guest_features, VirtIODevice),
+        VMSTATE_STRUCT_VARRAY_POINTER_INT32(vq, VirtIODevice, nvqs,
+                                            vmstate_virtqueue, VirtQueue),
+        VMSTATE_END_OF_LIST()
+    }
+};
@@ -13,6 +13,7 @@
 #include "ps2.h"
 #include "vmlibrary_ops.h"
 #include "cocoa_util.h"
+#include "qemu/main-loop.h"
 //#include "vmm/vmx.h"
 
 // TODO - REFACTOR: We courrently define these constants but use hard-coded numbers in code...
@@ -79,6 +80,10 @@ typedef struct VmxPortState
     
     //VmxPortReadFunc *func[VMXPORT_ENTRIES];
     void *opaque[VMXPORT_ENTRIES];
+
+    /* serializes the fs helper, which is dispatched without the iothread
+       lock; taken before the iothread lock */
+    QemuMutex fs_lock;
 } VmxPortState;
 
 VmxPortState *tmp_state;
@@ -1408,47 +1413,86 @@ static uint32_t vmx_fs_ret_stat(VmxPortState *s, struct CPUState *cpu, int size)
 DECLARE_TLS(CPUState *, current_cpu);
 #define current_cpu tls_var(current_cpu)
 
+/* The fs helper blocks on host file I/O and must not hold up the iothread
+ * lock; a caller that holds it gives it up for the duration.
+ */
+static bool vmx_port_fs_lock(VmxPortState *s)
+{
+    bool relock = vmx_mutex_iothread_locked();
+
+    if (relock)
+        vmx_mutex_unlock_iothread();
+    vmx_mutex_lock(&s->fs_lock);
+    return relock;
+}
+
+static void vmx_port_fs_unlock(VmxPortState *s, bool relock)
+{
+    vmx_mutex_unlock(&s->fs_lock);
+    if (relock)
+        vmx_mutex_lock_iothread();
+}
+
 static uint32_t vmx_port_ioport_read(void *opaque, hwaddr addr, unsigned size)
 {
     VmxPortState *s = opaque;
     CPUState *cs = current_cpu;
-    
-    if (addr == 1)
-        return vmx_guest_helper_ret_stat(s, cs, size);
-    
-    if (addr == 2) {
-        uint32_t v = vmx_guest_helper_mouse_read(s, cs, size);
-        return v;
+    bool release_lock = false;
+    uint32_t ret = 0;
+
+    switch (addr) {
+    case 1:
+    case 2:
+        /* the guest helper and mouse ports talk to the ui and input layers */
+        if (!vmx_mutex_iothread_locked()) {
+            vmx_mutex_lock_iothread();
+            release_lock = true;
+        }
+        if (addr == 1)
+            ret = vmx_guest_helper_ret_stat(s, cs, size);
+        else
+            ret = vmx_guest_helper_mouse_read(s, cs, size);
+        if (release_lock)
+            vmx_mutex_unlock_iothread();
+        break;
+    case 3:
+        release_lock = vmx_port_fs_lock(s);
+        ret = vmx_fs_ret_stat(s, cs, size);
+        vmx_port_fs_unlock(s, release_lock);
+        break;
     }
-    
-    if (addr == 3)
-        return vmx_fs_ret_stat(s, cs, size);
 
-    return 0;
+    return ret;
 }
 
 static void vmx_port_ioport_write(void *opaque, hwaddr addr, uint64_t val, unsigned size)
 {
     VmxPortState *s = opaque;
     CPUState *cs = current_cpu;
+    bool release_lock = false;
 
-    if (addr == 0) {
+    switch (addr) {
+    case 0:
         macvm_debug_port(val, size);
-        return;
-    }
-    
-    if (addr == 1) {
-        vmx_guest_helper(s, cs, val, size);
-        return;
-    }
-    
-    if (addr == 2) {
-        vmx_guest_helper_mouse_write(s, cs, val, size);
-        return;
-    }
-    
-    if (addr == 3) {
+        break;
+    case 1:
+    case 2:
+        if (!vmx_mutex_iothread_locked()) {
+            vmx_mutex_lock_iothread();
+            release_lock = true;
+        }
+        if (addr == 1)
+            vmx_guest_helper(s, cs, val, size);
+        else
+            vmx_guest_helper_mouse_write(s, cs, val, size);
+        if (release_lock)
+            vmx_mutex_unlock_iothread();
+        break;
+    case 3:
+        release_lock = vmx_port_fs_lock(s);
         vmx_fs_helper(s, cs, val, size);
+        vmx_port_fs_unlock(s, release_lock);
+        break;
     }
 }
 
@@ -1543,7 +1587,9 @@ static void vmx_port_realizefn(DeviceState *dev, Error **errp)
     ISADevice *isadev = ISA_DEVICE(dev);
     VmxPortState *s = VMPORT(dev);
 
+    vmx_mutex_init(&s->fs_lock);
     memory_area_init_io(&s->io, VeertuTypeHold(s), &vmx_port_ops, s, "vmx_port", 6);
+    mem_area_clear_global_locking(&s->io);
     isa_register_ioport(isadev, &s->io, VMX_DEBUG_PORT);
     
     vmx_port = s;
@@ -27,6 +27,16 @@
 
 @synthesize exportFormat = _exportFormat;
 
+- (void) awakeFromNib
+{
+    [super awakeFromNib];
+
+    /* The nib lists the native and Vagrant formats; the menu index is the
+     * VMExportFormat, so the compressed export goes right after them */
+    if ([self.exportMenu numberOfItems] == ExportFormatCompressedVmz)
+        [self.exportMenu addItemWithTitle: @"Veertu VM, compressed disks"];
+}
+
 - (void)drawRect:(NSRect)dirtyRect {
     [super drawRect:dirtyRect];
     
@@ -49,7 +59,8 @@
     NSString *trimmedNameFieldString = [nameFieldString stringByDeletingPathExtension];
     NSString *ext = @"box";
 
-    if ([self exportFormat] == ExportFormatNativeVmz)
+    if ([self exportFormat] == ExportFormatNativeVmz ||
+        [self exportFormat] == ExportFormatCompressedVmz)
         ext = @"vmx";
 
     NSString *nameFieldStringWithExt = [NSString stringWithFormat:@"%@.%@", trimmedNameFieldString, ext];
@@ -25,6 +25,7 @@
 #define BLOCK_ACCOUNTING_H
 
 #include <stdint.h>
+#include <stdbool.h>
 
 #include "qemu/typedefs.h"
 
@@ -35,11 +36,53 @@ enum BlockAcctType {
     BLOCK_MAX_IOTYPE,
 };
 
+/* Latency histogram bins: bin 0 counts requests faster than 1024 ns, bin n
+ * those in [1024 << (n - 1), 1024 << n) ns and the last bin everything
+ * slower, about 4 s and up. */
+#define BLOCK_LATENCY_BINS 24
+
+/* Windows of the interval stats, see block_acct_set_intervals() */
+enum BlockAcctInterval {
+    BLOCK_ACCT_INTERVAL_1S,
+    BLOCK_ACCT_INTERVAL_60S,
+    BLOCK_ACCT_INTERVAL_MAX,
+};
+
+typedef struct BlockAcctWindow {
+    int64_t start_ns;
+    int64_t end_ns;             /* 0 while the window is open */
+    uint64_t nr_ops[BLOCK_MAX_IOTYPE];
+    uint64_t total_time_ns[BLOCK_MAX_IOTYPE];
+    uint64_t min_time_ns[BLOCK_MAX_IOTYPE];
+    uint64_t max_time_ns[BLOCK_MAX_IOTYPE];
+    uint64_t queue_depth_ns[BLOCK_MAX_IOTYPE]; /* in-flight requests x ns */
+} BlockAcctWindow;
+
+typedef struct BlockAcctTimedStats {
+    int64_t interval_ns;
+    BlockAcctWindow current;
+    BlockAcctWindow last;       /* the last complete interval */
+} BlockAcctTimedStats;
+
 typedef struct BlockAcctStats {
     uint64_t nr_bytes[BLOCK_MAX_IOTYPE];
     uint64_t nr_ops[BLOCK_MAX_IOTYPE];
     uint64_t total_time_ns[BLOCK_MAX_IOTYPE];
+    uint64_t failed_ops[BLOCK_MAX_IOTYPE];
+    uint64_t invalid_ops[BLOCK_MAX_IOTYPE];
+    uint64_t nr_throttled[BLOCK_MAX_IOTYPE];
+    uint64_t throttled_time_ns[BLOCK_MAX_IOTYPE];
+    uint64_t latency_histogram[BLOCK_MAX_IOTYPE][BLOCK_LATENCY_BINS];
     uint64_t wr_highest_sector;
+
+    /* requests between bdrv_co_do_* entry and completion */
+    unsigned int in_flight[BLOCK_MAX_IOTYPE];
+    unsigned int max_in_flight[BLOCK_MAX_IOTYPE];
+
+    /* interval stats, only kept up to date while enabled */
+    bool intervals_enabled;
+    int64_t in_flight_changed_ns;
+    BlockAcctTimedStats timed_stats[BLOCK_ACCT_INTERVAL_MAX];
 } BlockAcctStats;
 
 typedef struct BlockAcctCookie {
@@ -51,7 +94,19 @@ typedef struct BlockAcctCookie {
 void block_acct_start(BlockAcctStats *stats, BlockAcctCookie *cookie,
                       int64_t bytes, enum BlockAcctType type);
 void block_acct_done(BlockAcctStats *stats, BlockAcctCookie *cookie);
+void block_acct_failed(BlockAcctStats *stats, BlockAcctCookie *cookie);
+void block_acct_invalid(BlockAcctStats *stats, enum BlockAcctType type);
+void block_acct_throttled(BlockAcctStats *stats, enum BlockAcctType type,
+                          int64_t throttled_ns);
 void block_acct_highest_sector(BlockAcctStats *stats, int64_t sector_num,
                                unsigned int nb_sectors);
 
+void block_acct_request_begin(BlockAcctStats *stats, enum BlockAcctType type);
+void block_acct_request_end(BlockAcctStats *stats, enum BlockAcctType type);
+
+void block_acct_set_intervals(BlockAcctStats *stats, bool enable);
+int64_t block_acct_latency_bin_start(int bin);
+BlockAcctWindow *block_acct_last_window(BlockAcctStats *stats,
+                                        enum BlockAcctInterval interval);
+
 #endif
@@ -39,6 +39,18 @@ typedef struct BlockDriverInfo {
      * True if this block driver only supports compressed writes
      */
     bool needs_compressed_writes;
+    /*
+     * Metadata cache statistics, 0 if the driver has no such cache
+     */
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    uint64_t cache_evictions;
+    /*
+     * Decompressed cluster cache statistics, 0 if the image has none
+     */
+    uint64_t decompress_hits;
+    uint64_t decompress_misses;
+    uint64_t decompress_ns;
 } BlockDriverInfo;
 
 typedef struct BlockFragInfo {
@@ -158,6 +170,9 @@ void bdrv_info(Monitor *mon, QObject **ret_data);
 void bdrv_stats_print(Monitor *mon, const QObject *data);
 void bdrv_info_stats(Monitor *mon, QObject **ret_data);
 
+/* disk I/O throttling */
+void bdrv_io_limits_enable(BlockDriverState *bs);
+void bdrv_io_limits_disable(BlockDriverState *bs);
 
 void bdrv_init(void);
 void bdrv_init_with_whitelist(void);
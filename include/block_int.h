@@ -30,6 +30,7 @@
 #include "qemu/queue.h"
 #include "coroutine.h"
 #include "qemu/timer.h"
+#include "qemu/throttle.h"
 #include "util/qapi-types.h"
 #include "qapi/qmp/qerror.h"
 #include "monitor/monitor.h"
@@ -357,6 +358,12 @@ struct BlockDriverState {
     /* number of in-flight serialising requests */
     unsigned int serialising_in_flight;
 
+    /* I/O throttling, requests wait in throttled_reqs[is_write] until the
+     * matching timer says the token buckets allow them to run */
+    ThrottleState throttle_state;
+    CoQueue      throttled_reqs[2];
+    QEMUTimer    *throttle_timers[2];
+    bool         io_limits_enabled;
 
     /* I/O stats (display with "info blockstats"). */
     BlockAcctStats stats;
@@ -421,8 +428,8 @@ int get_tmp_filename(char *filename, int size);
 BlockDriver *bdrv_probe_all(const uint8_t *buf, int buf_size,
                             const char *filename);
 
-//void bdrv_set_io_limits(BlockDriverState *bs,
-//                        ThrottleConfig *cfg);
+void bdrv_set_io_limits(BlockDriverState *bs,
+                        ThrottleConfig *cfg);
 
 
 
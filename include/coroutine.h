@@ -119,6 +119,13 @@ void vmx_co_queue_init(CoQueue *queue);
  */
 void coroutine_fn vmx_co_queue_wait(CoQueue *queue);
 
+/**
+ * Like vmx_co_queue_wait(), but queues the current coroutine ahead of the
+ * others, for a coroutine that was woken and has to go back to waiting
+ * without losing its place.
+ */
+void coroutine_fn vmx_co_queue_wait_insert_head(CoQueue *queue);
+
 /**
  * Restarts the next coroutine in the CoQueue and removes it from the queue.
  *
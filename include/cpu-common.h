@@ -91,6 +91,7 @@ bool cpu_physical_memory_is_io(hwaddr phys_addr);
  * virtualization.
  */
 void vmx_flush_coalesced_mmio_buffer(void);
+bool vmx_coalesced_mmio_append(hwaddr addr, const void *buf, unsigned size);
 
 uint32_t ldub_phys(VeertuAddressSpace *as, hwaddr addr);
 uint32_t lduw_le_phys(VeertuAddressSpace *as, hwaddr addr);
@@ -109,6 +109,12 @@ struct MemAreaSection {
     int readonly;
 };
 
+typedef struct CoalescedMemoryRange {
+    uint64_t offset;
+    uint64_t size;
+    QTAILQ_ENTRY(CoalescedMemoryRange) link;
+} CoalescedMemoryRange;
+
 struct VeertuMemArea {
     VeertuType pure_junk;
     void *opaque;
@@ -129,7 +135,8 @@ struct VeertuMemArea {
     uint64_t alias_offset;
     int priority;
     const MemAreaOps *ops;
-    
+    QTAILQ_HEAD(coalesced, CoalescedMemoryRange) coalesced;
+    bool global_locking;
 };
 
 struct MemoryCallbacks {
@@ -177,6 +184,11 @@ void mem_area_set_enable(VeertuMemArea *area, int enabled, int flush);
 void mem_area_set_addr(VeertuMemArea *area, uint64_t addr);
 void memory_area_set_size(VeertuMemArea *mem_area, uint64_t size);
 void mem_area_set_alias_offset(VeertuMemArea *area, uint64_t offset);
+void mem_area_set_coalescing(VeertuMemArea *area);
+void mem_area_add_coalescing(VeertuMemArea *area, uint64_t offset, uint64_t size);
+void mem_area_clear_coalescing(VeertuMemArea *area);
+bool mem_area_is_coalesced(VeertuMemArea *area, uint64_t offset, uint64_t size);
+void mem_area_clear_global_locking(VeertuMemArea *area);
 int is_addr_in_mem_area(VeertuMemArea *area, uint64_t addr);
 void veertu_mem_referesh();
 void memory_callbacks_register(MemoryCallbacks *callbacks, VeertuAddressSpace *address_space);
@@ -185,6 +197,7 @@ void veertu_address_space_init(VeertuAddressSpace *address_space, VeertuMemArea
 void veertu_address_space_destroy(VeertuAddressSpace *address_space);
 
 bool address_space_rw(VeertuAddressSpace *address_space, hwaddr addr, uint8_t *buf, int len, bool is_write);
+bool address_space_rw_rep(VeertuAddressSpace *address_space, hwaddr addr, uint8_t *buf, int size, uint32_t count, bool is_write);
 bool address_space_write(VeertuAddressSpace *address_space, uint64_t addr, const uint8_t *buf, int len);
 bool address_space_read(VeertuAddressSpace *address_space, uint64_t addr, uint8_t *buf, int len);
 bool address_space_memset(VeertuAddressSpace *as, hwaddr addr, const uint8_t value, int len);
@@ -192,6 +205,12 @@ VeertuMemArea *address_space_translate(VeertuAddressSpace *address_space, uint64
 bool address_space_access_valid(VeertuAddressSpace *address_space, uint64_t addr, int len, bool is_write);
 void *address_space_map(VeertuAddressSpace *address_space, uint64_t addr, uint64_t *plen, bool is_Write);
 void address_space_unmap(VeertuAddressSpace *address_space, void *buf, uint64_t len, int is_write, uint64_t access_len);
+bool address_space_is_coalesced(VeertuAddressSpace *address_space, hwaddr addr, unsigned size);
+bool address_space_is_lockless(VeertuAddressSpace *address_space, hwaddr addr, unsigned size);
+void address_space_dispatch_rdlock(void);
+void address_space_dispatch_wrlock(void);
+void address_space_dispatch_unlock(void);
+unsigned address_space_dispatch_generation(void);
 
 
 #endif
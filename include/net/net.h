@@ -44,6 +44,10 @@ typedef void (NetPoll)(NetClientState *, bool enable);
 typedef int (NetCanReceive)(NetClientState *);
 typedef ssize_t (NetReceive)(NetClientState *, const uint8_t *, size_t);
 typedef ssize_t (NetReceiveIOV)(NetClientState *, const struct iovec *, int);
+/* Takes several flat packets at once, returns how many were consumed.
+ * Fewer than offered means no room for the rest: they stay queued until
+ * the receiver flushes its queue, as when receive returns 0. */
+typedef int (NetReceiveBatch)(NetClientState *, const struct iovec *, int);
 typedef void (NetCleanup) (NetClientState *);
 typedef void (LinkStatusChanged)(NetClientState *);
 typedef void (NetClientDestructor)(NetClientState *);
@@ -61,6 +65,7 @@ typedef struct NetClientInfo {
     NetReceive *receive;
     NetReceive *receive_raw;
     NetReceiveIOV *receive_iov;
+    NetReceiveBatch *receive_batch;
     NetCanReceive *can_receive;
     NetCleanup *cleanup;
     LinkStatusChanged *link_status_changed;
@@ -127,6 +132,10 @@ void vmx_send_packet(NetClientState *nc, const uint8_t *buf, int size);
 ssize_t vmx_send_packet_raw(NetClientState *nc, const uint8_t *buf, int size);
 ssize_t vmx_send_packet_async(NetClientState *nc, const uint8_t *buf,
                                int size, NetPacketSent *sent_cb);
+/* Sends count flat packets, returns how many went out.  Fewer means the
+ * next one was queued: hold the rest until sent_cb runs for it. */
+int vmx_send_packet_batch_async(NetClientState *nc, const struct iovec *pkts,
+                                int count, NetPacketSent *sent_cb);
 void vmx_purge_queued_packets(NetClientState *nc);
 void vmx_flush_queued_packets(NetClientState *nc);
 void vmx_format_nic_info_str(NetClientState *nc, uint8_t macaddr[6]);
@@ -153,6 +162,9 @@ ssize_t vmx_deliver_packet_iov(NetClientState *sender,
                             const struct iovec *iov,
                             int iovcnt,
                             void *opaque);
+int vmx_deliver_packet_batch(const struct iovec *pkts, int count,
+                              void *opaque);
+char *vmx_net_queue_stats_report(void);
 
 void print_net_client(Monitor *mon, NetClientState *nc);
 void do_info_network(Monitor *mon, const QDict *qdict);
@@ -34,6 +34,17 @@ typedef void (NetPacketSent) (NetClientState *sender, ssize_t ret);
 #define QEMU_NET_PACKET_FLAG_NONE  0
 #define QEMU_NET_PACKET_FLAG_RAW  (1<<0)
 
+typedef struct NetQueueStats {
+    uint64_t queued;            /* packets that had to wait in the queue */
+    uint64_t dropped;           /* queue full and no sent callback */
+    uint64_t purged;
+    uint32_t high_water;        /* most packets queued at once */
+    uint64_t batches;           /* receive_batch calls while flushing */
+    uint64_t batched;           /* packets passed in those calls */
+    uint32_t max_batch;
+    uint64_t pool_misses;       /* packets that needed a fresh allocation */
+} NetQueueStats;
+
 NetQueue *vmx_new_net_queue(void *opaque);
 
 void vmx_del_net_queue(NetQueue *queue);
@@ -52,7 +63,14 @@ ssize_t vmx_net_queue_send_iov(NetQueue *queue,
                                 int iovcnt,
                                 NetPacketSent *sent_cb);
 
+int vmx_net_queue_send_batch(NetQueue *queue,
+                             NetClientState *sender,
+                             const struct iovec *pkts,
+                             int count,
+                             NetPacketSent *sent_cb);
+
 void vmx_net_queue_purge(NetQueue *queue, NetClientState *from);
 bool vmx_net_queue_flush(NetQueue *queue);
+void vmx_net_queue_get_stats(NetQueue *queue, NetQueueStats *stats);
 
 #endif /* QEMU_NET_QUEUE_H */
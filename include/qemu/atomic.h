@@ -21,12 +21,18 @@
 
 
 #define atomic_or   __sync_fetch_and_or
+#define atomic_and  __sync_fetch_and_and
 
 #define atomic_read(p)              \
 ({                                  \
     (*(volatile typeof (*p) *)p);   \
 })
 
+#define atomic_set(p, i)            \
+({                                  \
+    (*(volatile typeof (*p) *)p) = (i); \
+})
+
 #define atomic_mb_read(p)               \
 ({                                      \
     typeof(*p)  __v = atomic_read(p);   \
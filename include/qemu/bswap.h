@@ -136,11 +136,12 @@ static int inline ldl_le_p(const void *p)
 }
 
 
-typedef uint8_t jchar;
+typedef uint16_t jchar;
 typedef uint32_t juint;
 
-#define swab16(a) ( (((jchar)(a)) << 8) |                            \
-(((jchar)(a)) >> 8)     )
+#define swab16(a) ((jchar)(                                          \
+(((jchar)(a)) << 8) |                           \
+(((jchar)(a)) >> 8)     ))
 #define swab32(a) ((juint)(                                          \
 (((juint)(a)) << 24) |                          \
 ((((juint)(a)) & (juint)0x0000ff00UL) << 8) |    \
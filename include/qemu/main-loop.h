@@ -299,6 +299,12 @@ void vmx_mutex_lock_iothread(void);
  */
 void vmx_mutex_unlock_iothread(void);
 
+/**
+ * vmx_mutex_iothread_locked: Return whether the calling thread holds the
+ * main loop mutex.
+ */
+bool vmx_mutex_iothread_locked(void);
+
 /* internal interfaces */
 
 void vmx_fd_register(int fd);
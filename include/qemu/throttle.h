@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2016 Veertu Inc,
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 or
+ * (at your option) version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef THROTTLE_H
+#define THROTTLE_H
+
+#include <stdint.h>
+#include "qemu-common.h"
+#include "qapi/error.h"
+
+typedef enum {
+    THROTTLE_BPS_TOTAL,
+    THROTTLE_BPS_READ,
+    THROTTLE_BPS_WRITE,
+    THROTTLE_OPS_TOTAL,
+    THROTTLE_OPS_READ,
+    THROTTLE_OPS_WRITE,
+    BUCKETS_COUNT,
+} BucketType;
+
+/*
+ * Token bucket: tokens are added at avg units per second up to the burst
+ * size and every request takes its size out.  A request may run as long as
+ * the bucket isn't in debt, so requests larger than the burst size still
+ * make progress; the debt they leave behind delays the following ones.
+ */
+typedef struct TokenBucket {
+    double avg;             /* average rate in units per second, 0 = off */
+    double max;             /* burst size in units, 0 = avg / 10 */
+    double tokens;          /* available units, negative when in debt */
+} TokenBucket;
+
+typedef struct ThrottleConfig {
+    TokenBucket buckets[BUCKETS_COUNT];
+    uint64_t op_size;       /* bytes counted as one operation, 0 = any size */
+} ThrottleConfig;
+
+typedef struct ThrottleState {
+    ThrottleConfig cfg;
+    int64_t previous_refill;    /* QEMU_CLOCK_REALTIME, ns */
+} ThrottleState;
+
+void throttle_init(ThrottleState *ts);
+
+bool throttle_enabled(ThrottleConfig *cfg);
+bool check_throttle_config(ThrottleConfig *cfg, Error **errp);
+
+void throttle_config(ThrottleState *ts, ThrottleConfig *cfg);
+void throttle_get_config(ThrottleState *ts, ThrottleConfig *cfg);
+
+/* Nanoseconds until a request in this direction may run, 0 if it may now */
+int64_t throttle_compute_wait(ThrottleState *ts, bool is_write, int64_t now);
+
+void throttle_account(ThrottleState *ts, bool is_write, uint64_t size);
+
+#endif
@@ -52,6 +52,9 @@ struct CPUState {
     struct x86_efer efer;
     uint8_t mmio_buf[4096];
     uint8_t* apic_page;
+    struct x86_decode_cache *decode_cache;
+    struct x86_tlb *tlb;
+    struct veertu_exit_stats *exit_stats;
     
     bool vmx_vcpu_dirty;
     struct VeertuState *veertu_state;
@@ -7,6 +7,16 @@ typedef int ThreadPoolFunc(void *opaque);
 
 typedef struct ThreadPool ThreadPool;
 
+typedef struct ThreadPoolStats {
+    uint64_t submitted;
+    uint64_t completed;
+    uint64_t in_flight;
+    uint64_t max_in_flight;
+    uint64_t total_latency_ns;      /* submission to completion callback */
+    uint64_t max_latency_ns;
+    int threads;
+} ThreadPoolStats;
+
 ThreadPool *thread_pool_create(struct VeertuAioContext *ctx, int threads);
 void thread_pool_destroy(ThreadPool *pool);
 
@@ -16,5 +26,6 @@ BlockAIOCB *thread_pool_submit_aio(ThreadPool *pool,
 int coroutine_fn thread_pool_submit_co(ThreadPool *pool,
         ThreadPoolFunc *func, void *arg);
 void thread_pool_submit(ThreadPool *pool, ThreadPoolFunc *func, void *arg);
+void thread_pool_get_stats(ThreadPool *pool, ThreadPoolStats *stats);
 
 #endif
@@ -0,0 +1,48 @@
+/*
+ * Virtio PCI Bindings
+ *
+ * Copyright IBM, Corp. 2007
+ * Copyright (c) 2009 CodeSourcery
+ * Copyright (C) 2016 Veertu Inc,
+ *
+ * Authors:
+ *  Anthony Liguori   <aliguori@us.ibm.com>
+ *  Paul Brook        <paul@codesourcery.com>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef VIRTIO_PCI_H
+#define VIRTIO_PCI_H
+
+#include "pci.h"
+#include "virtio.h"
+
+/* Legacy (virtio 0.9.5) register layout of BAR 0 */
+#define VIRTIO_PCI_HOST_FEATURES        0x00
+#define VIRTIO_PCI_GUEST_FEATURES       0x04
+#define VIRTIO_PCI_QUEUE_PFN            0x08
+#define VIRTIO_PCI_QUEUE_NUM            0x0c
+#define VIRTIO_PCI_QUEUE_SEL            0x0e
+#define VIRTIO_PCI_QUEUE_NOTIFY         0x10
+#define VIRTIO_PCI_STATUS               0x12
+#define VIRTIO_PCI_ISR                  0x13
+#define VIRTIO_PCI_CONFIG               0x14
+
+#define VIRTIO_PCI_QUEUE_ADDR_SHIFT     12
+
+/* Devices embed the proxy first so the PCIDevice is at offset 0 */
+typedef struct VirtIOPCIProxy {
+    PCIDevice pci_dev;
+    VeertuMemArea bar;
+    VirtIODevice *vdev;
+} VirtIOPCIProxy;
+
+/* vdev must have been set up with virtio_init and its queues added */
+void virtio_pci_init(VirtIOPCIProxy *proxy, VirtIODevice *vdev,
+                     uint16_t subsystem_id);
+void virtio_pci_exit(VirtIOPCIProxy *proxy);
+
+#endif
@@ -0,0 +1,169 @@
+/*
+ * Virtio Support
+ *
+ * Copyright IBM, Corp. 2007
+ * Copyright (C) 2016 Veertu Inc,
+ *
+ * Authors:
+ *  Anthony Liguori   <aliguori@us.ibm.com>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef VIRTIO_H
+#define VIRTIO_H
+
+#include "qemu-common.h"
+#include "hwaddr.h"
+#include "memory.h"
+#include "vmstate.h"
+
+/* Device status bits */
+#define VIRTIO_CONFIG_S_ACKNOWLEDGE     1
+#define VIRTIO_CONFIG_S_DRIVER          2
+#define VIRTIO_CONFIG_S_DRIVER_OK       4
+#define VIRTIO_CONFIG_S_FAILED          0x80
+
+/* Transport feature bits, device features use the bits below 24 */
+#define VIRTIO_F_NOTIFY_ON_EMPTY        24
+#define VIRTIO_RING_F_INDIRECT_DESC     28
+#define VIRTIO_RING_F_EVENT_IDX         29
+#define VIRTIO_F_BAD_FEATURE            30
+
+/* ISR bits */
+#define VIRTIO_ISR_QUEUE                1
+#define VIRTIO_ISR_CONFIG               2
+
+/* Device ids */
+#define VIRTIO_ID_NET                   1
+
+#define VIRTIO_QUEUE_MAX                64
+#define VIRTQUEUE_MAX_SIZE              1024
+
+/* Legacy rings are laid out in one block aligned to this */
+#define VIRTIO_PCI_VRING_ALIGN          4096
+
+/* Ring layout, little endian in guest memory */
+#define VRING_DESC_F_NEXT               1
+#define VRING_DESC_F_WRITE              2
+#define VRING_DESC_F_INDIRECT           4
+
+#define VRING_USED_F_NO_NOTIFY          1
+#define VRING_AVAIL_F_NO_INTERRUPT      1
+
+typedef struct VRingDesc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+} VRingDesc;
+
+typedef struct VRingAvail {
+    uint16_t flags;
+    uint16_t idx;
+    uint16_t ring[0];           /* followed by used_event */
+} VRingAvail;
+
+typedef struct VRingUsedElem {
+    uint32_t id;
+    uint32_t len;
+} VRingUsedElem;
+
+typedef struct VRingUsed {
+    uint16_t flags;
+    uint16_t idx;
+    VRingUsedElem ring[0];      /* followed by avail_event */
+} VRingUsed;
+
+/* A chain of descriptors popped from the avail ring, mapped into host
+ * memory.  in_sg is written by the device, out_sg read. */
+typedef struct VirtQueueElement {
+    unsigned int index;
+    unsigned int out_num;
+    unsigned int in_num;
+    hwaddr in_addr[VIRTQUEUE_MAX_SIZE];
+    hwaddr out_addr[VIRTQUEUE_MAX_SIZE];
+    struct iovec in_sg[VIRTQUEUE_MAX_SIZE];
+    struct iovec out_sg[VIRTQUEUE_MAX_SIZE];
+} VirtQueueElement;
+
+typedef struct VirtQueue VirtQueue;
+typedef struct VirtIODevice VirtIODevice;
+
+typedef void (VirtIOHandleOutput)(VirtIODevice *vdev, VirtQueue *vq);
+
+typedef struct VirtIODeviceOps {
+    /* Trims the offered features to what the backend can do */
+    uint32_t (*get_features)(VirtIODevice *vdev, uint32_t features);
+    void (*set_features)(VirtIODevice *vdev, uint32_t features);
+    void (*get_config)(VirtIODevice *vdev, uint8_t *config);
+    void (*set_config)(VirtIODevice *vdev, const uint8_t *config);
+    void (*set_status)(VirtIODevice *vdev, uint8_t status);
+    void (*reset)(VirtIODevice *vdev);
+} VirtIODeviceOps;
+
+struct VirtIODevice {
+    const char *name;
+    const VirtIODeviceOps *ops;
+    uint8_t status;
+    uint8_t isr;
+    uint16_t queue_sel;
+    uint32_t host_features;
+    uint32_t guest_features;
+    size_t config_len;
+    uint8_t *config;
+    VirtQueue *vq;
+    int32_t nvqs;
+    bool broken;                /* the guest corrupted a ring */
+
+    /* guest memory as seen by the device */
+    VeertuAddressSpace *dma_as;
+
+    /* set by the transport, raises or lowers its interrupt from isr */
+    void (*update_irq)(void *opaque);
+    void *transport;
+};
+
+void virtio_init(VirtIODevice *vdev, const char *name,
+                 const VirtIODeviceOps *ops, size_t config_len,
+                 VeertuAddressSpace *dma_as);
+void virtio_cleanup(VirtIODevice *vdev);
+void virtio_reset(VirtIODevice *vdev);
+void virtio_error(VirtIODevice *vdev, const char *msg);
+void virtio_set_status(VirtIODevice *vdev, uint8_t status);
+int virtio_set_features(VirtIODevice *vdev, uint32_t features);
+void virtio_update_config(VirtIODevice *vdev);
+
+VirtQueue *virtio_add_queue(VirtIODevice *vdev, int queue_size,
+                            VirtIOHandleOutput *handle_output);
+int virtio_get_queue_index(VirtQueue *vq);
+VirtQueue *virtio_get_queue(VirtIODevice *vdev, int n);
+void virtio_queue_set_addr(VirtIODevice *vdev, int n, hwaddr addr);
+hwaddr virtio_queue_get_addr(VirtIODevice *vdev, int n);
+int virtio_queue_get_num(VirtIODevice *vdev, int n);
+void virtio_queue_notify(VirtIODevice *vdev, int n);
+
+int virtio_queue_ready(VirtQueue *vq);
+int virtio_queue_empty(VirtQueue *vq);
+void virtio_queue_set_notification(VirtQueue *vq, int enable);
+int virtqueue_avail_bytes(VirtQueue *vq, unsigned int in_bytes,
+                          unsigned int out_bytes);
+
+int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem);
+void virtqueue_discard(VirtQueue *vq, const VirtQueueElement *elem,
+                       unsigned int len);
+void virtqueue_rewind(VirtQueue *vq, unsigned int num);
+void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
+                    unsigned int len, unsigned int idx);
+void virtqueue_flush(VirtQueue *vq, unsigned int count);
+void virtqueue_push(VirtQueue *vq, const VirtQueueElement *elem,
+                    unsigned int len);
+
+void virtio_notify(VirtIODevice *vdev, VirtQueue *vq);
+void virtio_notify_config(VirtIODevice *vdev);
+
+extern const VMStateDescription vmstate_virtio;
+
+#endif
@@ -3264,6 +3264,18 @@ STEXI
 Expose Hyper-V interface to guest (Useful for optimizing Windows guests).
 ETEXI
 
+DEF("exit-stats", HAS_ARG, QEMU_OPTION_exit_stats, \
+    "-exit-stats seconds\n"
+    "                dump per-vcpu exit statistics to stderr every 'seconds'\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -exit-stats @var{seconds}
+@findex -exit-stats
+Dump per-vCPU VM exit counts and latency histograms to stderr every
+@var{seconds} seconds. The same report is available from the monitor
+with @code{exit_stats}.
+ETEXI
+
 HXCOMM This is the last statement. Insert new options before this line!
 STEXI
 @end table
@@ -0,0 +1,114 @@
+/*
+ * The main loop, reduced to what the block layer thread pool needs: one
+ * bottom half, scheduled by the workers from their threads and run by
+ * aio_poll() on the thread that polls.
+ *
+ * Copyright (C) 2016 Veertu Inc,
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 or
+ * (at your option) version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <time.h>
+
+#include "qemu-common.h"
+#include "aio.h"
+#include "block_int.h"
+
+struct QEMUBH {
+    QEMUBHFunc *cb;
+    void *opaque;
+    bool scheduled;
+};
+
+static pthread_mutex_t loop_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t loop_cond = PTHREAD_COND_INITIALIZER;
+static QEMUBH *loop_bh;
+
+QEMUBH *aio_bh_new(VeertuAioContext *ctx, QEMUBHFunc *cb, void *opaque)
+{
+    QEMUBH *bh = g_malloc0(sizeof(*bh));
+
+    bh->cb = cb;
+    bh->opaque = opaque;
+    assert(!loop_bh);
+    loop_bh = bh;
+    return bh;
+}
+
+void vmx_bh_schedule(QEMUBH *bh)
+{
+    pthread_mutex_lock(&loop_lock);
+    bh->scheduled = true;
+    pthread_cond_signal(&loop_cond);
+    pthread_mutex_unlock(&loop_lock);
+}
+
+void vmx_bh_delete(QEMUBH *bh)
+{
+    loop_bh = NULL;
+    g_free(bh);
+}
+
+bool aio_poll(VeertuAioContext *ctx, bool blocking)
+{
+    pthread_mutex_lock(&loop_lock);
+    while (blocking && !loop_bh->scheduled) {
+        pthread_cond_wait(&loop_cond, &loop_lock);
+    }
+    if (!loop_bh->scheduled) {
+        pthread_mutex_unlock(&loop_lock);
+        return false;
+    }
+    loop_bh->scheduled = false;
+    pthread_mutex_unlock(&loop_lock);
+
+    loop_bh->cb(loop_bh->opaque);
+    return true;
+}
+
+VeertuAioContext *vmx_get_aio_context(void)
+{
+    return NULL;
+}
+
+int64_t vmx_clock_get_ns(QEMUClockType type)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
+void *vmx_aio_get(const AIOCBInfo *aiocb_info, BlockDriverState *bs,
+                  BlockCompletionFunc *cb, void *opaque)
+{
+    BlockAIOCB *acb = g_malloc0(aiocb_info->aiocb_size);
+
+    acb->aiocb_info = aiocb_info;
+    acb->bs = bs;
+    acb->cb = cb;
+    acb->opaque = opaque;
+    acb->refcnt = 1;
+    return acb;
+}
+
+void vmx_aio_unref(void *p)
+{
+    BlockAIOCB *acb = p;
+
+    assert(acb->refcnt > 0);
+    if (--acb->refcnt == 0) {
+        g_free(acb);
+    }
+}
@@ -0,0 +1,300 @@
+/*
+ * Builds a DMG image in memory, mostly zlib chunks with some raw and zero
+ * ones, and streams it through the dmg driver: one sequential reader, four
+ * readers on different parts of the image and random 4K reads.  Reports
+ * throughput and how often the chunk cache hit, and checks every sector
+ * that is read.
+ *
+ *   dmg-bench [chunks]
+ *
+ * Copyright (C) 2016 Veertu Inc,
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 or
+ * (at your option) version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* the driver's functions are static */
+#include "../block/dmg.c"
+
+#define check(cond)                                                     \
+    do {                                                                \
+        if (!(cond)) {                                                  \
+            fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__,   \
+                    #cond);                                             \
+            exit(1);                                                    \
+        }                                                               \
+    } while (0)
+
+#define CHUNK_SECTORS   2048            /* 1M, what hdiutil uses */
+#define CHUNK_BYTES     (CHUNK_SECTORS * 512)
+#define READ_SECTORS    128             /* 64K guest requests */
+#define MAX_READERS     4
+
+#define TYPE_ZLIB       0x80000005
+#define TYPE_RAW        1
+#define TYPE_ZERO       2
+#define TYPE_END        0xffffffff
+
+/* Option parsing and the AioContext, as far as dmg_open and dmg_fill_chunk
+ * use them */
+
+static QemuOpts *bench_opts = (QemuOpts *)&bench_opts;
+static ThreadPool *pool;
+
+QemuOpts *vmx_opts_create(QemuOptsList *list, const char *id,
+                          int fail_if_exists, Error **errp)
+{
+    return bench_opts;
+}
+
+void vmx_opts_absorb_qdict(QemuOpts *opts, QDict *qdict, Error **errp)
+{
+}
+
+uint64_t vmx_opt_get_size(QemuOpts *opts, const char *name, uint64_t defval)
+{
+    return defval;
+}
+
+void vmx_opts_del(QemuOpts *opts)
+{
+}
+
+void bdrv_register(BlockDriver *bdrv)
+{
+}
+
+VeertuAioContext *bdrv_get_aio_context(BlockDriverState *bs)
+{
+    return NULL;
+}
+
+ThreadPool *aio_get_thread_pool(VeertuAioContext *ctx)
+{
+    return pool;
+}
+
+static BlockDriverState bs, file;
+static int nb_chunks = 64;
+
+static uint32_t chunk_type(int chunk)
+{
+    switch (chunk % 8) {
+    case 3:
+        return TYPE_ZERO;
+    case 6:
+        return TYPE_RAW;
+    default:
+        return TYPE_ZLIB;
+    }
+}
+
+/* Text that deflates about 6:1, with the sector number in every line */
+static void fill_sector(uint64_t sector, uint8_t *buf)
+{
+    static const char *words[] = {
+        "block", "cluster", "sector", "chunk", "inflate", "mish", "koly",
+        "guest", "image", "stream", "zlib", "cache",
+    };
+    unsigned seed = sector;
+    int len = 0;
+
+    if (chunk_type(sector / CHUNK_SECTORS) == TYPE_ZERO) {
+        memset(buf, 0, 512);
+        return;
+    }
+    while (len < 512) {
+        char line[64];
+        int n = snprintf(line, sizeof(line), "%" PRIu64 " %s %s %u\n", sector,
+                         words[rand_r(&seed) % ARRAY_SIZE(words)],
+                         words[rand_r(&seed) % ARRAY_SIZE(words)],
+                         rand_r(&seed) % 1000);
+
+        n = MIN(n, 512 - len);
+        memcpy(buf + len, line, n);
+        len += n;
+    }
+}
+
+static void put_be32(uint8_t *p, uint32_t v)
+{
+    v = cpu_to_be32(v);
+    memcpy(p, &v, 4);
+}
+
+static void put_be64(uint8_t *p, uint64_t v)
+{
+    v = cpu_to_be64(v);
+    memcpy(p, &v, 8);
+}
+
+/* Chunk data from offset 0, then the block table, then the koly trailer */
+static void build_image(void)
+{
+    uint8_t *raw = g_malloc(CHUNK_BYTES);
+    uLongf clen;
+    uint8_t *zbuf = g_malloc(compressBound(CHUNK_BYTES));
+    int table_bytes = 204 + 40 * (nb_chunks + 1);
+    uint8_t *info = g_malloc0(0x100 + 4 + table_bytes);
+    uint8_t *entry = info + 0x100 + 208;
+    uint8_t koly[512] = { 0 };
+    uint64_t pos = 0, compressed = 0, info_begin;
+    int c, i;
+
+    for (c = 0; c < nb_chunks; c++, entry += 40) {
+        uint32_t type = chunk_type(c);
+        uint64_t length = 0;
+
+        for (i = 0; i < CHUNK_SECTORS; i++) {
+            fill_sector((uint64_t)c * CHUNK_SECTORS + i, raw + i * 512);
+        }
+        if (type == TYPE_ZLIB) {
+            clen = compressBound(CHUNK_BYTES);
+            check(compress2(zbuf, &clen, raw, CHUNK_BYTES, 6) == Z_OK);
+            check(bdrv_pwrite(&file, pos, zbuf, clen) == clen);
+            length = clen;
+            compressed += clen;
+        } else if (type == TYPE_RAW) {
+            check(bdrv_pwrite(&file, pos, raw, CHUNK_BYTES) == CHUNK_BYTES);
+            length = CHUNK_BYTES;
+        }
+
+        put_be32(entry, type);
+        put_be64(entry + 8, (uint64_t)c * CHUNK_SECTORS);
+        put_be64(entry + 16, CHUNK_SECTORS);
+        put_be64(entry + 24, pos);
+        put_be64(entry + 32, length);
+        pos += length;
+    }
+    put_be32(entry, TYPE_END);
+
+    info_begin = QEMU_ALIGN_UP(pos, 512);
+    put_be32(info, 0x100);
+    put_be32(info + 4, 0x100 + 4 + table_bytes);
+    put_be32(info + 0x100, table_bytes);
+    put_be32(info + 0x104, 0x6d697368);    /* "mish" */
+    check(bdrv_pwrite(&file, info_begin, info, 0x100 + 4 + table_bytes) > 0);
+
+    put_be64(koly + 512 - 0x1d8, info_begin);
+    pos = QEMU_ALIGN_UP(info_begin + 0x100 + 4 + table_bytes, 512);
+    check(bdrv_pwrite(&file, pos, koly, sizeof(koly)) == sizeof(koly));
+
+    printf("%d chunks, %d MB, %.1f MB deflated\n", nb_chunks,
+           nb_chunks * CHUNK_BYTES >> 20, compressed / 1048576.0);
+    g_free(raw);
+    g_free(zbuf);
+    g_free(info);
+}
+
+typedef struct Reader {
+    uint64_t start, end;        /* sectors, sequential readers only */
+    long random_reads;
+    bool done;
+} Reader;
+
+static Reader readers[MAX_READERS];
+
+static void check_data(uint64_t sector, const uint8_t *buf, int nb_sectors)
+{
+    uint8_t expected[512];
+    int i;
+
+    for (i = 0; i < nb_sectors; i++) {
+        fill_sector(sector + i, expected);
+        check(!memcmp(buf + i * 512, expected, 512));
+    }
+}
+
+static void coroutine_fn reader_entry(void *opaque)
+{
+    Reader *r = opaque;
+    uint8_t *buf = g_malloc(READ_SECTORS * 512);
+    uint64_t total = (uint64_t)nb_chunks * CHUNK_SECTORS;
+    unsigned seed = r - readers + 1;
+    uint64_t sector;
+    long i;
+
+    for (sector = r->start; sector < r->end; sector += READ_SECTORS) {
+        check(dmg_co_read(&bs, sector, buf, READ_SECTORS) == 0);
+        check_data(sector, buf, READ_SECTORS);
+    }
+    for (i = 0; i < r->random_reads; i++) {
+        sector = rand_r(&seed) % (total / 8) * 8;
+        check(dmg_co_read(&bs, sector, buf, 8) == 0);
+        check_data(sector, buf, 8);
+    }
+    g_free(buf);
+    r->done = true;
+}
+
+static void run(const char *name, int nr_readers, long random_reads)
+{
+    BDRVDMGState *s = bs.opaque;
+    uint64_t total = (uint64_t)nb_chunks * CHUNK_SECTORS;
+    uint64_t hits = s->cache.hits, misses = s->cache.misses;
+    int64_t start = vmx_clock_get_ns(QEMU_CLOCK_REALTIME), elapsed;
+    double mb;
+    int i, done;
+
+    for (i = 0; i < nr_readers; i++) {
+        readers[i] = (Reader) {
+            .start          = random_reads ? 0 : total * i / nr_readers,
+            .end            = random_reads ? 0 : total * (i + 1) / nr_readers,
+            .random_reads   = random_reads,
+        };
+        vmx_coroutine_enter(vmx_coroutine_create(reader_entry), &readers[i]);
+    }
+    do {
+        for (i = done = 0; i < nr_readers; i++) {
+            done += readers[i].done;
+        }
+    } while (done < nr_readers && aio_poll(NULL, true));
+    elapsed = vmx_clock_get_ns(QEMU_CLOCK_REALTIME) - start;
+
+    mb = random_reads ? nr_readers * random_reads * 4096 / 1048576.0
+                      : total * 512 / 1048576.0;
+    printf("%-26s %8.1f MB/s  cache hits %6" PRIu64 " misses %4" PRIu64 "\n",
+           name, mb * 1e9 / elapsed, s->cache.hits - hits,
+           s->cache.misses - misses);
+}
+
+int main(int argc, char **argv)
+{
+    Error *local_err = NULL;
+
+    if (argc > 1) {
+        nb_chunks = atoi(argv[1]);
+        check(nb_chunks > 0);
+    }
+
+    build_image();
+    pool = thread_pool_create(NULL, 4);
+
+    bs.file = &file;
+    bs.opaque = g_malloc0(sizeof(BDRVDMGState));
+    check(dmg_open(&bs, NULL, 0, &local_err) == 0);
+    check(((BDRVDMGState *)bs.opaque)->n_chunks == nb_chunks);
+
+    run("1 sequential reader", 1, 0);
+    run("4 sequential readers", 4, 0);
+    run("4 random 4K readers", 4, 2000);
+
+    dmg_close(&bs);
+    thread_pool_destroy(pool);
+    printf("dmg-bench: ok\n");
+    return 0;
+}
@@ -0,0 +1,614 @@
+/*
+ * Runs the e1000 transmit path over descriptor rings in a malloc'd block
+ * standing in for guest memory: full sized frames and 64K TSO frames, once
+ * with a peer that takes a virtio-net header and once with one that does
+ * not.  Every frame handed to the peer in the first round is checked, and
+ * so is the header stripping on receive in both modes.
+ *
+ *   e1000-bench [rounds]
+ *
+ * Copyright (C) 2016 Veertu Inc,
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 or
+ * (at your option) version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <netinet/in.h>
+
+/* the device's functions are static */
+#include "../devices/e1000.c"
+
+#define check(cond)                                                     \
+    do {                                                                \
+        if (!(cond)) {                                                  \
+            fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__,   \
+                    #cond);                                             \
+            exit(1);                                                    \
+        }                                                               \
+    } while (0)
+
+#define GUEST_SIZE      0x200000
+#define RING_SIZE       256             /* descriptors, tx and rx */
+#define TX_RING         0x1000
+#define RX_RING         0x2000
+#define HDR             0x4000          /* frame headers, one per packet */
+#define PAYLOAD         0x10000         /* shared by every packet */
+#define RX_BUF          0x100000        /* 2K per rx descriptor */
+
+#define HDR_LEN         54              /* ethernet, ipv4, tcp */
+#define MSS             1448
+#define TSO_PAYLOAD     64000
+#define FRAME_PAYLOAD   1460
+#define SEQ             1000
+
+/* Guest memory, reached through the device's bus master address space */
+
+static uint8_t *guest;
+
+bool address_space_rw(VeertuAddressSpace *address_space, hwaddr addr,
+                      uint8_t *buf, int len, bool is_write)
+{
+    check(addr + len <= GUEST_SIZE);
+    if (is_write) {
+        memcpy(guest + addr, buf, len);
+    } else {
+        memcpy(buf, guest + addr, len);
+    }
+    return false;
+}
+
+/* Registration, memory regions, timers and interrupts: nothing to do */
+
+const VMStateInfo vmstate_info_bool = { .name = "bool" };
+const VMStateInfo vmstate_info_int8 = { .name = "int8" };
+const VMStateInfo vmstate_info_uint8 = { .name = "uint8" };
+const VMStateInfo vmstate_info_uint16 = { .name = "uint16" };
+const VMStateInfo vmstate_info_uint32 = { .name = "uint32" };
+const VMStateInfo vmstate_info_buffer = { .name = "buffer" };
+const VMStateInfo vmstate_info_unused_buffer = { .name = "unused_buffer" };
+const VMStateDescription vmstate_pci_device = { .name = "PCIDevice" };
+QEMUTimerListGroup main_loop_tlg;
+
+struct VeertuTypeClass *register_type_internal(VeertuTypeInfo *type)
+{
+    return NULL;
+}
+
+char *get_typename(VeertuType *type)
+{
+    return (char *)"e1000";
+}
+
+void device_add_bootindex_property(VeertuType *obj, int32_t *bootindex,
+                                   char *name, char *suffix,
+                                   DeviceState *dev, Error **errp)
+{
+}
+
+void memory_area_init_io(VeertuMemArea *mem_area, VeertuType *owner,
+                         MemAreaOps *mem_ops, void *opaque, char *name,
+                         uint64_t size)
+{
+}
+
+void mem_area_add_coalescing(VeertuMemArea *area, uint64_t offset,
+                             uint64_t size)
+{
+}
+
+void pci_register_bar(PCIDevice *pci_dev, int region_num, uint8_t attr,
+                      VeertuMemArea *memory)
+{
+}
+
+void pci_default_write_config(PCIDevice *d, uint32_t address, uint32_t val,
+                              int len)
+{
+}
+
+void pci_set_irq(PCIDevice *pci_dev, int level)
+{
+}
+
+void timer_init_tl(QEMUTimer *ts, QEMUTimerList *timer_list, int scale,
+                   QEMUTimerCB *cb, void *opaque)
+{
+    ts->cb = cb;
+    ts->opaque = opaque;
+    ts->scale = scale;
+}
+
+void timer_mod(QEMUTimer *ts, int64_t expire_time)
+{
+}
+
+void timer_del(QEMUTimer *ts)
+{
+}
+
+void timer_free(QEMUTimer *ts)
+{
+    g_free(ts);
+}
+
+int64_t vmx_clock_get_ns(QEMUClockType type)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
+/* The NIC's queue and its peer, which checks and counts what it is sent */
+
+static NetClientState nic_nc, peer_nc;
+static NICState nic = { .ncs = &nic_nc };
+static NICInfo nd = { .netdev = &peer_nc };
+NICInfo *current_nd = &nd;
+
+static E1000State *s;
+static bool peer_vnet, peer_using_vnet;
+static int peer_vnet_hdr_len, peer_offloads;
+
+static struct {
+    bool verify;
+    bool tso;
+    uint32_t next_seq;          /* of the next frame's first payload byte */
+    long frames;
+    uint64_t bytes;
+} peer;
+
+NICState *vmx_new_nic(NetClientInfo *info, NICConf *conf, const char *model,
+                      const char *name, void *opaque)
+{
+    nic_nc.info = info;
+    nic_nc.peer = conf->peers.ncs[conf->peers.queues - 1];
+    nic.conf = conf;
+    nic.opaque = opaque;
+    return &nic;
+}
+
+void vmx_del_nic(NICState *nic)
+{
+}
+
+NetClientState *vmx_get_queue(NICState *nic)
+{
+    return nic->ncs;
+}
+
+void *vmx_get_nic_opaque(NetClientState *nc)
+{
+    check(nc == &nic_nc);
+    return nic.opaque;
+}
+
+void vmx_format_nic_info_str(NetClientState *nc, uint8_t macaddr[6])
+{
+}
+
+void vmx_macaddr_default_if_unset(MACAddr *macaddr)
+{
+    static const MACAddr def = { { 0x52, 0x54, 0x00, 0x12, 0x34, 0x56 } };
+
+    *macaddr = def;
+}
+
+void vmx_flush_queued_packets(NetClientState *nc)
+{
+}
+
+bool vmx_has_vnet_hdr(NetClientState *nc)
+{
+    check(nc == &peer_nc);
+    return peer_vnet;
+}
+
+bool vmx_has_ufo(NetClientState *nc)
+{
+    return peer_vnet;
+}
+
+void vmx_using_vnet_hdr(NetClientState *nc, bool enable)
+{
+    peer_using_vnet = enable;
+}
+
+void vmx_set_vnet_hdr_len(NetClientState *nc, int len)
+{
+    peer_vnet_hdr_len = len;
+}
+
+void vmx_set_offload(NetClientState *nc, int csum, int tso4, int tso6,
+                     int ecn, int ufo)
+{
+    peer_offloads = csum | tso4 | tso6 | ecn | ufo;
+}
+
+static uint16_t fold(uint32_t sum)
+{
+    while (sum > 0xffff) {
+        sum = (sum >> 16) + (sum & 0xffff);
+    }
+    return sum;
+}
+
+/* The guest's pseudo-header sum, without the length, as Linux leaves it */
+static uint16_t pseudo_sum(const uint8_t *ip)
+{
+    return fold(ip_checksum_add(0, ip + 12, 8) + IPPROTO_TCP);
+}
+
+static void check_frame(const struct virtio_net_hdr *hdr, const uint8_t *buf,
+                        int size)
+{
+    static const struct virtio_net_hdr empty;
+    const uint8_t *ip = buf + 14, *tcp = buf + 34;
+    int tcp_len = size - 34, payload = tcp_len - 20;
+    uint32_t seq = ldl_be_p(tcp + 4), sum;
+    bool gso = hdr && hdr->gso_type != VIRTIO_NET_HDR_GSO_NONE;
+
+    check(size >= HDR_LEN && lduw_be_p(ip + 2) == size - 14);
+    check(ip_checksum(ip, 20) == 0);
+    check(seq == peer.next_seq);
+    check(!memcmp(tcp + 20, guest + PAYLOAD + seq - SEQ, payload));
+    peer.next_seq += payload;
+
+    if (gso) {
+        /* one frame for the whole TSO context, for the host to segment */
+        check(peer.tso);
+        check(hdr->flags == VIRTIO_NET_HDR_F_NEEDS_CSUM);
+        check(hdr->gso_type == VIRTIO_NET_HDR_GSO_TCPV4);
+        check(hdr->gso_size == MSS && hdr->hdr_len == HDR_LEN);
+        check(hdr->csum_start == 34 && hdr->csum_offset == 16);
+        check(payload == TSO_PAYLOAD);
+        sum = pseudo_sum(ip) + tcp_len;
+        check(lduw_be_p(tcp + 16) == fold(sum));
+    } else {
+        /* a frame the guest could have sent itself, checksums filled in */
+        check(!hdr || !memcmp(hdr, &empty, sizeof(empty)));
+        check(payload <= (peer.tso ? MSS : FRAME_PAYLOAD));
+        sum = ip_checksum_add(0, tcp, tcp_len) +
+              ip_checksum_add(0, ip + 12, 8) + IPPROTO_TCP + tcp_len;
+        check(ip_checksum_finish(sum) == 0);
+    }
+
+    /* PSH on the last frame of a packet only */
+    if (peer.next_seq - SEQ == (peer.tso ? TSO_PAYLOAD : FRAME_PAYLOAD)) {
+        check(tcp[13] & 0x08);
+        peer.next_seq = SEQ;
+    } else {
+        check(!(tcp[13] & 0x08));
+    }
+}
+
+ssize_t vmx_sendv_packet(NetClientState *nc, const struct iovec *iov,
+                         int iovcnt)
+{
+    check(nc == &nic_nc && peer_vnet);
+    check(iovcnt == 2 && iov[0].iov_len == sizeof(struct virtio_net_hdr));
+    if (peer.verify) {
+        check_frame(iov[0].iov_base, iov[1].iov_base, iov[1].iov_len);
+    }
+    peer.frames++;
+    peer.bytes += iov[1].iov_len;
+    return iov[1].iov_len;
+}
+
+void vmx_send_packet(NetClientState *nc, const uint8_t *buf, int size)
+{
+    check(nc == &nic_nc && !peer_vnet);
+    if (peer.verify) {
+        check_frame(NULL, buf, size);
+    }
+    peer.frames++;
+    peer.bytes += size;
+}
+
+/* The guest driver */
+
+static void reg_write(int reg, uint32_t val)
+{
+    e1000_mmio_write(s, reg, val, 4);
+}
+
+static void setup(bool vnet)
+{
+    static E1000BaseClass klass = {
+        .parent_class.device_id = E1000_DEV_ID_82540EM,
+        .phy_id2 = E1000_PHY_ID2_8254xx_DEFAULT,
+    };
+    int i;
+
+    if (s) {
+        pci_e1000_uninit(&s->parent);
+        g_free(s->parent.config);
+        g_free(s);
+    }
+    peer_vnet = vnet;
+    peer_using_vnet = false;
+    peer_vnet_hdr_len = 0;
+    peer_offloads = -1;
+
+    s = g_malloc0(sizeof(*s));
+    s->parent.qdev.parent.class = (void *)&klass;
+    s->parent.config = g_malloc0(PCI_CONFIG_SPACE_SIZE);
+    check(pci_e1000_init(&s->parent) == 0);
+    e1000_reset(s);
+    s->parent.config[PCI_COMMAND] |= PCI_COMMAND_MASTER;
+
+    check(s->has_vnet == vnet && peer_using_vnet == vnet);
+    if (vnet) {
+        check(peer_vnet_hdr_len == sizeof(struct virtio_net_hdr));
+        check(peer_offloads == 0);
+    }
+
+    memset(guest, 0, GUEST_SIZE);
+    for (i = 0; i < RING_SIZE; i++) {
+        struct e1000_rx_desc *rd = (struct e1000_rx_desc *)(guest + RX_RING) + i;
+
+        rd->buffer_addr = cpu_to_le64(RX_BUF + i * 2048);
+    }
+    for (i = 0; i < TSO_PAYLOAD; i++) {
+        guest[PAYLOAD + i] = i * 7 + (i >> 9);
+    }
+
+    reg_write(E1000_TDBAL, TX_RING);
+    reg_write(E1000_TDLEN, RING_SIZE * sizeof(struct e1000_tx_desc));
+    reg_write(E1000_TDH, 0);
+    reg_write(E1000_TDT, 0);
+    reg_write(E1000_TCTL, E1000_TCTL_EN);
+    reg_write(E1000_RDBAL, RX_RING);
+    reg_write(E1000_RDLEN, RING_SIZE * sizeof(struct e1000_rx_desc));
+    reg_write(E1000_RDH, 0);
+    reg_write(E1000_RDT, RING_SIZE - 1);
+    reg_write(E1000_RCTL, E1000_RCTL_EN | E1000_RCTL_BAM | E1000_RCTL_SECRC);
+}
+
+/* Ethernet, IPv4 and TCP headers at HDR, with what Linux leaves for the
+ * device to fill in: the TCP checksum field holds the pseudo-header sum,
+ * with the length unless the packet is a TSO one */
+static void build_headers(int payload, bool tso)
+{
+    static const uint8_t eth[14] = {
+        0x52, 0x54, 0x00, 0x12, 0x34, 0x57, 0x52, 0x54, 0x00, 0x12, 0x34, 0x56,
+        0x08, 0x00,
+    };
+    uint8_t *h = guest + HDR, *ip = h + 14, *tcp = h + 34;
+
+    memset(h, 0, HDR_LEN);
+    memcpy(h, eth, sizeof(eth));
+    ip[0] = 0x45;
+    stw_be_p(ip + 2, tso ? 0 : 40 + payload);
+    stw_be_p(ip + 4, 0x1234);
+    ip[8] = 64;
+    ip[9] = IPPROTO_TCP;
+    stl_be_p(ip + 12, 0x0a00020f);          /* 10.0.2.15 */
+    stl_be_p(ip + 16, 0x0a000202);          /* 10.0.2.2 */
+    stw_be_p(tcp, 40000);
+    stw_be_p(tcp + 2, 5001);
+    stl_be_p(tcp + 4, SEQ);
+    tcp[12] = 0x50;
+    tcp[13] = 0x18;                         /* ACK, PSH */
+    stw_be_p(tcp + 14, 0xffff);
+    stw_be_p(tcp + 16, tso ? pseudo_sum(ip)
+                           : fold(pseudo_sum(ip) + 20 + payload));
+}
+
+static struct e1000_tx_desc *tx_desc(int i)
+{
+    return (struct e1000_tx_desc *)(guest + TX_RING) + i % RING_SIZE;
+}
+
+static int put_context(int i, bool tso, int payload)
+{
+    struct e1000_context_desc *xp = (struct e1000_context_desc *)tx_desc(i);
+    uint32_t cmd = E1000_TXD_CMD_DEXT | E1000_TXD_CMD_IP | E1000_TXD_CMD_TCP;
+
+    memset(xp, 0, sizeof(*xp));
+    xp->lower_setup.ip_fields.ipcss = 14;
+    xp->lower_setup.ip_fields.ipcso = 14 + 10;
+    xp->lower_setup.ip_fields.ipcse = cpu_to_le16(33);
+    xp->upper_setup.tcp_fields.tucss = 34;
+    xp->upper_setup.tcp_fields.tucso = 34 + 16;
+    if (tso) {
+        cmd |= E1000_TXD_CMD_TSE | payload;
+        xp->tcp_seg_setup.fields.hdr_len = HDR_LEN;
+        xp->tcp_seg_setup.fields.mss = cpu_to_le16(MSS);
+    }
+    xp->cmd_and_length = cpu_to_le32(cmd);
+    return i + 1;
+}
+
+static int put_data(int i, uint64_t addr, int len, uint32_t cmd, bool first)
+{
+    struct e1000_tx_desc *dp = tx_desc(i);
+    uint8_t popts = E1000_TXD_POPTS_IXSM | E1000_TXD_POPTS_TXSM;
+
+    dp->buffer_addr = cpu_to_le64(addr);
+    dp->lower.data = cpu_to_le32(E1000_TXD_CMD_DEXT | E1000_TXD_DTYP_D |
+                                 E1000_TXD_CMD_IFCS | cmd | len);
+    dp->upper.data = cpu_to_le32(first ? popts << 8 : 0);
+    return i + 1;
+}
+
+/* Queues one packet as the Linux driver does: a context descriptor, the
+ * headers, then the payload a page per descriptor */
+static int put_packet(int i, bool tso)
+{
+    int payload = tso ? TSO_PAYLOAD : FRAME_PAYLOAD, off, len;
+    uint32_t cmd = tso ? E1000_TXD_CMD_TSE : 0;
+
+    i = put_context(i, tso, payload);
+    i = put_data(i, HDR, HDR_LEN, cmd, true);
+    for (off = 0; off < payload; off += len) {
+        len = MIN(4096, payload - off);
+        if (off + len == payload) {
+            cmd |= E1000_TXD_CMD_EOP | E1000_TXD_CMD_RS;
+        }
+        i = put_data(i, PAYLOAD + off, len, cmd, false);
+    }
+    return i;
+}
+
+/* Fills the ring and has the device send it, returns the packets sent */
+static int xmit_round(bool tso)
+{
+    int descs = tso ? 2 + DIV_ROUND_UP(TSO_PAYLOAD, 4096) : 3;
+    int head = s->mac_reg[TDH], i = head, n;
+
+    for (n = 0; i + descs - head < RING_SIZE; n++) {
+        i = put_packet(i, tso);
+    }
+    reg_write(E1000_TDT, i % RING_SIZE);
+    check(s->mac_reg[TDH] == i % RING_SIZE);
+    check(tx_desc(i - 1)->upper.fields.status & E1000_TXD_STAT_DD);
+    return n;
+}
+
+static void bench_tx(const char *name, bool tso, int rounds)
+{
+    int64_t start, elapsed;
+    long packets, frames;
+    int r;
+
+    build_headers(tso ? TSO_PAYLOAD : FRAME_PAYLOAD, tso);
+    memset(&peer, 0, sizeof(peer));
+    peer.verify = true;
+    peer.tso = tso;
+    peer.next_seq = SEQ;
+    packets = xmit_round(tso);
+    check(peer.next_seq == SEQ);
+    frames = peer.frames;
+    if (!tso || !peer_vnet) {
+        check(frames == packets * (tso ? DIV_ROUND_UP(TSO_PAYLOAD, MSS) : 1));
+    } else {
+        check(frames == packets);
+    }
+
+    peer.verify = false;
+    packets = 0;
+    start = vmx_clock_get_ns(QEMU_CLOCK_REALTIME);
+    for (r = 0; r < rounds; r++) {
+        packets += xmit_round(tso);
+    }
+    elapsed = vmx_clock_get_ns(QEMU_CLOCK_REALTIME) - start;
+    frames = peer.frames - frames;
+
+    printf("%-28s %9.0f packets/s %9.0f frames/s %6.2f Gbit/s\n", name,
+           packets * 1e9 / elapsed, frames * 1e9 / elapsed,
+           packets * (tso ? TSO_PAYLOAD : FRAME_PAYLOAD) * 8.0 / elapsed);
+}
+
+/* Hands the device one frame from the peer and checks what the guest got */
+static void receive(const struct iovec *iov, int iovcnt, const uint8_t *frame,
+                    int size)
+{
+    int rdh = s->mac_reg[RDH];
+    struct e1000_rx_desc *rd = (struct e1000_rx_desc *)(guest + RX_RING) + rdh;
+
+    rd->status = 0;
+    check(e1000_receive_iov(&nic_nc, iov, iovcnt) == MAX(size, MIN_BUF_SIZE));
+    check(s->mac_reg[RDH] == (rdh + 1) % RING_SIZE);
+    check(rd->status & E1000_RXD_STAT_DD && rd->status & E1000_RXD_STAT_EOP);
+    check(le16_to_cpu(rd->length) == MAX(size, MIN_BUF_SIZE));
+    check(!memcmp(guest + RX_BUF + rdh * 2048, frame, size));
+    reg_write(E1000_RDT, rdh);
+}
+
+static void check_rx(void)
+{
+    struct virtio_net_hdr plain = { 0 }, gso = {
+        .flags = VIRTIO_NET_HDR_F_NEEDS_CSUM,
+        .gso_type = VIRTIO_NET_HDR_GSO_TCPV4,
+        .hdr_len = HDR_LEN, .gso_size = MSS, .csum_start = 34,
+        .csum_offset = 16,
+    };
+    uint8_t frame[1514], packed[sizeof(plain) + sizeof(frame)];
+    struct iovec iov[4];
+    int i, rdh;
+
+    memset(frame, 0xff, 6);
+    for (i = 6; i < sizeof(frame); i++) {
+        frame[i] = i * 13;
+    }
+
+    if (!peer_vnet) {
+        /* taken as is, whatever it starts with */
+        memcpy(packed, &gso, sizeof(gso));
+        memcpy(packed + sizeof(gso), frame, sizeof(frame));
+        memset(packed, 0xff, 6);
+        iov[0] = (struct iovec) { packed, sizeof(frame) };
+        receive(iov, 1, packed, sizeof(frame));
+        iov[0] = (struct iovec) { frame, 10 };
+        iov[1] = (struct iovec) { frame + 10, sizeof(frame) - 10 };
+        receive(iov, 2, frame, sizeof(frame));
+        return;
+    }
+
+    /* header and frame in their own buffers, as tap sends them */
+    iov[0] = (struct iovec) { &plain, sizeof(plain) };
+    iov[1] = (struct iovec) { frame, sizeof(frame) };
+    receive(iov, 2, frame, sizeof(frame));
+    iov[0].iov_base = &gso;
+    receive(iov, 2, frame, sizeof(frame));
+    iov[1].iov_len = 42;
+    receive(iov, 2, frame, 42);
+
+    /* in one buffer */
+    memcpy(packed, &gso, sizeof(gso));
+    memcpy(packed + sizeof(gso), frame, sizeof(frame));
+    iov[0] = (struct iovec) { packed, sizeof(packed) };
+    receive(iov, 1, frame, sizeof(frame));
+
+    /* the header split, and the frame's header split from the rest */
+    iov[0] = (struct iovec) { &plain, 4 };
+    iov[1] = (struct iovec) { (uint8_t *)&plain + 4, sizeof(plain) - 4 };
+    iov[2] = (struct iovec) { frame, 8 };
+    iov[3] = (struct iovec) { frame + 8, sizeof(frame) - 8 };
+    receive(iov, 4, frame, sizeof(frame));
+
+    /* a header alone is dropped */
+    rdh = s->mac_reg[RDH];
+    iov[0] = (struct iovec) { &gso, sizeof(gso) };
+    check(e1000_receive_iov(&nic_nc, iov, 1) == sizeof(gso));
+    check(s->mac_reg[RDH] == rdh);
+}
+
+int main(int argc, char **argv)
+{
+    int rounds = 200;
+
+    if (argc > 1) {
+        rounds = atoi(argv[1]);
+        check(rounds > 0);
+    }
+    guest = g_malloc0(GUEST_SIZE);
+
+    setup(true);
+    check_rx();
+    bench_tx("vnet peer, 1514 byte frames", false, rounds * 10);
+    bench_tx("vnet peer, 64K TSO", true, rounds);
+
+    setup(false);
+    check_rx();
+    bench_tx("plain peer, 1514 byte frames", false, rounds * 10);
+    bench_tx("plain peer, 64K TSO", true, rounds);
+
+    printf("e1000-bench: ok\n");
+    return 0;
+}
@@ -0,0 +1,160 @@
+/*
+ * The protocol layer under an image format driver, for host side
+ * harnesses: every BlockDriverState used as bs->file reads and writes one
+ * sparse in-memory image.  Clusters that were never written read as zeroes.
+ *
+ * Copyright (C) 2016 Veertu Inc,
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 or
+ * (at your option) version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu-common.h"
+#include "block_int.h"
+
+#define CHUNK_BITS      16
+#define CHUNK_SIZE      (1 << CHUNK_BITS)
+#define MAX_CHUNKS      (1 << 20)       /* 64G of image */
+
+static uint8_t *chunks[MAX_CHUNKS];
+static int64_t image_length;
+
+int bdrv_pread(BlockDriverState *bs, int64_t offset, void *buf, int count)
+{
+    int64_t pos = offset;
+    uint8_t *p = buf;
+
+    while (pos < offset + count) {
+        uint64_t chunk = pos >> CHUNK_BITS;
+        int skip = pos & (CHUNK_SIZE - 1);
+        int n = MIN(CHUNK_SIZE - skip, offset + count - pos);
+
+        if (chunk >= MAX_CHUNKS) {
+            return -EIO;
+        }
+        if (chunks[chunk]) {
+            memcpy(p, chunks[chunk] + skip, n);
+        } else {
+            memset(p, 0, n);
+        }
+        pos += n;
+        p += n;
+    }
+    return count;
+}
+
+int bdrv_pwrite(BlockDriverState *bs, int64_t offset, const void *buf,
+                int count)
+{
+    int64_t pos = offset;
+    const uint8_t *p = buf;
+
+    while (pos < offset + count) {
+        uint64_t chunk = pos >> CHUNK_BITS;
+        int skip = pos & (CHUNK_SIZE - 1);
+        int n = MIN(CHUNK_SIZE - skip, offset + count - pos);
+
+        if (chunk >= MAX_CHUNKS) {
+            return -EIO;
+        }
+        if (!chunks[chunk]) {
+            chunks[chunk] = g_malloc0(CHUNK_SIZE);
+        }
+        memcpy(chunks[chunk] + skip, p, n);
+        pos += n;
+        p += n;
+    }
+    image_length = MAX(image_length, offset + count);
+    return count;
+}
+
+int bdrv_pwrite_sync(BlockDriverState *bs, int64_t offset, const void *buf,
+                     int count)
+{
+    int ret = bdrv_pwrite(bs, offset, buf, count);
+
+    return ret < 0 ? ret : 0;
+}
+
+int bdrv_read(BlockDriverState *bs, int64_t sector_num, uint8_t *buf,
+              int nb_sectors)
+{
+    int ret = bdrv_pread(bs, sector_num * BDRV_SECTOR_SIZE, buf,
+                         nb_sectors * BDRV_SECTOR_SIZE);
+
+    return ret < 0 ? ret : 0;
+}
+
+int bdrv_write(BlockDriverState *bs, int64_t sector_num, const uint8_t *buf,
+               int nb_sectors)
+{
+    int ret = bdrv_pwrite(bs, sector_num * BDRV_SECTOR_SIZE, buf,
+                          nb_sectors * BDRV_SECTOR_SIZE);
+
+    return ret < 0 ? ret : 0;
+}
+
+int bdrv_flush(BlockDriverState *bs)
+{
+    return 0;
+}
+
+int bdrv_discard(BlockDriverState *bs, int64_t sector_num, int nb_sectors)
+{
+    return 0;
+}
+
+int bdrv_truncate(BlockDriverState *bs, int64_t offset)
+{
+    image_length = offset;
+    return 0;
+}
+
+int64_t bdrv_getlength(BlockDriverState *bs)
+{
+    return image_length;
+}
+
+void bdrv_debug_event(BlockDriverState *bs, BlkDebugEvent event)
+{
+}
+
+void *vmx_try_blockalign(BlockDriverState *bs, size_t size)
+{
+    void *ptr;
+
+    if (posix_memalign(&ptr, 4096, MAX(size, 1))) {
+        return NULL;
+    }
+    return ptr;
+}
+
+void *vmx_blockalign(BlockDriverState *bs, size_t size)
+{
+    void *ptr = vmx_try_blockalign(bs, size);
+
+    if (!ptr) {
+        abort();
+    }
+    return ptr;
+}
+
+void *vmx_blockalign0(BlockDriverState *bs, size_t size)
+{
+    return memset(vmx_blockalign(bs, size), 0, size);
+}
+
+void vmx_vfree(void *ptr)
+{
+    free(ptr);
+}
@@ -0,0 +1,266 @@
+/*
+ * Runs N threads through address_space_rw into I/O areas that do and do
+ * not rely on the iothread lock, and reports accesses per second against
+ * the thread count.
+ *
+ * The areas copy the locking of the devices converted to run without the
+ * iothread lock: the local apic (its own recursive lock), the ACPI PM
+ * timer (no shared state) and the vmx backdoor ports that still take the
+ * iothread lock.  "apic-locked" is the apic with global locking left on,
+ * i.e. what every vcpu paid before the conversion.
+ *
+ * Copyright (C) 2016 Veertu Inc,
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 or
+ * (at your option) version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "qemu-common.h"
+#include "qemu/main-loop.h"
+#include "qemu/module.h"
+#include "address-spaces.h"
+
+#define check(cond)                                                     \
+    do {                                                                \
+        if (!(cond)) {                                                  \
+            fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__,   \
+                    #cond);                                             \
+            exit(1);                                                    \
+        }                                                               \
+    } while (0)
+
+#define APIC_BASE       0xfee00000
+#define APIC_LOCKED     0xfed00000
+#define PM_TMR_PORT     0x608
+#define VMX_PORT        0x5658
+
+#define MAX_THREADS     16
+
+/* Devices */
+
+static pthread_mutex_t apic_mutex;
+static uint32_t apic_regs[256];
+
+static uint64_t apic_read(void *opaque, hwaddr addr, unsigned size)
+{
+    uint32_t val;
+
+    pthread_mutex_lock(&apic_mutex);
+    val = apic_regs[(addr >> 4) & 0xff];
+    pthread_mutex_unlock(&apic_mutex);
+    return val;
+}
+
+static void apic_write(void *opaque, hwaddr addr, uint64_t val, unsigned size)
+{
+    pthread_mutex_lock(&apic_mutex);
+    apic_regs[(addr >> 4) & 0xff] = val;
+    pthread_mutex_unlock(&apic_mutex);
+}
+
+static MemAreaOps apic_ops = {
+    .read = apic_read,
+    .write = apic_write,
+    .valid.min_access_size = 4,
+    .valid.max_access_size = 4,
+};
+
+static uint64_t pm_tmr_read(void *opaque, hwaddr addr, unsigned size)
+{
+    struct timespec ts;
+
+    check(!vmx_mutex_iothread_locked());
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    /* 3.579545 MHz */
+    return ((ts.tv_sec * 1000000000llu + ts.tv_nsec) * 3579545 /
+            1000000000) & 0xffffff;
+}
+
+static void pm_tmr_write(void *opaque, hwaddr addr, uint64_t val,
+                         unsigned size)
+{
+}
+
+static MemAreaOps pm_tmr_ops = {
+    .read = pm_tmr_read,
+    .write = pm_tmr_write,
+    .valid.min_access_size = 4,
+    .valid.max_access_size = 4,
+};
+
+static uint64_t vmx_port_calls;
+
+static uint64_t vmx_port_read(void *opaque, hwaddr addr, unsigned size)
+{
+    check(vmx_mutex_iothread_locked());
+    return ++vmx_port_calls;
+}
+
+static void vmx_port_write(void *opaque, hwaddr addr, uint64_t val,
+                           unsigned size)
+{
+    check(vmx_mutex_iothread_locked());
+}
+
+static MemAreaOps vmx_port_ops = {
+    .read = vmx_port_read,
+    .write = vmx_port_write,
+    .valid.min_access_size = 4,
+    .valid.max_access_size = 4,
+};
+
+static VeertuMemArea apic_io, apic_locked_io, pm_tmr_io, vmx_port_io;
+
+static void init_devices(void)
+{
+    pthread_mutexattr_t attr;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&apic_mutex, &attr);
+
+    veertu_moudle_call_init(3);
+    cpu_exec_init_all();
+
+    memory_area_init_io(&apic_io, NULL, &apic_ops, NULL, "apic", 0x1000);
+    mem_area_clear_global_locking(&apic_io);
+    mem_area_add_child(get_system_memory(), APIC_BASE, &apic_io);
+
+    memory_area_init_io(&apic_locked_io, NULL, &apic_ops, NULL, "apic-locked",
+                        0x1000);
+    mem_area_add_child(get_system_memory(), APIC_LOCKED, &apic_locked_io);
+
+    memory_area_init_io(&pm_tmr_io, NULL, &pm_tmr_ops, NULL, "acpi-tmr", 4);
+    mem_area_clear_global_locking(&pm_tmr_io);
+    mem_area_add_child(get_system_io(), PM_TMR_PORT, &pm_tmr_io);
+
+    memory_area_init_io(&vmx_port_io, NULL, &vmx_port_ops, NULL, "vmx-port",
+                        4);
+    mem_area_add_child(get_system_io(), VMX_PORT, &vmx_port_io);
+}
+
+/* Workers */
+
+struct target {
+    const char *name;
+    VeertuAddressSpace *as;
+    hwaddr addr;
+    bool write;
+};
+
+static struct target targets[] = {
+    { "apic tpr read", &address_space_memory, APIC_BASE + 0x80, false },
+    { "apic eoi write", &address_space_memory, APIC_BASE + 0xb0, true },
+    { "apic-locked read", &address_space_memory, APIC_LOCKED + 0x80, false },
+    { "acpi-tmr read", &address_space_io, PM_TMR_PORT, false },
+    { "vmx-port read", &address_space_io, VMX_PORT, false },
+};
+
+struct worker {
+    pthread_t thread;
+    struct target *target;
+    long iterations;
+};
+
+static void *worker_run(void *opaque)
+{
+    struct worker *w = opaque;
+    uint32_t val = 0;
+    long i;
+
+    for (i = 0; i < w->iterations; i++) {
+        check(!address_space_rw(w->target->as, w->target->addr,
+                                (uint8_t *)&val, 4, w->target->write));
+    }
+    return NULL;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000llu + ts.tv_nsec;
+}
+
+static double run(struct target *target, int nr_threads, long iterations)
+{
+    struct worker workers[MAX_THREADS];
+    uint64_t start;
+    int i;
+
+    start = now_ns();
+    for (i = 0; i < nr_threads; i++) {
+        workers[i].target = target;
+        workers[i].iterations = iterations;
+        check(!pthread_create(&workers[i].thread, NULL, worker_run,
+                              &workers[i]));
+    }
+    for (i = 0; i < nr_threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    return (double)nr_threads * iterations * 1e9 / (now_ns() - start);
+}
+
+static void test_dispatch(void)
+{
+    uint32_t val = 0x12345678;
+    uint64_t calls = vmx_port_calls;
+
+    check(!address_space_rw(&address_space_memory, APIC_BASE + 0x300,
+                            (uint8_t *)&val, 4, true));
+    val = 0;
+    check(!address_space_rw(&address_space_memory, APIC_LOCKED + 0x300,
+                            (uint8_t *)&val, 4, false));
+    check(val == 0x12345678);
+    check(address_space_is_lockless(&address_space_memory, APIC_BASE, 4));
+    check(!address_space_is_lockless(&address_space_memory, APIC_LOCKED, 4));
+    check(address_space_is_lockless(&address_space_io, PM_TMR_PORT, 4));
+    check(!address_space_is_lockless(&address_space_io, VMX_PORT, 4));
+
+    check(!address_space_rw(&address_space_io, VMX_PORT, (uint8_t *)&val, 4,
+                            false));
+    check(val == calls + 1);
+    check(!vmx_mutex_iothread_locked());
+}
+
+int main(int argc, char **argv)
+{
+    long iterations = argc > 1 ? atol(argv[1]) : 200000;
+    int threads[] = { 1, 2, 4, 8 };
+    int i, j;
+
+    init_devices();
+    test_dispatch();
+
+    printf("%-18s", "accesses/s");
+    for (j = 0; j < ARRAY_SIZE(threads); j++) {
+        printf(" %9d thr", threads[j]);
+    }
+    printf("\n");
+    for (i = 0; i < ARRAY_SIZE(targets); i++) {
+        printf("%-18s", targets[i].name);
+        for (j = 0; j < ARRAY_SIZE(threads); j++) {
+            printf(" %13.0f", run(&targets[i], threads[j], iterations));
+        }
+        printf("\n");
+    }
+
+    printf("memory-dispatch-bench: ok\n");
+    return 0;
+}
@@ -0,0 +1,129 @@
+/*
+ * Just enough of the rest of the emulator to run the memory core
+ * (util/exec.c and util/mapping.c) in a host process.
+ *
+ * Copyright (C) 2016 Veertu Inc,
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 or
+ * (at your option) version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sys/mman.h>
+
+#include "qemu-common.h"
+#include "qemu/main-loop.h"
+#include "qdev-core.h"
+#include "vmstate.h"
+#include "exec-all.h"
+#include "sysemu.h"
+
+int mem_prealloc;
+const VMStateInfo vmstate_info_uint32;
+
+/* A plain mutex, owned per thread as in util/cpus.c */
+static pthread_mutex_t iothread_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread bool iothread_locked;
+
+void vmx_mutex_lock_iothread(void)
+{
+    pthread_mutex_lock(&iothread_mutex);
+    iothread_locked = true;
+}
+
+void vmx_mutex_unlock_iothread(void)
+{
+    iothread_locked = false;
+    pthread_mutex_unlock(&iothread_mutex);
+}
+
+bool vmx_mutex_iothread_locked(void)
+{
+    return iothread_locked;
+}
+
+void *vmx_memalign(size_t alignment, size_t size)
+{
+    void *ptr;
+
+    if (posix_memalign(&ptr, alignment, size)) {
+        abort();
+    }
+    return ptr;
+}
+
+void vmx_vfree(void *ptr)
+{
+    free(ptr);
+}
+
+void *vmx_anon_ram_alloc(size_t size, uint64_t *alignment)
+{
+    void *ptr = mmap(0, size, PROT_READ | PROT_WRITE,
+                     MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+
+    if (ptr == MAP_FAILED) {
+        return NULL;
+    }
+    if (alignment) {
+        *alignment = getpagesize();
+    }
+    return ptr;
+}
+
+void vmx_anon_ram_free(void *ptr, size_t size)
+{
+    munmap(ptr, size);
+}
+
+int vmx_madvise(void *addr, size_t len, int advice)
+{
+    return 0;
+}
+
+int vmx_get_thread_id(void)
+{
+    return getpid();
+}
+
+QemuOpts *vmx_get_machine_opts(void)
+{
+    return NULL;
+}
+
+bool vmx_opt_get_bool(QemuOpts *opts, const char *name, bool defval)
+{
+    return defval;
+}
+
+char *qdev_get_dev_path(DeviceState *dev)
+{
+    return NULL;
+}
+
+const struct VMStateDescription *qdev_get_vmsd(DeviceState *dev)
+{
+    return NULL;
+}
+
+int vmstate_register_with_alias_id(DeviceState *dev,
+                                   int instance_id,
+                                   const VMStateDescription *vmsd,
+                                   void *base, int alias_id,
+                                   int required_for_version)
+{
+    return 0;
+}
+
+void tb_invalidate_phys_addr(VeertuAddressSpace *as, hwaddr addr)
+{
+}
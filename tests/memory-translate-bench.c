@@ -0,0 +1,248 @@
+/*
+ * Times address_space_translate and address_space_rw against a memory map
+ * laid out like the one devices/pc.c builds: RAM split around the PCI hole
+ * through aliases, BIOS and option ROMs, the VGA window over low RAM and
+ * a few MMIO devices under 4G.  Checks that the per-thread translate cache
+ * gives the same answers as the page map, including after a remap.
+ *
+ * Copyright (C) 2016 Veertu Inc,
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 or
+ * (at your option) version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "qemu-common.h"
+#include "qemu/main-loop.h"
+#include "qemu/module.h"
+#include "address-spaces.h"
+
+#define check(cond)                                                     \
+    do {                                                                \
+        if (!(cond)) {                                                  \
+            fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__,   \
+                    #cond);                                             \
+            exit(1);                                                    \
+        }                                                               \
+    } while (0)
+
+#define MiB             (1024 * 1024ull)
+
+#define RAM_SIZE        (1024 * MiB)
+#define BELOW_4G        (768 * MiB)
+#define BIOS_SIZE       (256 * 1024)
+#define ISA_BIOS_SIZE   (128 * 1024)
+#define VGA_BASE        0xa0000
+#define VGA_SIZE        0x20000
+#define OPTION_ROM      0xc0000
+#define OPTION_ROM_SIZE 0x20000
+#define IOAPIC_BASE     0xfec00000
+#define HPET_BASE       0xfed00000
+#define APIC_BASE       0xfee00000
+#define E1000_BAR       0xfebc0000
+
+static uint64_t mmio_read(void *opaque, hwaddr addr, unsigned size)
+{
+    return (uintptr_t)opaque + addr;
+}
+
+static void mmio_write(void *opaque, hwaddr addr, uint64_t val, unsigned size)
+{
+}
+
+static MemAreaOps mmio_ops = {
+    .read = mmio_read,
+    .write = mmio_write,
+    .valid.min_access_size = 1,
+    .valid.max_access_size = 4,
+};
+
+static VeertuMemArea ram, ram_below_4g, ram_above_4g;
+static VeertuMemArea bios, isa_bios, option_rom;
+static VeertuMemArea vga, ioapic, hpet, apic, e1000;
+
+static void add_mmio(VeertuMemArea *area, char *name, hwaddr base,
+                     uint64_t size, int priority)
+{
+    memory_area_init_io(area, NULL, &mmio_ops, (void *)(uintptr_t)base, name,
+                        size);
+    mem_area_add_child_overlap(get_system_memory(), base, area, priority);
+}
+
+static void pc_memory_map(void)
+{
+    VeertuMemArea *system_memory;
+
+    veertu_moudle_call_init(3);
+    cpu_exec_init_all();
+    system_memory = get_system_memory();
+
+    mem_area_init_ram(&ram, "pc.ram", RAM_SIZE, NULL);
+    mem_area_init_alias(&ram_below_4g, "ram-below-4g", &ram, 0, BELOW_4G);
+    mem_area_add_child(system_memory, 0, &ram_below_4g);
+    mem_area_init_alias(&ram_above_4g, "ram-above-4g", &ram, BELOW_4G,
+                        RAM_SIZE - BELOW_4G);
+    mem_area_add_child(system_memory, 0x100000000ULL, &ram_above_4g);
+
+    mem_area_init_ram(&bios, "pc.bios", BIOS_SIZE, NULL);
+    mem_area_set_readonly(&bios, 1, 0);
+    mem_area_add_child(system_memory, 0x100000000ULL - BIOS_SIZE, &bios);
+    mem_area_init_alias(&isa_bios, "isa-bios", &bios,
+                        BIOS_SIZE - ISA_BIOS_SIZE, ISA_BIOS_SIZE);
+    mem_area_add_child_overlap(system_memory, 0x100000 - ISA_BIOS_SIZE,
+                               &isa_bios, 1);
+    mem_area_init_ram(&option_rom, "pc.rom", OPTION_ROM_SIZE, NULL);
+    mem_area_add_child_overlap(system_memory, OPTION_ROM, &option_rom, 1);
+
+    add_mmio(&vga, "vga-lowmem", VGA_BASE, VGA_SIZE, 1);
+    add_mmio(&ioapic, "ioapic", IOAPIC_BASE, 0x1000, 0);
+    add_mmio(&hpet, "hpet", HPET_BASE, 0x400, 0);
+    add_mmio(&apic, "apic-msi", APIC_BASE, 0x100000, 0);
+    add_mmio(&e1000, "e1000-mmio", E1000_BAR, 0x20000, 0);
+}
+
+static uint8_t *ram_ptr(hwaddr offset)
+{
+    return (uint8_t *)memory_area_get_ram_ptr(&ram) + offset;
+}
+
+static void test_map(void)
+{
+    uint64_t val, pattern = 0x0123456789abcdefull;
+    VeertuMemArea *mr;
+    hwaddr xlat, l;
+
+    /* RAM goes straight to pc.ram, on both sides of the hole */
+    check(!address_space_rw(&address_space_memory, 0x123458,
+                            (uint8_t *)&pattern, 8, true));
+    check(!memcmp(ram_ptr(0x123458), &pattern, 8));
+    memcpy(ram_ptr(BELOW_4G + 0x1000), &pattern, 8);
+    val = 0;
+    check(!address_space_rw(&address_space_memory, 0x100001000ull,
+                            (uint8_t *)&val, 8, false));
+    check(val == pattern);
+
+    l = 8;
+    mr = address_space_translate(&address_space_memory, BELOW_4G - 0x1000,
+                                 &xlat, &l, false);
+    check(mr == &ram && xlat == BELOW_4G - 0x1000);
+    l = 8;
+    mr = address_space_translate(&address_space_memory, 0x100002000ull,
+                                 &xlat, &l, false);
+    check(mr == &ram && xlat == BELOW_4G + 0x2000);
+
+    /* ROM ignores writes, also after a cached read */
+    check(!address_space_rw(&address_space_memory, 0xfffffff0,
+                            (uint8_t *)&val, 8, false));
+    val = ~0ull;
+    address_space_rw(&address_space_memory, 0xfffffff0, (uint8_t *)&val, 8,
+                     true);
+    check(*(uint64_t *)((uint8_t *)memory_area_get_ram_ptr(&bios) +
+                        BIOS_SIZE - 0x10) != ~0ull);
+
+    check(!address_space_rw(&address_space_memory, E1000_BAR + 0x10,
+                            (uint8_t *)&val, 4, false));
+    check((uint32_t)val == E1000_BAR + 0x10);
+    check(!address_space_rw(&address_space_memory, VGA_BASE + 4,
+                            (uint8_t *)&val, 4, false));
+    check((uint32_t)val == VGA_BASE + 4);
+
+    /* a remap is seen by the next lookup from this thread */
+    mem_area_set_enable(&vga, 0, 1);
+    pattern = 0x1122334455667788ull;
+    memcpy(ram_ptr(VGA_BASE + 8), &pattern, 8);
+    check(!address_space_rw(&address_space_memory, VGA_BASE + 8,
+                            (uint8_t *)&val, 8, false));
+    check(val == pattern);
+    mem_area_set_enable(&vga, 1, 1);
+    check(!address_space_rw(&address_space_memory, VGA_BASE + 8,
+                            (uint8_t *)&val, 4, false));
+    check((uint32_t)val == VGA_BASE + 8);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000llu + ts.tv_nsec;
+}
+
+/* Addresses are visited round robin, so more than four regions miss */
+static void bench_translate(const char *name, const hwaddr *addrs, int nr,
+                            long iterations)
+{
+    uint64_t start = now_ns();
+    hwaddr xlat, l;
+    long i;
+
+    for (i = 0; i < iterations; i++) {
+        l = 8;
+        address_space_translate(&address_space_memory, addrs[i % nr], &xlat,
+                                &l, false);
+    }
+    printf("%-30s %6.1f ns/op\n", name,
+           (double)(now_ns() - start) / iterations);
+}
+
+static void bench_rw(const char *name, const hwaddr *addrs, int nr, int len,
+                     long iterations)
+{
+    uint8_t buf[64];
+    uint64_t start = now_ns();
+    long i;
+
+    for (i = 0; i < iterations; i++) {
+        address_space_rw(&address_space_memory, addrs[i % nr], buf, len,
+                         i & 1);
+    }
+    printf("%-30s %6.1f ns/op\n", name,
+           (double)(now_ns() - start) / iterations);
+}
+
+int main(int argc, char **argv)
+{
+    long iterations = argc > 1 ? atol(argv[1]) : 5000000;
+    static const hwaddr ring[] = { 0x7f000, 0x7f800, 0x2e000000 };
+    static const hwaddr high[] = { 0x100000000ull, 0x10ff00000ull };
+    static const hwaddr devices[] = { E1000_BAR + 0xc0, IOAPIC_BASE + 0x10 };
+    static const hwaddr mixed[] = { 0x7f000, E1000_BAR + 0x3818, 0x100000000ull,
+                                    0x7f800 };
+    static const hwaddr spread[] = { 0x7f000, 0xfffffff0, 0xc0000, VGA_BASE,
+                                     IOAPIC_BASE, HPET_BASE, E1000_BAR,
+                                     0x100000000ull };
+
+    pc_memory_map();
+    test_map();
+
+    bench_translate("translate, 2 RAM sections", ring, ARRAY_SIZE(ring),
+                    iterations);
+    bench_translate("translate, 4 mixed regions", mixed, ARRAY_SIZE(mixed),
+                    iterations);
+    bench_translate("translate, 8 regions (misses)", spread,
+                    ARRAY_SIZE(spread), iterations);
+    bench_rw("rw 16 bytes, RAM below 4G", ring, ARRAY_SIZE(ring), 16,
+             iterations);
+    bench_rw("rw 16 bytes, RAM above 4G", high, ARRAY_SIZE(high), 16,
+             iterations);
+    bench_rw("rw 4 bytes, MMIO", devices, ARRAY_SIZE(devices), 4, iterations);
+    bench_rw("rw 4 bytes, 8 regions", spread, ARRAY_SIZE(spread), 4,
+             iterations);
+
+    printf("memory-translate-bench: ok\n");
+    return 0;
+}
@@ -0,0 +1,212 @@
+/*
+ * Fragments the refcounts of a qcow2 image held in memory and times the
+ * cluster allocations that allocating writes make: one cluster per 64K
+ * write into small holes, then 1M writes that have to search past them
+ * after a round of discards.  Checks every allocation against a reference
+ * map and the refcounts written back at the end.
+ *
+ * Copyright (C) 2016 Veertu Inc,
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 or
+ * (at your option) version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "qemu-common.h"
+#include "block_int.h"
+#include "qcow2.h"
+
+#define check(cond)                                                     \
+    do {                                                                \
+        if (!(cond)) {                                                  \
+            fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__,   \
+                    #cond);                                             \
+            exit(1);                                                    \
+        }                                                               \
+    } while (0)
+
+#define CLUSTER_BITS    16
+#define CLUSTER_SIZE    (1 << CLUSTER_BITS)
+#define REFBLOCK_BITS   (CLUSTER_BITS - 1)          /* 16 bit refcounts */
+#define NB_REFBLOCKS    8
+#define IMAGE_CLUSTERS  (NB_REFBLOCKS << REFBLOCK_BITS)     /* 16G */
+#define MAX_CLUSTERS    (2 * IMAGE_CLUSTERS)
+
+/* header, refcount table, refcount blocks */
+#define REFTABLE_OFFSET         CLUSTER_SIZE
+#define REFBLOCK_OFFSET(i)      ((2 + (i)) * (uint64_t)CLUSTER_SIZE)
+#define METADATA_CLUSTERS       (2 + NB_REFBLOCKS)
+
+void qcow2_signal_corruption(BlockDriverState *bs, bool fatal, int64_t offset,
+                             int64_t size, const char *message_format, ...)
+{
+    check(!"image corrupted");
+}
+
+int qcow2_write_l1_entry(BlockDriverState *bs, int l1_index)
+{
+    abort();
+}
+
+static BlockDriverState bs, file;
+static BDRVQcowState s;
+static bool used[MAX_CLUSTERS];
+static unsigned seed = 1;
+
+static void build_image(void)
+{
+    uint64_t *reftable = g_malloc0(CLUSTER_SIZE);
+    uint16_t *refblock = g_malloc0(CLUSTER_SIZE);
+    uint64_t i = METADATA_CLUSTERS;
+    int b, run;
+
+    /* runs of 1-32 used clusters between holes of 1-4 clusters */
+    memset(used, 0, sizeof(used));
+    memset(used, 1, METADATA_CLUSTERS);
+    while (i < IMAGE_CLUSTERS) {
+        for (run = 1 + rand_r(&seed) % 32; run && i < IMAGE_CLUSTERS; run--) {
+            used[i++] = true;
+        }
+        i += 1 + rand_r(&seed) % 4;
+    }
+
+    for (b = 0; b < NB_REFBLOCKS; b++) {
+        reftable[b] = cpu_to_be64(REFBLOCK_OFFSET(b));
+        for (i = 0; i < (1 << REFBLOCK_BITS); i++) {
+            refblock[i] = cpu_to_be16(used[(b << REFBLOCK_BITS) + i]);
+        }
+        check(bdrv_pwrite(&file, REFBLOCK_OFFSET(b), refblock,
+                          CLUSTER_SIZE) == CLUSTER_SIZE);
+    }
+    check(bdrv_pwrite(&file, REFTABLE_OFFSET, reftable, CLUSTER_SIZE) ==
+          CLUSTER_SIZE);
+    check(bdrv_truncate(&file, (uint64_t)IMAGE_CLUSTERS * CLUSTER_SIZE) == 0);
+    g_free(reftable);
+    g_free(refblock);
+
+    s.cluster_bits = CLUSTER_BITS;
+    s.cluster_size = CLUSTER_SIZE;
+    s.cluster_sectors = CLUSTER_SIZE / BDRV_SECTOR_SIZE;
+    s.l2_bits = CLUSTER_BITS - 3;
+    s.l2_size = 1 << s.l2_bits;
+    s.refcount_order = 4;
+    s.refcount_block_bits = REFBLOCK_BITS;
+    s.refcount_block_size = 1 << REFBLOCK_BITS;
+    s.refcount_table_offset = REFTABLE_OFFSET;
+    s.refcount_table_size = CLUSTER_SIZE / sizeof(uint64_t);
+    QTAILQ_INIT(&s.discards);
+
+    bs.opaque = &s;
+    bs.file = &file;
+    s.l2_table_cache = qcow2_cache_create(&bs, 4);
+    s.refcount_block_cache = qcow2_cache_create(&bs, 4);
+    check(s.l2_table_cache && s.refcount_block_cache);
+    check(qcow2_refcount_init(&bs) == 0);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000llu + ts.tv_nsec;
+}
+
+static int64_t alloc(int nb_clusters)
+{
+    int64_t offset = qcow2_alloc_clusters(&bs, nb_clusters * CLUSTER_SIZE);
+    uint64_t i, index = offset >> CLUSTER_BITS;
+
+    check(offset > 0 && !(offset & (CLUSTER_SIZE - 1)));
+    check(index + nb_clusters <= MAX_CLUSTERS);
+    for (i = index; i < index + nb_clusters; i++) {
+        check(!used[i]);
+        used[i] = true;
+    }
+    return offset;
+}
+
+/* Allocates until the allocator hands out space past `limit` or `max`
+ * allocations are done; returns the number of allocations */
+static long bench(const char *name, int nb_clusters, uint64_t limit, long max)
+{
+    uint64_t start = now_ns(), elapsed;
+    long n = 0;
+
+    while (n < max && alloc(nb_clusters) < limit) {
+        n++;
+    }
+    elapsed = now_ns() - start;
+    printf("%-28s %7ld allocations %9.0f/s %8.2f us each\n", name, n + 1,
+           (n + 1) * 1e9 / elapsed, elapsed / 1e3 / (n + 1));
+    return n;
+}
+
+static void discard_random(long count)
+{
+    uint64_t i;
+
+    while (count) {
+        i = METADATA_CLUSTERS + rand_r(&seed) % (IMAGE_CLUSTERS -
+                                                 METADATA_CLUSTERS);
+        if (!used[i]) {
+            continue;
+        }
+        qcow2_free_clusters(&bs, i << CLUSTER_BITS, CLUSTER_SIZE,
+                            QCOW2_DISCARD_NEVER);
+        used[i] = false;
+        count--;
+    }
+}
+
+static void check_refcounts(void)
+{
+    uint64_t i;
+
+    check(qcow2_cache_flush(&bs, s.refcount_block_cache) == 0);
+    for (i = 0; i < MAX_CLUSTERS; i++) {
+        int refcount = qcow2_get_refcount(&bs, i);
+
+        /* refcount blocks added past the end of the image */
+        if (refcount && !used[i] && i >= IMAGE_CLUSTERS) {
+            used[i] = true;
+        }
+        check(refcount == used[i]);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t limit = (uint64_t)IMAGE_CLUSTERS * CLUSTER_SIZE;
+    uint64_t start;
+
+    build_image();
+
+    start = now_ns();
+    alloc(1);
+    printf("%-28s %7.1f ms\n", "first allocation (map build)",
+           (now_ns() - start) / 1e6);
+
+    bench("64K writes into holes", 1, limit, IMAGE_CLUSTERS);
+    discard_random(IMAGE_CLUSTERS / 16);
+    bench("1M writes after discards", 16, 2 * limit, 2000);
+    bench("64K writes after discards", 1, limit, IMAGE_CLUSTERS);
+    check_refcounts();
+
+    printf("qcow2-alloc-bench: ok\n");
+    return 0;
+}
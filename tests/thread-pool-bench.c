@@ -0,0 +1,209 @@
+/*
+ * Drives the block layer thread pool with paio_submit-style preadv/pwritev
+ * requests against a scratch file and reports requests per second and
+ * submit-to-callback latency for a range of queue depths.  Point it at a
+ * file on tmpfs to take the disk out of the numbers.
+ *
+ *   thread-pool-bench [file] [requests per queue depth]
+ *
+ * Copyright (C) 2016 Veertu Inc,
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 or
+ * (at your option) version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "qemu-common.h"
+#include "thread-pool.h"
+#include "aio.h"
+
+#define check(cond)                                                     \
+    do {                                                                \
+        if (!(cond)) {                                                  \
+            fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__,   \
+                    #cond);                                             \
+            exit(1);                                                    \
+        }                                                               \
+    } while (0)
+
+#define BLOCK_SIZE      4096
+#define FILE_BLOCKS     16384           /* 64M */
+#define MAX_DEPTH       128
+
+/* thread_pool_submit_co is not used here */
+
+void vmx_coroutine_enter(Coroutine *co, void *opaque)
+{
+    abort();
+}
+
+void coroutine_fn vmx_coroutine_yield(void)
+{
+    abort();
+}
+
+Coroutine *coroutine_fn vmx_coroutine_self(void)
+{
+    abort();
+}
+
+bool vmx_in_coroutine(void)
+{
+    return false;
+}
+
+/* Requests, shaped like RawPosixAIOData and handled like aio_worker */
+
+typedef struct BenchRequest {
+    int fd;
+    bool write;
+    uint32_t block;
+    struct iovec iov;
+    uint8_t buf[BLOCK_SIZE];
+} BenchRequest;
+
+static int fd;
+static ThreadPool *pool;
+static BenchRequest requests[MAX_DEPTH];
+static long to_submit, completed;
+static bool write_pass;
+static unsigned seed = 1;
+
+static int bench_worker(void *opaque)
+{
+    BenchRequest *req = opaque;
+    off_t offset = (off_t)req->block * BLOCK_SIZE;
+    ssize_t ret;
+
+    do {
+        if (req->write) {
+            ret = pwritev(req->fd, &req->iov, 1, offset);
+        } else {
+            ret = preadv(req->fd, &req->iov, 1, offset);
+        }
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0) {
+        return -errno;
+    }
+    return ret == BLOCK_SIZE ? 0 : -EINVAL;
+}
+
+static void bench_cb(void *opaque, int ret);
+
+static void submit(BenchRequest *req)
+{
+    if (write_pass) {
+        req->block = FILE_BLOCKS - to_submit;
+        memset(req->buf, req->block & 0xff, BLOCK_SIZE);
+        memcpy(req->buf, &req->block, sizeof(req->block));
+    } else {
+        req->block = rand_r(&seed) % FILE_BLOCKS;
+    }
+    req->fd = fd;
+    req->write = write_pass;
+    req->iov.iov_base = req->buf;
+    req->iov.iov_len = BLOCK_SIZE;
+    to_submit--;
+    thread_pool_submit_aio(pool, bench_worker, req, bench_cb, req);
+}
+
+static void bench_cb(void *opaque, int ret)
+{
+    BenchRequest *req = opaque;
+    uint32_t block;
+
+    check(ret == 0);
+    if (!req->write) {
+        memcpy(&block, req->buf, sizeof(block));
+        check(block == req->block);
+        check(req->buf[BLOCK_SIZE - 1] == (req->block & 0xff));
+    }
+    completed++;
+    if (to_submit) {
+        submit(req);
+    }
+}
+
+static void run(int depth, long nr_requests)
+{
+    ThreadPoolStats before, after;
+    int64_t start, elapsed;
+    long total = nr_requests;
+    int i;
+
+    to_submit = total;
+    completed = 0;
+    thread_pool_get_stats(pool, &before);
+    start = vmx_clock_get_ns(QEMU_CLOCK_REALTIME);
+    for (i = 0; i < depth && to_submit; i++) {
+        submit(&requests[i]);
+    }
+    while (completed < total) {
+        aio_poll(NULL, true);
+    }
+    elapsed = vmx_clock_get_ns(QEMU_CLOCK_REALTIME) - start;
+    thread_pool_get_stats(pool, &after);
+
+    check(after.completed - before.completed == total);
+    check(after.in_flight == 0);
+    if (write_pass) {
+        return;
+    }
+    printf("depth %3d: %9.0f req/s  latency avg %7.1f us  threads %d\n",
+           depth, total * 1e9 / elapsed,
+           (after.total_latency_ns - before.total_latency_ns) /
+           (1000.0 * total), after.threads);
+}
+
+int main(int argc, char **argv)
+{
+    char path[] = "/tmp/thread-pool-bench.XXXXXX";
+    long nr_requests = argc > 2 ? atol(argv[2]) : 100000;
+    int depths[] = { 1, 4, 16, 64, 128 };
+    int i;
+
+    if (argc > 1) {
+        fd = open(argv[1], O_RDWR | O_CREAT | O_TRUNC, 0600);
+    } else {
+        fd = mkstemp(path);
+    }
+    check(fd >= 0);
+    if (argc <= 1) {
+        unlink(path);
+    }
+
+    pool = thread_pool_create(NULL, 4);
+
+    /* fill the file through the pool, then check what reads return */
+    write_pass = true;
+    run(16, FILE_BLOCKS);
+    write_pass = false;
+    for (i = 0; i < ARRAY_SIZE(depths); i++) {
+        run(depths[i], nr_requests);
+    }
+
+    thread_pool_destroy(pool);
+    close(fd);
+    if (argc > 1) {
+        unlink(argv[1]);
+    }
+    printf("thread-pool-bench: ok\n");
+    return 0;
+}
@@ -0,0 +1,526 @@
+/*
+ * Drives the virtio descriptor ring code against a malloc'd block standing
+ * in for guest memory.
+ *
+ * Copyright (C) 2016 Veertu Inc,
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 or
+ * (at your option) version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "virtio.h"
+
+#define check(cond)                                                     \
+    do {                                                                \
+        if (!(cond)) {                                                  \
+            fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__,   \
+                    #cond);                                             \
+            exit(1);                                                    \
+        }                                                               \
+    } while (0)
+
+#define GUEST_SIZE      0x10000
+#define PAGE_SIZE       0x1000
+
+#define QUEUE_NUM       16
+#define RING            0x1000          /* descriptors, then avail */
+#define USED            (RING + PAGE_SIZE)
+#define TABLE           0x4000          /* indirect descriptor table */
+#define BUF             0x8000          /* data buffers, one page each */
+
+#define FEATURE(bit)    (1u << (bit))
+
+/* Guest memory and the address space virtio.c maps it through */
+
+static uint8_t *guest;
+static VeertuAddressSpace as;
+static int mapped;                      /* maps not yet unmapped */
+static bool split_pages;                /* end every map at a page */
+
+void *address_space_map(VeertuAddressSpace *address_space, uint64_t addr,
+                        uint64_t *plen, bool is_Write)
+{
+    uint64_t len = *plen;
+
+    check(address_space == &as);
+    if (addr >= GUEST_SIZE) {
+        *plen = 0;
+        return NULL;
+    }
+    len = MIN(len, GUEST_SIZE - addr);
+    if (split_pages) {
+        len = MIN(len, PAGE_SIZE - (addr & (PAGE_SIZE - 1)));
+    }
+    *plen = len;
+    mapped++;
+    return guest + addr;
+}
+
+void address_space_unmap(VeertuAddressSpace *address_space, void *buf,
+                         uint64_t len, int is_write, uint64_t access_len)
+{
+    check(address_space == &as);
+    check((uint8_t *)buf >= guest && (uint8_t *)buf < guest + GUEST_SIZE);
+    check(access_len <= len);
+    mapped--;
+}
+
+/* Only referenced by vmstate_virtio, never called here */
+const VMStateInfo vmstate_info_uint8 = { .name = "uint8" };
+const VMStateInfo vmstate_info_uint16 = { .name = "uint16" };
+const VMStateInfo vmstate_info_uint32 = { .name = "uint32" };
+const VMStateInfo vmstate_info_uint64 = { .name = "uint64" };
+
+/* The device and the guest side of its one queue */
+
+static const VirtIODeviceOps ops;
+static VirtIODevice vdev;
+static VirtQueue *vq;
+static int irqs;
+
+static VRingDesc *desc;
+static VRingAvail *avail;
+static VRingUsed *used;
+
+static void count_irq(void *opaque)
+{
+    if (vdev.isr & VIRTIO_ISR_QUEUE) {
+        (*(int *)opaque)++;
+    }
+    vdev.isr = 0;
+}
+
+static void setup(uint32_t features)
+{
+    memset(guest, 0, GUEST_SIZE);
+    split_pages = false;
+    irqs = 0;
+
+    virtio_init(&vdev, "ring", &ops, 0, &as);
+    vdev.host_features = FEATURE(VIRTIO_F_NOTIFY_ON_EMPTY) |
+                         FEATURE(VIRTIO_RING_F_INDIRECT_DESC) |
+                         FEATURE(VIRTIO_RING_F_EVENT_IDX);
+    vdev.update_irq = count_irq;
+    vdev.transport = &irqs;
+    check(virtio_set_features(&vdev, features) == 0);
+
+    vq = virtio_add_queue(&vdev, QUEUE_NUM, NULL);
+    virtio_queue_set_addr(&vdev, 0, RING);
+    check(virtio_queue_ready(vq));
+    check(mapped == 1);
+
+    desc = (VRingDesc *)(guest + RING);
+    avail = (VRingAvail *)(guest + RING + QUEUE_NUM * sizeof(VRingDesc));
+    used = (VRingUsed *)(guest + USED);
+}
+
+static void teardown(void)
+{
+    virtio_cleanup(&vdev);
+    check(mapped == 0);
+}
+
+static void set_desc(VRingDesc *table, int i, hwaddr addr, uint32_t len,
+                     uint16_t flags, uint16_t next)
+{
+    table[i].addr = addr;
+    table[i].len = len;
+    table[i].flags = flags;
+    table[i].next = next;
+}
+
+static void offer(uint16_t head)
+{
+    avail->ring[avail->idx % QUEUE_NUM] = head;
+    avail->idx++;
+}
+
+static uint16_t *used_event(void)
+{
+    return &avail->ring[QUEUE_NUM];
+}
+
+static uint16_t *avail_event(void)
+{
+    return (uint16_t *)&used->ring[QUEUE_NUM];
+}
+
+/* Two readable buffers and a writable one in a single chain */
+static void test_pop_chain(void)
+{
+    VirtQueueElement elem;
+
+    setup(0);
+    set_desc(desc, 3, BUF, 10, VRING_DESC_F_NEXT, 5);
+    set_desc(desc, 5, BUF + PAGE_SIZE, 20, VRING_DESC_F_NEXT, 7);
+    set_desc(desc, 7, BUF + 2 * PAGE_SIZE, 100, VRING_DESC_F_WRITE, 0);
+    memcpy(guest + BUF, "request", 8);
+
+    check(virtio_queue_empty(vq));
+    check(virtqueue_pop(vq, &elem) == 0);
+    offer(3);
+    check(!virtio_queue_empty(vq));
+
+    check(virtqueue_pop(vq, &elem) == 3);
+    check(elem.index == 3);
+    check(elem.out_num == 2 && elem.in_num == 1);
+    check(elem.out_sg[0].iov_base == guest + BUF);
+    check(elem.out_sg[0].iov_len == 10);
+    check(elem.out_sg[1].iov_len == 20);
+    check(elem.in_sg[0].iov_base == guest + BUF + 2 * PAGE_SIZE);
+    check(elem.in_addr[0] == BUF + 2 * PAGE_SIZE);
+    check(!strcmp(elem.out_sg[0].iov_base, "request"));
+    check(virtio_queue_empty(vq));
+    check(virtqueue_pop(vq, &elem) == 0);
+
+    memcpy(elem.in_sg[0].iov_base, "reply", 6);
+    virtqueue_push(vq, &elem, 6);
+    check(used->idx == 1);
+    check(used->ring[0].id == 3 && used->ring[0].len == 6);
+    check(!strcmp((char *)guest + BUF + 2 * PAGE_SIZE, "reply"));
+    check(mapped == 1);
+    check(!vdev.broken);
+    teardown();
+}
+
+/* Several chains filled out of order and published with one flush */
+static void test_fill_flush(void)
+{
+    VirtQueueElement elem[3];
+    int i;
+
+    setup(0);
+    for (i = 0; i < 3; i++) {
+        set_desc(desc, i, BUF + i * PAGE_SIZE, 64, VRING_DESC_F_WRITE, 0);
+        offer(i);
+    }
+    for (i = 0; i < 3; i++) {
+        check(virtqueue_pop(vq, &elem[i]) == 1);
+        check(elem[i].index == i);
+    }
+
+    virtqueue_fill(vq, &elem[2], 30, 2);
+    virtqueue_fill(vq, &elem[0], 10, 0);
+    virtqueue_fill(vq, &elem[1], 20, 1);
+    check(used->idx == 0);
+    virtqueue_flush(vq, 3);
+    check(used->idx == 3);
+    for (i = 0; i < 3; i++) {
+        check(used->ring[i].id == i);
+        check(used->ring[i].len == (i + 1) * 10);
+    }
+    check(mapped == 1);
+    teardown();
+}
+
+/* A buffer crossing a region boundary takes one iovec per region */
+static void test_split_buffer(void)
+{
+    VirtQueueElement elem;
+
+    setup(0);
+    split_pages = true;
+    set_desc(desc, 0, BUF + PAGE_SIZE - 100, 300, VRING_DESC_F_WRITE, 0);
+    offer(0);
+
+    check(virtqueue_pop(vq, &elem) == 2);
+    check(elem.in_num == 2);
+    check(elem.in_sg[0].iov_len == 100);
+    check(elem.in_sg[1].iov_len == 200);
+    check(elem.in_addr[1] == BUF + PAGE_SIZE);
+    virtqueue_push(vq, &elem, 150);
+    check(mapped == 1);
+    teardown();
+}
+
+/* A readable buffer after a writable one is rejected */
+static void test_bad_order(void)
+{
+    VirtQueueElement elem;
+
+    setup(0);
+    set_desc(desc, 0, BUF, 10, VRING_DESC_F_WRITE | VRING_DESC_F_NEXT, 1);
+    set_desc(desc, 1, BUF + PAGE_SIZE, 10, 0, 0);
+    offer(0);
+
+    check(virtqueue_pop(vq, &elem) == 0);
+    check(vdev.broken);
+    check(mapped == 1);
+    teardown();
+}
+
+static void test_indirect(void)
+{
+    VRingDesc *table = (VRingDesc *)(guest + TABLE);
+    VirtQueueElement elem;
+
+    setup(FEATURE(VIRTIO_RING_F_INDIRECT_DESC));
+    set_desc(desc, 2, TABLE, 3 * sizeof(VRingDesc), VRING_DESC_F_INDIRECT, 0);
+    set_desc(table, 0, BUF, 12, VRING_DESC_F_NEXT, 2);
+    set_desc(table, 2, BUF + PAGE_SIZE, 34, VRING_DESC_F_NEXT, 1);
+    set_desc(table, 1, BUF + 2 * PAGE_SIZE, 56, VRING_DESC_F_WRITE, 0);
+    offer(2);
+
+    check(virtqueue_avail_bytes(vq, 56, 46));
+    check(!virtqueue_avail_bytes(vq, 57, 0));
+    check(virtqueue_pop(vq, &elem) == 3);
+    check(elem.index == 2);
+    check(elem.out_num == 2 && elem.in_num == 1);
+    check(elem.out_sg[1].iov_len == 34);
+    check(elem.in_sg[0].iov_base == guest + BUF + 2 * PAGE_SIZE);
+    check(mapped == 4);             /* the table went back straight away */
+    virtqueue_push(vq, &elem, 56);
+    check(used->ring[0].id == 2);
+    check(mapped == 1);
+    check(!vdev.broken);
+    teardown();
+}
+
+static void test_nested_indirect(void)
+{
+    VRingDesc *table = (VRingDesc *)(guest + TABLE);
+    VirtQueueElement elem;
+
+    setup(FEATURE(VIRTIO_RING_F_INDIRECT_DESC));
+    set_desc(desc, 0, TABLE, 2 * sizeof(VRingDesc), VRING_DESC_F_INDIRECT, 0);
+    set_desc(table, 0, BUF, 12, VRING_DESC_F_NEXT, 1);
+    set_desc(table, 1, TABLE, 2 * sizeof(VRingDesc), VRING_DESC_F_INDIRECT, 0);
+    offer(0);
+
+    check(virtqueue_pop(vq, &elem) == 0);
+    check(vdev.broken);
+    check(mapped == 1);
+    teardown();
+}
+
+static void test_looped_chain(void)
+{
+    VirtQueueElement elem;
+
+    setup(0);
+    set_desc(desc, 0, BUF, 8, VRING_DESC_F_NEXT, 1);
+    set_desc(desc, 1, BUF + PAGE_SIZE, 8, VRING_DESC_F_NEXT, 0);
+    offer(0);
+
+    check(!virtqueue_avail_bytes(vq, 0, 1000));
+    check(vdev.broken);
+    check(virtqueue_pop(vq, &elem) == 0);
+    check(mapped == 1);
+    teardown();
+
+    setup(0);
+    set_desc(desc, 0, BUF, 8, VRING_DESC_F_NEXT, 1);
+    set_desc(desc, 1, BUF + PAGE_SIZE, 8, VRING_DESC_F_NEXT, 0);
+    offer(0);
+    check(virtqueue_pop(vq, &elem) == 0);
+    check(vdev.broken);
+    check(mapped == 1);
+    teardown();
+}
+
+static void test_bad_head(void)
+{
+    VirtQueueElement elem;
+
+    setup(0);
+    offer(QUEUE_NUM);
+    check(virtqueue_pop(vq, &elem) == 0);
+    check(vdev.broken);
+    teardown();
+
+    /* more heads than the ring holds */
+    setup(0);
+    avail->idx = QUEUE_NUM + 1;
+    check(virtqueue_pop(vq, &elem) == 0);
+    check(vdev.broken);
+    teardown();
+}
+
+static void test_discard(void)
+{
+    VirtQueueElement elem;
+
+    setup(0);
+    set_desc(desc, 4, BUF, 64, VRING_DESC_F_WRITE, 0);
+    offer(4);
+
+    check(virtqueue_pop(vq, &elem) == 1);
+    check(virtio_queue_empty(vq));
+    virtqueue_discard(vq, &elem, 0);
+    check(!virtio_queue_empty(vq));
+    check(mapped == 1);
+    check(virtqueue_pop(vq, &elem) == 1);
+    check(elem.index == 4);
+    virtqueue_push(vq, &elem, 0);
+    check(used->idx == 1);
+    teardown();
+}
+
+/* A packet spread over three buffers is given up before the flush */
+static void test_rewind(void)
+{
+    VirtQueueElement elem[3];
+    int i;
+
+    setup(0);
+    for (i = 0; i < 3; i++) {
+        set_desc(desc, i, BUF + i * PAGE_SIZE, 64, VRING_DESC_F_WRITE, 0);
+        offer(i);
+    }
+    for (i = 0; i < 3; i++) {
+        check(virtqueue_pop(vq, &elem[i]) == 1);
+    }
+    virtqueue_fill(vq, &elem[1], 64, 1);
+    virtqueue_fill(vq, &elem[2], 64, 2);
+    virtqueue_discard(vq, &elem[0], 0);
+    virtqueue_rewind(vq, 2);
+    check(used->idx == 0);
+    check(mapped == 1);
+
+    for (i = 0; i < 3; i++) {
+        check(virtqueue_pop(vq, &elem[i]) == 1);
+        check(elem[i].index == i);
+        virtqueue_push(vq, &elem[i], 0);
+    }
+    check(used->idx == 3);
+    check(virtio_queue_empty(vq));
+    teardown();
+}
+
+/* Without EVENT_IDX the guest can only switch notifications off wholesale */
+static void test_flags(void)
+{
+    VirtQueueElement elem;
+
+    setup(0);
+    set_desc(desc, 0, BUF, 64, VRING_DESC_F_WRITE, 0);
+    offer(0);
+    offer(0);
+
+    virtio_queue_set_notification(vq, 0);
+    check(used->flags & VRING_USED_F_NO_NOTIFY);
+    virtio_queue_set_notification(vq, 1);
+    check(!(used->flags & VRING_USED_F_NO_NOTIFY));
+
+    check(virtqueue_pop(vq, &elem) == 1);
+    virtqueue_push(vq, &elem, 1);
+    virtio_notify(&vdev, vq);
+    check(irqs == 1);
+
+    avail->flags = VRING_AVAIL_F_NO_INTERRUPT;
+    check(virtqueue_pop(vq, &elem) == 1);
+    virtqueue_push(vq, &elem, 1);
+    virtio_notify(&vdev, vq);
+    check(irqs == 1);
+    teardown();
+
+    /* NOTIFY_ON_EMPTY overrides the flag once the ring runs dry */
+    setup(FEATURE(VIRTIO_F_NOTIFY_ON_EMPTY));
+    set_desc(desc, 0, BUF, 64, VRING_DESC_F_WRITE, 0);
+    avail->flags = VRING_AVAIL_F_NO_INTERRUPT;
+    offer(0);
+    check(virtqueue_pop(vq, &elem) == 1);
+    virtqueue_push(vq, &elem, 1);
+    virtio_notify(&vdev, vq);
+    check(irqs == 1);
+    teardown();
+}
+
+static void test_event_idx(void)
+{
+    VirtQueueElement elem;
+    int i;
+
+    setup(FEATURE(VIRTIO_RING_F_EVENT_IDX));
+    for (i = 0; i < 8; i++) {
+        set_desc(desc, i, BUF + i * PAGE_SIZE, 64, VRING_DESC_F_WRITE, 0);
+        offer(i);
+    }
+
+    /* avail_event tracks how far the device has read, flags are ignored */
+    virtio_queue_set_notification(vq, 0);
+    check(!(used->flags & VRING_USED_F_NO_NOTIFY));
+    virtio_queue_set_notification(vq, 1);
+    check(*avail_event() == 8);
+    check(virtqueue_pop(vq, &elem) == 1);
+    check(*avail_event() == 1);
+
+    /* the first notification always goes out */
+    avail->flags = VRING_AVAIL_F_NO_INTERRUPT;
+    *used_event() = 3;
+    virtqueue_push(vq, &elem, 1);
+    virtio_notify(&vdev, vq);
+    check(irqs == 1);
+
+    /* then only when used->idx steps past used_event */
+    for (i = 2; i <= 5; i++) {
+        check(virtqueue_pop(vq, &elem) == 1);
+        virtqueue_push(vq, &elem, 1);
+        virtio_notify(&vdev, vq);
+        check(used->idx == i);
+        check(irqs == (i < 4 ? 1 : 2));
+    }
+
+    /* a batch flush that jumps over used_event still notifies */
+    *used_event() = 6;
+    for (i = 0; i < 3; i++) {
+        VirtQueueElement e;
+
+        check(virtqueue_pop(vq, &e) == 1);
+        virtqueue_fill(vq, &e, 1, i);
+    }
+    check(*avail_event() == 8);
+    virtqueue_flush(vq, 3);
+    check(used->idx == 8);
+    virtio_notify(&vdev, vq);
+    check(irqs == 3);
+    teardown();
+}
+
+static void test_ring_outside_ram(void)
+{
+    setup(0);
+    virtio_queue_set_addr(&vdev, 0, GUEST_SIZE - PAGE_SIZE);
+    check(!virtio_queue_ready(vq));
+    check(vdev.broken);
+    check(mapped == 0);
+    teardown();
+}
+
+int main(void)
+{
+    guest = malloc(GUEST_SIZE);
+    check(guest);
+
+    test_pop_chain();
+    test_fill_flush();
+    test_split_buffer();
+    test_bad_order();
+    test_indirect();
+    test_nested_indirect();
+    test_looped_chain();
+    test_bad_head();
+    test_discard();
+    test_rewind();
+    test_flags();
+    test_event_idx();
+    test_ring_outside_ram();
+
+    free(guest);
+    printf("virtio-ring-test: ok\n");
+    return 0;
+}
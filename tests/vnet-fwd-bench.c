@@ -0,0 +1,620 @@
+/*
+ * Forwards a host port to a "guest" echo server on the loopback interface
+ * and pushes traffic through the forwarder thread: round trips on one
+ * connection with the rest idle, then every connection streaming at once.
+ * Checks the data that comes back, that idle connections hold no ring,
+ * that a stalled guest stops the forwarder at one full 64K ring, the
+ * port_fwd_stats counters, and that half-closes and deleting the rule
+ * reach the other side.
+ *
+ *   vnet-fwd-bench [connections]
+ *
+ * Copyright (C) 2016 Veertu Inc,
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 or
+ * (at your option) version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+
+/* the rule table and the connection list are static */
+#include "../util/vnet_fwd.c"
+
+#define check(cond)                                                     \
+    do {                                                                \
+        if (!(cond)) {                                                  \
+            fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__,   \
+                    #cond);                                             \
+            exit(1);                                                    \
+        }                                                               \
+    } while (0)
+
+#define MAX_FDS         65536
+#define STREAM_BYTES    (256 * 1024)    /* per connection, each way */
+#define CONNECT_BATCH   64
+#define TIMEOUT_NS      (30 * 1000000000ll)
+
+/* The socket helpers from osdep.c and oslib-posix.c */
+
+int vmx_socket(int domain, int type, int protocol)
+{
+    return socket(domain, type, protocol);
+}
+
+int vmx_accept(int s, struct sockaddr *addr, socklen_t *addrlen)
+{
+    return accept(s, addr, addrlen);
+}
+
+int vmx_pipe(int pipefd[2])
+{
+    return pipe(pipefd);
+}
+
+void vmx_set_nonblock(int fd)
+{
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+int socket_set_fast_reuse(int fd)
+{
+    int val = 1;
+
+    return setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+}
+
+int socket_set_nodelay(int fd)
+{
+    int val = 1;
+
+    return setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+}
+
+uint32_t vm_ip_address;
+
+/* The main loop's fd handlers: the listening socket and guest sockets
+ * still connecting.  Run by pump() on the main thread. */
+
+static struct {
+    IOHandler *read, *write;
+    void *opaque;
+} handlers[MAX_FDS];
+static int handlers_end;
+
+int vmx_set_fd_handler(int fd, IOHandler *fd_read, IOHandler *fd_write,
+                       void *opaque)
+{
+    check(fd >= 0 && fd < MAX_FDS);
+    handlers[fd].read = fd_read;
+    handlers[fd].write = fd_write;
+    handlers[fd].opaque = opaque;
+    handlers_end = MAX(handlers_end, fd + 1);
+    return 0;
+}
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
+static uint8_t pattern(int id, uint64_t offset)
+{
+    return offset * 31 + id;
+}
+
+static int listen_on(int port)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    socklen_t len = sizeof(addr);
+    int fd = socket(PF_INET, SOCK_STREAM, 0);
+
+    check(fd >= 0);
+    socket_set_fast_reuse(fd);
+    check(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    check(listen(fd, SOMAXCONN) == 0);
+    check(getsockname(fd, (struct sockaddr *)&addr, &len) == 0);
+    vmx_set_nonblock(fd);
+    return fd;
+}
+
+/* The guest: echoes everything back on every connection, half-closes
+ * after the client did, and reads nothing while paused */
+
+typedef struct GuestConn {
+    int fd;
+    uint8_t buf[16384];
+    size_t len, off;
+    short revents;
+    bool eof;
+} GuestConn;
+
+static int guest_listen_fd, guest_port;
+static volatile bool guest_paused, guest_stop;
+
+static void *guest_thread(void *opaque)
+{
+    GuestConn **conns = g_new0(GuestConn *, MAX_FDS);
+    struct pollfd *pfds = g_new(struct pollfd, MAX_FDS);
+    int nconns = 0, n, i, fd;
+    ssize_t ret;
+
+    while (!guest_stop) {
+        pfds[0] = (struct pollfd) { .fd = guest_listen_fd, .events = POLLIN };
+        for (i = 0, n = 1; i < nconns; i++, n++) {
+            GuestConn *g = conns[i];
+
+            pfds[n].fd = g->fd;
+            pfds[n].events = g->len ? POLLOUT :
+                             guest_paused || g->eof ? 0 : POLLIN;
+        }
+        poll(pfds, n, 10);
+        for (i = 0; i < nconns; i++) {
+            conns[i]->revents = pfds[i + 1].revents;
+        }
+
+        while ((fd = accept(guest_listen_fd, NULL, NULL)) >= 0) {
+            GuestConn *g = g_new0(GuestConn, 1);
+
+            vmx_set_nonblock(fd);
+            socket_set_nodelay(fd);
+            g->fd = fd;
+            g->revents = POLLIN;
+            conns[nconns++] = g;
+        }
+        for (i = 0; i < nconns; i++) {
+            GuestConn *g = conns[i];
+
+            if (g->revents && !g->len && !g->eof && !guest_paused) {
+                ret = recv(g->fd, g->buf, sizeof(g->buf), 0);
+                if (ret > 0) {
+                    g->len = ret;
+                    g->off = 0;
+                } else if (ret == 0 || errno != EAGAIN) {
+                    g->eof = true;
+                    shutdown(g->fd, SHUT_WR);
+                }
+            }
+            if (g->len) {
+                ret = send(g->fd, g->buf + g->off, g->len, 0);
+                if (ret > 0) {
+                    g->off += ret;
+                    g->len -= ret;
+                } else if (errno != EAGAIN) {
+                    g->len = 0;
+                }
+            }
+            if (g->eof && !g->len) {
+                close(g->fd);
+                g_free(g);
+                conns[i--] = conns[--nconns];
+            }
+        }
+    }
+    for (i = 0; i < nconns; i++) {
+        close(conns[i]->fd);
+        g_free(conns[i]);
+    }
+    g_free(conns);
+    g_free(pfds);
+    return NULL;
+}
+
+/* The host side clients */
+
+typedef struct Client {
+    int fd;
+    uint64_t to_send, sent, received;
+    bool eof;
+} Client;
+
+static Client *clients;
+static int nb_clients, host_port;
+static bool wait_eof;
+
+/* Idle clients stay out of the poll, so that it is the forwarder's that
+ * is timed */
+static bool client_busy(Client *c)
+{
+    return c->fd >= 0 && !c->eof &&
+           (c->sent < c->to_send || c->received < c->sent || wait_eof);
+}
+static char rule[64];
+
+static void client_connect(Client *c)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(host_port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+
+    memset(c, 0, sizeof(*c));
+    c->fd = socket(PF_INET, SOCK_STREAM, 0);
+    check(c->fd >= 0 && c->fd < MAX_FDS);
+    vmx_set_nonblock(c->fd);
+    socket_set_nodelay(c->fd);
+    check(connect(c->fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 ||
+          errno == EINPROGRESS);
+}
+
+static void client_io(Client *c, int id, short revents)
+{
+    uint8_t buf[16384];
+    ssize_t ret;
+    size_t i, n;
+
+    while (c->sent < c->to_send) {
+        n = MIN(sizeof(buf), c->to_send - c->sent);
+        for (i = 0; i < n; i++) {
+            buf[i] = pattern(id, c->sent + i);
+        }
+        ret = send(c->fd, buf, n, 0);
+        if (ret <= 0) {
+            check(errno == EAGAIN || errno == ENOTCONN);
+            break;
+        }
+        c->sent += ret;
+    }
+    while (!c->eof && (revents & (POLLIN | POLLHUP | POLLERR))) {
+        ret = recv(c->fd, buf, sizeof(buf), 0);
+        if (ret == 0 || (ret < 0 && errno == ECONNRESET)) {
+            c->eof = true;
+            break;
+        }
+        if (ret < 0) {
+            check(errno == EAGAIN);
+            break;
+        }
+        for (i = 0; i < ret; i++) {
+            check(buf[i] == pattern(id, c->received + i));
+        }
+        c->received += ret;
+        check(c->received <= c->sent);
+    }
+}
+
+/* Runs the main loop's handlers and the clients until done() */
+static void pump(bool (*done)(void))
+{
+    struct pollfd *pfds = g_new(struct pollfd, MAX_FDS);
+    int64_t deadline = now_ns() + TIMEOUT_NS;
+    int fd, i, n;
+
+    while (!done()) {
+        check(now_ns() < deadline);
+        for (fd = n = 0; fd < handlers_end; fd++) {
+            if (handlers[fd].read || handlers[fd].write) {
+                pfds[n].fd = fd;
+                pfds[n].events = (handlers[fd].read ? POLLIN : 0) |
+                                 (handlers[fd].write ? POLLOUT : 0);
+                n++;
+            }
+        }
+        for (i = 0; i < nb_clients; i++) {
+            Client *c = &clients[i];
+
+            pfds[n].fd = client_busy(c) ? c->fd : -1;
+            pfds[n].events = POLLIN |
+                             (c->sent < c->to_send ? POLLOUT : 0);
+            n++;
+        }
+        poll(pfds, n, 10);
+
+        for (i = 0; i < n - nb_clients; i++) {
+            fd = pfds[i].fd;
+            if ((pfds[i].revents & (POLLIN | POLLHUP | POLLERR)) &&
+                handlers[fd].read) {
+                handlers[fd].read(handlers[fd].opaque);
+            }
+            if ((pfds[i].revents & (POLLOUT | POLLHUP | POLLERR)) &&
+                handlers[fd].write) {
+                handlers[fd].write(handlers[fd].opaque);
+            }
+        }
+        for (i = 0; i < nb_clients; i++) {
+            if (pfds[n - nb_clients + i].fd >= 0) {
+                client_io(&clients[i], i, pfds[n - nb_clients + i].revents);
+            }
+        }
+    }
+    g_free(pfds);
+}
+
+/* What the forwarder thread knows, read under its lock */
+
+static PortFwdState *rule_state(void)
+{
+    int i;
+
+    for (i = 0; i < MAX_PORT_FWD; i++) {
+        if (port_fwd_states[i].used) {
+            return &port_fwd_states[i];
+        }
+    }
+    return NULL;
+}
+
+static uint32_t fwd_active(void)
+{
+    PortFwdState *s;
+    uint32_t active;
+
+    vmx_mutex_lock(&fwd_lock);
+    s = rule_state();
+    active = s ? s->active : 0;
+    vmx_mutex_unlock(&fwd_lock);
+    return active;
+}
+
+static int fwd_rings(void)
+{
+    PortFwdConn *c;
+    int i, rings = 0;
+
+    vmx_mutex_lock(&fwd_lock);
+    QTAILQ_FOREACH(c, &fwd_conns, next) {
+        for (i = 0; i < 2; i++) {
+            check(c->pipe[i].len <= FWD_BUF_SIZE);
+            rings += c->pipe[i].data != NULL;
+        }
+    }
+    vmx_mutex_unlock(&fwd_lock);
+    return rings;
+}
+
+static int wait_active;
+
+static bool all_active(void)
+{
+    return fwd_active() == wait_active;
+}
+
+static bool all_echoed(void)
+{
+    int i;
+
+    for (i = 0; i < nb_clients; i++) {
+        if (clients[i].received < clients[i].to_send) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool all_eof(void)
+{
+    int i;
+
+    for (i = 0; i < nb_clients; i++) {
+        if (!clients[i].eof) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool no_conns(void)
+{
+    int n;
+
+    vmx_mutex_lock(&fwd_lock);
+    n = fwd_nconns;
+    vmx_mutex_unlock(&fwd_lock);
+    return n == 0;
+}
+
+static void open_clients(int count)
+{
+    int64_t start = now_ns();
+    int i;
+
+    clients = g_new(Client, count);
+    for (nb_clients = 0; nb_clients < count; ) {
+        for (i = 0; i < CONNECT_BATCH && nb_clients < count; i++) {
+            client_connect(&clients[nb_clients++]);
+        }
+        wait_active = nb_clients;
+        pump(all_active);
+    }
+    printf("%-30s %8.2f ms\n", "connect and forward", (now_ns() - start) / 1e6);
+}
+
+static void close_clients(void)
+{
+    int i;
+
+    for (i = 0; i < nb_clients; i++) {
+        close(clients[i].fd);
+    }
+    g_free(clients);
+    clients = NULL;
+    nb_clients = 0;
+    wait_eof = false;
+}
+
+/* One byte back and forth on the first connection, the others idle */
+static void bench_round_trips(int count)
+{
+    int64_t start = now_ns();
+    int i;
+
+    for (i = 0; i < count; i++) {
+        clients[0].to_send++;
+        pump(all_echoed);
+    }
+    printf("%-30s %8.2f us  (%d idle)\n", "round trip", (now_ns() - start) /
+           1e3 / count, nb_clients - 1);
+}
+
+static void bench_stream(void)
+{
+    int64_t start = now_ns(), elapsed;
+    int i;
+
+    for (i = 0; i < nb_clients; i++) {
+        clients[i].to_send += STREAM_BYTES;
+    }
+    pump(all_echoed);
+    elapsed = now_ns() - start;
+    printf("%-30s %8.1f MB/s each way\n", "all streaming",
+           (double)nb_clients * STREAM_BYTES * 1e3 / elapsed);
+}
+
+/* With the guest not reading, a client can only fill the socket buffers
+ * and one ring */
+static void check_backpressure(void)
+{
+    Client *c = &clients[0];
+    struct pollfd pfd = { .fd = c->fd, .events = POLLOUT };
+    PortFwdConn *conn;
+    uint64_t start = c->sent;
+    int full = 0;
+
+    guest_paused = true;
+    usleep(50 * 1000);
+    do {
+        c->to_send = c->sent + 1024 * 1024;
+        client_io(c, 0, 0);
+        check(c->sent - start < 256 * 1024 * 1024);
+    } while (poll(&pfd, 1, 200) > 0);
+
+    vmx_mutex_lock(&fwd_lock);
+    QTAILQ_FOREACH(conn, &fwd_conns, next) {
+        full += conn->pipe[0].len == FWD_BUF_SIZE;
+    }
+    vmx_mutex_unlock(&fwd_lock);
+    check(full == 1);
+    printf("%-30s %8.1f KB buffered\n", "stalled guest",
+           (c->sent - start) / 1024.0);
+
+    c->to_send = c->sent;
+    guest_paused = false;
+    pump(all_echoed);
+}
+
+static void check_stats(void)
+{
+    char *report = vnet_port_fwd_stats_report(), expect[128];
+    PortFwdState *s;
+    uint64_t bytes = 0;
+    int i;
+
+    for (i = 0; i < nb_clients; i++) {
+        bytes += clients[i].sent;
+    }
+
+    vmx_mutex_lock(&fwd_lock);
+    s = rule_state();
+    check(s && s->connections == nb_clients && s->failed == 0);
+    check(s->active == nb_clients);
+    check(s->bytes_to_guest == bytes && s->bytes_to_host == bytes);
+    vmx_mutex_unlock(&fwd_lock);
+
+    snprintf(expect, sizeof(expect), "connections %d active %d failed 0 "
+             "to guest %" PRIu64 " bytes to host %" PRIu64 " bytes\n",
+             nb_clients, nb_clients, bytes, bytes);
+    check(strstr(report, expect));
+    printf("port_fwd_stats: %s", report);
+    g_free(report);
+}
+
+int main(int argc, char **argv)
+{
+    struct rlimit rl;
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    QemuThread thread;
+    int count = 1000, i;
+
+    if (argc > 1) {
+        count = atoi(argv[1]);
+        check(count > 0);
+    }
+
+    /* clients, both ends of every forwarded connection, the guest's */
+    check(getrlimit(RLIMIT_NOFILE, &rl) == 0);
+    rl.rlim_cur = MIN(rl.rlim_max, MAX_FDS);
+    setrlimit(RLIMIT_NOFILE, &rl);
+    check(getrlimit(RLIMIT_NOFILE, &rl) == 0);
+    if (4 * count + 64 > rl.rlim_cur) {
+        count = (rl.rlim_cur - 64) / 4;
+        printf("open file limit, %d connections\n", count);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    guest_listen_fd = listen_on(0);
+    check(getsockname(guest_listen_fd, (struct sockaddr *)&addr, &len) == 0);
+    guest_port = ntohs(addr.sin_port);
+    vmx_thread_create(&thread, "guest", guest_thread, NULL,
+                      QEMU_THREAD_JOINABLE);
+
+    /* a free port for the rule to bind */
+    i = listen_on(0);
+    check(getsockname(i, (struct sockaddr *)&addr, &len) == 0);
+    host_port = ntohs(addr.sin_port);
+    close(i);
+    snprintf(rule, sizeof(rule), "tcp:127.0.0.1:%d-127.0.0.1:%d",
+             host_port, guest_port);
+    check(vnet_add_port_fwd(rule) == 0);
+
+    open_clients(count);
+    check(fwd_rings() == 0);
+    bench_round_trips(2000);
+    check(fwd_rings() == 2);
+
+    bench_stream();
+    check(fwd_rings() == 2 * nb_clients);
+    printf("%-30s %8.1f MB for %d connections\n", "ring memory",
+           fwd_rings() * (double)FWD_BUF_SIZE / 1048576, nb_clients);
+
+    check_backpressure();
+    check_stats();
+
+    /* half-closes go through, the guest then closes its side */
+    for (i = 0; i < nb_clients; i++) {
+        shutdown(clients[i].fd, SHUT_WR);
+    }
+    wait_eof = true;
+    pump(all_eof);
+    pump(no_conns);
+    check(fwd_active() == 0);
+    close_clients();
+
+    /* deleting the rule drops its connections */
+    open_clients(16);
+    check(vnet_del_port_fwd(rule) == 0);
+    wait_eof = true;
+    pump(all_eof);
+    pump(no_conns);
+    check(rule_state() == NULL);
+    close_clients();
+
+    guest_stop = true;
+    vmx_thread_join(&thread);
+    printf("vnet-fwd-bench: ok\n");
+    return 0;
+}
@@ -0,0 +1,194 @@
+/*
+ * Drives the vnet proxy receive path against a socketpair standing in for
+ * the vmnet proxy.
+ *
+ * Copyright (C) 2016 Veertu Inc,
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 or
+ * (at your option) version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "vnet_proxy.h"
+
+#define check(cond)                                                     \
+    do {                                                                \
+        if (!(cond)) {                                                  \
+            fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__,   \
+                    #cond);                                             \
+            exit(1);                                                    \
+        }                                                               \
+    } while (0)
+
+static VnetRxRing ring;
+
+/* Stands in for the peer: takes up to 'room' packets, then queues one */
+typedef struct Peer {
+    int room;
+    int taken;
+    int queued;
+    uint8_t first[VNET_RX_BATCH];   /* first byte of each packet taken */
+} Peer;
+
+static int peer_send(void *opaque, const struct iovec *pkts, int count)
+{
+    Peer *p = opaque;
+    int i, n = count < p->room ? count : p->room;
+
+    for (i = 0; i < n; i++) {
+        p->first[p->taken++] = ((uint8_t *)pkts[i].iov_base)[0];
+    }
+    p->room -= n;
+    if (n < count) {
+        p->first[p->taken++] = ((uint8_t *)pkts[n].iov_base)[0];
+        p->queued++;
+    }
+    return n;
+}
+
+static void open_pair(int fds[2])
+{
+    check(socketpair(AF_UNIX, SOCK_DGRAM, 0, fds) == 0);
+    check(fcntl(fds[0], F_SETFL, O_NONBLOCK) == 0);
+}
+
+static void send_packets(int fd, int first, int count, size_t len)
+{
+    uint8_t buf[VNET_RX_BUF_SIZE + 16];
+    int i;
+
+    for (i = 0; i < count; i++) {
+        memset(buf, first + i, len);
+        check(send(fd, buf, len, 0) == (ssize_t)len);
+    }
+}
+
+static void test_empty(void)
+{
+    int fds[2];
+
+    open_pair(fds);
+    check(vnet_proxy_read(&ring, fds[0]) == 0);
+    check(vnet_rx_ring_deliver(&ring, peer_send, NULL));
+    close(fds[0]);
+    close(fds[1]);
+}
+
+/* A read stops at the batch size, the rest stays on the socket */
+static void test_batch_limit(void)
+{
+    Peer peer = { .room = 1000 };
+    int fds[2], i;
+
+    open_pair(fds);
+    send_packets(fds[1], 1, VNET_RX_BATCH + 3, 60);
+
+    check(vnet_proxy_read(&ring, fds[0]) == VNET_RX_BATCH);
+    for (i = 0; i < VNET_RX_BATCH; i++) {
+        check(ring.pkt[i].iov_len == 60);
+        check(((uint8_t *)ring.pkt[i].iov_base)[59] == i + 1);
+    }
+    check(vnet_rx_ring_deliver(&ring, peer_send, &peer));
+    check(peer.taken == VNET_RX_BATCH && !peer.queued);
+    check(ring.count == 0 && ring.next == 0);
+
+    check(vnet_proxy_read(&ring, fds[0]) == 3);
+    check(((uint8_t *)ring.pkt[2].iov_base)[0] == VNET_RX_BATCH + 3);
+    check(vnet_proxy_read(&ring, fds[0]) == 0);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+/* Datagrams that don't fit a buffer are dropped, not split */
+static void test_oversized(void)
+{
+    int fds[2];
+
+    open_pair(fds);
+    send_packets(fds[1], 1, 1, 100);
+    send_packets(fds[1], 2, 1, VNET_RX_BUF_SIZE + 16);
+    send_packets(fds[1], 3, 1, VNET_RX_BUF_SIZE - 1);
+
+    check(vnet_proxy_read(&ring, fds[0]) == 2);
+    check(ring.pkt[0].iov_len == 100);
+    check(ring.pkt[1].iov_len == VNET_RX_BUF_SIZE - 1);
+    check(((uint8_t *)ring.pkt[1].iov_base)[0] == 3);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+/* When the peer queues a packet the rest waits in order for completion */
+static void test_backpressure(void)
+{
+    Peer peer = { .room = 3 };
+    int fds[2], i;
+
+    open_pair(fds);
+    send_packets(fds[1], 1, 10, 64);
+    check(vnet_proxy_read(&ring, fds[0]) == 10);
+
+    check(!vnet_rx_ring_deliver(&ring, peer_send, &peer));
+    check(peer.taken == 4 && peer.queued == 1);
+    check(ring.next == 4 && ring.count == 10);
+
+    /* the queued packet completed, the peer has room for two more */
+    peer.room = 2;
+    check(!vnet_rx_ring_deliver(&ring, peer_send, &peer));
+    check(peer.taken == 7 && ring.next == 7);
+
+    peer.room = 100;
+    check(vnet_rx_ring_deliver(&ring, peer_send, &peer));
+    check(peer.taken == 10 && ring.count == 0 && ring.next == 0);
+
+    for (i = 0; i < 10; i++) {
+        check(peer.first[i] == i + 1);
+    }
+    close(fds[0]);
+    close(fds[1]);
+}
+
+/* The last packet being the one queued still holds further reads */
+static void test_queue_last(void)
+{
+    Peer peer = { .room = 1 };
+    int fds[2];
+
+    open_pair(fds);
+    send_packets(fds[1], 1, 2, 64);
+    check(vnet_proxy_read(&ring, fds[0]) == 2);
+
+    check(!vnet_rx_ring_deliver(&ring, peer_send, &peer));
+    check(ring.next == ring.count);
+    check(vnet_rx_ring_deliver(&ring, peer_send, &peer));
+    check(ring.count == 0);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+int main(void)
+{
+    test_empty();
+    test_batch_limit();
+    test_oversized();
+    test_backpressure();
+    test_queue_last();
+    printf("vnet-proxy-test: ok\n");
+    return 0;
+}
@@ -0,0 +1,240 @@
+/*
+ * Times guest virtual to physical translation against a 4-level page table
+ * built in host memory, with and without the per-vCPU TLB in front of
+ * walk_gpt, and checks the translations it returns.
+ *
+ * Copyright (C) 2016 Veertu Inc,
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 or
+ * (at your option) version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "qemu-common.h"
+#include "qom/cpu.h"
+#include "address-spaces.h"
+#include "vmcs.h"
+#include "x86_mmu.h"
+
+#define check(cond)                                                     \
+    do {                                                                \
+        if (!(cond)) {                                                  \
+            fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__,   \
+                    #cond);                                             \
+            exit(1);                                                    \
+        }                                                               \
+    } while (0)
+
+#define PAGE_SIZE       0x1000
+#define LARGE_SIZE      0x200000
+
+/*
+ * Page tables live in the first pages of guest memory.  PD entries
+ * 0..NR_PT-1 point at page tables, the next NR_LARGE map 2M pages.
+ */
+#define PML4            0x1000
+#define PDPT            0x2000
+#define PD              0x3000
+#define PT(n)           (0x4000 + (n) * PAGE_SIZE)
+#define NR_PT           8
+#define NR_LARGE        8
+#define NR_SMALL        (NR_PT * 512)
+#define GUEST_SIZE      PT(NR_PT)
+
+#define SMALL_GPA       0x10000000llu
+#define LARGE_GPA       0x40000000llu
+#define LARGE_GVA       ((uint64_t)NR_PT * LARGE_SIZE)
+
+#define RO_PAGE         5               /* present, not writable */
+#define ABSENT_PAGE     (NR_SMALL - 1)  /* not present */
+
+#define PTE_RW          (PT_PRESENT | PT_WRITE | PT_USER)
+
+/* What walk_gpt sees of the guest: memory, CR0/CR3 and the paging mode */
+
+VeertuAddressSpace address_space_memory;
+static uint8_t *guest;
+static uint64_t guest_reads;
+
+bool address_space_rw(VeertuAddressSpace *as, hwaddr addr, uint8_t *buf,
+                      int len, bool is_write)
+{
+    check(as == &address_space_memory);
+    check(!is_write);
+    check(addr + len <= GUEST_SIZE);
+    memcpy(buf, guest + addr, len);
+    guest_reads++;
+    return false;
+}
+
+hv_return_t hv_vmx_vcpu_read_vmcs(hv_vcpuid_t vcpu, uint32_t field,
+                                  uint64_t *value)
+{
+    switch (field) {
+    case VMCS_GUEST_CR3:
+        *value = PML4;
+        break;
+    case VMCS_GUEST_CR0:
+        *value = CR0_PE | CR0_PG | CR0_WP;
+        break;
+    default:
+        *value = 0;
+        break;
+    }
+    return 0;
+}
+
+hv_return_t hv_vmx_vcpu_write_vmcs(hv_vcpuid_t vcpu, uint32_t field,
+                                   uint64_t value)
+{
+    return 0;
+}
+
+bool x86_is_long_mode(struct CPUState *cpu)
+{
+    return true;
+}
+
+bool x86_is_paging_mode(struct CPUState *cpu)
+{
+    return true;
+}
+
+bool x86_is_pae_enabled(struct CPUState *cpu)
+{
+    return true;
+}
+
+static void set_pte(uint64_t table, int index, uint64_t pte)
+{
+    memcpy(guest + table + index * 8, &pte, 8);
+}
+
+static void build_page_tables(void)
+{
+    int i;
+
+    guest = calloc(1, GUEST_SIZE);
+    check(guest);
+
+    set_pte(PML4, 0, PDPT | PTE_RW);
+    set_pte(PDPT, 0, PD | PTE_RW);
+    for (i = 0; i < NR_PT; i++) {
+        set_pte(PD, i, PT(i) | PTE_RW);
+    }
+    for (i = 0; i < NR_LARGE; i++) {
+        set_pte(PD, NR_PT + i, (LARGE_GPA + i * LARGE_SIZE) | PTE_RW | PT_PS);
+    }
+    for (i = 0; i < NR_SMALL; i++) {
+        set_pte(PT(i / 512), i % 512, (SMALL_GPA + i * PAGE_SIZE) | PTE_RW);
+    }
+    set_pte(PT(RO_PAGE / 512), RO_PAGE % 512,
+            (SMALL_GPA + RO_PAGE * PAGE_SIZE) | PT_PRESENT | PT_USER);
+    set_pte(PT(ABSENT_PAGE / 512), ABSENT_PAGE % 512, 0);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000llu + ts.tv_nsec;
+}
+
+static void test_translations(CPUState *cpu)
+{
+    addr_t gpa;
+    int i;
+
+    for (i = 0; i < NR_SMALL; i++) {
+        addr_t gva = (addr_t)i * PAGE_SIZE + (i & 0xfff);
+        if (i == ABSENT_PAGE) {
+            continue;
+        }
+        check(mmu_gva_to_gpa_ext(cpu, gva, &gpa, GVA_TO_GPA_USER));
+        check(gpa == SMALL_GPA + (addr_t)i * PAGE_SIZE + (i & 0xfff));
+    }
+    for (i = 0; i < NR_LARGE; i++) {
+        addr_t gva = LARGE_GVA + (addr_t)i * LARGE_SIZE + 0x12345;
+        check(mmu_gva_to_gpa(cpu, gva, &gpa));
+        check(gpa == LARGE_GPA + (addr_t)i * LARGE_SIZE + 0x12345);
+    }
+
+    /* a read hit must not satisfy a write to a read-only page */
+    check(mmu_gva_to_gpa(cpu, RO_PAGE * PAGE_SIZE, &gpa));
+    check(!mmu_gva_to_gpa_ext(cpu, RO_PAGE * PAGE_SIZE, &gpa,
+                              GVA_TO_GPA_WRITABLE));
+    check(!mmu_gva_to_gpa(cpu, (addr_t)ABSENT_PAGE * PAGE_SIZE, &gpa));
+
+    /* a flush makes the next lookup see the new page tables */
+    check(mmu_gva_to_gpa(cpu, 7 * PAGE_SIZE, &gpa));
+    set_pte(PT(0), 7, (SMALL_GPA + 9 * PAGE_SIZE) | PTE_RW);
+    mmu_tlb_flush(cpu);
+    check(mmu_gva_to_gpa(cpu, 7 * PAGE_SIZE, &gpa));
+    check(gpa == SMALL_GPA + 9 * PAGE_SIZE);
+    set_pte(PT(0), 7, (SMALL_GPA + 7 * PAGE_SIZE) | PTE_RW);
+    mmu_tlb_flush(cpu);
+}
+
+/*
+ * Every exit starts with an empty TLB, so the interesting cases are the
+ * cost of a cold walk and what a REP MOVS-style run of accesses inside one
+ * exit pays once the first access of each page has filled an entry.
+ */
+static void bench(CPUState *cpu, const char *name, long iterations,
+                  int per_exit, addr_t stride, addr_t base, addr_t span)
+{
+    uint64_t reads = guest_reads;
+    uint64_t start = now_ns();
+    addr_t gva = 0, gpa;
+    long i;
+
+    for (i = 0; i < iterations; i++) {
+        if (i % per_exit == 0) {
+            mmu_tlb_flush(cpu);
+        }
+        check(mmu_gva_to_gpa(cpu, base + gva, &gpa));
+        gva = (gva + stride) % span;
+    }
+
+    printf("%-16s %8.1f ns/translation %6.2f guest reads/translation\n",
+           name, (double)(now_ns() - start) / iterations,
+           (double)(guest_reads - reads) / iterations);
+}
+
+int main(int argc, char **argv)
+{
+    long iterations = argc > 1 ? atol(argv[1]) : 2000000;
+    CPUState cpu;
+
+    memset(&cpu, 0, sizeof(cpu));
+    build_page_tables();
+    init_mmu(&cpu);
+    test_translations(&cpu);
+
+    /* 4K pages, a new page on every access */
+    bench(&cpu, "walk 4K", iterations, 1, PAGE_SIZE * 7, 0,
+          (addr_t)(NR_SMALL - 1) * PAGE_SIZE);
+    bench(&cpu, "walk 2M", iterations, 1, LARGE_SIZE + PAGE_SIZE,
+          LARGE_GVA, (addr_t)NR_LARGE * LARGE_SIZE);
+    /* 8-byte elements of a 64K string move, one exit per 8K elements */
+    bench(&cpu, "rep movsq 4K", iterations, 8192, 8, 0, 0x10000);
+    bench(&cpu, "rep movsq 2M", iterations, 8192, 8, LARGE_GVA, 0x10000);
+
+    printf("x86-mmu-bench: ok\n");
+    return 0;
+}
@@ -743,6 +743,7 @@ static void vmx_tcg_init_cpu_signals(void)
 #endif /* _WIN32 */
 
 static QemuMutex vmx_global_mutex;
+static __thread bool iothread_locked;
 static QemuCond vmx_io_proceeded_cond;
 static bool iothread_requesting_mutex;
 
@@ -890,6 +891,7 @@ static void *vmx_cpu_thread_fn(void *arg)
     int r;
 
     vmx_mutex_lock(&vmx_global_mutex);
+    iothread_locked = true;
     vmx_thread_get_self(cpu->thread);
     cpu->thread_id = vmx_get_thread_id();
     cpu->can_do_io = 1;
@@ -973,6 +975,7 @@ static void *vmx_tcg_cpu_thread_fn(void *arg)
     vmx_thread_get_self(cpu->thread);
 
     vmx_mutex_lock(&vmx_global_mutex);
+    iothread_locked = true;
     CPU_FOREACH(cpu) {
         cpu->thread_id = vmx_get_thread_id();
         cpu->created = true;
@@ -1079,6 +1082,11 @@ static bool vmx_in_vcpu_thread(void)
     return current_cpu && vmx_cpu_is_self(current_cpu);
 }
 
+bool vmx_mutex_iothread_locked(void)
+{
+    return iothread_locked;
+}
+
 void vmx_mutex_lock_iothread(void)
 {
     if (1) {
@@ -1092,10 +1100,12 @@ void vmx_mutex_lock_iothread(void)
         iothread_requesting_mutex = false;
         vmx_cond_broadcast(&vmx_io_proceeded_cond);
     }
+    iothread_locked = true;
 }
 
 void vmx_mutex_unlock_iothread(void)
 {
+    iothread_locked = false;
     vmx_mutex_unlock(&vmx_global_mutex);
 }
 
@@ -41,6 +41,8 @@
 #include "cpu-all.h"
 
 #include "qemu/range.h"
+#include "qemu/atomic.h"
+#include "qemu/main-loop.h"
 #include "vmm/vmx.h"
 
 //#define DEBUG_SUBPAGE
@@ -320,14 +322,96 @@ static MemAreaSection *address_space_lookup_region(AddressSpaceDispatch *d,
     return section;
 }
 
+/*
+ * Per-thread MRU cache of the last sections returned by
+ * address_space_translate_internal. Entries are tagged with the dispatch
+ * they were found in and with dispatch_generation, which mem_commit bumps
+ * whenever a dispatch is replaced, so a stale entry can never match.
+ * Readers hold the iothread lock or the dispatch rwlock, mem_commit holds
+ * both.
+ */
+#define TRANSLATE_CACHE_SIZE 4
+
+typedef struct TranslateCacheEntry {
+    AddressSpaceDispatch *d;
+    unsigned generation;
+    hwaddr start;
+    hwaddr end;
+    MemAreaSection *section;
+    /* RAM sections only, host and ram address of start */
+    uint8_t *host;
+    ram_addr_t ram_addr;
+} TranslateCacheEntry;
+
+static unsigned dispatch_generation = 1;
+static __thread TranslateCacheEntry translate_cache[TRANSLATE_CACHE_SIZE];
+
+static void *vmx_ram_ptr_length(ram_addr_t addr, hwaddr *size);
+
+static TranslateCacheEntry *translate_cache_lookup(AddressSpaceDispatch *d, hwaddr addr)
+{
+    TranslateCacheEntry tmp;
+    int i;
+
+    for (i = 0; i < TRANSLATE_CACHE_SIZE; i++) {
+        TranslateCacheEntry *e = &translate_cache[i];
+
+        if (e->d != d || e->generation != dispatch_generation ||
+            addr < e->start || addr >= e->end)
+            continue;
+        if (i) {
+            tmp = *e;
+            memmove(&translate_cache[1], &translate_cache[0], i * sizeof(tmp));
+            translate_cache[0] = tmp;
+        }
+        return &translate_cache[0];
+    }
+    return NULL;
+}
+
+static void translate_cache_insert(AddressSpaceDispatch *d, MemAreaSection *section)
+{
+    TranslateCacheEntry *e = &translate_cache[0];
+    VeertuMemArea *mr = section->mr;
+    hwaddr size = section->size;
+
+    /* the unassigned section covers everything that isn't mapped */
+    if (section == &d->map.sections[PHYS_SECTION_UNASSIGNED] || !size)
+        return;
+
+    memmove(&translate_cache[1], &translate_cache[0],
+            (TRANSLATE_CACHE_SIZE - 1) * sizeof(*e));
+    e->d = d;
+    e->generation = dispatch_generation;
+    e->start = section->offset_within_address_space;
+    e->end = e->start + size;
+    e->section = section;
+    e->host = NULL;
+    if (mem_area_is_ram(mr)) {
+        e->ram_addr = mem_area_get_ram_addr(mr) + section->offset_within_region;
+        e->host = vmx_ram_ptr_length(e->ram_addr, &size);
+        if (size < section->size)
+            e->host = NULL;
+    }
+}
+
 static MemAreaSection *
 address_space_translate_internal(AddressSpaceDispatch *d, hwaddr addr, hwaddr *xlat,
                                  hwaddr *plen, bool resolve_subpage)
 {
+    TranslateCacheEntry *e = NULL;
     MemAreaSection *section;
     uint64_t diff;
 
-    section = address_space_lookup_region(d, addr, resolve_subpage);
+    if (resolve_subpage)
+        e = translate_cache_lookup(d, addr);
+    if (e) {
+        section = e->section;
+    } else {
+        section = address_space_lookup_region(d, addr, resolve_subpage);
+        if (resolve_subpage)
+            translate_cache_insert(d, section);
+    }
     /* Compute offset within MemAreaSection */
     addr -= section->offset_within_address_space;
 
@@ -349,6 +433,34 @@ static inline bool memory_access_is_direct(VeertuMemArea *mr, bool is_write)
     return false;
 }
 
+/* Dispatch tables are otherwise only touched under the iothread lock; threads
+ * that look up regions without it hold this for reading instead.
+ */
+static pthread_rwlock_t dispatch_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+void address_space_dispatch_rdlock(void)
+{
+    pthread_rwlock_rdlock(&dispatch_lock);
+}
+
+void address_space_dispatch_wrlock(void)
+{
+    pthread_rwlock_wrlock(&dispatch_lock);
+}
+
+void address_space_dispatch_unlock(void)
+{
+    pthread_rwlock_unlock(&dispatch_lock);
+}
+
+/* Changes whenever a dispatch is replaced, so callers can tell whether a
+ * region they resolved earlier may have moved.
+ */
+unsigned address_space_dispatch_generation(void)
+{
+    return atomic_read(&dispatch_generation);
+}
+
 VeertuMemArea *address_space_translate(VeertuAddressSpace *as, hwaddr addr,
                                       hwaddr *xlat, hwaddr *plen,
                                       bool is_write)
@@ -356,9 +468,14 @@ VeertuMemArea *address_space_translate(VeertuAddressSpace *as, hwaddr addr,
     MemAreaSection *section;
     VeertuMemArea *mr;
     hwaddr len = *plen;
+    bool locked = vmx_mutex_iothread_locked();
 
+    if (!locked)
+        address_space_dispatch_rdlock();
     section = address_space_translate_internal(as->dispatch, addr, &addr, plen, true);
     mr = section->mr;
+    if (!locked)
+        address_space_dispatch_unlock();
 
     *plen = len;
     *xlat = addr;
@@ -721,8 +838,98 @@ static void mem_add(MemoryCallbacks *listener, MemAreaSection *section)
     }
 }
 
+/* Coalesced MMIO
+ *
+ * vCPUs that exit on a write to a coalesced range queue it here without
+ * taking the iothread lock.  Slots are claimed by bumping tail and become
+ * visible once ready is set; the ring is drained in order, under the
+ * iothread lock, before any other I/O access is dispatched.
+ */
+#define COALESCED_MMIO_RING_SIZE 1024
+
+typedef struct CoalescedMMIOEntry {
+    hwaddr addr;
+    uint8_t data[8];
+    unsigned size;
+    int ready;
+} CoalescedMMIOEntry;
+
+static struct {
+    unsigned long head;
+    unsigned long tail;
+    CoalescedMMIOEntry entries[COALESCED_MMIO_RING_SIZE];
+} coalesced_mmio;
+static bool coalesced_mmio_flushing;
+
+bool vmx_coalesced_mmio_append(hwaddr addr, const void *buf, unsigned size)
+{
+    CoalescedMMIOEntry *e;
+    unsigned long head, tail;
+
+    assert(size <= sizeof(e->data));
+    do {
+        tail = atomic_read(&coalesced_mmio.tail);
+        head = atomic_read(&coalesced_mmio.head);
+        if (tail - head >= COALESCED_MMIO_RING_SIZE)
+            return false;
+    } while (atomic_cmpxchg(&coalesced_mmio.tail, tail, tail + 1) != tail);
+
+    e = &coalesced_mmio.entries[tail % COALESCED_MMIO_RING_SIZE];
+    e->addr = addr;
+    e->size = size;
+    memcpy(e->data, buf, size);
+    smp_wmb();
+    atomic_set(&e->ready, 1);
+
+    /* make sure the main loop drains it even if nothing else takes the lock */
+    if (tail == head)
+        vmx_notify_event();
+    return true;
+}
+
 void vmx_flush_coalesced_mmio_buffer(void)
 {
+    CoalescedMMIOEntry *e, ent;
+    unsigned long head;
+
+    if (coalesced_mmio_flushing)
+        return;
+
+    coalesced_mmio_flushing = true;
+    while ((head = coalesced_mmio.head) != atomic_read(&coalesced_mmio.tail)) {
+        e = &coalesced_mmio.entries[head % COALESCED_MMIO_RING_SIZE];
+        /* the producer has claimed the slot but may still be filling it */
+        while (!atomic_read(&e->ready))
+            ;
+        smp_rmb();
+        ent = *e;
+        smp_mb();
+        atomic_set(&e->ready, 0);
+        atomic_set(&coalesced_mmio.head, head + 1);
+
+        address_space_rw(&address_space_memory, ent.addr, ent.data, ent.size, true);
+    }
+    coalesced_mmio_flushing = false;
+}
+
+/* Called before dispatching to an I/O area. Takes the iothread lock for areas
+ * that rely on it and returns true if the caller has to drop it afterwards.
+ * Lockless areas are dispatched as is; they never share state with coalesced
+ * ranges, so the ring is only drained when the lock is held.
+ */
+static bool prepare_mmio_access(VeertuMemArea *mr)
+{
+    bool release_lock = false;
+
+    if (!vmx_mutex_iothread_locked()) {
+        if (!mr->global_locking)
+            return false;
+        vmx_mutex_lock_iothread();
+        release_lock = true;
+    }
+    if (atomic_read(&coalesced_mmio.head) != atomic_read(&coalesced_mmio.tail))
+        vmx_flush_coalesced_mmio_buffer();
+    return release_lock;
 }
 
 void vmx_mutex_lock_ramlist(void)
@@ -1594,12 +1801,15 @@ static void mem_commit(MemoryCallbacks *listener)
 
     phys_page_compact_all(next, next->map.nodes_nb);
 
+    address_space_dispatch_wrlock();
     as->dispatch = next;
+    dispatch_generation++;
 
     if (cur) {
         phys_sections_free(&cur->map);
         g_free(cur);
     }
+    address_space_dispatch_unlock();
 }
 
 static void tcg_commit(MemoryCallbacks *listener)
@@ -1762,6 +1972,30 @@ static int memory_access_size(VeertuMemArea *mr, unsigned l, hwaddr addr)
     return l;
 }
 
+/* Host pointer for a guest RAM access that hits the translate cache, or NULL.
+ * *plen is clamped to the RAM section and *ram_addr set for dirty tracking.
+ */
+static uint8_t *address_space_ram_fast(VeertuAddressSpace *as, hwaddr addr, hwaddr *plen,
+                                       ram_addr_t *ram_addr, bool is_write)
+{
+    TranslateCacheEntry *e;
+    uint8_t *host = NULL;
+    bool locked = vmx_mutex_iothread_locked();
+
+    if (!locked)
+        address_space_dispatch_rdlock();
+    e = translate_cache_lookup(as->dispatch, addr);
+    if (e && e->host && !(is_write && e->section->mr->readonly)) {
+        if (*plen > e->end - addr)
+            *plen = e->end - addr;
+        *ram_addr = e->ram_addr + (addr - e->start);
+        host = e->host + (addr - e->start);
+    }
+    if (!locked)
+        address_space_dispatch_unlock();
+    return host;
+}
+
 bool address_space_rw(VeertuAddressSpace *as, hwaddr addr, uint8_t *buf,
                       int len, bool is_write)
 {
@@ -1771,13 +2005,30 @@ bool address_space_rw(VeertuAddressSpace *as, hwaddr addr, uint8_t *buf,
     hwaddr addr1;
     VeertuMemArea *mr;
     bool error = false;
+    bool release_lock = false;
 
     while (len > 0) {
+        l = len;
+        ptr = address_space_ram_fast(as, addr, &l, &addr1, is_write);
+        if (ptr) {
+            if (is_write) {
+                memcpy(ptr, buf, l);
+                invalidate_and_set_dirty(addr1, l);
+            } else {
+                memcpy(buf, ptr, l);
+            }
+            len -= l;
+            buf += l;
+            addr += l;
+            continue;
+        }
+
         l = len;
         mr = address_space_translate(as, addr, &addr1, &l, is_write);
 
         if (is_write) {
             if (!memory_access_is_direct(mr, is_write)) {
+                release_lock = prepare_mmio_access(mr);
                 l = memory_access_size(mr, l, addr1);
                 /* XXX: could force current_cpu to NULL to avoid
                    potential bugs */
@@ -1815,6 +2066,7 @@ bool address_space_rw(VeertuAddressSpace *as, hwaddr addr, uint8_t *buf,
         } else {
             if (!memory_access_is_direct(mr, is_write)) {
                 /* I/O case */
+                release_lock = prepare_mmio_access(mr);
                 l = memory_access_size(mr, l, addr1);
                 switch (l) {
                 case 8:
@@ -1846,6 +2098,12 @@ bool address_space_rw(VeertuAddressSpace *as, hwaddr addr, uint8_t *buf,
                 memcpy(buf, ptr, l);
             }
         }
+
+        if (release_lock) {
+            vmx_mutex_unlock_iothread();
+            release_lock = false;
+        }
+
         len -= l;
         buf += l;
         addr += l;
@@ -1854,6 +2112,105 @@ bool address_space_rw(VeertuAddressSpace *as, hwaddr addr, uint8_t *buf,
     return error;
 }
 
+bool address_space_is_coalesced(VeertuAddressSpace *as, hwaddr addr, unsigned size)
+{
+    MemAreaSection *section;
+    hwaddr xlat, l = size;
+    bool locked = vmx_mutex_iothread_locked();
+    bool ret = false;
+
+    if (!locked)
+        address_space_dispatch_rdlock();
+    section = address_space_translate_internal(as->dispatch, addr, &xlat, &l, true);
+    if (l >= size && !memory_access_is_direct(section->mr, true))
+        ret = mem_area_is_coalesced(section->mr, xlat, size);
+    if (!locked)
+        address_space_dispatch_unlock();
+    return ret;
+}
+
+/* True if an access to [addr, addr + size) can be dispatched without the
+ * iothread lock.
+ */
+bool address_space_is_lockless(VeertuAddressSpace *as, hwaddr addr, unsigned size)
+{
+    hwaddr xlat, l = size;
+    VeertuMemArea *mr;
+
+    mr = address_space_translate(as, addr, &xlat, &l, true);
+    if (l < size || memory_access_is_direct(mr, true))
+        return false;
+    return !mr->global_locking;
+}
+
+/*
+ * Repeat a `size` byte access `count` times at the same address, as done by
+ * REP INS/OUTS.  The region is resolved once; accesses the region can't take
+ * at that size go through address_space_rw one element at a time.
+ */
+bool address_space_rw_rep(VeertuAddressSpace *as, hwaddr addr, uint8_t *buf,
+                          int size, uint32_t count, bool is_write)
+{
+    hwaddr l = size;
+    hwaddr addr1;
+    uint64_t val = 0;
+    VeertuMemArea *mr;
+    bool error = false;
+    bool release_lock;
+
+    mr = address_space_translate(as, addr, &addr1, &l, is_write);
+    if (memory_access_is_direct(mr, is_write) ||
+        memory_access_size(mr, size, addr1) != size || size > 8) {
+        while (count--) {
+            error |= address_space_rw(as, addr, buf, size, is_write);
+            buf += size;
+        }
+        return error;
+    }
+
+    release_lock = prepare_mmio_access(mr);
+    while (count--) {
+        if (is_write) {
+            switch (size) {
+            case 8:
+                val = ldq_p(buf);
+                break;
+            case 4:
+                val = ldl_p(buf);
+                break;
+            case 2:
+                val = lduw_p(buf);
+                break;
+            default:
+                val = ldub_p(buf);
+                break;
+            }
+            error |= memory_area_io_write(mr, addr1, val, size);
+        } else {
+            error |= memory_area_io_read(mr, addr1, &val, size);
+            switch (size) {
+            case 8:
+                stq_p(buf, val);
+                break;
+            case 4:
+                stl_p(buf, val);
+                break;
+            case 2:
+                stw_p(buf, val);
+                break;
+            default:
+                stb_p(buf, val);
+                break;
+            }
+        }
+        buf += size;
+    }
+    if (release_lock)
+        vmx_mutex_unlock_iothread();
+
+    return error;
+}
+
 bool address_space_write(VeertuAddressSpace *as, hwaddr addr,
                          const uint8_t *buf, int len)
 {
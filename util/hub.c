@@ -73,6 +73,34 @@ static ssize_t net_hub_receive_iov(NetHub *hub, NetHubPort *source_port,
     return len;
 }
 
+/* Keeps runs of packets together so a port whose peer takes batches gets
+ * them in one call.  Like vmx_send_packet, what a port can't take now is
+ * queued or dropped. */
+static int net_hub_receive_batch(NetHub *hub, NetHubPort *source_port,
+                                 const struct iovec *pkts, int count)
+{
+    NetHubPort *port;
+    int sent;
+
+    QLIST_FOREACH(port, &hub->ports, next) {
+        if (port == source_port) {
+            continue;
+        }
+
+        sent = 0;
+        while (sent < count) {
+            sent += vmx_send_packet_batch_async(&port->nc, pkts + sent,
+                                                count - sent, NULL);
+            if (sent < count) {
+                /* a short count means the packet after those sent was
+                 * queued, go on with the one after it */
+                sent++;
+            }
+        }
+    }
+    return count;
+}
+
 static NetHub *net_hub_new(int id)
 {
     NetHub *hub;
@@ -122,6 +150,14 @@ static ssize_t net_hub_port_receive_iov(NetClientState *nc,
     return net_hub_receive_iov(port->hub, port, iov, iovcnt);
 }
 
+static int net_hub_port_receive_batch(NetClientState *nc,
+                                      const struct iovec *pkts, int count)
+{
+    NetHubPort *port = DO_UPCAST(NetHubPort, nc, nc);
+
+    return net_hub_receive_batch(port->hub, port, pkts, count);
+}
+
 static void net_hub_port_cleanup(NetClientState *nc)
 {
     NetHubPort *port = DO_UPCAST(NetHubPort, nc, nc);
@@ -135,6 +171,7 @@ static NetClientInfo net_hub_port_info = {
     .can_receive = net_hub_port_can_receive,
     .receive = net_hub_port_receive,
     .receive_iov = net_hub_port_receive_iov,
+    .receive_batch = net_hub_port_receive_batch,
     .cleanup = net_hub_port_cleanup,
 };
 
@@ -35,6 +35,7 @@ void usb_audio_register_types(void);
 void usb_hub_register_types(void);
 void usb_msd_register_types(void);
 void e1000_register_types(void);
+void virtio_net_register_types(void);
 //void fw_path_provider_register_types(void);
 void fw_cfg_register_types(void);
 void ehci_pci_register_types(void);
@@ -150,6 +151,7 @@ type_init(ehci_pci_register_types)
 type_init(fw_cfg_register_types)
 //type_init(fw_path_provider_register_types)
 type_init(e1000_register_types)
+type_init(virtio_net_register_types)
 type_init(usb_msd_register_types)
 type_init(usb_hub_register_types)
 type_init(usb_audio_register_types)
@@ -28,6 +28,7 @@
 #include "slirp/libslirp.h"
 #include "qemu/main-loop.h"
 #include "aio.h"
+#include "cpu-common.h"
 
 #ifndef _WIN32
 
@@ -584,6 +585,7 @@ int main_loop_wait(int nonblocking)
                                           &main_loop_tlg));
 
     ret = vmx_event_wait_ns(timeout_ns);
+    vmx_flush_coalesced_mmio_buffer();
     vmx_iohandler_poll(gpollfds, ret);
 #ifdef CONFIG_SLIRP
     slirp_pollfds_poll(gpollfds, (ret < 0));
@@ -249,6 +249,8 @@ void mem_area_initfn(VeertuType *obj)
     area->enabled = 1;
     area->ops = &do_nothing_ops;
     QTAILQ_INIT(&area->child);
+    QTAILQ_INIT(&area->coalesced);
+    area->global_locking = true;
 }
 
 static bool do_nothing_func(void *opauqe, uint64_t addr, unsigned size, bool is_write)
@@ -451,6 +453,59 @@ void mem_area_set_readonly(VeertuMemArea *area, int readonly, int flush)
         veertu_mem_referesh();
 }
 
+void mem_area_set_coalescing(VeertuMemArea *area)
+{
+    mem_area_clear_coalescing(area);
+    mem_area_add_coalescing(area, 0, area->size);
+}
+
+void mem_area_add_coalescing(VeertuMemArea *area, uint64_t offset, uint64_t size)
+{
+    CoalescedMemoryRange *cmr = g_malloc0(sizeof(*cmr));
+
+    cmr->offset = offset;
+    cmr->size = size;
+    address_space_dispatch_wrlock();
+    QTAILQ_INSERT_TAIL(&area->coalesced, cmr, link);
+    address_space_dispatch_unlock();
+}
+
+void mem_area_clear_coalescing(VeertuMemArea *area)
+{
+    CoalescedMemoryRange *cmr;
+
+    if (QTAILQ_EMPTY(&area->coalesced))
+        return;
+
+    vmx_flush_coalesced_mmio_buffer();
+    address_space_dispatch_wrlock();
+    while (!QTAILQ_EMPTY(&area->coalesced)) {
+        cmr = QTAILQ_FIRST(&area->coalesced);
+        QTAILQ_REMOVE(&area->coalesced, cmr, link);
+        g_free(cmr);
+    }
+    address_space_dispatch_unlock();
+}
+
+bool mem_area_is_coalesced(VeertuMemArea *area, uint64_t offset, uint64_t size)
+{
+    CoalescedMemoryRange *cmr;
+
+    QTAILQ_FOREACH(cmr, &area->coalesced, link) {
+        if (offset >= cmr->offset && offset + size <= cmr->offset + cmr->size)
+            return true;
+    }
+    return false;
+}
+
+/* The area's ops do their own locking and may be called by a vcpu thread
+ * without the iothread lock held.
+ */
+void mem_area_clear_global_locking(VeertuMemArea *area)
+{
+    area->global_locking = false;
+}
+
 void *memory_area_get_ram_ptr(VeertuMemArea *area)
 {
     return area->alias ? vmx_get_ram_ptr(area->alias->ram_addr) : vmx_get_ram_ptr(area->ram_addr);
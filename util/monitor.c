@@ -30,6 +30,7 @@
 #include "loader.h"
 #include "net/net.h"
 #include "net/slirp.h"
+#include "vnet_fwd.h"
 #include "emuchar.h"
 #include "sysemu.h"
 #include "monitor/monitor.h"
@@ -52,12 +53,17 @@
 #include "qapi/qmp/json-parser.h"
 #include "qemu/osdep.h"
 #include "cpu.h"
+#include "vmm/vmx.h"
+#include "vmm/x86_decode.h"
+#include "vmm/veertu.h"
 #ifdef CONFIG_TRACE_SIMPLE
 #include "trace/simple.h"
 #endif
 #include "memory.h"
 #include "qmp-commands.h"
 #include "qemu/thread.h"
+#include "qemu/main-loop.h"
+#include "thread-pool.h"
 #include "qapi.h"
 #include "qapi/qmp-event.h"
 #include "qapi-event.h"
@@ -448,6 +454,166 @@ void cmd_del_port_forward(Monitor *mon, int argc, char *argv[])
     monitor_puts(mon, res >=0 ? "OK\n" : "FAIL\n");
 }
 
+void cmd_port_fwd_stats(Monitor *mon, int argc, char *argv[])
+{
+    char *report;
+
+    report = vnet_port_fwd_stats_report();
+    monitor_puts(mon, report);
+    g_free(report);
+}
+
+void cmd_decode_stats(Monitor *mon, int argc, char *argv[])
+{
+    char buf[256];
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        struct x86_decode_cache *cache = cpu->decode_cache;
+
+        if (!cache)
+            continue;
+        snprintf(buf, sizeof(buf), "cpu %d: hits %llu misses %llu invalidations %llu\n",
+                 cpu->cpu_index, cache->hits, cache->misses, cache->invalidations);
+        monitor_puts(mon, buf);
+    }
+}
+
+void cmd_exit_stats(Monitor *mon, int argc, char *argv[])
+{
+    char *report;
+
+    if (argc > 1 && !strcasecmp(argv[1], "reset")) {
+        veertu_exit_stats_reset();
+        return;
+    }
+    if (argc > 2 && !strcasecmp(argv[1], "interval")) {
+        veertu_exit_stats_dump_interval(atoi(argv[2]));
+        return;
+    }
+
+    report = veertu_exit_stats_report();
+    monitor_puts(mon, report);
+    g_free(report);
+}
+
+void cmd_block_stats(Monitor *mon, int argc, char *argv[])
+{
+    char buf[256];
+    BlockDriverState *bs = NULL;
+    BlockDriverInfo bdi;
+    BlockAcctStats *stats;
+    ThreadPoolStats tps;
+    BlockAcctWindow *w;
+
+    /* block_stats intervals on|off toggles the per-second/minute windows */
+    if (argc > 2 && !strcasecmp(argv[1], "intervals")) {
+        bool enable = !strcasecmp(argv[2], "on");
+
+        while ((bs = bdrv_next(bs))) {
+            block_acct_set_intervals(bdrv_get_stats(bs), enable);
+        }
+        monitor_puts(mon, "OK\n");
+        return;
+    }
+
+    while ((bs = bdrv_next(bs))) {
+        stats = bdrv_get_stats(bs);
+        snprintf(buf, sizeof(buf), "%s: failed rd %llu wr %llu flush %llu "
+                 "invalid rd %llu wr %llu max queue depth rd %u wr %u\n",
+                 bdrv_get_device_name(bs),
+                 stats->failed_ops[BLOCK_ACCT_READ],
+                 stats->failed_ops[BLOCK_ACCT_WRITE],
+                 stats->failed_ops[BLOCK_ACCT_FLUSH],
+                 stats->invalid_ops[BLOCK_ACCT_READ],
+                 stats->invalid_ops[BLOCK_ACCT_WRITE],
+                 stats->max_in_flight[BLOCK_ACCT_READ],
+                 stats->max_in_flight[BLOCK_ACCT_WRITE]);
+        monitor_puts(mon, buf);
+        w = block_acct_last_window(stats, BLOCK_ACCT_INTERVAL_1S);
+        if (w) {
+            snprintf(buf, sizeof(buf), "%s: last 1s rd %llu ops avg %llu us "
+                     "max %llu us, wr %llu ops avg %llu us max %llu us\n",
+                     bdrv_get_device_name(bs),
+                     w->nr_ops[BLOCK_ACCT_READ],
+                     w->nr_ops[BLOCK_ACCT_READ] ?
+                     w->total_time_ns[BLOCK_ACCT_READ] /
+                     w->nr_ops[BLOCK_ACCT_READ] / 1000 : 0,
+                     w->max_time_ns[BLOCK_ACCT_READ] / 1000,
+                     w->nr_ops[BLOCK_ACCT_WRITE],
+                     w->nr_ops[BLOCK_ACCT_WRITE] ?
+                     w->total_time_ns[BLOCK_ACCT_WRITE] /
+                     w->nr_ops[BLOCK_ACCT_WRITE] / 1000 : 0,
+                     w->max_time_ns[BLOCK_ACCT_WRITE] / 1000);
+            monitor_puts(mon, buf);
+        }
+        if (stats->nr_throttled[BLOCK_ACCT_READ] ||
+            stats->nr_throttled[BLOCK_ACCT_WRITE]) {
+            snprintf(buf, sizeof(buf), "%s: throttled reads %llu (%llu ms) "
+                     "writes %llu (%llu ms)\n", bdrv_get_device_name(bs),
+                     stats->nr_throttled[BLOCK_ACCT_READ],
+                     stats->throttled_time_ns[BLOCK_ACCT_READ] / 1000000,
+                     stats->nr_throttled[BLOCK_ACCT_WRITE],
+                     stats->throttled_time_ns[BLOCK_ACCT_WRITE] / 1000000);
+            monitor_puts(mon, buf);
+        }
+        if (bdrv_get_info(bs, &bdi) < 0)
+            continue;
+        snprintf(buf, sizeof(buf), "%s: cache hits %llu misses %llu evictions %llu\n",
+                 bdrv_get_device_name(bs), bdi.cache_hits, bdi.cache_misses,
+                 bdi.cache_evictions);
+        monitor_puts(mon, buf);
+        if (bdi.decompress_hits || bdi.decompress_misses) {
+            snprintf(buf, sizeof(buf), "%s: decompress hits %llu misses %llu "
+                     "avg inflate %llu us\n", bdrv_get_device_name(bs),
+                     bdi.decompress_hits, bdi.decompress_misses,
+                     bdi.decompress_misses ?
+                     bdi.decompress_ns / bdi.decompress_misses / 1000 : 0);
+            monitor_puts(mon, buf);
+        }
+    }
+
+    thread_pool_get_stats(aio_get_thread_pool(vmx_get_aio_context()), &tps);
+    snprintf(buf, sizeof(buf), "thread pool: threads %d submitted %llu in flight %llu "
+             "(max %llu) avg latency %llu us max %llu us\n",
+             tps.threads, tps.submitted, tps.in_flight, tps.max_in_flight,
+             tps.completed ? tps.total_latency_ns / tps.completed / 1000 : 0,
+             tps.max_latency_ns / 1000);
+    monitor_puts(mon, buf);
+}
+
+void cmd_net_stats(Monitor *mon, int argc, char *argv[])
+{
+    char *report;
+
+    report = vmx_net_queue_stats_report();
+    monitor_puts(mon, report);
+    g_free(report);
+}
+
+/* block_throttle <device> <bps> <bps_rd> <bps_wr> <iops> <iops_rd> <iops_wr>
+ * all zero removes the limits */
+void cmd_block_throttle(Monitor *mon, int argc, char *argv[])
+{
+    Error *err = NULL;
+
+    if (argc != 8) {
+        monitor_puts(mon, "FAIL\n");
+        return;
+    }
+
+    qmp_block_set_io_throttle(argv[1], atoll(argv[2]), atoll(argv[3]),
+                              atoll(argv[4]), atoll(argv[5]), atoll(argv[6]),
+                              atoll(argv[7]), false, 0, false, 0, false, 0,
+                              false, 0, false, 0, false, 0, false, 0, &err);
+    if (err) {
+        monitor_puts(mon, error_get_pretty(err));
+        monitor_puts(mon, "\nFAIL\n");
+        error_free(err);
+        return;
+    }
+    monitor_puts(mon, "OK\n");
+}
 
 static struct cmd_handler handlers[] = {
     {"status", cmd_status},
@@ -459,6 +625,12 @@ static struct cmd_handler handlers[] = {
     {"ip_addr", cmd_show_ip_address},
     {"add_port_forward", cmd_add_port_forward},
     {"del_port_forward", cmd_del_port_forward},
+    {"decode_stats", cmd_decode_stats},
+    {"exit_stats", cmd_exit_stats},
+    {"block_stats", cmd_block_stats},
+    {"block_throttle", cmd_block_throttle},
+    {"net_stats", cmd_net_stats},
+    {"port_fwd_stats", cmd_port_fwd_stats},
 };
 
 
@@ -572,6 +572,18 @@ ssize_t vmx_send_packet_async(NetClientState *sender,
                                              buf, size, sent_cb);
 }
 
+int vmx_send_packet_batch_async(NetClientState *sender,
+                                const struct iovec *pkts, int count,
+                                NetPacketSent *sent_cb)
+{
+    if (sender->link_down || !sender->peer) {
+        return count;
+    }
+
+    return vmx_net_queue_send_batch(sender->peer->incoming_queue, sender,
+                                    pkts, count, sent_cb);
+}
+
 void vmx_send_packet(NetClientState *nc, const uint8_t *buf, int size)
 {
     vmx_send_packet_async(nc, buf, size, NULL);
@@ -624,6 +636,28 @@ ssize_t vmx_deliver_packet_iov(NetClientState *sender,
     return ret;
 }
 
+int vmx_deliver_packet_batch(const struct iovec *pkts, int count,
+                              void *opaque)
+{
+    NetClientState *nc = opaque;
+    int ret;
+
+    if (nc->link_down) {
+        return count;
+    }
+
+    if (nc->receive_disabled) {
+        return 0;
+    }
+
+    ret = nc->info->receive_batch(nc, pkts, count);
+    if (ret < count) {
+        nc->receive_disabled = 1;
+    }
+
+    return ret;
+}
+
 ssize_t vmx_sendv_packet_async(NetClientState *sender,
                                 const struct iovec *iov, int iovcnt,
                                 NetPacketSent *sent_cb)
@@ -1054,6 +1088,25 @@ void print_net_client(Monitor *mon, NetClientState *nc)
 {
 }
 
+char *vmx_net_queue_stats_report(void)
+{
+    GString *str = g_string_new(NULL);
+    NetClientState *nc;
+    NetQueueStats stats;
+
+    QTAILQ_FOREACH(nc, &net_clients, next) {
+        vmx_net_queue_get_stats(nc->incoming_queue, &stats);
+        g_string_append_printf(str, "%s: queued %llu dropped %llu purged %llu "
+                               "high water %u batches %llu avg batch %llu "
+                               "max batch %u pool misses %llu\n", nc->name,
+                               stats.queued, stats.dropped, stats.purged,
+                               stats.high_water, stats.batches,
+                               stats.batches ? stats.batched / stats.batches : 0,
+                               stats.max_batch, stats.pool_misses);
+    }
+    return g_string_free(str, false);
+}
+
 RxFilterInfoList *qmp_query_rx_filter(bool has_name, const char *name,
                                       Error **errp)
 {
@@ -1253,6 +1253,70 @@ void qapi_free_BlockInfo(BlockInfo *obj)
 }
 
 
+void qapi_free_BlockDeviceTimedStatsList(BlockDeviceTimedStatsList *obj)
+{
+    QapiDeallocVisitor *md;
+    Visitor *v;
+
+    if (!obj) {
+        return;
+    }
+
+    md = qapi_dealloc_visitor_new();
+    v = qapi_dealloc_get_visitor(md);
+    visit_type_BlockDeviceTimedStatsList(v, &obj, NULL, NULL);
+    qapi_dealloc_visitor_cleanup(md);
+}
+
+
+void qapi_free_BlockDeviceTimedStats(BlockDeviceTimedStats *obj)
+{
+    QapiDeallocVisitor *md;
+    Visitor *v;
+
+    if (!obj) {
+        return;
+    }
+
+    md = qapi_dealloc_visitor_new();
+    v = qapi_dealloc_get_visitor(md);
+    visit_type_BlockDeviceTimedStats(v, &obj, NULL, NULL);
+    qapi_dealloc_visitor_cleanup(md);
+}
+
+
+void qapi_free_BlockLatencyHistogramList(BlockLatencyHistogramList *obj)
+{
+    QapiDeallocVisitor *md;
+    Visitor *v;
+
+    if (!obj) {
+        return;
+    }
+
+    md = qapi_dealloc_visitor_new();
+    v = qapi_dealloc_get_visitor(md);
+    visit_type_BlockLatencyHistogramList(v, &obj, NULL, NULL);
+    qapi_dealloc_visitor_cleanup(md);
+}
+
+
+void qapi_free_BlockLatencyHistogram(BlockLatencyHistogram *obj)
+{
+    QapiDeallocVisitor *md;
+    Visitor *v;
+
+    if (!obj) {
+        return;
+    }
+
+    md = qapi_dealloc_visitor_new();
+    v = qapi_dealloc_get_visitor(md);
+    visit_type_BlockLatencyHistogram(v, &obj, NULL, NULL);
+    qapi_dealloc_visitor_cleanup(md);
+}
+
+
 void qapi_free_BlockDeviceStatsList(BlockDeviceStatsList *obj)
 {
     QapiDeallocVisitor *md;
@@ -357,6 +357,30 @@ typedef struct BlockInfoList
 } BlockInfoList;
 
 
+typedef struct BlockDeviceTimedStats BlockDeviceTimedStats;
+
+typedef struct BlockDeviceTimedStatsList
+{
+    union {
+        BlockDeviceTimedStats *value;
+        uint64_t padding;
+    };
+    struct BlockDeviceTimedStatsList *next;
+} BlockDeviceTimedStatsList;
+
+
+typedef struct BlockLatencyHistogram BlockLatencyHistogram;
+
+typedef struct BlockLatencyHistogramList
+{
+    union {
+        BlockLatencyHistogram *value;
+        uint64_t padding;
+    };
+    struct BlockLatencyHistogramList *next;
+} BlockLatencyHistogramList;
+
+
 typedef struct BlockDeviceStats BlockDeviceStats;
 
 typedef struct BlockDeviceStatsList
@@ -2927,6 +2951,34 @@ struct BlockInfo
 void qapi_free_BlockInfoList(BlockInfoList *obj);
 void qapi_free_BlockInfo(BlockInfo *obj);
 
+struct BlockDeviceTimedStats
+{
+    int64_t interval_length;
+    int64_t min_rd_latency_ns;
+    int64_t max_rd_latency_ns;
+    int64_t avg_rd_latency_ns;
+    int64_t min_wr_latency_ns;
+    int64_t max_wr_latency_ns;
+    int64_t avg_wr_latency_ns;
+    int64_t min_flush_latency_ns;
+    int64_t max_flush_latency_ns;
+    int64_t avg_flush_latency_ns;
+    double avg_rd_queue_depth;
+    double avg_wr_queue_depth;
+};
+
+void qapi_free_BlockDeviceTimedStatsList(BlockDeviceTimedStatsList *obj);
+void qapi_free_BlockDeviceTimedStats(BlockDeviceTimedStats *obj);
+
+struct BlockLatencyHistogram
+{
+    intList *boundaries;
+    intList *bins;
+};
+
+void qapi_free_BlockLatencyHistogramList(BlockLatencyHistogramList *obj);
+void qapi_free_BlockLatencyHistogram(BlockLatencyHistogram *obj);
+
 struct BlockDeviceStats
 {
     int64_t rd_bytes;
@@ -2938,6 +2990,21 @@ struct BlockDeviceStats
     int64_t wr_total_time_ns;
     int64_t rd_total_time_ns;
     int64_t wr_highest_offset;
+    int64_t failed_rd_operations;
+    int64_t failed_wr_operations;
+    int64_t failed_flush_operations;
+    int64_t invalid_rd_operations;
+    int64_t invalid_wr_operations;
+    int64_t invalid_flush_operations;
+    int64_t max_rd_queue_depth;
+    int64_t max_wr_queue_depth;
+    BlockDeviceTimedStatsList *timed_stats;
+    bool has_rd_latency_histogram;
+    BlockLatencyHistogram *rd_latency_histogram;
+    bool has_wr_latency_histogram;
+    BlockLatencyHistogram *wr_latency_histogram;
+    bool has_flush_latency_histogram;
+    BlockLatencyHistogram *flush_latency_histogram;
 };
 
 void qapi_free_BlockDeviceStatsList(BlockDeviceStatsList *obj);
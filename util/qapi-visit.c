@@ -1497,6 +1497,154 @@ out:
     error_propagate(errp, err);
 }
 
+static void visit_type_BlockDeviceTimedStats_fields(Visitor *m, BlockDeviceTimedStats **obj, Error **errp)
+{
+    Error *err = NULL;
+    visit_type_int(m, &(*obj)->interval_length, "interval_length", &err);
+    if (err) {
+        goto out;
+    }
+    visit_type_int(m, &(*obj)->min_rd_latency_ns, "min_rd_latency_ns", &err);
+    if (err) {
+        goto out;
+    }
+    visit_type_int(m, &(*obj)->max_rd_latency_ns, "max_rd_latency_ns", &err);
+    if (err) {
+        goto out;
+    }
+    visit_type_int(m, &(*obj)->avg_rd_latency_ns, "avg_rd_latency_ns", &err);
+    if (err) {
+        goto out;
+    }
+    visit_type_int(m, &(*obj)->min_wr_latency_ns, "min_wr_latency_ns", &err);
+    if (err) {
+        goto out;
+    }
+    visit_type_int(m, &(*obj)->max_wr_latency_ns, "max_wr_latency_ns", &err);
+    if (err) {
+        goto out;
+    }
+    visit_type_int(m, &(*obj)->avg_wr_latency_ns, "avg_wr_latency_ns", &err);
+    if (err) {
+        goto out;
+    }
+    visit_type_int(m, &(*obj)->min_flush_latency_ns, "min_flush_latency_ns", &err);
+    if (err) {
+        goto out;
+    }
+    visit_type_int(m, &(*obj)->max_flush_latency_ns, "max_flush_latency_ns", &err);
+    if (err) {
+        goto out;
+    }
+    visit_type_int(m, &(*obj)->avg_flush_latency_ns, "avg_flush_latency_ns", &err);
+    if (err) {
+        goto out;
+    }
+    visit_type_number(m, &(*obj)->avg_rd_queue_depth, "avg_rd_queue_depth", &err);
+    if (err) {
+        goto out;
+    }
+    visit_type_number(m, &(*obj)->avg_wr_queue_depth, "avg_wr_queue_depth", &err);
+    if (err) {
+        goto out;
+    }
+
+out:
+    error_propagate(errp, err);
+}
+
+void visit_type_BlockDeviceTimedStats(Visitor *m, BlockDeviceTimedStats **obj, const char *name, Error **errp)
+{
+    Error *err = NULL;
+
+    visit_start_struct(m, (void **)obj, "BlockDeviceTimedStats", name, sizeof(BlockDeviceTimedStats), &err);
+    if (!err) {
+        if (*obj) {
+            visit_type_BlockDeviceTimedStats_fields(m, obj, errp);
+        }
+        visit_end_struct(m, &err);
+    }
+    error_propagate(errp, err);
+}
+
+void visit_type_BlockDeviceTimedStatsList(Visitor *m, BlockDeviceTimedStatsList **obj, const char *name, Error **errp)
+{
+    Error *err = NULL;
+    GenericList *i, **prev;
+
+    visit_start_list(m, name, &err);
+    if (err) {
+        goto out;
+    }
+
+    for (prev = (GenericList **)obj;
+         !err && (i = visit_next_list(m, prev, &err)) != NULL;
+         prev = &i) {
+        BlockDeviceTimedStatsList *native_i = (BlockDeviceTimedStatsList *)i;
+        visit_type_BlockDeviceTimedStats(m, &native_i->value, NULL, &err);
+    }
+
+    error_propagate(errp, err);
+    err = NULL;
+    visit_end_list(m, &err);
+out:
+    error_propagate(errp, err);
+}
+
+static void visit_type_BlockLatencyHistogram_fields(Visitor *m, BlockLatencyHistogram **obj, Error **errp)
+{
+    Error *err = NULL;
+    visit_type_intList(m, &(*obj)->boundaries, "boundaries", &err);
+    if (err) {
+        goto out;
+    }
+    visit_type_intList(m, &(*obj)->bins, "bins", &err);
+    if (err) {
+        goto out;
+    }
+
+out:
+    error_propagate(errp, err);
+}
+
+void visit_type_BlockLatencyHistogram(Visitor *m, BlockLatencyHistogram **obj, const char *name, Error **errp)
+{
+    Error *err = NULL;
+
+    visit_start_struct(m, (void **)obj, "BlockLatencyHistogram", name, sizeof(BlockLatencyHistogram), &err);
+    if (!err) {
+        if (*obj) {
+            visit_type_BlockLatencyHistogram_fields(m, obj, errp);
+        }
+        visit_end_struct(m, &err);
+    }
+    error_propagate(errp, err);
+}
+
+void visit_type_BlockLatencyHistogramList(Visitor *m, BlockLatencyHistogramList **obj, const char *name, Error **errp)
+{
+    Error *err = NULL;
+    GenericList *i, **prev;
+
+    visit_start_list(m, name, &err);
+    if (err) {
+        goto out;
+    }
+
+    for (prev = (GenericList **)obj;
+         !err && (i = visit_next_list(m, prev, &err)) != NULL;
+         prev = &i) {
+        BlockLatencyHistogramList *native_i = (BlockLatencyHistogramList *)i;
+        visit_type_BlockLatencyHistogram(m, &native_i->value, NULL, &err);
+    }
+
+    error_propagate(errp, err);
+    err = NULL;
+    visit_end_list(m, &err);
+out:
+    error_propagate(errp, err);
+}
+
 static void visit_type_BlockDeviceStats_fields(Visitor *m, BlockDeviceStats **obj, Error **errp)
 {
     Error *err = NULL;
@@ -1536,6 +1684,63 @@ static void visit_type_BlockDeviceStats_fields(Visitor *m, BlockDeviceStats **ob
     if (err) {
         goto out;
     }
+    visit_type_int(m, &(*obj)->failed_rd_operations, "failed_rd_operations", &err);
+    if (err) {
+        goto out;
+    }
+    visit_type_int(m, &(*obj)->failed_wr_operations, "failed_wr_operations", &err);
+    if (err) {
+        goto out;
+    }
+    visit_type_int(m, &(*obj)->failed_flush_operations, "failed_flush_operations", &err);
+    if (err) {
+        goto out;
+    }
+    visit_type_int(m, &(*obj)->invalid_rd_operations, "invalid_rd_operations", &err);
+    if (err) {
+        goto out;
+    }
+    visit_type_int(m, &(*obj)->invalid_wr_operations, "invalid_wr_operations", &err);
+    if (err) {
+        goto out;
+    }
+    visit_type_int(m, &(*obj)->invalid_flush_operations, "invalid_flush_operations", &err);
+    if (err) {
+        goto out;
+    }
+    visit_type_int(m, &(*obj)->max_rd_queue_depth, "max_rd_queue_depth", &err);
+    if (err) {
+        goto out;
+    }
+    visit_type_int(m, &(*obj)->max_wr_queue_depth, "max_wr_queue_depth", &err);
+    if (err) {
+        goto out;
+    }
+    visit_type_BlockDeviceTimedStatsList(m, &(*obj)->timed_stats, "timed_stats", &err);
+    if (err) {
+        goto out;
+    }
+    visit_optional(m, &(*obj)->has_rd_latency_histogram, "rd_latency_histogram", &err);
+    if (!err && (*obj)->has_rd_latency_histogram) {
+        visit_type_BlockLatencyHistogram(m, &(*obj)->rd_latency_histogram, "rd_latency_histogram", &err);
+    }
+    if (err) {
+        goto out;
+    }
+    visit_optional(m, &(*obj)->has_wr_latency_histogram, "wr_latency_histogram", &err);
+    if (!err && (*obj)->has_wr_latency_histogram) {
+        visit_type_BlockLatencyHistogram(m, &(*obj)->wr_latency_histogram, "wr_latency_histogram", &err);
+    }
+    if (err) {
+        goto out;
+    }
+    visit_optional(m, &(*obj)->has_flush_latency_histogram, "flush_latency_histogram", &err);
+    if (!err && (*obj)->has_flush_latency_histogram) {
+        visit_type_BlockLatencyHistogram(m, &(*obj)->flush_latency_histogram, "flush_latency_histogram", &err);
+    }
+    if (err) {
+        goto out;
+    }
 
 out:
     error_propagate(errp, err);
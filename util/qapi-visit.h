@@ -89,6 +89,12 @@ void visit_type_BlockDirtyInfoList(Visitor *m, BlockDirtyInfoList **obj, const c
 void visit_type_BlockInfo(Visitor *m, BlockInfo **obj, const char *name, Error **errp);
 void visit_type_BlockInfoList(Visitor *m, BlockInfoList **obj, const char *name, Error **errp);
 
+void visit_type_BlockDeviceTimedStats(Visitor *m, BlockDeviceTimedStats **obj, const char *name, Error **errp);
+void visit_type_BlockDeviceTimedStatsList(Visitor *m, BlockDeviceTimedStatsList **obj, const char *name, Error **errp);
+
+void visit_type_BlockLatencyHistogram(Visitor *m, BlockLatencyHistogram **obj, const char *name, Error **errp);
+void visit_type_BlockLatencyHistogramList(Visitor *m, BlockLatencyHistogramList **obj, const char *name, Error **errp);
+
 void visit_type_BlockDeviceStats(Visitor *m, BlockDeviceStats **obj, const char *name, Error **errp);
 void visit_type_BlockDeviceStatsList(Visitor *m, BlockDeviceStatsList **obj, const char *name, Error **errp);
 
@@ -37,13 +37,25 @@
  *
  * If a sent callback isn't provided, we just drop the packet to avoid
  * unbounded queueing.
+ *
+ * Packets small enough for a pool buffer are recycled through a per-queue
+ * free list rather than going back to the allocator.  When the receiver
+ * has a receive_batch handler, flushing hands it runs of queued packets
+ * in one call.
  */
 
+/* A full-size frame plus a virtio-net header */
+#define NET_QUEUE_POOL_BUF_SIZE 2048
+#define NET_QUEUE_POOL_MAX      256
+
+#define NET_QUEUE_BATCH         32
+
 struct NetPacket {
     QTAILQ_ENTRY(NetPacket) entry;
     NetClientState *sender;
     unsigned flags;
     int size;
+    bool pooled;
     NetPacketSent *sent_cb;
     uint8_t data[0];
 };
@@ -55,9 +67,61 @@ struct NetQueue {
 
     QTAILQ_HEAD(packets, NetPacket) packets;
 
+    /* free pool buffers, linked through entry */
+    QTAILQ_HEAD(, NetPacket) pool;
+    uint32_t pool_count;
+
+    NetQueueStats stats;
+
     unsigned delivering : 1;
 };
 
+static NetPacket *vmx_net_queue_alloc_packet(NetQueue *queue, size_t size)
+{
+    NetPacket *packet;
+
+    if (size > NET_QUEUE_POOL_BUF_SIZE) {
+        packet = g_malloc(sizeof(NetPacket) + size);
+        packet->pooled = false;
+        queue->stats.pool_misses++;
+        return packet;
+    }
+
+    packet = QTAILQ_FIRST(&queue->pool);
+    if (packet) {
+        QTAILQ_REMOVE(&queue->pool, packet, entry);
+        queue->pool_count--;
+        return packet;
+    }
+
+    /* the pool grows to what the traffic needs, up to its limit */
+    packet = g_malloc(sizeof(NetPacket) + NET_QUEUE_POOL_BUF_SIZE);
+    packet->pooled = true;
+    queue->stats.pool_misses++;
+    return packet;
+}
+
+static void vmx_net_queue_free_packet(NetQueue *queue, NetPacket *packet)
+{
+    if (packet->pooled && queue->pool_count < NET_QUEUE_POOL_MAX) {
+        QTAILQ_INSERT_HEAD(&queue->pool, packet, entry);
+        queue->pool_count++;
+        return;
+    }
+    g_free(packet);
+}
+
+static void vmx_net_queue_insert(NetQueue *queue, NetPacket *packet)
+{
+    queue->nq_count++;
+    QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+
+    queue->stats.queued++;
+    if (queue->nq_count > queue->stats.high_water) {
+        queue->stats.high_water = queue->nq_count;
+    }
+}
+
 NetQueue *vmx_new_net_queue(void *opaque)
 {
     NetQueue *queue;
@@ -69,6 +133,7 @@ NetQueue *vmx_new_net_queue(void *opaque)
     queue->nq_count = 0;
 
     QTAILQ_INIT(&queue->packets);
+    QTAILQ_INIT(&queue->pool);
 
     queue->delivering = 0;
 
@@ -83,6 +148,10 @@ void vmx_del_net_queue(NetQueue *queue)
         QTAILQ_REMOVE(&queue->packets, packet, entry);
         g_free(packet);
     }
+    QTAILQ_FOREACH_SAFE(packet, &queue->pool, entry, next) {
+        QTAILQ_REMOVE(&queue->pool, packet, entry);
+        g_free(packet);
+    }
 
     g_free(queue);
 }
@@ -97,17 +166,17 @@ static void vmx_net_queue_append(NetQueue *queue,
     NetPacket *packet;
 
     if (queue->nq_count >= queue->nq_maxlen && !sent_cb) {
+        queue->stats.dropped++;
         return; /* drop if queue full and no callback */
     }
-    packet = g_malloc(sizeof(NetPacket) + size);
+    packet = vmx_net_queue_alloc_packet(queue, size);
     packet->sender = sender;
     packet->flags = flags;
     packet->size = size;
     packet->sent_cb = sent_cb;
     memcpy(packet->data, buf, size);
 
-    queue->nq_count++;
-    QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+    vmx_net_queue_insert(queue, packet);
 }
 
 static void vmx_net_queue_append_iov(NetQueue *queue,
@@ -122,13 +191,14 @@ static void vmx_net_queue_append_iov(NetQueue *queue,
     int i;
 
     if (queue->nq_count >= queue->nq_maxlen && !sent_cb) {
+        queue->stats.dropped++;
         return; /* drop if queue full and no callback */
     }
     for (i = 0; i < iovcnt; i++) {
         max_len += iov[i].iov_len;
     }
 
-    packet = g_malloc(sizeof(NetPacket) + max_len);
+    packet = vmx_net_queue_alloc_packet(queue, max_len);
     packet->sender = sender;
     packet->sent_cb = sent_cb;
     packet->flags = flags;
@@ -141,8 +211,7 @@ static void vmx_net_queue_append_iov(NetQueue *queue,
         packet->size += len;
     }
 
-    queue->nq_count++;
-    QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+    vmx_net_queue_insert(queue, packet);
 }
 
 static ssize_t vmx_net_queue_deliver(NetQueue *queue,
@@ -200,6 +269,39 @@ ssize_t vmx_net_queue_send(NetQueue *queue,
     return ret;
 }
 
+/* Goes through the receiver's receive_batch when it has one and is ready,
+ * one packet at a time otherwise or for what the batch didn't take. */
+int vmx_net_queue_send_batch(NetQueue *queue,
+                             NetClientState *sender,
+                             const struct iovec *pkts,
+                             int count,
+                             NetPacketSent *sent_cb)
+{
+    NetClientState *nc = queue->opaque;
+    int sent = 0;
+
+    if (!queue->delivering && nc->info->receive_batch &&
+        vmx_can_send_packet(sender)) {
+        queue->delivering = 1;
+        sent = vmx_deliver_packet_batch(pkts, count, queue->opaque);
+        queue->delivering = 0;
+
+        if (sent == count) {
+            vmx_net_queue_flush(queue);
+            return sent;
+        }
+    }
+
+    for (; sent < count; sent++) {
+        if (vmx_net_queue_send(queue, sender, QEMU_NET_PACKET_FLAG_NONE,
+                               pkts[sent].iov_base, pkts[sent].iov_len,
+                               sent_cb) == 0) {
+            break;
+        }
+    }
+    return sent;
+}
+
 ssize_t vmx_net_queue_send_iov(NetQueue *queue,
                                 NetClientState *sender,
                                 unsigned flags,
@@ -233,21 +335,78 @@ void vmx_net_queue_purge(NetQueue *queue, NetClientState *from)
         if (packet->sender == from) {
             QTAILQ_REMOVE(&queue->packets, packet, entry);
             queue->nq_count--;
+            queue->stats.purged++;
             if (packet->sent_cb) {
                 packet->sent_cb(packet->sender, 0);
             }
-            g_free(packet);
+            vmx_net_queue_free_packet(queue, packet);
+        }
+    }
+}
+
+/* Delivers a run of queued packets through the receiver's receive_batch.
+ * Returns false if it couldn't take all of them. */
+static bool vmx_net_queue_flush_batch(NetQueue *queue)
+{
+    NetPacket *batch[NET_QUEUE_BATCH], *packet;
+    struct iovec pkts[NET_QUEUE_BATCH];
+    int count = 0, taken, i;
+
+    QTAILQ_FOREACH(packet, &queue->packets, entry) {
+        if (count == NET_QUEUE_BATCH ||
+            (packet->flags & QEMU_NET_PACKET_FLAG_RAW)) {
+            break;
+        }
+        batch[count] = packet;
+        pkts[count].iov_base = packet->data;
+        pkts[count].iov_len = packet->size;
+        count++;
+    }
+
+    queue->delivering = 1;
+    taken = vmx_deliver_packet_batch(pkts, count, queue->opaque);
+    queue->delivering = 0;
+
+    if (taken) {
+        queue->stats.batches++;
+        queue->stats.batched += taken;
+        if (taken > queue->stats.max_batch) {
+            queue->stats.max_batch = taken;
+        }
+    }
+
+    /* unlink first, the callbacks may queue new packets */
+    for (i = 0; i < taken; i++) {
+        QTAILQ_REMOVE(&queue->packets, batch[i], entry);
+        queue->nq_count--;
+    }
+    for (i = 0; i < taken; i++) {
+        if (batch[i]->sent_cb) {
+            batch[i]->sent_cb(batch[i]->sender, batch[i]->size);
         }
+        vmx_net_queue_free_packet(queue, batch[i]);
     }
+
+    return taken == count;
 }
 
 bool vmx_net_queue_flush(NetQueue *queue)
 {
+    NetClientState *nc = queue->opaque;
+
     while (!QTAILQ_EMPTY(&queue->packets)) {
         NetPacket *packet;
         int ret;
 
         packet = QTAILQ_FIRST(&queue->packets);
+        if (nc->info->receive_batch &&
+            !(packet->flags & QEMU_NET_PACKET_FLAG_RAW)) {
+            if (!vmx_net_queue_flush_batch(queue)) {
+                return false;
+            }
+            continue;
+        }
+
         QTAILQ_REMOVE(&queue->packets, packet, entry);
         queue->nq_count--;
 
@@ -266,7 +425,12 @@ bool vmx_net_queue_flush(NetQueue *queue)
             packet->sent_cb(packet->sender, ret);
         }
 
-        g_free(packet);
+        vmx_net_queue_free_packet(queue, packet);
     }
     return true;
 }
+
+void vmx_net_queue_get_stats(NetQueue *queue, NetQueueStats *stats)
+{
+    *stats = queue->stats;
+}
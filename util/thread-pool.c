@@ -2,11 +2,14 @@
 #include "qemu/queue.h"
 #include "qemu/thread.h"
 #include "qemu/osdep.h"
+#include "qemu/atomic.h"
+#include "qemu/timer.h"
 #include "coroutine.h"
 #include "thread-pool.h"
 #include "qemu/main-loop.h"
 
 typedef struct ThreadPoolElement ThreadPoolElement;
+typedef struct ThreadPoolWorker ThreadPoolWorker;
 
 enum ThreadState {
     THREAD_QUEUED,
@@ -16,6 +19,9 @@ enum ThreadState {
 
 #define MAX_THREADS 64
 
+/* An idle worker above the minimum count retires after this many ms */
+#define THREAD_IDLE_TIMEOUT 10000
+
 struct ThreadPoolElement {
     BlockAIOCB common;
     ThreadPool *pool;
@@ -24,112 +30,273 @@ struct ThreadPoolElement {
 
     enum ThreadState state;
     int ret;
+    int64_t submit_time;
 
-    /* Access to this list is protected by lock.  */
+    /* The queue the request was submitted to; the list is protected by the
+     * lock of that worker.  */
+    ThreadPoolWorker *worker;
     QTAILQ_ENTRY(ThreadPoolElement) reqs;
 
-    /* Access to this list is protected by the global mutex.  */
+    /* Finished requests, pushed by the workers without a lock.  */
+    QSLIST_ENTRY(ThreadPoolElement) done;
+
+    /* Access to these lists is protected by the global mutex.  */
+    QSIMPLEQ_ENTRY(ThreadPoolElement) completed;
     QLIST_ENTRY(ThreadPoolElement) all;
 };
 
+/*
+ * Every worker slot has its own request queue. Requests are spread over the
+ * running workers round robin, and a worker whose queue is empty steals from
+ * the others, so the submitter and the workers only meet on a per-slot lock.
+ */
+struct ThreadPoolWorker {
+    ThreadPool *pool;
+    int index;
+    QemuMutex lock;
+    QTAILQ_HEAD(, ThreadPoolElement) request_list;
+    int queued;
+};
+
 struct ThreadPool {
     VeertuAioContext *ctx;
     QEMUBH *completion_bh;
-    QemuMutex lock;
+
+    /* One count per queued request.  */
     QemuSemaphore sem;
+
+    /* Bumped after every request is queued.  A worker whose scan came up
+     * empty sleeps on request_queued until it changes.  */
+    unsigned submit_gen;
+    int scan_waiters;
+    QemuCond request_queued;
+
+    /* Protects spawning and retiring workers.  */
+    QemuMutex lock;
+    QemuCond worker_stopped;
+    int min_threads;
     int max_threads;
-    QemuThread threads[MAX_THREADS];
+    int cur_threads;    /* slots [0, cur_threads) have a running worker */
+    int live_threads;   /* includes workers that are retiring */
+    int idle_threads;
+    bool stopping;
+
+    unsigned next_worker;
+    ThreadPoolWorker workers[MAX_THREADS];
+
+    /* Pushed by the workers, drained by the completion bottom half.  */
+    QSLIST_HEAD(, ThreadPoolElement) done_list;
 
     /* The following variables are only accessed from one VeertuAioContext. */
     QLIST_HEAD(, ThreadPoolElement) head;
+    QSIMPLEQ_HEAD(, ThreadPoolElement) completed;
+    ThreadPoolStats stats;
+};
 
-    /* The following variables are protected by lock.  */
-    QTAILQ_HEAD(, ThreadPoolElement) request_list;
+static ThreadPoolElement *worker_take_request(ThreadPoolWorker *w)
+{
+    ThreadPoolElement *req;
 
-    bool stopping;
-};
+    if (!atomic_read(&w->queued)) {
+        return NULL;
+    }
+
+    vmx_mutex_lock(&w->lock);
+    req = QTAILQ_FIRST(&w->request_list);
+    if (req) {
+        QTAILQ_REMOVE(&w->request_list, req, reqs);
+        req->state = THREAD_ACTIVE;
+        w->queued--;
+    }
+    vmx_mutex_unlock(&w->lock);
+
+    return req;
+}
+
+/* Own queue first, then steal from the other slots. The caller owns a
+ * semaphore count, so a request is queued somewhere until it is found.
+ * A scan can still come up empty when another worker took the request
+ * this one was counted for and the request left for it was queued in a
+ * slot already passed; that one was queued after submit_gen was read, so
+ * wait for the generation to move instead of scanning again right away.
+ */
+static ThreadPoolElement *worker_get_request(ThreadPoolWorker *w)
+{
+    ThreadPool *pool = w->pool;
+    ThreadPoolElement *req;
+    unsigned gen;
+    int i;
+
+    for (;;) {
+        gen = atomic_read(&pool->submit_gen);
+        smp_rmb();
+        req = worker_take_request(w);
+        for (i = 1; !req && i < MAX_THREADS; i++) {
+            req = worker_take_request(&pool->workers[(w->index + i) % MAX_THREADS]);
+        }
+        if (req || pool->stopping) {
+            return req;
+        }
+
+        vmx_mutex_lock(&pool->lock);
+        atomic_inc(&pool->scan_waiters);
+        smp_mb();
+        while (atomic_read(&pool->submit_gen) == gen && !pool->stopping) {
+            vmx_cond_wait(&pool->request_queued, &pool->lock);
+        }
+        atomic_dec(&pool->scan_waiters);
+        vmx_mutex_unlock(&pool->lock);
+    }
+}
+
+static void thread_pool_complete(ThreadPool *pool, ThreadPoolElement *req)
+{
+    ThreadPoolElement *first;
+
+    /* QSLIST_INSERT_HEAD_ATOMIC, keeping the old head: once req is on the
+     * list the bottom half may complete and free it */
+    do {
+        first = atomic_read(&pool->done_list.slh_first);
+        req->done.sle_next = first;
+    } while (atomic_cmpxchg(&pool->done_list.slh_first, first, req) != first);
+
+    /* Only the first request of a batch schedules the bottom half */
+    if (!first) {
+        vmx_bh_schedule(pool->completion_bh);
+    }
+}
+
+/* Called with pool->lock held when the worker times out while idle */
+static bool worker_should_retire(ThreadPoolWorker *w)
+{
+    ThreadPool *pool = w->pool;
+
+    return w->index == pool->cur_threads - 1 &&
+           pool->cur_threads > pool->min_threads &&
+           !atomic_read(&w->queued);
+}
 
 static void *worker_thread(void *opaque)
 {
-    ThreadPool *pool = opaque;
+    ThreadPoolWorker *w = opaque;
+    ThreadPool *pool = w->pool;
 
     while (!pool->stopping) {
-        vmx_sem_timedwait(&pool->sem, 10000);
-
-        vmx_mutex_lock(&pool->lock);
-        if (QTAILQ_EMPTY(&pool->request_list)) {
+        ThreadPoolElement *req;
+        int ret;
+
+        atomic_inc(&pool->idle_threads);
+        ret = vmx_sem_timedwait(&pool->sem, THREAD_IDLE_TIMEOUT);
+        atomic_dec(&pool->idle_threads);
+
+        if (ret < 0) {
+            vmx_mutex_lock(&pool->lock);
+            if (worker_should_retire(w)) {
+                pool->cur_threads--;
+                vmx_mutex_unlock(&pool->lock);
+                break;
+            }
             vmx_mutex_unlock(&pool->lock);
             continue;
         }
 
-        ThreadPoolElement *req = QTAILQ_FIRST(&pool->request_list);
-        QTAILQ_REMOVE(&pool->request_list, req, reqs);
-        req->state = THREAD_ACTIVE;
-        vmx_mutex_unlock(&pool->lock);
+        req = worker_get_request(w);
+        if (!req) {
+            continue;
+        }
 
         req->ret = req->func(req->arg);
         smp_wmb();
         req->state = THREAD_DONE;
 
-        vmx_mutex_lock(&pool->lock);
-        vmx_bh_schedule(pool->completion_bh);
-        vmx_mutex_unlock(&pool->lock);
+        thread_pool_complete(pool, req);
     }
 
+    vmx_mutex_lock(&pool->lock);
+    pool->live_threads--;
+    vmx_cond_signal(&pool->worker_stopped);
+    vmx_mutex_unlock(&pool->lock);
     return NULL;
 }
 
-static void spawn_thread(ThreadPool *pool, int i)
+/* Called with pool->lock held */
+static void spawn_thread(ThreadPool *pool)
 {
-    vmx_thread_create(&pool->threads[i], "worker", worker_thread, pool, QEMU_THREAD_JOINABLE);
+    ThreadPoolWorker *w = &pool->workers[pool->cur_threads];
+    QemuThread thread;
+
+    pool->cur_threads++;
+    pool->live_threads++;
+    vmx_thread_create(&thread, "worker", worker_thread, w, QEMU_THREAD_DETACHED);
 }
 
 static void thread_pool_completion_bh(void *opaque)
 {
     ThreadPool *pool = opaque;
     ThreadPoolElement *elem, *next;
+    QSLIST_HEAD(, ThreadPoolElement) batch, ordered;
+    int64_t now = vmx_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int64_t latency;
+
+    /* The stack is newest first, queue the batch in completion order */
+    QSLIST_MOVE_ATOMIC(&batch, &pool->done_list);
+    QSLIST_INIT(&ordered);
+    QSLIST_FOREACH_SAFE(elem, &batch, done, next) {
+        QSLIST_INSERT_HEAD(&ordered, elem, done);
+    }
+    QSLIST_FOREACH(elem, &ordered, done) {
+        QSIMPLEQ_INSERT_TAIL(&pool->completed, elem, completed);
+    }
 
-restart:
-    QLIST_FOREACH_SAFE(elem, &pool->head, all, next) {
-        if (elem->state != THREAD_DONE)
-            continue;
+    while ((elem = QSIMPLEQ_FIRST(&pool->completed))) {
+        QSIMPLEQ_REMOVE_HEAD(&pool->completed, completed);
+        QLIST_REMOVE(elem, all);
+
+        latency = now - elem->submit_time;
+        pool->stats.completed++;
+        pool->stats.in_flight--;
+        pool->stats.total_latency_ns += latency;
+        if ((uint64_t)latency > pool->stats.max_latency_ns) {
+            pool->stats.max_latency_ns = latency;
+        }
 
-        if (elem->state == THREAD_DONE && elem->common.cb) {
-            QLIST_REMOVE(elem, all);
+        if (elem->common.cb) {
             /* Read state before ret.  */
             smp_rmb();
 
             /* Schedule ourselves in case elem->common.cb() calls aio_poll() to
              * wait for another request that completed at the same time.
              */
-            vmx_bh_schedule(pool->completion_bh);
+            if (!QSIMPLEQ_EMPTY(&pool->completed)) {
+                vmx_bh_schedule(pool->completion_bh);
+            }
 
             elem->common.cb(elem->common.opaque, elem->ret);
-            vmx_aio_unref(elem);
-            goto restart;
-        } else {
-            /* remove the request */
-            QLIST_REMOVE(elem, all);
-            vmx_aio_unref(elem);
         }
+        vmx_aio_unref(elem);
     }
 }
 
 static void thread_pool_cancel(BlockAIOCB *acb)
 {
     ThreadPoolElement *elem = (ThreadPoolElement *)acb;
-    ThreadPool *pool = elem->pool;
+    ThreadPoolWorker *w = elem->worker;
 
-    vmx_mutex_lock(&pool->lock);
-    if (elem->state == THREAD_QUEUED && vmx_sem_timedwait(&pool->sem, 0) == 0) {
-        QTAILQ_REMOVE(&pool->request_list, elem, reqs);
-        vmx_bh_schedule(pool->completion_bh);
+    vmx_mutex_lock(&w->lock);
+    if (elem->state == THREAD_QUEUED &&
+        vmx_sem_timedwait(&elem->pool->sem, 0) == 0) {
+        QTAILQ_REMOVE(&w->request_list, elem, reqs);
+        w->queued--;
 
         elem->state = THREAD_DONE;
         elem->ret = -ECANCELED;
+        vmx_mutex_unlock(&w->lock);
+
+        thread_pool_complete(elem->pool, elem);
+        return;
     }
 
-    vmx_mutex_unlock(&pool->lock);
+    vmx_mutex_unlock(&w->lock);
 }
 
 static VeertuAioContext *thread_pool_get_aio_context(BlockAIOCB *acb)
@@ -150,18 +317,48 @@ BlockAIOCB *thread_pool_submit_aio(ThreadPool *pool,
         BlockCompletionFunc *cb, void *opaque)
 {
     ThreadPoolElement *req;
+    ThreadPoolWorker *w;
+    int cur;
 
     req = vmx_aio_get(&thread_pool_aiocb_info, NULL, cb, opaque);
     req->func = func;
     req->arg = arg;
     req->state = THREAD_QUEUED;
     req->pool = pool;
-
-    vmx_mutex_lock(&pool->lock);
+    req->submit_time = vmx_clock_get_ns(QEMU_CLOCK_REALTIME);
 
     QLIST_INSERT_HEAD(&pool->head, req, all);
-    QTAILQ_INSERT_TAIL(&pool->request_list, req, reqs);
-    vmx_mutex_unlock(&pool->lock);
+    pool->stats.submitted++;
+    if (++pool->stats.in_flight > pool->stats.max_in_flight) {
+        pool->stats.max_in_flight = pool->stats.in_flight;
+    }
+
+    /* Grow the pool when every worker is busy */
+    if (atomic_read(&pool->idle_threads) == 0 &&
+        atomic_read(&pool->cur_threads) < pool->max_threads) {
+        vmx_mutex_lock(&pool->lock);
+        if (pool->cur_threads < pool->max_threads && !pool->stopping) {
+            spawn_thread(pool);
+        }
+        vmx_mutex_unlock(&pool->lock);
+    }
+
+    cur = atomic_read(&pool->cur_threads);
+    w = &pool->workers[pool->next_worker++ % (cur ? cur : 1)];
+
+    vmx_mutex_lock(&w->lock);
+    req->worker = w;
+    QTAILQ_INSERT_TAIL(&w->request_list, req, reqs);
+    w->queued++;
+    vmx_mutex_unlock(&w->lock);
+
+    atomic_inc(&pool->submit_gen);
+    smp_mb();
+    if (atomic_read(&pool->scan_waiters)) {
+        vmx_mutex_lock(&pool->lock);
+        vmx_cond_broadcast(&pool->request_queued);
+        vmx_mutex_unlock(&pool->lock);
+    }
 
     vmx_sem_post(&pool->sem);
     return &req->common;
@@ -195,6 +392,15 @@ void thread_pool_submit(ThreadPool *pool, ThreadPoolFunc *func, void *arg)
     thread_pool_submit_aio(pool, func, arg, NULL, NULL);
 }
 
+void thread_pool_get_stats(ThreadPool *pool, ThreadPoolStats *stats)
+{
+    *stats = pool->stats;
+    stats->threads = atomic_read(&pool->cur_threads);
+}
+
+/* thread_cnt workers are started up front and never retire; the pool grows
+ * up to MAX_THREADS while requests are waiting for a worker.
+ */
 ThreadPool *thread_pool_create(VeertuAioContext *ctx, int thread_cnt)
 {
     ThreadPool *pool = g_new(ThreadPool, 1);
@@ -207,14 +413,29 @@ ThreadPool *thread_pool_create(VeertuAioContext *ctx, int thread_cnt)
     pool->ctx = ctx;
     pool->completion_bh = aio_bh_new(ctx, thread_pool_completion_bh, pool);
     vmx_mutex_init(&pool->lock);
+    vmx_cond_init(&pool->worker_stopped);
+    vmx_cond_init(&pool->request_queued);
     vmx_sem_init(&pool->sem, 0);
-    pool->max_threads = thread_cnt;
+    pool->min_threads = MIN(MAX(thread_cnt, 1), MAX_THREADS);
+    pool->max_threads = MAX_THREADS;
 
     QLIST_INIT(&pool->head);
-    QTAILQ_INIT(&pool->request_list);
+    QSIMPLEQ_INIT(&pool->completed);
+    QSLIST_INIT(&pool->done_list);
+
+    for (int i = 0; i < MAX_THREADS; i++) {
+        ThreadPoolWorker *w = &pool->workers[i];
+
+        w->pool = pool;
+        w->index = i;
+        vmx_mutex_init(&w->lock);
+        QTAILQ_INIT(&w->request_list);
+    }
 
-    for (int i = 0; i < thread_cnt; i++)
-        spawn_thread(pool, i);
+    vmx_mutex_lock(&pool->lock);
+    for (int i = 0; i < pool->min_threads; i++)
+        spawn_thread(pool);
+    vmx_mutex_unlock(&pool->lock);
 
     return pool;
 }
@@ -227,15 +448,22 @@ void thread_pool_destroy(ThreadPool *pool)
     assert(QLIST_EMPTY(&pool->head));
 
     /* Wait for worker threads to terminate */
+    vmx_mutex_lock(&pool->lock);
     pool->stopping = true;
-
-    for (int i = 0; i < pool->max_threads; i++)
+    vmx_cond_broadcast(&pool->request_queued);
+    for (int i = 0; i < pool->live_threads; i++)
         vmx_sem_post(&pool->sem);
-    for (int i = 0; i < pool->max_threads; i++)
-        vmx_thread_join(&pool->threads[i]);
+    while (pool->live_threads > 0)
+        vmx_cond_wait(&pool->worker_stopped, &pool->lock);
+    vmx_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < MAX_THREADS; i++)
+        vmx_mutex_destroy(&pool->workers[i].lock);
 
     vmx_bh_delete(pool->completion_bh);
     vmx_sem_destroy(&pool->sem);
+    vmx_cond_destroy(&pool->worker_stopped);
+    vmx_cond_destroy(&pool->request_queued);
     vmx_mutex_destroy(&pool->lock);
     g_free(pool);
 }
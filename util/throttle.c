@@ -0,0 +1,195 @@
+/*
+ * Copyright (C) 2016 Veertu Inc,
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 or
+ * (at your option) version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/throttle.h"
+#include "qemu/timer.h"
+
+/* Largest rate or burst accepted, keeps the double arithmetic exact */
+#define THROTTLE_VALUE_MAX 1000000000000000LL
+
+static double bucket_capacity(TokenBucket *bkt)
+{
+    return bkt->max ? bkt->max : bkt->avg / 10;
+}
+
+static void throttle_refill(ThrottleState *ts, int64_t now)
+{
+    double elapsed = (double)(now - ts->previous_refill) / get_ticks_per_sec();
+    int i;
+
+    if (elapsed <= 0) {
+        return;
+    }
+    ts->previous_refill = now;
+
+    for (i = 0; i < BUCKETS_COUNT; i++) {
+        TokenBucket *bkt = &ts->cfg.buckets[i];
+
+        if (!bkt->avg) {
+            continue;
+        }
+        bkt->tokens = MIN(bkt->tokens + bkt->avg * elapsed,
+                          bucket_capacity(bkt));
+    }
+}
+
+void throttle_init(ThrottleState *ts)
+{
+    memset(ts, 0, sizeof(*ts));
+    ts->previous_refill = vmx_clock_get_ns(QEMU_CLOCK_REALTIME);
+}
+
+bool throttle_enabled(ThrottleConfig *cfg)
+{
+    int i;
+
+    for (i = 0; i < BUCKETS_COUNT; i++) {
+        if (cfg->buckets[i].avg > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool check_throttle_config(ThrottleConfig *cfg, Error **errp)
+{
+    int i;
+
+    if ((cfg->buckets[THROTTLE_BPS_TOTAL].avg &&
+         (cfg->buckets[THROTTLE_BPS_READ].avg ||
+          cfg->buckets[THROTTLE_BPS_WRITE].avg)) ||
+        (cfg->buckets[THROTTLE_OPS_TOTAL].avg &&
+         (cfg->buckets[THROTTLE_OPS_READ].avg ||
+          cfg->buckets[THROTTLE_OPS_WRITE].avg))) {
+        error_setg(errp, "bps/iops total limits cannot be combined with "
+                   "read/write limits");
+        return false;
+    }
+
+    for (i = 0; i < BUCKETS_COUNT; i++) {
+        TokenBucket *bkt = &cfg->buckets[i];
+
+        if (bkt->avg < 0 || bkt->max < 0 ||
+            bkt->avg > THROTTLE_VALUE_MAX || bkt->max > THROTTLE_VALUE_MAX) {
+            error_setg(errp, "bps/iops/max values must be within [0, %lld]",
+                       THROTTLE_VALUE_MAX);
+            return false;
+        }
+        if (bkt->max && !bkt->avg) {
+            error_setg(errp, "bps_max/iops_max require corresponding "
+                       "bps/iops values");
+            return false;
+        }
+        if (bkt->max && bkt->max < bkt->avg / 10) {
+            error_setg(errp, "bps_max/iops_max cannot be lower than a tenth "
+                       "of bps/iops");
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Buckets start full so a freshly configured drive gets its burst */
+/* Buckets that were already limited keep their fill level, or their debt,
+ * clamped to the new burst size; buckets that just got a limit start full.
+ * Otherwise changing the limits would hand out a fresh burst every time. */
+void throttle_config(ThrottleState *ts, ThrottleConfig *cfg)
+{
+    int64_t now = vmx_clock_get_ns(QEMU_CLOCK_REALTIME);
+    ThrottleConfig old;
+    int i;
+
+    throttle_refill(ts, now);
+    old = ts->cfg;
+    ts->cfg = *cfg;
+    for (i = 0; i < BUCKETS_COUNT; i++) {
+        TokenBucket *bkt = &ts->cfg.buckets[i];
+
+        if (old.buckets[i].avg) {
+            bkt->tokens = MIN(old.buckets[i].tokens, bucket_capacity(bkt));
+        } else {
+            bkt->tokens = bucket_capacity(bkt);
+        }
+    }
+    ts->previous_refill = now;
+}
+
+void throttle_get_config(ThrottleState *ts, ThrottleConfig *cfg)
+{
+    int i;
+
+    *cfg = ts->cfg;
+    for (i = 0; i < BUCKETS_COUNT; i++) {
+        cfg->buckets[i].tokens = 0;
+    }
+}
+
+static int64_t bucket_wait(TokenBucket *bkt)
+{
+    if (!bkt->avg || bkt->tokens >= 0) {
+        return 0;
+    }
+    /* round up so the timer never fires before the debt is paid */
+    return (int64_t)(-bkt->tokens * get_ticks_per_sec() / bkt->avg) + 1;
+}
+
+int64_t throttle_compute_wait(ThrottleState *ts, bool is_write, int64_t now)
+{
+    TokenBucket *b = ts->cfg.buckets;
+    int64_t wait;
+
+    throttle_refill(ts, now);
+
+    wait = MAX(bucket_wait(&b[THROTTLE_BPS_TOTAL]),
+               bucket_wait(&b[THROTTLE_OPS_TOTAL]));
+    if (is_write) {
+        wait = MAX(wait, bucket_wait(&b[THROTTLE_BPS_WRITE]));
+        wait = MAX(wait, bucket_wait(&b[THROTTLE_OPS_WRITE]));
+    } else {
+        wait = MAX(wait, bucket_wait(&b[THROTTLE_BPS_READ]));
+        wait = MAX(wait, bucket_wait(&b[THROTTLE_OPS_READ]));
+    }
+    return wait;
+}
+
+static void bucket_take(TokenBucket *bkt, double units)
+{
+    if (bkt->avg) {
+        bkt->tokens -= units;
+    }
+}
+
+void throttle_account(ThrottleState *ts, bool is_write, uint64_t size)
+{
+    TokenBucket *b = ts->cfg.buckets;
+    double units = 1.0;
+
+    /* large requests count as several operations if op_size is set */
+    if (ts->cfg.op_size && size > ts->cfg.op_size) {
+        units = (double)size / ts->cfg.op_size;
+    }
+
+    bucket_take(&b[THROTTLE_BPS_TOTAL], size);
+    bucket_take(&b[THROTTLE_OPS_TOTAL], units);
+    if (is_write) {
+        bucket_take(&b[THROTTLE_BPS_WRITE], size);
+        bucket_take(&b[THROTTLE_OPS_WRITE], units);
+    } else {
+        bucket_take(&b[THROTTLE_BPS_READ], size);
+        bucket_take(&b[THROTTLE_OPS_READ], units);
+    }
+}
@@ -99,6 +99,7 @@ int main(int argc, char **argv)
 #include "qapi/opts-visitor.h"
 #include "qapi-event.h"
 #include "vmlibrary_ops.h"
+#include "vmm/veertu.h"
 
 #define DEFAULT_RAM_SIZE 128
 
@@ -2362,6 +2363,7 @@ int veertu_run(int argc, char **argv, char **envp)
     Error *main_loop_err = NULL;
     const char *port_fwd[MAX_PORT_FWD] = {NULL};
     int num_port_fwd = 0;
+    int exit_stats_interval = 0;
 
     atexit(vmx_run_exit_notifiers);
     error_set_progname(argv[0]);
@@ -2926,6 +2928,9 @@ int veertu_run(int argc, char **argv, char **envp)
                 if (num_port_fwd < MAX_PORT_FWD)
                     port_fwd[num_port_fwd++] = optarg;
                 break;
+            case QEMU_OPTION_exit_stats:
+                exit_stats_interval = atoi(optarg);
+                break;
             default:
                 os_parse_cmd_args(popt->index, optarg);
             }
@@ -3262,6 +3267,9 @@ int veertu_run(int argc, char **argv, char **envp)
         exit(1);
     }
 
+    if (exit_stats_interval > 0)
+        veertu_exit_stats_dump_interval(exit_stats_interval);
+
     while (num_port_fwd) {
         if (slirp_used)
             net_slirp_redir(port_fwd[num_port_fwd - 1]);
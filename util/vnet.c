@@ -39,6 +39,7 @@
 #include <netinet/bootp.h>
 #include "window/cocoa_util.h"
 #include "vnet_fwd.h"
+#include "vnet_proxy.h"
 
 #include <vlaunch/vmsg.h>
 #include <vlaunch/vobj.h>
@@ -75,7 +76,7 @@ typedef struct VnetState {
     int event_cnt;
     uint32_t ipaddr;
     uint8_t buf_snd[2048];
-    uint8_t buf_rcv[2048];
+    VnetRxRing rx;
     int proxyfd;
 } VnetState;
 
@@ -119,6 +120,7 @@ static int vnet_can_send(void *opaque)
 
 static void vnet_send(void *opaque);
 static void vnet_writable(void *opaque);
+static void vnet_send_completed(NetClientState *nc, ssize_t len);
 
 static void vnet_update_fd_handler(VnetState *s)
 {
@@ -150,10 +152,21 @@ static void vnet_writable(void *opaque)
     vmx_flush_queued_packets(&s->nc);
 }
 
+static int vnet_rx_send(void *opaque, const struct iovec *pkts, int count)
+{
+    VnetState *s = opaque;
+
+    return vmx_send_packet_batch_async(&s->nc, pkts, count,
+                                       vnet_send_completed);
+}
+
 static void vnet_send_completed(NetClientState *nc, ssize_t len)
 {
     VnetState *s = DO_UPCAST(VnetState, nc, nc);
-    vnet_read_poll(s, true);
+
+    if (vnet_rx_ring_deliver(&s->rx, vnet_rx_send, s)) {
+        vnet_read_poll(s, true);
+    }
 }
 
 int iov_tot_len(const struct iovec *iov, int iovcnt)
@@ -357,50 +370,86 @@ static NetClientInfo net_vnet_info = {
     .cleanup = vnet_cleanup,
 };
 
+/* Wakes vnet_send up; a full pipe means a wake-up is pending already */
+static void vnet_kick(VnetState *s)
+{
+    char c = 0;
+
+    while (write(s->fd[1], &c, 1) < 0 && errno == EINTR);
+}
+
+static int vnet_read_vmnet(VnetState *s)
+{
+    struct vmpktdesc pkt_desc[VNET_RX_BATCH];
+    struct iovec iov[VNET_RX_BATCH];
+    int pkt_cnt = VNET_RX_BATCH;
+    char buf[64];
+    int i, n = 0;
+
+    while (read(s->fd[0], buf, sizeof(buf)) > 0);
+
+    for (i = 0; i < VNET_RX_BATCH; i++) {
+        iov[i].iov_base = s->rx.buf[i];
+        iov[i].iov_len = VNET_RX_BUF_SIZE;
+        pkt_desc[i].vm_flags = 0;
+        pkt_desc[i].vm_pkt_iov = &iov[i];
+        pkt_desc[i].vm_pkt_iovcnt = 1;
+        pkt_desc[i].vm_pkt_size = VNET_RX_BUF_SIZE;
+    }
+
+    // direct call to vmnet
+    vmnet_return_t res = vmnet_read(s->iface, pkt_desc, &pkt_cnt);
+    if (res != VMNET_SUCCESS)
+        pkt_cnt = 0;
+
+    for (i = 0; i < pkt_cnt; i++) {
+        if (pkt_desc[i].vm_pkt_size == VNET_RX_BUF_SIZE) {
+            // weird bug: received a dummy buffer
+            // drop it as a workaround
+            continue;
+        }
+        s->rx.pkt[n].iov_base = s->rx.buf[i];
+        s->rx.pkt[n].iov_len = pkt_desc[i].vm_pkt_size;
+        n++;
+    }
+
+    if (pkt_cnt == VNET_RX_BATCH) {
+        /* there may be more, come back once these are passed on */
+        vnet_kick(s);
+    }
+
+    s->rx.count = n;
+    s->rx.next = 0;
+    return n;
+}
+
 static void vnet_send(void *opaque)
 {
     NetClientState *nc = opaque;
     VnetState *s = DO_UPCAST(VnetState, nc, nc);
-    int pkt_cnt = 1;
-    struct iovec iov;
+    int i;
 
-    iov.iov_base = s->buf_rcv;
-    iov.iov_len = sizeof(s->buf_rcv);
+    if (s->rx.next < s->rx.count) {
+        /* still waiting for the peer to take the last batch */
+        return;
+    }
 
-    int pktlen = 0;
     if (-1 != s->proxyfd) {
-        pktlen = readv(s->proxyfd, &iov, 1);
-        if (pktlen <= 0)
-            return;
+        vnet_proxy_read(&s->rx, s->proxyfd);
     } else {
-        char c;
-        while (read(s->fd[0], &c, 1) >= 0);
-
-        // direct call to vmnet
-        struct vmpktdesc pkt_desc;
-        pkt_desc.vm_flags = 0;
-        pkt_desc.vm_pkt_iov = &iov;
-        pkt_desc.vm_pkt_iovcnt = 1;
-        pkt_desc.vm_pkt_size = sizeof(s->buf_rcv);
+        vnet_read_vmnet(s);
+    }
 
-        vmnet_return_t res = vmnet_read(s->iface, &pkt_desc, &pkt_cnt);
-        if (res != VMNET_SUCCESS)
-            return;
+    for (i = 0; i < s->rx.count; i++) {
+        uint8_t *pkt = s->rx.pkt[i].iov_base;
+        size_t pktlen = s->rx.pkt[i].iov_len;
 
-        if (pkt_desc.vm_pkt_size == sizeof(s->buf_rcv)) {
-            // weird bug: received a dummy buffer
-            // drop it as a workaround
-            return;
-        }
-        pktlen = pkt_desc.vm_pkt_size;
+        vnet_mac_change(s, pkt, pktlen, true);
+        vnet_mac_change_for_arp(s, pkt, pktlen, true);
+        vnet_mac_change_for_dhcp(s, pkt, pktlen, true);
     }
 
-    assert(pktlen >= 0 && pktlen < sizeof(s->buf_rcv));
-    vnet_mac_change(s, s->buf_rcv, pktlen, true);
-    vnet_mac_change_for_arp(s, s->buf_rcv, pktlen, true);
-    vnet_mac_change_for_dhcp(s, s->buf_rcv, pktlen, true);
-
-    if (vmx_send_packet_async(nc, s->buf_rcv, pktlen, vnet_send_completed) == 0)
+    if (!vnet_rx_ring_deliver(&s->rx, vnet_rx_send, s))
         vnet_read_poll(s, false);
 }
 
@@ -450,14 +499,14 @@ static VnetState *net_vnet_fd_init(NetClientState *peer,
     if (iface) {
         pipe(s->fd);
         fcntl(s->fd[0], F_SETFL, O_NONBLOCK);
+        fcntl(s->fd[1], F_SETFL, O_NONBLOCK);
         s->event_cnt = 0;
 
         vmnet_interface_set_event_callback(s->iface, VMNET_INTERFACE_PACKETS_AVAILABLE, queue,
                                        ^(interface_event_t event_id, xpc_object_t event)
                                        {
-                                           int c = 0;
                                            if (!s->event_cnt) {
-                                               write(s->fd[1], &c, 1);
+                                               vnet_kick(s);
                                             }
                                        });
     }
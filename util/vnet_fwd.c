@@ -26,6 +26,7 @@
 #include <poll.h>
 
 #include "qemu/sockets.h"
+#include "qemu/thread.h"
 #include "net/net.h"
 #include "clients.h"
 #include "monitor/monitor.h"
@@ -36,6 +37,9 @@
 
 #define MAX_PORT_FWD    128
 
+/* Per direction of a forwarded connection */
+#define FWD_BUF_SIZE    (64 * 1024)
+
 typedef struct PortFwd
 {
     struct in_addr host_addr;
@@ -47,17 +51,45 @@ typedef struct PortFwd
 
 typedef struct PortFwdState {
     int used;
+    unsigned id;
     PortFwd port_fwd;
     int listen_fd;
 
-    int redir_fd;
-    int redir_fd_connected;
-    int client_fd;
+    /* protected by fwd_lock */
+    uint64_t connections;
+    uint64_t failed;            /* the guest side didn't connect */
+    uint64_t bytes_to_guest;
+    uint64_t bytes_to_host;
+    uint32_t active;
 } PortFwdState;
 
+/* Ring buffer carrying one direction of a connection */
+typedef struct FwdPipe {
+    uint8_t *data;
+    size_t head;
+    size_t len;
+    bool eof;                   /* the source shut down its side */
+    bool shut;                  /* ...and the rest was passed on */
+} FwdPipe;
+
+typedef struct PortFwdConn {
+    QTAILQ_ENTRY(PortFwdConn) next;
+    PortFwdState *fwd;
+    unsigned fwd_id;            /* stale once the rule is deleted */
+    int fd[2];                  /* host client, guest */
+    FwdPipe pipe[2];            /* pipe[i] carries fd[i] to fd[!i] */
+    int poll_idx;
+} PortFwdConn;
+
 static PortFwdState port_fwd_states[MAX_PORT_FWD];
+static unsigned port_fwd_next_id;
 
-static void net_socket_accept(void *opaque);
+static QemuMutex fwd_lock;
+static QTAILQ_HEAD(, PortFwdConn) fwd_conns =
+    QTAILQ_HEAD_INITIALIZER(fwd_conns);
+static int fwd_nconns;
+static int fwd_wake_fd[2];
+static bool fwd_thread_started;
 
 extern uint32_t vm_ip_address;
 
@@ -134,28 +166,35 @@ fail_syntax:
     return -1;
 }
 
-static void vnet_free_fwd_state(PortFwdState *s, int close_listen)
+/* Accept and the connect to the guest run in the main loop, then the
+ * connection moves to the forwarder thread which multiplexes the data of
+ * all of them in one blocking poll. */
+
+static void vnet_fwd_conn_free(PortFwdConn *c)
+{
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        if (c->fd[i] >= 0) {
+            closesocket(c->fd[i]);
+        }
+        g_free(c->pipe[i].data);
+    }
+    g_free(c);
+}
+
+/* false once the rule was deleted, called with fwd_lock held */
+static bool vnet_fwd_conn_current(PortFwdConn *c)
+{
+    return c->fwd->used && c->fwd->id == c->fwd_id;
+}
+
+static void vnet_fwd_kick(void)
 {
-    printf("closing conn\n");
-    /*if (s->listen_fd > 0) {
-        close(s->listen_fd);
-        vmx_set_fd_handler(s->listen_fd, NULL, NULL, NULL);
-    }*/
-    if (s->redir_fd > 0) {
-        close(s->redir_fd);
-        vmx_set_fd_handler(s->redir_fd, NULL, NULL, NULL);
-        s->redir_fd = 0;
-    }
-    if (s->client_fd > 0) {
-        close(s->client_fd);
-        vmx_set_fd_handler(s->client_fd, NULL, NULL, NULL);
-        s->client_fd = 0;
-    }
-    if (close_listen) {
-        close(s->listen_fd);
-        vmx_set_fd_handler(s->listen_fd, NULL, NULL, NULL);
-        s->listen_fd = 0;
-        s->used = 0;
+    char c = 0;
+
+    if (write(fwd_wake_fd[1], &c, 1) < 0) {
+        /* a full pipe wakes the thread just as well */
     }
 }
 
@@ -168,12 +207,13 @@ static int do_poll(struct pollfd fds[], nfds_t nfds, int timeout)
     return res;
 }
 
+/* The sockets are non-blocking, EAGAIN is left to the caller */
 static ssize_t do_send(int socket, const void *buffer, size_t length, int flags)
 {
     ssize_t res;
     do {
         res = vmx_send(socket, buffer, length, flags);
-    } while (res < 0 && (errno == EAGAIN || errno == EINTR));
+    } while (res < 0 && errno == EINTR);
     return res;
 }
 
@@ -182,149 +222,269 @@ static ssize_t do_recv(int socket, void *buffer, size_t length, int flags)
     ssize_t res;
     do {
         res = vmx_recv(socket, buffer, length, flags);
-    } while (res < 0 && (errno == EAGAIN || errno == EINTR));
+    } while (res < 0 && errno == EINTR);
     return res;
 }
 
-void *redirect_func(void *opaque)
+static ssize_t fwd_pipe_fill(FwdPipe *p, int fd)
 {
-    PortFwdState *s = opaque;
-    char buf[4096], *pbuf;
-    struct pollfd fds[2];
-    ssize_t size, sent;
-    int res;
-    
-    vmx_set_nonblock(s->redir_fd);
-    vmx_set_nonblock(s->client_fd);
+    size_t tail = (p->head + p->len) % FWD_BUF_SIZE;
+    ssize_t ret;
 
-    fds[0].fd = s->redir_fd;
-    fds[1].fd = s->client_fd;
+    /* idle connections don't hold buffers until the first data */
+    if (!p->data) {
+        p->data = g_malloc(FWD_BUF_SIZE);
+    }
+    ret = do_recv(fd, p->data + tail,
+                  MIN(FWD_BUF_SIZE - p->len, FWD_BUF_SIZE - tail), 0);
+    if (ret > 0) {
+        p->len += ret;
+    }
+    return ret;
+}
 
-    fds[0].events = POLLIN;
-    fds[1].events = POLLIN;
+static ssize_t fwd_pipe_drain(FwdPipe *p, int fd)
+{
+    ssize_t ret;
 
-    while (1) {
-        res = do_poll(fds, 2, 0);
-        if (!res)
-            continue;
-        if (res < 0)
-            break;
+    ret = do_send(fd, p->data + p->head,
+                  MIN(p->len, FWD_BUF_SIZE - p->head), 0);
+    if (ret > 0) {
+        p->len -= ret;
+        p->head = p->len ? (p->head + ret) % FWD_BUF_SIZE : 0;
+    }
+    return ret;
+}
 
-        if (fds[0].revents & (POLLERR | POLLHUP))
-            break;
-        if (fds[1].revents & (POLLERR | POLLHUP))
-            break;
+/* Reads only while the pipe has room, so a slow reader on one side
+ * throttles the other through the socket buffers. */
+static void vnet_fwd_conn_events(PortFwdConn *c, struct pollfd *pfd)
+{
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        pfd[i].fd = c->fd[i];
+        pfd[i].events = 0;
+        pfd[i].revents = 0;
+        if (!c->pipe[i].eof && c->pipe[i].len < FWD_BUF_SIZE) {
+            pfd[i].events |= POLLIN;
+        }
+        if (c->pipe[!i].len) {
+            pfd[i].events |= POLLOUT;
+        }
+        if (!pfd[i].events) {
+            /* else a hangup we can't act on yet would spin the poll */
+            pfd[i].fd = -1;
+        }
+    }
+}
 
-        if (fds[0].revents & POLLIN) {
-            size = do_recv(fds[0].fd, buf, sizeof(buf), 0);
-            if (size < 0)
-                break;
-    
-            pbuf = buf;
-            fds[1].events = POLLOUT;
-            while (size && do_poll(&fds[1], 1, 0) >= 0) {
-                if (fds[1].revents & (POLLERR | POLLHUP))
-                    break;
-                if (!(fds[1].revents & POLLOUT))
-                    continue;
-                if ((sent = do_send(fds[1].fd, pbuf, size, 0)) < 0)
-                    break;
-
-                pbuf += sent;
-                size -= sent;
+/* Returns false when the connection is done */
+static bool vnet_fwd_conn_io(PortFwdConn *c, struct pollfd *pfd)
+{
+    PortFwdState *s = c->fwd;
+    FwdPipe *p;
+    ssize_t ret;
+    int i;
+
+    if ((pfd[0].revents | pfd[1].revents) & (POLLERR | POLLNVAL)) {
+        return false;
+    }
+
+    for (i = 0; i < 2; i++) {
+        p = &c->pipe[i];
+        if ((pfd[i].revents & (POLLIN | POLLHUP)) && !p->eof &&
+            p->len < FWD_BUF_SIZE) {
+            ret = fwd_pipe_fill(p, c->fd[i]);
+            if (ret == 0) {
+                p->eof = true;
+            } else if (ret < 0 && errno != EAGAIN) {
+                return false;
             }
-            if (size)
-                break;
-        } else if (fds[1].revents & POLLIN) {
-            size = do_recv(fds[1].fd, buf, sizeof(buf), 0);
-            if (size < 0)
-                break;
-
-            pbuf = buf;
-            fds[0].events = POLLOUT;
-            while (size && do_poll(&fds[0], 1, 0) >= 0) {
-                if (fds[0].revents & (POLLERR | POLLHUP))
-                    break;
-
-                if (!(fds[0].revents & POLLOUT))
-                    continue;
-                if ((sent = do_send(fds[0].fd, pbuf, size, 0)) < 0)
-                    break;
-
-                pbuf += sent;
-                size -= sent;
+        }
+        if (p->len) {
+            ret = fwd_pipe_drain(p, c->fd[!i]);
+            if (ret < 0 && errno != EAGAIN) {
+                return false;
+            }
+            if (ret > 0 && i == 0) {
+                s->bytes_to_guest += ret;
+            } else if (ret > 0) {
+                s->bytes_to_host += ret;
             }
-            if (size)
-                break;
         }
+        if (p->eof && !p->len && !p->shut) {
+            shutdown(c->fd[!i], SHUT_WR);
+            p->shut = true;
+        }
+    }
+    return !(c->pipe[0].shut && c->pipe[1].shut);
+}
 
-        fds[0].events = POLLIN;
-        fds[1].events = POLLIN;
+static void vnet_fwd_conn_close(PortFwdConn *c)
+{
+    QTAILQ_REMOVE(&fwd_conns, c, next);
+    fwd_nconns--;
+    if (vnet_fwd_conn_current(c)) {
+        c->fwd->active--;
     }
+    vnet_fwd_conn_free(c);
+}
 
-    vnet_free_fwd_state(s, 0);
+static void *vnet_fwd_thread(void *opaque)
+{
+    struct pollfd *pfds = NULL;
+    int npfds = 0, n;
+    PortFwdConn *c, *next;
+    char buf[64];
+
+    vmx_mutex_lock(&fwd_lock);
+    for (;;) {
+        if (1 + 2 * fwd_nconns > npfds) {
+            npfds = 1 + 2 * fwd_nconns;
+            pfds = g_renew(struct pollfd, pfds, npfds);
+        }
+        pfds[0].fd = fwd_wake_fd[0];
+        pfds[0].events = POLLIN;
+        n = 1;
+        QTAILQ_FOREACH(c, &fwd_conns, next) {
+            vnet_fwd_conn_events(c, &pfds[n]);
+            c->poll_idx = n;
+            n += 2;
+        }
+        vmx_mutex_unlock(&fwd_lock);
+
+        do_poll(pfds, n, -1);
+
+        vmx_mutex_lock(&fwd_lock);
+        if (pfds[0].revents & POLLIN) {
+            while (read(fwd_wake_fd[0], buf, sizeof(buf)) > 0) {
+            }
+        }
+        QTAILQ_FOREACH_SAFE(c, &fwd_conns, next, next) {
+            if (!vnet_fwd_conn_current(c)) {
+                vnet_fwd_conn_close(c);
+            } else if (c->poll_idx &&
+                       !vnet_fwd_conn_io(c, &pfds[c->poll_idx])) {
+                vnet_fwd_conn_close(c);
+            }
+        }
+    }
     return NULL;
 }
 
-static void vnet_socket_connect(void *opaque)
+static int vnet_fwd_thread_start(void)
 {
-    pthread_t tid;
-    PortFwdState *s = opaque;
-    printf("vnet_socket_connect\n");
+    QemuThread thread;
 
-    pthread_create(&tid, NULL, redirect_func, s);
-    
-    vmx_set_fd_handler(s->redir_fd, NULL, NULL, s);
-    vmx_set_fd_handler(s->client_fd, NULL, NULL, s);
-    //vmx_set_fd_handler(s->redir_fd, vnet_redir_read, NULL, s);
-    //vmx_set_fd_handler(s->client_fd, vnet_client_read, NULL, s);
-    
+    if (fwd_thread_started) {
+        return 0;
+    }
+    if (vmx_pipe(fwd_wake_fd) < 0) {
+        perror("pipe");
+        return -1;
+    }
+    vmx_set_nonblock(fwd_wake_fd[0]);
+    vmx_set_nonblock(fwd_wake_fd[1]);
+    vmx_mutex_init(&fwd_lock);
+    vmx_thread_create(&thread, "port-fwd", vnet_fwd_thread, NULL,
+                      QEMU_THREAD_DETACHED);
+    fwd_thread_started = true;
+    return 0;
+}
+
+/* Hands a connected pair over to the forwarder thread */
+static void vnet_fwd_conn_start(PortFwdConn *c)
+{
+    vmx_mutex_lock(&fwd_lock);
+    if (!vnet_fwd_conn_current(c)) {
+        vmx_mutex_unlock(&fwd_lock);
+        vnet_fwd_conn_free(c);
+        return;
+    }
+    c->fwd->active++;
+    c->poll_idx = 0;
+    QTAILQ_INSERT_TAIL(&fwd_conns, c, next);
+    fwd_nconns++;
+    vmx_mutex_unlock(&fwd_lock);
+    vnet_fwd_kick();
 }
 
+static void vnet_fwd_conn_failed(PortFwdConn *c)
+{
+    vmx_mutex_lock(&fwd_lock);
+    if (vnet_fwd_conn_current(c)) {
+        c->fwd->failed++;
+    }
+    vmx_mutex_unlock(&fwd_lock);
+    vnet_fwd_conn_free(c);
+}
+
+static void vnet_socket_connect(void *opaque)
+{
+    PortFwdConn *c = opaque;
+    socklen_t len = sizeof(int);
+    int err = 0;
+
+    vmx_set_fd_handler(c->fd[1], NULL, NULL, NULL);
+    if (getsockopt(c->fd[1], SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+        vnet_fwd_conn_failed(c);
+        return;
+    }
+    vnet_fwd_conn_start(c);
+}
 
-static int vnet_init_guest_socket(PortFwdState *s)
+static void vnet_init_guest_socket(PortFwdState *s, int client_fd)
 {
     // connect to guest socket
     struct sockaddr_in daddr;
+    PortFwdConn *c;
+    int ret;
 
-    if (!s->port_fwd.guest_addr.s_addr) {
-        if (!vm_ip_address)
-            return -1;
-        s->port_fwd.guest_addr.s_addr = vm_ip_address;
-    }
-    
+    c = g_new0(PortFwdConn, 1);
+    c->fwd = s;
+    c->fwd_id = s->id;
+    c->fd[0] = client_fd;
+    c->fd[1] = -1;
+
+    vmx_mutex_lock(&fwd_lock);
+    s->connections++;
+    vmx_mutex_unlock(&fwd_lock);
+
+    memset(&daddr, 0, sizeof(daddr));
     daddr.sin_family = AF_INET;
-    memcpy(&daddr.sin_addr.s_addr, &s->port_fwd.guest_addr, sizeof(daddr.sin_addr.s_addr));
+    daddr.sin_addr = s->port_fwd.guest_addr;
     daddr.sin_port = htons(s->port_fwd.guest_port);
-    
-    s->redir_fd = vmx_socket(PF_INET, SOCK_STREAM, 0);
-    if (s->redir_fd < 0) {
+    if (!daddr.sin_addr.s_addr) {
+        if (!vm_ip_address) {
+            goto fail;
+        }
+        daddr.sin_addr.s_addr = vm_ip_address;
+    }
+
+    c->fd[1] = vmx_socket(PF_INET, SOCK_STREAM, 0);
+    if (c->fd[1] < 0) {
         perror("socket");
-        return -1;
+        goto fail;
     }
-    
-    vmx_set_nonblock(s->redir_fd);
+    vmx_set_nonblock(c->fd[1]);
+    socket_set_nodelay(c->fd[1]);
 
-    s->redir_fd_connected = 0;
-    for(;;) {
-        int ret = connect(s->redir_fd, (struct sockaddr *)&daddr, sizeof(daddr));
-        if (ret < 0) {
-            int err = socket_error();
-            if (err == EINTR || err == EWOULDBLOCK) {
-            } else if (err == EINPROGRESS) {
-                break;
-            } else {
-                vnet_free_fwd_state(s, 0);
-                return -1;
-            }
-        } else {
-            s->redir_fd_connected = 1;
-            break;
-        }
+    do {
+        ret = connect(c->fd[1], (struct sockaddr *)&daddr, sizeof(daddr));
+    } while (ret < 0 && socket_error() == EINTR);
+
+    if (ret == 0) {
+        vnet_fwd_conn_start(c);
+        return;
     }
-    
-    vmx_set_fd_handler(s->redir_fd, NULL, vnet_socket_connect, s);
-    return 0;
+    if (socket_error() == EINPROGRESS) {
+        vmx_set_fd_handler(c->fd[1], NULL, vnet_socket_connect, c);
+        return;
+    }
+
+fail:
+    vnet_fwd_conn_failed(c);
 }
 
 static void vnet_socket_accept(void *opaque)
@@ -332,27 +492,28 @@ static void vnet_socket_accept(void *opaque)
     PortFwdState *s = opaque;
     struct sockaddr_in saddr;
     socklen_t len;
+    int fd;
 
     for(;;) {
         len = sizeof(saddr);
-        s->client_fd = vmx_accept(s->listen_fd, (struct sockaddr *)&saddr, &len);
-        if (s->client_fd < 0 && errno != EINTR) {
-            vnet_free_fwd_state(s, 1);
-        } else if (s->client_fd  >= 0) {
-            vmx_set_nonblock(s->client_fd);
+        fd = vmx_accept(s->listen_fd, (struct sockaddr *)&saddr, &len);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
             break;
         }
-    }
-
-    if (s->client_fd >= 0 && vnet_init_guest_socket(s) < 0) {
-        vnet_free_fwd_state(s, 0);
+        vmx_set_nonblock(fd);
+        socket_set_nodelay(fd);
+        vnet_init_guest_socket(s, fd);
     }
 }
 
 int vnet_add_port_fwd(const char *redir_str)
 {
     PortFwdState *s = NULL;
-    int fd, ret;
+    PortFwd fwd;
+    int ret;
     struct sockaddr_in saddr;
 
     for (int i = 0; i < ARRAY_SIZE(port_fwd_states); i++) {
@@ -361,14 +522,24 @@ int vnet_add_port_fwd(const char *redir_str)
             break;
         }
     }
-    memset(s, 0, sizeof(*s));
     if (!s)
         return -1;
 
-    if (parse_port_fwd(redir_str, &s->port_fwd) < 0) {
+    if (parse_port_fwd(redir_str, &fwd) < 0) {
         printf("parse port_fwd failed\n");
         return -1;
     }
+    if (vnet_fwd_thread_start() < 0) {
+        return -1;
+    }
+
+    /* connections of a previous rule in this slot may still be closing */
+    vmx_mutex_lock(&fwd_lock);
+    memset(s, 0, sizeof(*s));
+    s->id = ++port_fwd_next_id;
+    s->port_fwd = fwd;
+    vmx_mutex_unlock(&fwd_lock);
+
     saddr.sin_family = AF_INET;
     memcpy(&saddr.sin_addr.s_addr, &s->port_fwd.host_addr, sizeof(saddr.sin_addr.s_addr));
     saddr.sin_port = htons(s->port_fwd.host_port);
@@ -387,19 +558,20 @@ int vnet_add_port_fwd(const char *redir_str)
     ret = bind(s->listen_fd, (struct sockaddr *)&saddr, sizeof(saddr));
     if (ret < 0) {
         perror("bind");
-        closesocket(fd);
+        closesocket(s->listen_fd);
         return -1;
     }
-    ret = listen(s->listen_fd, 0);
+    ret = listen(s->listen_fd, SOMAXCONN);
     if (ret < 0) {
         perror("listen");
         closesocket(s->listen_fd);
         return -1;
     }
 
-    s->redir_fd = -1;
+    vmx_mutex_lock(&fwd_lock);
     s->used = 1;
-    
+    vmx_mutex_unlock(&fwd_lock);
+
     vmx_set_fd_handler(s->listen_fd, vnet_socket_accept, NULL, s);
     return 0;
 }
@@ -418,9 +590,49 @@ int vnet_del_port_fwd(const char *redir_str)
             port_fwd_states[i].port_fwd.guest_port == fwd.guest_port &&
             port_fwd_states[i].port_fwd.host_addr.s_addr == fwd.host_addr.s_addr &&
             port_fwd_states[i].port_fwd.host_port == fwd.host_port) {
+            PortFwdState *s = &port_fwd_states[i];
 
-            vnet_free_fwd_state(&port_fwd_states[i], 1);
+            vmx_set_fd_handler(s->listen_fd, NULL, NULL, NULL);
+            closesocket(s->listen_fd);
+
+            /* the forwarder drops the rule's connections when it wakes */
+            vmx_mutex_lock(&fwd_lock);
+            s->used = 0;
+            vmx_mutex_unlock(&fwd_lock);
+            vnet_fwd_kick();
         }
     }
     return 0;
 }
+
+char *vnet_port_fwd_stats_report(void)
+{
+    GString *str = g_string_new(NULL);
+    PortFwdState *s;
+
+    if (!fwd_thread_started) {
+        return g_string_free(str, false);
+    }
+
+    vmx_mutex_lock(&fwd_lock);
+    for (int i = 0; i < ARRAY_SIZE(port_fwd_states); i++) {
+        s = &port_fwd_states[i];
+        if (!s->used) {
+            continue;
+        }
+        /* inet_ntoa has a single static buffer */
+        g_string_append_printf(str, "%s %s:%d -> ",
+                               s->port_fwd.is_udp ? "udp" : "tcp",
+                               inet_ntoa(s->port_fwd.host_addr),
+                               s->port_fwd.host_port);
+        g_string_append_printf(str, "%s:%d: connections %llu active %u "
+                               "failed %llu to guest %llu bytes "
+                               "to host %llu bytes\n",
+                               inet_ntoa(s->port_fwd.guest_addr),
+                               s->port_fwd.guest_port, s->connections,
+                               s->active, s->failed, s->bytes_to_guest,
+                               s->bytes_to_host);
+    }
+    vmx_mutex_unlock(&fwd_lock);
+    return g_string_free(str, false);
+}
@@ -21,5 +21,7 @@
 #include "qemu-common.h"
 
 int vnet_add_port_fwd(const char *redir_str);
+int vnet_del_port_fwd(const char *redir_str);
+char *vnet_port_fwd_stats_report(void);
 
 #endif /* __VNET_FWD_H__ */
@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2016 Veertu Inc,
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 or
+ * (at your option) version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "vnet_proxy.h"
+
+/* One datagram per packet; there's no recvmmsg here, so read until the
+ * socket is drained or the batch is full. */
+int vnet_proxy_read(VnetRxRing *ring, int fd)
+{
+    ssize_t len;
+    int n = 0;
+
+    while (n < VNET_RX_BATCH) {
+        len = recv(fd, ring->buf[n], VNET_RX_BUF_SIZE, 0);
+        if (len <= 0) {
+            break;
+        }
+        if (len >= VNET_RX_BUF_SIZE) {
+            /* truncated, it didn't fit the buffer */
+            continue;
+        }
+        ring->pkt[n].iov_base = ring->buf[n];
+        ring->pkt[n].iov_len = len;
+        n++;
+    }
+
+    ring->count = n;
+    ring->next = 0;
+    return n;
+}
+
+bool vnet_rx_ring_deliver(VnetRxRing *ring, VnetRxSend *send, void *opaque)
+{
+    int count = ring->count - ring->next;
+    int sent;
+
+    if (count) {
+        sent = send(opaque, ring->pkt + ring->next, count);
+        if (sent < count) {
+            /* the one after those sent sits in the peer's queue */
+            ring->next += sent + 1;
+            return false;
+        }
+    }
+
+    ring->next = ring->count = 0;
+    return true;
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2016 Veertu Inc,
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 or
+ * (at your option) version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __VNET_PROXY_H__
+#define __VNET_PROXY_H__
+
+/*
+ * Receive ring of the vnet backend and the proxy socket reader.  Kept free
+ * of vmnet and the net layer so it builds on any host, see
+ * tests/vnet-proxy-test.c.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/* Packets taken from the backend per wakeup */
+#define VNET_RX_BATCH       32
+#define VNET_RX_BUF_SIZE    2048
+
+typedef struct VnetRxRing {
+    uint8_t buf[VNET_RX_BATCH][VNET_RX_BUF_SIZE];
+    /* pkt[next..count) are read but not yet passed on */
+    struct iovec pkt[VNET_RX_BATCH];
+    int count;
+    int next;
+} VnetRxRing;
+
+/* Passes packets on, returns how many went out.  Fewer means the next one
+ * was queued and the rest have to wait until it completes. */
+typedef int (VnetRxSend)(void *opaque, const struct iovec *pkts, int count);
+
+/* Reads the datagrams waiting on a non-blocking proxy socket into an empty
+ * ring, returns how many */
+int vnet_proxy_read(VnetRxRing *ring, int fd);
+
+/* Returns false if send queued a packet, call again once it completes */
+bool vnet_rx_ring_deliver(VnetRxRing *ring, VnetRxSend *send, void *opaque);
+
+#endif /* __VNET_PROXY_H__ */
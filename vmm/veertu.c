@@ -25,6 +25,7 @@
 #include "x86_decode.h"
 #include "x86_emu.h"
 #include "x86_mmu.h"
+#include "veertu.h"
 #include "x86_cpuid.h"
 #include "x86_descr.h"
 #include "qemu-common.h"
@@ -34,6 +35,7 @@
 #include "emuaccel.h"
 #include "hw.h"
 #include "ui/console.h"
+#include "qemu/timer.h"
 #include "boards.h"
 #include "known_hypervisor_interface.h"
 
@@ -207,10 +209,13 @@ void vmx_reset_vcpu(CPUState *cpu)
 
     hv_vm_sync_tsc(0);
     cpu->hlt = 0;
+    decode_cache_flush(cpu);
     hv_vcpu_invalidate_tlb(cpu->mac_vcpu_fd);
     hv_vcpu_flush(cpu->mac_vcpu_fd);
 }
 
+static void exit_stats_init(CPUState *cpu);
+
 int veertu_vcpu_init(CPUState *cpu)
 {
     X86CPU *x86cpu;
@@ -218,7 +223,9 @@ int veertu_vcpu_init(CPUState *cpu)
 
     init_emu(cpu);
     init_decoder(cpu);
+    init_mmu(cpu);
     init_cpuid(cpu);
+    exit_stats_init(cpu);
 
     if (g_hypervisor_iface)
         g_hypervisor_iface->init_cpu_context(cpu);
@@ -345,7 +352,8 @@ void veertu_region_add(MemoryCallbacks *listener, MemAreaSection *section)
 
 void veertu_interrupt_handle(CPUState *cpu_state, int mask)
 {
-    cpu_state->interrupt_request |= mask;
+    /* may be called by a vcpu dispatching to a lockless device */
+    atomic_or(&cpu_state->interrupt_request, mask);
     if (!vmx_cpu_is_self(cpu_state))
         vmx_cpu_kick(cpu_state);
 }
@@ -394,51 +402,48 @@ int veertu_machine_init(MachineState *machine)
 extern void vmx_fs_port_write(hwaddr addr, uint64_t val, unsigned size);
 extern uint32_t vmx_fs_port_read(hwaddr addr, unsigned size);
 
+static int veertu_fs_port_index(uint16_t port)
+{
+    switch (port) {
+        case 0x1850:
+            return 0;
+        case 0x1854:
+            return 1;
+        case 0x1858:
+            return 2;
+        case 0x185c:
+            return 3;
+        default:
+            return -1;
+    }
+}
+
 void veertu_handle_io(CPUState *cpu_state, uint16_t port, void *data, int direction, int size, uint32_t count)
 {
     int x;
+    int fs_port = veertu_fs_port_index(port);
     uint8_t *ptr = data;
 
-    if (port == 0x185c) {
-        if (direction) {
-            vmx_fs_port_write(3, *(uint32_t *)data, size);
-        } else {
-            *((uint32_t *)data) = vmx_fs_port_read(3, size);
-        }
-        return;
-    }
-    
-    if (port == 0x1854) {
-        if (direction) {
-            vmx_fs_port_write(1, *(uint32_t *)data, size);
-        } else {
-            *((uint32_t *)data) = vmx_fs_port_read(1, size);
-        }
-        return;
-    }
-    
-    if (port == 0x1850) {
-        if (direction) {
-            vmx_fs_port_write(0, *(uint32_t *)data, size);
-        } else {
-            *((uint32_t *)data) = vmx_fs_port_read(0, size);
-        }
-        return;
-    }
-    
-    if (port == 0x1858) {
-        if (direction) {
-            vmx_fs_port_write(2, *(uint32_t *)data, size);
-        } else {
-            *((uint32_t *)data) = vmx_fs_port_read(2, size);
+    if (fs_port >= 0) {
+        for (x = 0; x < count; ++x) {
+            uint32_t val = 0;
+
+            if (direction) {
+                memcpy(&val, ptr, MIN(size, 4));
+                vmx_fs_port_write(fs_port, val, size);
+            } else {
+                val = vmx_fs_port_read(fs_port, size);
+                memcpy(ptr, &val, MIN(size, 4));
+            }
+            ptr += size;
         }
         return;
     }
 
-    for (x = 0; x < count ;++x) {
+    if (count == 1)
         address_space_rw(&address_space_io, port, ptr, size, direction);
-        ptr += size;
-    }
+    else
+        address_space_rw_rep(&address_space_io, port, ptr, size, count, direction);
 }
 
 void __veertu_cpu_synchronize_state(void *data)
@@ -541,6 +546,7 @@ static void save_state_to_tss32(CPUState *cpu, struct x86_tss_segment32 *tss)
 static void load_state_from_tss32(CPUState *cpu, struct x86_tss_segment32 *tss)
 {
     wvmcs(cpu->mac_vcpu_fd, VMCS_GUEST_CR3, tss->cr3);
+    mmu_tlb_flush(cpu);
 
     RIP(cpu) = tss->eip;
     EFLAGS(cpu) = tss->eflags | 2;
@@ -665,6 +671,8 @@ static void vmx_handle_task_switch(CPUState *cpu, x68_segment_selector tss_sel,
 
     store_regs(cpu);
 
+    decode_cache_flush(cpu);
+    mmu_tlb_flush(cpu);
     hv_vcpu_invalidate_tlb(cpu->mac_vcpu_fd);
     hv_vcpu_flush(cpu->mac_vcpu_fd);
 }
@@ -691,6 +699,394 @@ void update_apic_tpr(CPUState *cpu)
 
 #define VECTORING_INFO_VECTOR_MASK     0xff
 
+#define EXIT_REASON_NAME(r) [EXIT_REASON_##r] = #r
+
+static const char *exit_reason_names[VEERTU_EXIT_REASONS] = {
+    EXIT_REASON_NAME(EXCEPTION),
+    EXIT_REASON_NAME(EXT_INTR),
+    EXIT_REASON_NAME(TRIPLE_FAULT),
+    EXIT_REASON_NAME(INIT),
+    EXIT_REASON_NAME(SIPI),
+    EXIT_REASON_NAME(IO_SMI),
+    EXIT_REASON_NAME(SMI),
+    EXIT_REASON_NAME(INTR_WINDOW),
+    EXIT_REASON_NAME(NMI_WINDOW),
+    EXIT_REASON_NAME(TASK_SWITCH),
+    EXIT_REASON_NAME(CPUID),
+    EXIT_REASON_NAME(GETSEC),
+    EXIT_REASON_NAME(HLT),
+    EXIT_REASON_NAME(INVD),
+    EXIT_REASON_NAME(INVLPG),
+    EXIT_REASON_NAME(RDPMC),
+    EXIT_REASON_NAME(RDTSC),
+    EXIT_REASON_NAME(RSM),
+    EXIT_REASON_NAME(VMCALL),
+    EXIT_REASON_NAME(CR_ACCESS),
+    EXIT_REASON_NAME(DR_ACCESS),
+    EXIT_REASON_NAME(INOUT),
+    EXIT_REASON_NAME(RDMSR),
+    EXIT_REASON_NAME(WRMSR),
+    EXIT_REASON_NAME(INVAL_VMCS),
+    EXIT_REASON_NAME(INVAL_MSR),
+    EXIT_REASON_NAME(MWAIT),
+    EXIT_REASON_NAME(MTF),
+    EXIT_REASON_NAME(MONITOR),
+    EXIT_REASON_NAME(PAUSE),
+    EXIT_REASON_NAME(MCE_DURING_ENTRY),
+    EXIT_REASON_NAME(TPR),
+    EXIT_REASON_NAME(APIC_ACCESS),
+    EXIT_REASON_NAME(VIRTUALIZED_EOI),
+    EXIT_REASON_NAME(GDTR_IDTR),
+    EXIT_REASON_NAME(LDTR_TR),
+    EXIT_REASON_NAME(EPT_FAULT),
+    EXIT_REASON_NAME(EPT_MISCONFIG),
+    EXIT_REASON_NAME(INVEPT),
+    EXIT_REASON_NAME(RDTSCP),
+    EXIT_REASON_NAME(VMX_PREEMPT),
+    EXIT_REASON_NAME(INVVPID),
+    EXIT_REASON_NAME(WBINVD),
+    EXIT_REASON_NAME(XSETBV),
+    EXIT_REASON_NAME(APIC_WRITE),
+};
+
+static void exit_stats_init(CPUState *cpu)
+{
+    cpu->exit_stats = g_malloc0(sizeof(struct veertu_exit_stats));
+    cpu->exit_stats->device_slot = -1;
+    cpu->exit_stats->last_slot = -1;
+}
+
+static inline void exit_hist_add(struct veertu_exit_hist *hist, uint64_t ticks)
+{
+    int bucket = ticks ? 63 - __builtin_clzll(ticks) - VEERTU_EXIT_HIST_SHIFT : 0;
+
+    if (bucket < 0)
+        bucket = 0;
+    else if (bucket >= VEERTU_EXIT_HIST_BUCKETS)
+        bucket = VEERTU_EXIT_HIST_BUCKETS - 1;
+
+    hist->count++;
+    hist->total += ticks;
+    if (ticks > hist->max)
+        hist->max = ticks;
+    hist->buckets[bucket]++;
+}
+
+static inline void exit_stats_exit(CPUState *cpu, uint64_t exit_reason)
+{
+    struct veertu_exit_stats *stats = cpu->exit_stats;
+
+    stats->exit_tsc = rdtscp();
+    stats->exit_reason = exit_reason & (VEERTU_EXIT_REASONS - 1);
+    stats->device_slot = -1;
+    stats->locked = false;
+    stats->lock_ticks = 0;
+    stats->pending = true;
+}
+
+static inline void exit_stats_lock(CPUState *cpu)
+{
+    cpu->exit_stats->locked = true;
+    cpu->exit_stats->lock_tsc = rdtscp();
+}
+
+static inline void exit_stats_unlock(CPUState *cpu)
+{
+    struct veertu_exit_stats *stats = cpu->exit_stats;
+
+    if (stats->lock_tsc) {
+        stats->lock_ticks += rdtscp() - stats->lock_tsc;
+        stats->lock_tsc = 0;
+    }
+}
+
+/* account the exit being handled, called right before re-entering the guest */
+static inline void exit_stats_enter(CPUState *cpu)
+{
+    struct veertu_exit_stats *stats = cpu->exit_stats;
+    struct veertu_exit_reason_stats *reason;
+    uint64_t ticks;
+
+    if (stats->reset) {
+        memset(stats->reason, 0, sizeof(stats->reason));
+        memset(stats->device, 0, sizeof(stats->device));
+        stats->device_dropped = 0;
+        stats->device_slot = -1;
+        stats->last_slot = -1;
+        stats->reset = false;
+        stats->pending = false;
+    }
+    if (!stats->pending)
+        return;
+
+    ticks = rdtscp() - stats->exit_tsc;
+    reason = &stats->reason[stats->exit_reason];
+    exit_hist_add(&reason->exit, ticks);
+    /* exits handled without the lock would only pile up in bucket 0 */
+    if (stats->locked)
+        exit_hist_add(&reason->locked, stats->lock_ticks);
+    if (stats->device_slot >= 0) {
+        stats->device[stats->device_slot].count++;
+        stats->device[stats->device_slot].ticks += ticks;
+    }
+    stats->pending = false;
+}
+
+/*
+ * Attribute the current MMIO/PIO exit to the region at addr. Guests mostly
+ * hit the same doorbell or port over and over, so the slot of the last
+ * address is kept and the region is only looked up again when the address
+ * changes or the memory map was rebuilt.
+ */
+static void exit_stats_region(CPUState *cpu, VeertuAddressSpace *as, hwaddr addr, bool pio)
+{
+    struct veertu_exit_stats *stats = cpu->exit_stats;
+    struct veertu_exit_device_stats *dev;
+    unsigned generation = address_space_dispatch_generation();
+    VeertuMemArea *mr;
+    hwaddr xlat, len = 1;
+    int i, slot;
+
+    if (stats->last_slot >= 0 && stats->last_as == as && stats->last_addr == addr &&
+        stats->last_generation == generation) {
+        stats->device_slot = stats->last_slot;
+        return;
+    }
+
+    mr = address_space_translate(as, addr, &xlat, &len, false);
+    slot = ((uintptr_t)mr >> 4) % VEERTU_EXIT_DEVICES;
+    for (i = 0; i < VEERTU_EXIT_DEVICES; i++, slot = (slot + 1) % VEERTU_EXIT_DEVICES) {
+        dev = &stats->device[slot];
+        if (!dev->key) {
+            snprintf(dev->name, sizeof(dev->name), "%s", mr->name ? mr->name : "unnamed");
+            dev->pio = pio;
+            dev->key = mr;
+        } else if (dev->key != mr || dev->pio != pio) {
+            continue;
+        }
+        stats->device_slot = slot;
+        stats->last_as = as;
+        stats->last_addr = addr;
+        stats->last_generation = generation;
+        stats->last_slot = slot;
+        return;
+    }
+    stats->device_dropped++;
+}
+
+void veertu_exit_stats_reset(void)
+{
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        if (cpu->exit_stats)
+            cpu->exit_stats->reset = true;
+    }
+}
+
+static void exit_hist_report(GString *str, const char *what, struct veertu_exit_hist *hist)
+{
+    int i;
+
+    g_string_append_printf(str, " %s count %llu total %llu max %llu hist", what,
+                           hist->count, hist->total, hist->max);
+    for (i = 0; i < VEERTU_EXIT_HIST_BUCKETS; i++)
+        g_string_append_printf(str, "%c%llu", i ? ',' : ' ', hist->buckets[i]);
+}
+
+char *veertu_exit_stats_report(void)
+{
+    GString *str = g_string_new(NULL);
+    CPUState *cpu;
+    int i;
+
+    CPU_FOREACH(cpu) {
+        struct veertu_exit_stats *stats = cpu->exit_stats;
+
+        if (!stats)
+            continue;
+        for (i = 0; i < VEERTU_EXIT_REASONS; i++) {
+            struct veertu_exit_reason_stats *reason = &stats->reason[i];
+
+            if (!reason->exit.count)
+                continue;
+            if (exit_reason_names[i])
+                g_string_append_printf(str, "cpu %d exit %s", cpu->cpu_index, exit_reason_names[i]);
+            else
+                g_string_append_printf(str, "cpu %d exit %d", cpu->cpu_index, i);
+            exit_hist_report(str, "exit", &reason->exit);
+            exit_hist_report(str, "locked", &reason->locked);
+            g_string_append_c(str, '\n');
+        }
+        for (i = 0; i < VEERTU_EXIT_DEVICES; i++) {
+            struct veertu_exit_device_stats *dev = &stats->device[i];
+
+            if (!dev->key || !dev->count)
+                continue;
+            g_string_append_printf(str, "cpu %d %s %s count %llu total %llu\n", cpu->cpu_index,
+                                   dev->pio ? "pio" : "mmio", dev->name, dev->count, dev->ticks);
+        }
+        if (stats->device_dropped)
+            g_string_append_printf(str, "cpu %d device dropped %llu\n", cpu->cpu_index,
+                                   stats->device_dropped);
+    }
+    return g_string_free(str, false);
+}
+
+static QEMUTimer *exit_stats_timer;
+static int exit_stats_interval;
+
+static void exit_stats_dump(void *opaque)
+{
+    char *report = veertu_exit_stats_report();
+
+    fputs(report, stderr);
+    g_free(report);
+    timer_mod(exit_stats_timer, vmx_clock_get_ms(QEMU_CLOCK_REALTIME) + exit_stats_interval * 1000);
+}
+
+void veertu_exit_stats_dump_interval(int seconds)
+{
+    exit_stats_interval = seconds;
+    if (seconds <= 0) {
+        if (exit_stats_timer)
+            timer_del(exit_stats_timer);
+        return;
+    }
+    if (!exit_stats_timer)
+        exit_stats_timer = timer_new_ms(QEMU_CLOCK_REALTIME, exit_stats_dump, NULL);
+    timer_mod(exit_stats_timer, vmx_clock_get_ms(QEMU_CLOCK_REALTIME) + seconds * 1000);
+}
+
+/*
+ * Complete a MOV store to a coalesced MMIO range without the iothread lock:
+ * the write is queued on the coalesced ring and the vcpu re-enters the guest.
+ */
+static bool veertu_handle_ept_unlocked(CPUState *cpu, uint64_t exit_qual, uint64_t rip)
+{
+    struct x86_decode decode;
+    addr_t gpa, ptr, val;
+
+    if ((exit_qual & (EXIT_QUAL_NMIUDTI | EPT_VIOLATION_DATA_READ)) || !(exit_qual & EPT_VIOLATION_DATA_WRITE))
+        return false;
+    if (!ept_emulation_fault(exit_qual))
+        return false;
+
+    gpa = rvmcs(cpu->mac_vcpu_fd, VMCS_GUEST_PHYSICAL_ADDRESS);
+    if (!address_space_is_coalesced(&address_space_memory, gpa, 1))
+        return false;
+
+    load_regs(cpu);
+    cpu->fetch_rip = rip;
+    decode_instruction(cpu, &decode);
+    if (!fetch_mov_store(cpu, &decode, &ptr, &val))
+        return false;
+    if ((ptr & 0xfff) + decode.operand_size > 0x1000 || !mmu_gva_to_gpa(cpu, ptr, &gpa))
+        return false;
+    if (!address_space_is_coalesced(&address_space_memory, gpa, decode.operand_size))
+        return false;
+    if (!vmx_coalesced_mmio_append(gpa, &val, decode.operand_size))
+        return false;
+
+    RIP(cpu) += decode.len;
+    store_regs(cpu);
+    exit_stats_region(cpu, &address_space_memory, gpa, false);
+    return true;
+}
+
+/* IN/OUT to the vmx backdoor ports or to a port area that does its own
+ * locking.
+ */
+static bool veertu_handle_inout_unlocked(CPUState *cpu, uint64_t exit_qual, uint64_t rip,
+                                         uint32_t ins_len)
+{
+    uint32_t in = (exit_qual & 8) != 0;
+    uint32_t size =  (exit_qual & 7) + 1;
+    uint32_t string =  (exit_qual & 16) != 0;
+    uint32_t port =  exit_qual >> 16;
+
+    if (string)
+        return false;
+    if (veertu_fs_port_index(port) < 0 && !address_space_is_lockless(&address_space_io, port, size))
+        return false;
+
+    exit_stats_region(cpu, &address_space_io, port, true);
+    if (in) {
+        uint64_t val = 0;
+        load_regs(cpu);
+        veertu_handle_io(cpu, port, &val, 0, size, 1);
+        if (size == 1) AL(cpu) = val;
+        else if (size == 2) AX(cpu) = val;
+        else if (size == 4) RAX(cpu) = (uint32_t)val;
+        else VM_PANIC("size");
+        RIP(cpu) += ins_len;
+        store_regs(cpu);
+    } else {
+        RAX(cpu) = rreg(cpu->mac_vcpu_fd, HV_X86_RAX);
+        veertu_handle_io(cpu, port, &RAX(cpu), 1, size, 1);
+        macvm_set_rip(cpu, rip + ins_len);
+    }
+    return true;
+}
+
+/*
+ * 32 bit MOV stores to the apic page (EOI, ICR, timer) only take the apic
+ * lock, and the iothread lock for the registers that need it, see
+ * devices/apic.c. Reads and any other instruction go the locked way.
+ */
+static bool veertu_handle_apic_access_unlocked(CPUState *cpu, uint64_t exit_qual, uint64_t rip)
+{
+    struct x86_decode decode;
+    addr_t gpa, ptr, val;
+    uint32_t val32;
+
+    /* linear write during instruction execution */
+    if (APIC_ACCESS_TYPE(exit_qual) != 1)
+        return false;
+
+    load_regs(cpu);
+    cpu->fetch_rip = rip;
+    decode_instruction(cpu, &decode);
+    if (decode.operand_size != 4 || !fetch_mov_store(cpu, &decode, &ptr, &val))
+        return false;
+    if ((ptr & 3) || !mmu_gva_to_gpa(cpu, ptr, &gpa))
+        return false;
+    if ((gpa & 0xfff) != APIC_ACCESS_OFFSET(exit_qual) ||
+        !address_space_is_lockless(&address_space_memory, gpa, 4))
+        return false;
+
+    update_apic_tpr(cpu);
+    val32 = val;
+    address_space_write(&address_space_memory, gpa, (uint8_t *)&val32, 4);
+    RIP(cpu) += decode.len;
+    store_regs(cpu);
+    vmx_update_tpr(cpu);
+    return true;
+}
+
+/*
+ * Handle exits that don't need the iothread lock: stores to coalesced MMIO
+ * and accesses to areas that cleared global locking. Returns false if the
+ * exit has to go through the regular, locked path.
+ */
+static bool veertu_handle_exit_unlocked(CPUState *cpu, uint64_t exit_reason, uint64_t exit_qual,
+                                        uint64_t idtvec_info, uint64_t rip, uint32_t ins_len)
+{
+    if ((idtvec_info & VMCS_IDT_VEC_VALID) || cpu->interrupt_request || cpu->exit_request)
+        return false;
+
+    switch (exit_reason) {
+    case EXIT_REASON_EPT_FAULT:
+        return veertu_handle_ept_unlocked(cpu, exit_qual, rip);
+    case EXIT_REASON_INOUT:
+        return veertu_handle_inout_unlocked(cpu, exit_qual, rip, ins_len);
+    case EXIT_REASON_APIC_ACCESS:
+        return veertu_handle_apic_access_unlocked(cpu, exit_qual, rip);
+    default:
+        return false;
+    }
+}
+
 int veertu_cpu_exec(CPUState *cpu)
 {
     X86CPU *x86_cpu = X86_CPU(cpu);
@@ -698,6 +1094,7 @@ int veertu_cpu_exec(CPUState *cpu)
     int ret = 0;
     uint64_t rip = 0;
 
+    exit_stats_lock(cpu);
     if (veertu_process_events(cpu)) {
         vmx_mutex_unlock_iothread();
         pthread_yield_np();
@@ -718,6 +1115,7 @@ again:
         veertu_inject_interrupts(cpu);
         vmx_update_tpr(cpu);
         
+        exit_stats_unlock(cpu);
         vmx_mutex_unlock_iothread();
         
         while (!cpu_is_bsp(X86_CPU(cpu)) && cpu->halted) {
@@ -726,26 +1124,40 @@ again:
         }
         
         int r;
-        if ((r = hv_vcpu_run(cpu->mac_vcpu_fd))) {
-            printf("%ld: run %llx failed with %x\n", veertu_vcpu_id(cpu), rip, r);
-            abort();
-        }
-
-        /* handle VMEXIT */
-        uint64_t exit_reason = rvmcs(cpu->mac_vcpu_fd, VMCS_EXIT_REASON);
-        uint64_t exit_qual = rvmcs(cpu->mac_vcpu_fd, VMCS_EXIT_QUALIFICATION);
-        uint32_t ins_len = (uint32_t)rvmcs(cpu->mac_vcpu_fd, VMCS_EXIT_INSTRUCTION_LENGTH);
-        uint64_t idtvec_info = rvmcs(cpu->mac_vcpu_fd, VMCS_IDT_VECTORING_INFO);
-        rip = rreg(cpu->mac_vcpu_fd, HV_X86_RIP);
+        uint64_t exit_reason, exit_qual, idtvec_info;
+        uint32_t ins_len;
+        bool handled;
+        do {
+            exit_stats_enter(cpu);
+            if ((r = hv_vcpu_run(cpu->mac_vcpu_fd))) {
+                printf("%ld: run %llx failed with %x\n", veertu_vcpu_id(cpu), rip, r);
+                abort();
+            }
+            mmu_tlb_flush(cpu);
+
+            /* handle VMEXIT */
+            exit_reason = rvmcs(cpu->mac_vcpu_fd, VMCS_EXIT_REASON);
+            exit_stats_exit(cpu, exit_reason);
+            exit_qual = rvmcs(cpu->mac_vcpu_fd, VMCS_EXIT_QUALIFICATION);
+            ins_len = (uint32_t)rvmcs(cpu->mac_vcpu_fd, VMCS_EXIT_INSTRUCTION_LENGTH);
+            idtvec_info = rvmcs(cpu->mac_vcpu_fd, VMCS_IDT_VECTORING_INFO);
+            rip = rreg(cpu->mac_vcpu_fd, HV_X86_RIP);
+            handled = veertu_handle_exit_unlocked(cpu, exit_reason, exit_qual, idtvec_info, rip, ins_len);
+        } while (handled && !cpu->interrupt_request && !cpu->exit_request);
         RFLAGS(cpu) = rreg(cpu->mac_vcpu_fd, HV_X86_RFLAGS);
         env->eflags = RFLAGS(cpu);
 
         vmx_mutex_lock_iothread();
+        exit_stats_lock(cpu);
+        vmx_flush_coalesced_mmio_buffer();
         
         update_apic_tpr(cpu);
         current_cpu = cpu;
         
         ret = 0;
+        /* handled without the lock, came back to inject an interrupt */
+        if (handled)
+            continue;
         switch (exit_reason) {
             case EXIT_REASON_HLT: {
                 macvm_set_rip(cpu, rip + ins_len);
@@ -774,6 +1186,7 @@ again:
                 if (ept_emulation_fault(exit_qual) && !slot) {
                     struct x86_decode decode;
                     
+                    exit_stats_region(cpu, &address_space_memory, gpa, false);
                     load_regs(cpu);
                     cpu->fetch_rip = rip;
                     
@@ -812,6 +1225,7 @@ again:
                 uint32_t port =  exit_qual >> 16;
                 uint32_t rep = (exit_qual & 0x20) != 0;
                 
+                exit_stats_region(cpu, &address_space_io, port, true);
 #if 1
                 if (!string && in) {
                     uint64_t val = 0;
@@ -990,6 +1404,7 @@ again:
         }
     } while (ret == 0);
     
+    exit_stats_unlock(cpu);
     return ret;
 }
 
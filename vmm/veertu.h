@@ -20,5 +20,64 @@
 #define veertu_h
 
 #include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Per-vcpu exit profile. Every field is only written by the owning vcpu
+ * thread, readers take a racy snapshot. Times are in TSC ticks; histogram
+ * bucket i counts samples in [2^(i + SHIFT), 2^(i + SHIFT + 1)), with the
+ * first and last buckets open-ended.
+ */
+#define VEERTU_EXIT_REASONS         64
+#define VEERTU_EXIT_DEVICES         32
+#define VEERTU_EXIT_HIST_BUCKETS    16
+#define VEERTU_EXIT_HIST_SHIFT      9
+
+struct veertu_exit_hist {
+    uint64_t count;
+    uint64_t total;
+    uint64_t max;
+    uint64_t buckets[VEERTU_EXIT_HIST_BUCKETS];
+};
+
+struct veertu_exit_reason_stats {
+    struct veertu_exit_hist exit;       /* vm exit to re-entry */
+    struct veertu_exit_hist locked;     /* iothread lock held */
+};
+
+struct veertu_exit_device_stats {
+    const void *key;
+    char name[32];
+    bool pio;
+    uint64_t count;
+    uint64_t ticks;
+};
+
+struct veertu_exit_stats {
+    struct veertu_exit_reason_stats reason[VEERTU_EXIT_REASONS];
+    struct veertu_exit_device_stats device[VEERTU_EXIT_DEVICES];
+    uint64_t device_dropped;
+
+    /* exit currently being handled */
+    bool pending;
+    bool reset;
+    int exit_reason;
+    int device_slot;
+    bool locked;
+    uint64_t exit_tsc;
+    uint64_t lock_tsc;
+    uint64_t lock_ticks;
+
+    /* last region looked up, valid while the dispatch generation matches */
+    const void *last_as;
+    uint64_t last_addr;
+    unsigned last_generation;
+    int last_slot;
+};
+
+void veertu_exit_stats_reset(void);
+char *veertu_exit_stats_report(void);
+void veertu_exit_stats_dump_interval(int seconds);
 
 #endif /* veertu_h */
@@ -6,6 +6,7 @@
 #include <Hypervisor/hv_vmx.h>
 #include "vmcs.h"
 #include "qemu/tls.h"
+#include "qemu/atomic.h"
 #include "address-spaces.h"
 #include "util/cpu.h"
 
@@ -17,7 +18,7 @@ static void inline cpu_exit(CPUState *cpu)
 }
 static void inline cpu_reset_interrupt(CPUState *cpu, int mask)
 {
-    cpu->interrupt_request &= ~mask;
+    atomic_and(&cpu->interrupt_request, ~mask);
 }
 void vmx_cpu_kick(CPUState *cpu);
 bool vmx_cpu_is_self(CPUState *cpu);
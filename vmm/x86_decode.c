@@ -1567,8 +1567,116 @@ static void decode_opcodes(CPUState *cpu, struct x86_decode *decode)
     }
 }
 
+#define DECODE_MODE_LONG    (1 << 0)
+#define DECODE_MODE_REAL    (1 << 1)
+#define DECODE_MODE_V8086   (1 << 2)
+#define DECODE_MODE_CS_DB   (1 << 3)
+#define DECODE_MODE_CS_L    (1 << 4)
+
+/* everything besides the code bytes that decoding depends on */
+static uint32_t decode_cache_mode(CPUState *cpu)
+{
+    struct vmx_segment cs;
+    uint32_t mode = 0;
+
+    if (x86_is_long_mode(cpu))
+        mode |= DECODE_MODE_LONG;
+    if (x86_is_real(cpu))
+        mode |= DECODE_MODE_REAL;
+    else if (x86_is_v8086(cpu))
+        mode |= DECODE_MODE_V8086;
+
+    vmx_read_segment_descriptor(cpu, &cs, REG_SEG_CS);
+    if ((cs.ar >> 14) & 1)
+        mode |= DECODE_MODE_CS_DB;
+    if ((cs.ar >> 13) & 1)
+        mode |= DECODE_MODE_CS_L;
+
+    return mode;
+}
+
+static inline struct x86_decode_cache_entry *decode_cache_slot(CPUState *cpu, addr_t rip)
+{
+    return &cpu->decode_cache->entries[(rip ^ (rip >> 12)) & (DECODE_CACHE_SIZE - 1)];
+}
+
+/*
+ * Remaps without a cr3 load (invlpg does not exit) are caught by walking rip
+ * once and comparing with the gpa recorded at decode time, guest writes to
+ * code pages by re-reading the cached bytes there.  That is one walk and one
+ * physical read instead of a walk for every prefix, opcode, modrm and
+ * immediate.
+ */
+static bool decode_cache_lookup(CPUState *cpu, struct x86_decode *decode, addr_t cr3, addr_t rip, uint32_t mode)
+{
+    struct x86_decode_cache_entry *entry = decode_cache_slot(cpu, rip);
+    uint8_t bytes[DECODE_MAX_INS_LEN];
+    addr_t gpa;
+
+    if (!entry->valid || entry->rip != rip || entry->cr3 != cr3 || entry->mode != mode)
+        return false;
+
+    if (!mmu_gva_to_gpa(cpu, rip, &gpa) || gpa != entry->gpa) {
+        entry->valid = false;
+        cpu->decode_cache->invalidations++;
+        return false;
+    }
+
+    address_space_rw(&address_space_memory, entry->gpa, bytes, entry->decode.len, 0);
+    if (memcmp(bytes, entry->bytes, entry->decode.len)) {
+        entry->valid = false;
+        cpu->decode_cache->invalidations++;
+        return false;
+    }
+
+    memcpy(decode, &entry->decode, sizeof(*decode));
+    return true;
+}
+
+static void decode_cache_insert(CPUState *cpu, struct x86_decode *decode, addr_t cr3, addr_t rip, uint32_t mode)
+{
+    struct x86_decode_cache_entry *entry = decode_cache_slot(cpu, rip);
+    addr_t gpa;
+
+    /* instructions crossing a page can't be validated with one read */
+    if (decode->len > DECODE_MAX_INS_LEN || (rip & 0xfff) + decode->len > 0x1000)
+        return;
+    if (!mmu_gva_to_gpa(cpu, rip, &gpa))
+        return;
+
+    entry->valid = true;
+    entry->mode = mode;
+    entry->cr3 = cr3;
+    entry->rip = rip;
+    entry->gpa = gpa;
+    address_space_rw(&address_space_memory, gpa, entry->bytes, decode->len, 0);
+    memcpy(&entry->decode, decode, sizeof(*decode));
+}
+
+void decode_cache_flush(CPUState *cpu)
+{
+    int i;
+
+    if (!cpu->decode_cache)
+        return;
+
+    for (i = 0; i < DECODE_CACHE_SIZE; i++)
+        cpu->decode_cache->entries[i].valid = false;
+    cpu->decode_cache->invalidations++;
+}
+
 uint32_t decode_instruction(CPUState *cpu, struct x86_decode *decode)
 {
+    addr_t cr3 = rvmcs(cpu->mac_vcpu_fd, VMCS_GUEST_CR3);
+    addr_t rip = linear_rip(cpu, RIP(cpu));
+    uint32_t mode = decode_cache_mode(cpu);
+
+    if (decode_cache_lookup(cpu, decode, cr3, rip, mode)) {
+        cpu->decode_cache->hits++;
+        return decode->len;
+    }
+    cpu->decode_cache->misses++;
+
     ZERO_INIT(*decode);
 
     decode_prefix(cpu, decode);
@@ -1576,6 +1684,8 @@ uint32_t decode_instruction(CPUState *cpu, struct x86_decode *decode)
     set_operand_size(cpu, decode);
 
     decode_opcodes(cpu, decode);
+
+    decode_cache_insert(cpu, decode, cr3, rip, mode);
     
     return decode->len;
 }
@@ -1583,6 +1693,9 @@ uint32_t decode_instruction(CPUState *cpu, struct x86_decode *decode)
 void init_decoder(CPUState *cpu)
 {
     int i;
+
+    if (!cpu->decode_cache)
+        cpu->decode_cache = g_malloc0(sizeof(struct x86_decode_cache));
     
     for (i = 0; i < ARRAY_SIZE(_decode_tbl2); i++)
         memcpy(_decode_tbl1, &invl_inst, sizeof(invl_inst));
@@ -302,9 +302,32 @@ typedef struct x86_decode {
 
 } x86_decode;
 
+/* per-vcpu cache of decoded instructions, keyed by (cr3, linear rip, mode) */
+#define DECODE_CACHE_SIZE       256
+#define DECODE_MAX_INS_LEN      15
+
+struct x86_decode_cache_entry {
+    bool valid;
+    uint32_t mode;
+    addr_t cr3;
+    addr_t rip;
+    addr_t gpa;
+    uint8_t bytes[DECODE_MAX_INS_LEN];
+    struct x86_decode decode;
+};
+
+struct x86_decode_cache {
+    struct x86_decode_cache_entry entries[DECODE_CACHE_SIZE];
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t invalidations;
+};
+
 uint64_t sign(uint64_t val, int size);
 
+void init_decoder(CPUState *cpu);
 uint32_t decode_instruction(CPUState *cpu, struct x86_decode *decode);
+void decode_cache_flush(CPUState *cpu);
 
 addr_t get_reg_ref(CPUState *cpu, int reg, int is_extended, int size);
 addr_t get_reg_val(CPUState *cpu, int reg, int is_extended, int size);
@@ -295,6 +295,29 @@ static void exec_mov(struct CPUState *cpu, struct x86_decode *decode)
     RIP(cpu) += decode->len;
 }
 
+/*
+ * Resolve a plain MOV store (mov r/m, reg/imm or mov moffs, rAX) to its
+ * linear target and value without performing it. Returns false for any
+ * other instruction; nothing is read from guest memory in either case.
+ */
+bool fetch_mov_store(struct CPUState *cpu, struct x86_decode *decode, addr_t *ptr, addr_t *val)
+{
+    struct x86_decode_op *dst = &decode->op[0];
+    struct x86_decode_op *src = &decode->op[1];
+
+    if (X86_DECODE_CMD_MOV != decode->cmd || decode->lock)
+        return false;
+    if (!(X86_VAR_RM == dst->type && 3 != decode->modrm.mod) && X86_VAR_OFFSET != dst->type)
+        return false;
+    if (X86_VAR_REG != src->type && X86_VAR_IMMEDIATE != src->type)
+        return false;
+
+    fetch_operands(cpu, decode, 2, false, true, false);
+    *ptr = dst->ptr;
+    *val = src->val;
+    return true;
+}
+
 static void exec_add(struct CPUState *cpu, struct x86_decode *decode)
 {
     EXEC_2OP_ARITH_CMD(cpu, decode, +, SET_FLAGS_OSZAPC_ADD, true);
@@ -498,6 +521,111 @@ static inline void string_rep(struct CPUState * cpu, struct x86_decode *decode,
     }
 }
 
+static inline void string_advance_reg(struct CPUState *cpu, int reg, struct x86_decode *decode, uint32_t count)
+{
+    addr_t val = read_reg(cpu, reg, decode->addressing_size);
+    addr_t delta = (addr_t)decode->operand_size * count;
+
+    if (cpu->rflags.df)
+        val -= delta;
+    else
+        val += delta;
+    write_reg(cpu, reg, val, decode->addressing_size);
+}
+
+/*
+ * Number of elements of a REP string op through `reg` (at linear `addr`)
+ * that can be moved at once: the run stays inside the current page, does
+ * not wrap the address-size register and fits in mmio_buf. An element that
+ * straddles the page end or the wrap point goes on its own.
+ */
+static uint32_t string_run_length(struct CPUState *cpu, struct x86_decode *decode, int reg, addr_t addr, addr_t rcx)
+{
+    int size = decode->operand_size;
+    addr_t offset = read_reg(cpu, reg, decode->addressing_size);
+    addr_t mask = (8 == decode->addressing_size) ? -1llu : (1llu << (decode->addressing_size * 8)) - 1;
+    addr_t page_off = addr & 0xfff;
+    addr_t n;
+
+    if (page_off + size > 0x1000 || mask - offset < size - 1)
+        return 1;
+
+    /* every element of the run needs offset + size - 1 <= mask */
+    if (cpu->rflags.df)
+        n = MIN(page_off / size, offset / size) + 1;
+    else
+        n = MIN((0x1000 - page_off) / size - 1, (mask - offset - (size - 1)) / size) + 1;
+
+    n = MIN(n, rcx);
+    n = MIN(n, sizeof(cpu->mmio_buf) / size);
+    return (uint32_t)n;
+}
+
+/* lowest linear address touched by a run starting at `addr` */
+static inline addr_t string_run_start(struct CPUState *cpu, addr_t addr, int size, uint32_t count)
+{
+    if (cpu->rflags.df)
+        return addr - (addr_t)(count - 1) * size;
+    return addr;
+}
+
+/* with DF set the run was transferred highest address first */
+static void string_run_reverse(struct CPUState *cpu, uint8_t *buf, int size, uint32_t count)
+{
+    uint8_t tmp[8];
+    uint32_t i;
+
+    if (!cpu->rflags.df)
+        return;
+
+    for (i = 0; i < count / 2; i++) {
+        uint8_t *a = buf + i * size;
+        uint8_t *b = buf + (count - 1 - i) * size;
+
+        memcpy(tmp, a, size);
+        memcpy(a, b, size);
+        memcpy(b, tmp, size);
+    }
+}
+
+static void exec_ins_rep(struct CPUState *cpu, struct x86_decode *decode)
+{
+    int size = decode->operand_size;
+    addr_t rcx = read_reg(cpu, REG_RCX, decode->addressing_size);
+
+    while (rcx) {
+        addr_t addr = linear_addr_size(cpu, RDI(cpu), decode->addressing_size, REG_SEG_ES);
+        uint32_t count = string_run_length(cpu, decode, REG_RDI, addr, rcx);
+
+        veertu_handle_io(cpu, DX(cpu), cpu->mmio_buf, 0, size, count);
+        string_run_reverse(cpu, cpu->mmio_buf, size, count);
+        vmx_write_mem(cpu, string_run_start(cpu, addr, size, count), cpu->mmio_buf, size * count);
+
+        string_advance_reg(cpu, REG_RDI, decode, count);
+        rcx -= count;
+        write_reg(cpu, REG_RCX, rcx, decode->addressing_size);
+    }
+}
+
+static void exec_outs_rep(struct CPUState *cpu, struct x86_decode *decode)
+{
+    int size = decode->operand_size;
+    addr_t rcx = read_reg(cpu, REG_RCX, decode->addressing_size);
+
+    while (rcx) {
+        addr_t addr = decode_linear_addr(cpu, decode, RSI(cpu), REG_SEG_DS);
+        uint32_t count = string_run_length(cpu, decode, REG_RSI, addr, rcx);
+
+        vmx_read_mem(cpu, cpu->mmio_buf, string_run_start(cpu, addr, size, count), size * count);
+        string_run_reverse(cpu, cpu->mmio_buf, size, count);
+        veertu_handle_io(cpu, DX(cpu), cpu->mmio_buf, 1, size, count);
+
+        string_advance_reg(cpu, REG_RSI, decode, count);
+        rcx -= count;
+        write_reg(cpu, REG_RCX, rcx, decode->addressing_size);
+    }
+}
+
 static void exec_ins_single(struct CPUState *cpu, struct x86_decode *decode)
 {
     addr_t addr = linear_addr_size(cpu, RDI(cpu), decode->addressing_size, REG_SEG_ES);
@@ -511,7 +639,7 @@ static void exec_ins_single(struct CPUState *cpu, struct x86_decode *decode)
 static void exec_ins(struct CPUState *cpu, struct x86_decode *decode)
 {
     if (decode->rep)
-        string_rep(cpu, decode, exec_ins_single, 0);
+        exec_ins_rep(cpu, decode);
     else
         exec_ins_single(cpu, decode);
 
@@ -531,7 +659,7 @@ static void exec_outs_single(struct CPUState *cpu, struct x86_decode *decode)
 static void exec_outs(struct CPUState *cpu, struct x86_decode *decode)
 {
     if (decode->rep)
-        string_rep(cpu, decode, exec_outs_single, 0);
+        exec_outs_rep(cpu, decode);
     else
         exec_outs_single(cpu, decode);
     
@@ -554,10 +682,52 @@ static void exec_movs_single(struct CPUState *cpu, struct x86_decode *decode)
     string_increment_reg(cpu, REG_RDI, decode);
 }
 
+static bool string_runs_overlap(struct CPUState *cpu, addr_t src, addr_t dst, int len)
+{
+    addr_t src_gpa, dst_gpa;
+
+    if (src < dst + len && dst < src + len)
+        return true;
+    if (!mmu_gva_to_gpa(cpu, src, &src_gpa) || !mmu_gva_to_gpa(cpu, dst, &dst_gpa))
+        return true;
+    return src_gpa < dst_gpa + len && dst_gpa < src_gpa + len;
+}
+
+/* overlapping runs keep the element-by-element semantics */
+static void exec_movs_rep(struct CPUState *cpu, struct x86_decode *decode)
+{
+    int size = decode->operand_size;
+    addr_t rcx = read_reg(cpu, REG_RCX, decode->addressing_size);
+
+    while (rcx) {
+        addr_t src_addr = decode_linear_addr(cpu, decode, RSI(cpu), REG_SEG_DS);
+        addr_t dst_addr = linear_addr_size(cpu, RDI(cpu), decode->addressing_size, REG_SEG_ES);
+        uint32_t count = MIN(string_run_length(cpu, decode, REG_RSI, src_addr, rcx),
+                             string_run_length(cpu, decode, REG_RDI, dst_addr, rcx));
+
+        src_addr = string_run_start(cpu, src_addr, size, count);
+        dst_addr = string_run_start(cpu, dst_addr, size, count);
+        if (count > 1 && string_runs_overlap(cpu, src_addr, dst_addr, size * count))
+            count = 1;
+
+        if (1 == count) {
+            exec_movs_single(cpu, decode);
+        } else {
+            vmx_read_mem(cpu, cpu->mmio_buf, src_addr, size * count);
+            vmx_write_mem(cpu, dst_addr, cpu->mmio_buf, size * count);
+            string_advance_reg(cpu, REG_RSI, decode, count);
+            string_advance_reg(cpu, REG_RDI, decode, count);
+        }
+
+        rcx -= count;
+        write_reg(cpu, REG_RCX, rcx, decode->addressing_size);
+    }
+}
+
 static void exec_movs(struct CPUState *cpu, struct x86_decode *decode)
 {
     if (decode->rep) {
-        string_rep(cpu, decode, exec_movs_single, 0);
+        exec_movs_rep(cpu, decode);
     }
     else
         exec_movs_single(cpu, decode);
@@ -608,10 +778,31 @@ static void exec_stos_single(struct CPUState *cpu, struct x86_decode *decode)
 }
 
 
+static void exec_stos_rep(struct CPUState *cpu, struct x86_decode *decode)
+{
+    int size = decode->operand_size;
+    addr_t val = read_reg(cpu, REG_RAX, size);
+    addr_t rcx = read_reg(cpu, REG_RCX, decode->addressing_size);
+    uint32_t filled = 0;
+
+    while (rcx) {
+        addr_t addr = linear_addr_size(cpu, RDI(cpu), decode->addressing_size, REG_SEG_ES);
+        uint32_t count = string_run_length(cpu, decode, REG_RDI, addr, rcx);
+
+        for (; filled < count; filled++)
+            memcpy(cpu->mmio_buf + filled * size, &val, size);
+        vmx_write_mem(cpu, string_run_start(cpu, addr, size, count), cpu->mmio_buf, size * count);
+
+        string_advance_reg(cpu, REG_RDI, decode, count);
+        rcx -= count;
+        write_reg(cpu, REG_RCX, rcx, decode->addressing_size);
+    }
+}
+
 static void exec_stos(struct CPUState *cpu, struct x86_decode *decode)
 {
     if (decode->rep) {
-        string_rep(cpu, decode, exec_stos_single, 0);
+        exec_stos_rep(cpu, decode);
     }
     else
         exec_stos_single(cpu, decode);
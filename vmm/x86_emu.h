@@ -6,6 +6,7 @@
 
 void init_emu(struct CPUState *cpu);
 bool exec_instruction(struct CPUState *cpu, struct x86_decode *ins);
+bool fetch_mov_store(struct CPUState *cpu, struct x86_decode *decode, addr_t *ptr, addr_t *val);
 
 void load_regs(struct CPUState *cpu);
 void store_regs(struct CPUState *cpu);
@@ -30,6 +30,8 @@ struct gpt_translation {
     bool write_access;
     bool user_access;
     bool exec_access;
+    bool write_protect;
+    bool is_large;
 };
 
 static int gpt_top_level(struct CPUState *cpu, bool pae)
@@ -97,9 +99,8 @@ static bool test_pt_entry(struct CPUState *cpu, struct gpt_translation *pt, int
     if (!level)
         pt->err_code |= MMU_PAGE_PT;
         
-    addr_t cr0 = rvmcs(cpu->mac_vcpu_fd, VMCS_GUEST_CR0);
     /* check protection */
-    if (cr0 & CR0_WP) {
+    if (pt->write_protect) {
         if (pt->write_access && !pte_write_access(pte))
             return false;
     }
@@ -148,6 +149,7 @@ static bool walk_gpt(struct CPUState *cpu, addr_t addr, int err_code, struct gpt
     pt->user_access = (err_code & MMU_PAGE_US);
     pt->write_access = (err_code & MMU_PAGE_WT);
     pt->exec_access = (err_code & MMU_PAGE_NX);
+    pt->write_protect = rvmcs(cpu->mac_vcpu_fd, VMCS_GUEST_CR0) & CR0_WP;
     
     for (level = top_level; level > 0; level--) {
         get_pt_entry(cpu, pt, level, pae);
@@ -163,14 +165,80 @@ static bool walk_gpt(struct CPUState *cpu, addr_t addr, int err_code, struct gpt
         pt->gpa = (pt->pte[0] & page_mask) | (pt->gva & 0xfff);
     else
         pt->gpa = large_page_gpa(pt, pae);
+    pt->is_large = is_large;
 
     return true;
 }
 
+void init_mmu(struct CPUState *cpu)
+{
+    if (!cpu->tlb) {
+        cpu->tlb = g_malloc0(sizeof(struct x86_tlb));
+        /* zeroed entries belong to generation 0 and never match */
+        cpu->tlb->gen = 1;
+    }
+}
+
+void mmu_tlb_flush(struct CPUState *cpu)
+{
+    if (cpu->tlb)
+        cpu->tlb->gen++;
+}
+
+/*
+ * Permissions only ever narrow a walk, so an entry remembers every set of
+ * access flags a walk of this page has already succeeded with.
+ */
+static bool mmu_tlb_lookup(struct CPUState *cpu, addr_t gva, addr_t *gpa, int flags)
+{
+    struct x86_tlb *tlb = cpu->tlb;
+    struct x86_tlb_entry *entry;
+
+    entry = &tlb->small[(gva >> 12) & (MMU_TLB_SIZE - 1)];
+    if (entry->gen != tlb->gen || entry->gva != (gva & entry->page_mask)) {
+        entry = &tlb->large[(gva >> 21) & (MMU_TLB_LARGE_SIZE - 1)];
+        if (entry->gen != tlb->gen || entry->gva != (gva & entry->page_mask))
+            return false;
+    }
+    if (flags & ~entry->flags)
+        return false;
+
+    *gpa = entry->gpa | (gva & ~entry->page_mask);
+    return true;
+}
+
+static void mmu_tlb_insert(struct CPUState *cpu, struct gpt_translation *pt, int flags, bool pae)
+{
+    struct x86_tlb *tlb = cpu->tlb;
+    struct x86_tlb_entry *entry;
+    addr_t page_mask;
+
+    if (!pt->is_large) {
+        page_mask = ~0xfffllu;
+        entry = &tlb->small[(pt->gva >> 12) & (MMU_TLB_SIZE - 1)];
+    } else {
+        page_mask = pae ? ~0x1fffffllu : ~0x3fffffllu;
+        entry = &tlb->large[(pt->gva >> 21) & (MMU_TLB_LARGE_SIZE - 1)];
+    }
+
+    if (entry->gen == tlb->gen && entry->gva == (pt->gva & page_mask) &&
+        entry->page_mask == page_mask) {
+        entry->flags |= flags;
+        return;
+    }
+
+    entry->gen = tlb->gen;
+    entry->gva = pt->gva & page_mask;
+    entry->gpa = pt->gpa & page_mask;
+    entry->page_mask = page_mask;
+    entry->flags = flags;
+}
+
 
 bool mmu_gva_to_gpa_ext(struct CPUState *cpu, addr_t gva, addr_t *gpa, int flags)
 {
     bool res;
+    bool pae;
     struct gpt_translation pt;
     int err_code = 0;
 
@@ -183,8 +251,13 @@ bool mmu_gva_to_gpa_ext(struct CPUState *cpu, addr_t gva, addr_t *gpa, int flags
         return true;
     }
 
-    res = walk_gpt(cpu, gva, err_code, &pt, x86_is_pae_enabled(cpu));
+    if (mmu_tlb_lookup(cpu, gva, gpa, err_code))
+        return true;
+
+    pae = x86_is_pae_enabled(cpu);
+    res = walk_gpt(cpu, gva, err_code, &pt, pae);
     if (res) {
+        mmu_tlb_insert(cpu, &pt, err_code, pae);
         *gpa = pt.gpa;
         return true;
     }
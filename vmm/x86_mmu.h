@@ -26,6 +26,31 @@
 #define GVA_TO_GPA_EXEC                 4
 #define GVA_TO_GPA_FORWARD_PAGE_FAULT   8
 
+/*
+ * Translations done while handling one VM exit.  INVLPG and CR3 loads don't
+ * exit, so entries can't outlive the exit they were filled in; the whole
+ * TLB is dropped by bumping the generation on every VM entry.
+ */
+#define MMU_TLB_SIZE            64
+#define MMU_TLB_LARGE_SIZE      16
+
+struct x86_tlb_entry {
+    uint64_t gen;
+    addr_t gva;
+    addr_t gpa;
+    addr_t page_mask;
+    int flags;
+};
+
+struct x86_tlb {
+    uint64_t gen;
+    struct x86_tlb_entry small[MMU_TLB_SIZE];
+    struct x86_tlb_entry large[MMU_TLB_LARGE_SIZE];
+};
+
+void init_mmu(struct CPUState *cpu);
+void mmu_tlb_flush(struct CPUState *cpu);
+
 bool mmu_gva_to_gpa_ext(struct CPUState *cpu, addr_t gva, addr_t *gpa, int flags);
 bool mmu_gva_to_gpa(struct CPUState *cpu, addr_t gva, addr_t *gpa);
 
@@ -20,6 +20,7 @@
 typedef enum VMExportFormat {
     ExportFormatNativeVmz,
     ExportFormatVagrantBox,
+    ExportFormatCompressedVmz,  /* vmz with the disks converted to compressed qcow2 */
 } VMExportFormat;
 
 
@@ -155,7 +155,8 @@
         self.scsi_list = [NSDictionary dictionaryWithObjectsAndKeys:
                           /*@"LSI SAS 1068", @"lsisas1068",*/ @"LSI MegaSAS", @"megasas", nil];
         self.nic_list = [NSDictionary dictionaryWithObjectsAndKeys:
-                          @"e1000", @"e1000", @"rtl8139", @"rtl8139", nil];
+                          @"e1000", @"e1000", @"rtl8139", @"rtl8139",
+                          @"virtio-net", @"virtio", nil];
     }
     return self;
 }
@@ -19,6 +19,8 @@
 #include "block_int.h"
 #include "blockjob.h"
 #include "emublock-backend.h"
+#include "qapi/qmp/qstring.h"
+#include "qemu/timer.h"
 
 BlockBackend *blk_new_with_bs(const char *name, Error **errp);
 BlockDriverState *blk_bs(BlockBackend *blk);
@@ -45,7 +47,7 @@ void img_ops_init()
 }
 
 static BlockDriverState *img_open(const char *id1, const char *filename,
-                              const char *fmt, int flags,
+                              const char *fmt, QDict *options, int flags,
                               bool require_io, bool quiet)
 {
     BlockBackend *blk;
@@ -69,7 +71,7 @@ static BlockDriverState *img_open(const char *id1, const char *filename,
         drv = NULL;
     }
 
-    ret = bdrv_open(&bs, filename, NULL, NULL, flags, drv, &local_err);
+    ret = bdrv_open(&bs, filename, NULL, options, flags, drv, &local_err);
     if (ret < 0) {
         error_report("Could not open '%s': %s", filename,
                      error_get_pretty(local_err));
@@ -90,7 +92,7 @@ fail:
 uint64_t get_vm_image_size(const char *filename)
 {
     int bdrv_oflags = BDRV_O_CACHE_WB | BDRV_O_RDWR;
-    BlockDriverState *bs = img_open("image", filename, NULL, bdrv_oflags, true, false);
+    BlockDriverState *bs = img_open("image", filename, NULL, NULL, bdrv_oflags, true, false);
     if (!bs)
         return 0;
     BlockBackend *blk = bs->blk;
@@ -123,7 +125,7 @@ bool find_snapshot(const char* path, const char *snapshot_name)
     img_ops_init();
 
     int bdrv_oflags = BDRV_O_CACHE_WB;
-    BlockDriverState *bs = img_open("image", path, NULL, bdrv_oflags, false, true);
+    BlockDriverState *bs = img_open("image", path, NULL, NULL, bdrv_oflags, false, true);
     if (!bs)
         return false;
 
@@ -161,7 +163,7 @@ bool delete_snapshot(const char* path, const char *snapshot_name)
     img_ops_init();
     
     int bdrv_oflags = BDRV_O_CACHE_WB | BDRV_O_RDWR;
-    BlockDriverState *bs = img_open("image", path, NULL, bdrv_oflags, false, true);
+    BlockDriverState *bs = img_open("image", path, NULL, NULL, bdrv_oflags, false, true);
     if (!bs)
         return false;
 
@@ -170,3 +172,357 @@ bool delete_snapshot(const char* path, const char *snapshot_name)
     blk_unref(bs->blk);
     return ret;
 }
+
+/*
+ * Returns 1 if the extent at sector_num reads as zeroes without looking at
+ * the data, 0 if it has to be read and a negative errno on failure.  *pnum
+ * is set to the length of the extent, at most nb_sectors.
+ */
+static int img_extent_is_zero(BlockDriverState *bs, int64_t sector_num,
+                              int nb_sectors, int *pnum)
+{
+    int64_t ret;
+
+    ret = bdrv_get_block_status(bs, sector_num, nb_sectors, pnum);
+    if (ret < 0)
+        return ret;
+    if (ret & BDRV_BLOCK_ZERO)
+        return 1;
+    if (ret & BDRV_BLOCK_DATA)
+        return 0;
+    /* Unallocated: the backing file decides, without one it reads as zeroes */
+    return !bs->backing_hd;
+}
+
+/* Clusters read and handed to the compressing writer at once */
+#define COMPRESS_BUF_CLUSTERS 64
+
+bool compress_disk_image(const char *src, const char *dst, int level)
+{
+    Error *local_err = NULL;
+    BlockDriverState *bs, *out_bs;
+    BlockDriverInfo bdi;
+    QDict *options;
+    uint8_t *buf = NULL;
+    int64_t total_sectors, sector_num;
+    int cluster_sectors, buf_sectors, n, i, start, zero;
+    char level_str[16];
+    bool ret = false;
+
+    img_ops_init();
+
+    bs = img_open("source", src, NULL, NULL, BDRV_O_CACHE_WB, true, true);
+    if (!bs)
+        return false;
+
+    total_sectors = bdrv_nb_sectors(bs);
+    if (total_sectors < 0)
+        goto exit;
+
+    bdrv_img_create(dst, "qcow2", NULL, NULL, NULL, total_sectors * BDRV_SECTOR_SIZE,
+                    BDRV_O_CACHE_WB, &local_err, true);
+    if (local_err) {
+        debug("%s: %s", dst, error_get_pretty(local_err));
+        error_free(local_err);
+        goto exit;
+    }
+
+    snprintf(level_str, sizeof(level_str), "%d", level);
+    options = qdict_new();
+    qdict_put(options, "compression-level", qstring_from_str(level_str));
+    out_bs = img_open("target", dst, "qcow2", options, BDRV_O_CACHE_WB | BDRV_O_RDWR, true, true);
+    if (!out_bs)
+        goto exit;
+
+    if (bdrv_get_info(out_bs, &bdi) < 0 || bdi.cluster_size <= 0)
+        goto exit2;
+    cluster_sectors = bdi.cluster_size / BDRV_SECTOR_SIZE;
+    buf_sectors = cluster_sectors * COMPRESS_BUF_CLUSTERS;
+    buf = vmx_blockalign(out_bs, buf_sectors * BDRV_SECTOR_SIZE);
+
+    for (sector_num = 0; sector_num < total_sectors; sector_num += n) {
+        n = MIN(buf_sectors, total_sectors - sector_num);
+
+        /* Skip whole clusters that read as zeroes without reading them */
+        zero = img_extent_is_zero(bs, sector_num, n, &i);
+        if (zero < 0)
+            goto exit2;
+        if (zero && (i >= cluster_sectors || sector_num + i == total_sectors)) {
+            n = sector_num + i == total_sectors ? i : QEMU_ALIGN_DOWN(i, cluster_sectors);
+            continue;
+        }
+
+        if (bdrv_read(bs, sector_num, buf, n) < 0)
+            goto exit2;
+
+        /* The new image reads as zeroes, only write runs of non-zero clusters */
+        start = 0;
+        for (i = 0; ; i += cluster_sectors) {
+            bool end = i >= n;
+
+            if (!end && !buffer_is_zero(buf + i * BDRV_SECTOR_SIZE,
+                                        MIN(cluster_sectors, n - i) * BDRV_SECTOR_SIZE))
+                continue;
+            if (MIN(i, n) > start &&
+                bdrv_write_compressed(out_bs, sector_num + start, buf + start * BDRV_SECTOR_SIZE,
+                                      MIN(i, n) - start) < 0)
+                goto exit2;
+            if (end)
+                break;
+            start = i + cluster_sectors;
+        }
+    }
+
+    ret = bdrv_write_compressed(out_bs, 0, NULL, 0) == 0;
+
+exit2:
+    vmx_vfree(buf);
+    blk_unref(out_bs->blk);
+exit:
+    blk_unref(bs->blk);
+    return ret;
+}
+
+/*
+ * Copy engine used to clone and convert disks.  Extents are classified with
+ * bdrv_get_block_status so unallocated and zero ranges are never read, and
+ * only written when the target doesn't already read as zeroes.  Data is
+ * copied in large requests by several coroutines so that reads and writes
+ * of different extents overlap.  copy_disk_image_step lets a caller that
+ * has to keep its run loop going drive the copy in slices.
+ */
+#define COPY_BUF_SECTORS    ((4 * 1024 * 1024) >> BDRV_SECTOR_BITS)
+#define COPY_COROUTINES     8
+
+/* Zero runs of at least this size in copied data are left unallocated */
+#define COPY_SPARSE_SECTORS ((64 * 1024) >> BDRV_SECTOR_BITS)
+
+struct ImgCopyState {
+    BlockDriverState *src;
+    BlockDriverState *dst;
+    int64_t total_sectors;
+    bool has_zero_init;
+
+    /* protects the cursor, bdrv_get_block_status may yield */
+    CoMutex lock;
+    int64_t sector_num;         /* next sector to hand out */
+    int64_t status_end;         /* end of the extent the status is for */
+    bool status_zero;
+
+    int running;
+    int ret;
+};
+
+/* Hands out the next chunk, never longer than an extent or a buffer for
+ * data.  Returns its length, 0 when done or after an error. */
+static int coroutine_fn img_copy_next(ImgCopyState *s, int64_t *sector_num,
+                                      bool *zero)
+{
+    int64_t n;
+    int pnum, ret;
+
+    if (s->ret < 0 || s->sector_num >= s->total_sectors)
+        return 0;
+
+    if (s->status_end <= s->sector_num) {
+        n = MIN(s->total_sectors - s->sector_num, INT_MAX >> BDRV_SECTOR_BITS);
+        ret = img_extent_is_zero(s->src, s->sector_num, n, &pnum);
+        if (ret < 0) {
+            s->ret = ret;
+            return 0;
+        }
+        s->status_zero = ret;
+        s->status_end = s->sector_num + pnum;
+    }
+
+    *sector_num = s->sector_num;
+    *zero = s->status_zero;
+    n = s->status_end - s->sector_num;
+    if (!*zero)
+        n = MIN(n, COPY_BUF_SECTORS);
+    s->sector_num += n;
+    return n;
+}
+
+static int coroutine_fn img_copy_rw(BlockDriverState *bs, int64_t sector_num,
+                                    int nb_sectors, uint8_t *buf, bool is_write)
+{
+    QEMUIOVector qiov;
+    struct iovec iov = {
+        .iov_base = buf,
+        .iov_len = nb_sectors * BDRV_SECTOR_SIZE,
+    };
+
+    vmx_iovec_init_external(&qiov, &iov, 1);
+    return is_write ? bdrv_co_writev(bs, sector_num, nb_sectors, &qiov) :
+                      bdrv_co_readv(bs, sector_num, nb_sectors, &qiov);
+}
+
+/* Writes the runs of data that don't read as zeroes already */
+static int coroutine_fn img_copy_write(ImgCopyState *s, int64_t sector_num,
+                                       int nb_sectors, uint8_t *buf)
+{
+    int start = 0, i, n, ret;
+
+    if (!s->has_zero_init)
+        return img_copy_rw(s->dst, sector_num, nb_sectors, buf, true);
+
+    for (i = 0; ; i += COPY_SPARSE_SECTORS) {
+        bool end = i >= nb_sectors;
+
+        n = MIN(COPY_SPARSE_SECTORS, nb_sectors - i);
+        if (!end && !buffer_is_zero(buf + i * BDRV_SECTOR_SIZE,
+                                    n * BDRV_SECTOR_SIZE))
+            continue;
+        if (MIN(i, nb_sectors) > start) {
+            ret = img_copy_rw(s->dst, sector_num + start,
+                              MIN(i, nb_sectors) - start,
+                              buf + start * BDRV_SECTOR_SIZE, true);
+            if (ret < 0)
+                return ret;
+        }
+        if (end)
+            break;
+        start = i + n;
+    }
+    return 0;
+}
+
+static void coroutine_fn img_copy_co(void *opaque)
+{
+    ImgCopyState *s = opaque;
+    int64_t sector_num;
+    uint8_t *buf;
+    bool zero;
+    int n, ret = 0;
+
+    buf = vmx_try_blockalign(s->dst, COPY_BUF_SECTORS * BDRV_SECTOR_SIZE);
+    if (!buf) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    for (;;) {
+        vmx_co_mutex_lock(&s->lock);
+        n = img_copy_next(s, &sector_num, &zero);
+        vmx_co_mutex_unlock(&s->lock);
+        if (n <= 0)
+            break;
+
+        if (zero) {
+            if (!s->has_zero_init)
+                ret = bdrv_co_write_zeroes(s->dst, sector_num, n,
+                                           BDRV_REQ_MAY_UNMAP);
+        } else {
+            ret = img_copy_rw(s->src, sector_num, n, buf, false);
+            if (ret >= 0)
+                ret = img_copy_write(s, sector_num, n, buf);
+        }
+        if (ret < 0)
+            break;
+    }
+
+out:
+    if (ret < 0 && s->ret == 0)
+        s->ret = ret;
+    vmx_vfree(buf);
+    s->running--;
+}
+
+ImgCopyState *copy_disk_image_start(const char *src, const char *dst,
+                                    const char *fmt)
+{
+    Error *local_err = NULL;
+    BlockDriverState *bs, *out_bs;
+    ImgCopyState *s;
+    int64_t total_sectors;
+    int i;
+
+    img_ops_init();
+
+    bs = img_open("source", src, NULL, NULL, BDRV_O_CACHE_WB, true, true);
+    if (!bs)
+        return NULL;
+
+    total_sectors = bdrv_nb_sectors(bs);
+    if (total_sectors < 0)
+        goto fail;
+
+    bdrv_img_create(dst, fmt, NULL, NULL, NULL, total_sectors * BDRV_SECTOR_SIZE,
+                    BDRV_O_CACHE_WB, &local_err, true);
+    if (local_err) {
+        debug("%s: %s", dst, error_get_pretty(local_err));
+        error_free(local_err);
+        goto fail;
+    }
+
+    out_bs = img_open("target", dst, fmt, NULL, BDRV_O_CACHE_WB | BDRV_O_RDWR, true, true);
+    if (!out_bs)
+        goto fail_unlink;
+
+    s = g_new0(ImgCopyState, 1);
+    s->src = bs;
+    s->dst = out_bs;
+    s->total_sectors = total_sectors;
+    s->has_zero_init = bdrv_has_zero_init(out_bs);
+    if (!s->has_zero_init && bdrv_can_write_zeroes_with_unmap(out_bs) &&
+        bdrv_make_zero(out_bs, BDRV_REQ_MAY_UNMAP) == 0) {
+        s->has_zero_init = true;
+    }
+    vmx_co_mutex_init(&s->lock);
+
+    for (i = 0; i < COPY_COROUTINES; i++) {
+        s->running++;
+        vmx_coroutine_enter(vmx_coroutine_create(img_copy_co), s);
+    }
+    return s;
+
+fail_unlink:
+    /* don't leave the empty image we just created behind */
+    unlink(dst);
+fail:
+    blk_unref(bs->blk);
+    return NULL;
+}
+
+bool copy_disk_image_step(ImgCopyState *s, int ms, int64_t *done, int64_t *total)
+{
+    int64_t deadline = vmx_clock_get_ms(QEMU_CLOCK_REALTIME) + ms;
+
+    while (s->running && vmx_clock_get_ms(QEMU_CLOCK_REALTIME) < deadline) {
+        aio_poll(bdrv_get_aio_context(s->dst), true);
+    }
+
+    /* sectors handed out, close enough for a progress bar */
+    *done = s->sector_num;
+    *total = s->total_sectors;
+    return !s->running;
+}
+
+bool copy_disk_image_finish(ImgCopyState *s, bool cancel)
+{
+    bool ret;
+
+    /* the coroutines stop at their next chunk */
+    if (cancel && s->ret == 0)
+        s->ret = -ECANCELED;
+    while (s->running) {
+        aio_poll(bdrv_get_aio_context(s->dst), true);
+    }
+
+    if (s->ret < 0 && s->ret != -ECANCELED)
+        debug("copy failed: %s", strerror(-s->ret));
+    ret = s->ret == 0 && bdrv_flush(s->dst) == 0;
+
+    blk_unref(s->dst->blk);
+    blk_unref(s->src->blk);
+    g_free(s);
+    return ret;
+}
+
+bool copy_disk_image(const char *src, const char *dst, const char *fmt)
+{
+    ImgCopyState *s = copy_disk_image_start(src, dst, fmt);
+
+    return s && copy_disk_image_finish(s, false);
+}
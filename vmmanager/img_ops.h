@@ -27,5 +27,17 @@ void img_ops_init();
 bool create_disk_image(const char* path, const char *fmt, uint64_t size);
 bool find_snapshot(const char* path, const char *snapshot_name);
 bool delete_snapshot(const char* path, const char *snapshot_name);
+bool compress_disk_image(const char *src, const char *dst, int level);
+bool copy_disk_image(const char *src, const char *dst, const char *fmt);
+
+/* The same copy in slices, for callers that have to keep their run loop
+ * going: step runs it for about ms milliseconds and returns true once it
+ * is done; finish waits it out, or stops it early with cancel, and returns
+ * whether the copy succeeded. */
+typedef struct ImgCopyState ImgCopyState;
+ImgCopyState *copy_disk_image_start(const char *src, const char *dst,
+                                    const char *fmt);
+bool copy_disk_image_step(ImgCopyState *s, int ms, int64_t *done, int64_t *total);
+bool copy_disk_image_finish(ImgCopyState *s, bool cancel);
 
 #endif /* defined(__vmx__img_ops__) */